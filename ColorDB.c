@@ -0,0 +1,209 @@
+/* ColorDB.c
+ *
+ * Client-side color resolution: the color spec syntaxes Xlib understands,
+ * the X color names compiled in from rgb.txt, and pixel packing for static
+ * visuals, so that the common cases need no LookupColor/AllocColor at all.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "CharSet.h"
+#include "ColorDB.h"
+#include "colordb.h"
+
+#define MAXNAME     64
+
+static int
+hexval(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* Parse 1-4 hex digits ending at 'end' and scale them to 16 bits. */
+static int
+rgbfield(const char *s, char end, uint16_t *value, const char **next)
+{
+    unsigned int v = 0, max = 0;
+    int n, h;
+
+    for (n = 0; (h = hexval(s[n])) >= 0; n++) {
+        if (n == 4)
+            return 0;
+        v = (v << 4) | h;
+        max = (max << 4) | 0xf;
+    }
+    if (!n || s[n] != end)
+        return 0;
+    *value = (uint16_t)((v * 65535u + max / 2) / max);
+    *next = s + n + 1;
+    return 1;
+}
+
+static int
+rgbifield(const char *s, char end, uint16_t *value, const char **next)
+{
+    char *tail;
+    double v = strtod(s, &tail);
+
+    if (tail == s || *tail != end || v < 0.0 || v > 1.0)
+        return 0;
+    *value = (uint16_t)(v * 65535.0 + 0.5);
+    *next = tail + 1;
+    return 1;
+}
+
+/*
+ * ParseColorSpec: Numeric color specs, as XParseColor() takes them:
+ *   #rgb, #rrggbb, #rrrgggbbb, #rrrrggggbbbb, rgb:r/g/b and rgbi:r/g/b.
+ * Returns 1 and fills in the color on success.
+ */
+int
+ParseColorSpec(const char *spec,
+               uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+    uint16_t rgb[3];
+    unsigned int v;
+    int len, n, i, j, h;
+
+    if (spec[0] == '#') {
+        spec++;
+        len = strlen(spec);
+        if (len != 3 && len != 6 && len != 9 && len != 12)
+            return 0;
+        n = len / 3;
+        for (i = 0; i < 3; i++) {
+            for (v = 0, j = 0; j < n; j++) {
+                if ((h = hexval(*spec++)) < 0)
+                    return 0;
+                v = (v << 4) | h;
+            }
+            /* Xlib takes "#f00" to mean 0xf000, not 0xffff */
+            rgb[i] = v << (16 - n * 4);
+        }
+    }
+    else if (!strncmp(spec, "rgb:", 4)) {
+        spec += 4;
+        if (!rgbfield(spec, '/', &rgb[0], &spec) ||
+            !rgbfield(spec, '/', &rgb[1], &spec) ||
+            !rgbfield(spec, '\0', &rgb[2], &spec))
+            return 0;
+    }
+    else if (!strncmp(spec, "rgbi:", 5)) {
+        spec += 5;
+        if (!rgbifield(spec, '/', &rgb[0], &spec) ||
+            !rgbifield(spec, '/', &rgb[1], &spec) ||
+            !rgbifield(spec, '\0', &rgb[2], &spec))
+            return 0;
+    }
+    else
+        return 0;
+
+    *red = rgb[0];
+    *green = rgb[1];
+    *blue = rgb[2];
+    return 1;
+}
+
+/*
+ * LookupColorName: Find a color by name in the compiled-in table.  Names
+ * are case-insensitive, as the server treats them.
+ */
+int
+LookupColorName(const char *name,
+                uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+    char lower[MAXNAME];
+    uint32_t slot;
+
+    if (strlen(name) >= MAXNAME)
+        return 0;
+    CopyISOLatin1Lowered(lower, name);
+    slot = ColorHash(lower, colordb_disp[ColorHash(lower, 0) % COLORDB_BUCKETS]);
+    slot &= COLORDB_SIZE - 1;
+    if (!colordb[slot].name || strcmp(colordb[slot].name, lower))
+        return 0;
+    *red = colordb[slot].red * 257;
+    *green = colordb[slot].green * 257;
+    *blue = colordb[slot].blue * 257;
+    return 1;
+}
+
+/*
+ * ColorNameToRGB: Resolve a color spec or name without asking the server.
+ */
+int
+ColorNameToRGB(const char *name,
+               uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+    return ParseColorSpec(name, red, green, blue) ||
+           LookupColorName(name, red, green, blue);
+}
+
+static void
+maskshift(uint32_t mask, int *shift, uint32_t *max)
+{
+    for (*shift = 0; mask && !(mask & 1); mask >>= 1)
+        (*shift)++;
+    *max = mask;
+}
+
+static uint32_t
+packchannel(uint32_t mask, int bits, uint16_t value)
+{
+    uint32_t max, v;
+    int shift;
+
+    /* the server keeps only bits_per_rgb_value bits of it, scaled back up */
+    v = (uint32_t)(value >> (16 - bits)) * 65535 / ((1u << bits) - 1);
+    maskshift(mask, &shift, &max);
+    return ((v * max + 32767) / 65535) << shift;
+}
+
+static uint16_t
+unpackchannel(uint32_t mask, uint32_t pixel)
+{
+    uint32_t max;
+    int shift;
+
+    maskshift(mask, &shift, &max);
+    return max ? ((pixel & mask) >> shift) * 65535 / max : 0;
+}
+
+/*
+ * PackPixel: The pixel value for a color on a TrueColor visual, cut to the
+ * visual's bits_per_rgb_value and rounded to the nearest value the channel
+ * masks can hold, as the server would.
+ */
+uint32_t
+PackPixel(const xcb_visualtype_t *visual,
+          uint16_t red, uint16_t green, uint16_t blue)
+{
+    int bits = visual->bits_per_rgb_value;
+
+    if (bits < 1 || bits > 16)
+        bits = 16;
+    return packchannel(visual->red_mask, bits, red) |
+           packchannel(visual->green_mask, bits, green) |
+           packchannel(visual->blue_mask, bits, blue);
+}
+
+/*
+ * UnpackPixel: The color of a pixel value on a TrueColor visual.
+ */
+void
+UnpackPixel(const xcb_visualtype_t *visual, uint32_t pixel,
+            uint16_t *red, uint16_t *green, uint16_t *blue)
+{
+    *red = unpackchannel(visual->red_mask, pixel);
+    *green = unpackchannel(visual->green_mask, pixel);
+    *blue = unpackchannel(visual->blue_mask, pixel);
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,37 @@
+/* ColorDB.h */
+
+#ifndef _COLORDB_H_
+#define _COLORDB_H_
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+/*
+ * Hash used for the compiled-in color name table.  makecolordb and the
+ * lookup side must agree on it, so it lives here.
+ */
+static inline uint32_t
+ColorHash(const char *s, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+extern int ParseColorSpec(const char *spec,
+                          uint16_t *red, uint16_t *green, uint16_t *blue);
+extern int LookupColorName(const char *name,
+                           uint16_t *red, uint16_t *green, uint16_t *blue);
+extern int ColorNameToRGB(const char *name,
+                          uint16_t *red, uint16_t *green, uint16_t *blue);
+extern uint32_t PackPixel(const xcb_visualtype_t *visual,
+                          uint16_t red, uint16_t green, uint16_t blue);
+extern void UnpackPixel(const xcb_visualtype_t *visual, uint32_t pixel,
+                        uint16_t *red, uint16_t *green, uint16_t *blue);
+
+#endif /* _COLORDB_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,450 @@
+/* Daemon.c
+ *
+ * -daemon: keep the display connection, and whatever the commands have
+ * resolved or uploaded, alive between runs.  Commands arrive over a Unix
+ * socket as a forwarded argv.  The client's standard output and error are
+ * passed along with it (SCM_RIGHTS), so messages and -stats output appear
+ * just as they would from a standalone run.  The daemon answers with the
+ * command's exit status.
+ *
+ * A request is an 8 byte header, "XSRD" and the payload length, followed
+ * by the arguments, each terminated by a NUL.  The reply is the exit status
+ * as a 32 bit integer in the daemon's byte order.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* struct ucred */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <xcb/xcb.h>
+#include "Daemon.h"
+
+#define DAEMON_MAGIC        "XSRD"
+#define DAEMON_MAX_REQUEST  65536
+#define DAEMON_TIMEOUT      2       /* seconds a client may take to send */
+
+typedef struct {
+    char magic[4];
+    uint32_t length;
+} DaemonHeader;
+
+static volatile sig_atomic_t stop_serving;
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void
+catch_stop(int sig)
+{
+    stop_serving = 1;
+}
+
+/*
+ * DaemonSocketPath: The socket a daemon for 'display_name' listens on.  It
+ * is named after the parsed display so that ":0" and ":0.0" agree, and lives
+ * in $XDG_RUNTIME_DIR when there is one, else in a directory of the user's
+ * own in /tmp.  Returns -1 if the name is bad or the path would not fit.
+ */
+int
+DaemonSocketPath(const char *display_name, char *path, size_t len)
+{
+    struct sockaddr_un addr;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char *host, *p;
+    int display, screen, n;
+
+    if (!xcb_parse_display(display_name, &host, &display, &screen))
+        return -1;
+    for (p = host; *p; p++)
+        if (*p == '/')
+            *p = '_';
+    if (dir && *dir)
+        n = snprintf(path, len, "%s/xsetroot_xcb-%s:%d.%d", dir, host,
+                     display, screen);
+    else
+        n = snprintf(path, len, "/tmp/xsetroot_xcb-%u/%s:%d.%d",
+                     (unsigned)getuid(), host, display, screen);
+    free(host);
+    if (n < 0 || (size_t)n >= len || (size_t)n >= sizeof(addr.sun_path))
+        return -1;
+    return 0;
+}
+
+/*
+ * Whether the directory of the socket at 'path' is the user's alone, made
+ * first if missing.  $XDG_RUNTIME_DIR is by definition; the one in /tmp
+ * must be a directory of ours, not a link, that no one else may enter,
+ * or another user could listen in the daemon's place and be handed the
+ * clients' output.
+ */
+static int
+private_dir(const char *path)
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char name[sizeof(((struct sockaddr_un *)NULL)->sun_path)];
+    const char *slash = strrchr(path, '/');
+    struct stat st;
+
+    if ((dir && *dir) || !slash || (size_t)(slash - path) >= sizeof(name))
+        return 1;
+    memcpy(name, path, slash - path);
+    name[slash - path] = '\0';
+    if (mkdir(name, 0700) < 0 && errno != EEXIST)
+        return 0;
+    if (lstat(name, &st) < 0)
+        return 0;
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077)) {
+        errno = EPERM;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Fill in the address of the daemon for 'display_name', complaining if
+ * there is none to be had.
+ */
+static int
+daemon_address(const char *program_name, const char *display_name,
+               struct sockaddr_un *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (DaemonSocketPath(display_name, addr->sun_path, sizeof(addr->sun_path)) < 0) {
+        fprintf(stderr, "%s: no socket path for display '%s'\n", program_name,
+                display_name ? display_name : "");
+        return -1;
+    }
+    if (!private_dir(addr->sun_path)) {
+        fprintf(stderr, "%s: the directory of %s is not yours alone: %s\n",
+                program_name, addr->sun_path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Run one client's command with its output descriptors standing in for
+ * ours, and send back the status.
+ */
+static void
+serve_client(const char *program_name, int c, DaemonApplyProc apply)
+{
+    DaemonHeader hdr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct timeval tv = { DAEMON_TIMEOUT, 0 };
+    int fds[2] = { -1, -1 }, saved[2], flags[2], fd;
+    char *payload = NULL, **argv = NULL, *p;
+    int32_t status = 2;
+    ssize_t got;
+    int argc, i, n, take;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+
+    /* only the user who owns the daemon may drive it */
+    if (getsockopt(c, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        cred.uid != getuid())
+        return;
+#endif
+    setsockopt(c, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    got = recvmsg(c, &msg, MSG_WAITALL);
+    /* keep the two descriptors a request carries, and close any others */
+    for (cmsg = got >= 0 ? CMSG_FIRSTHDR(&msg) : NULL; cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        take = n == 2 && fds[0] < 0;
+        for (i = 0; i < n; i++) {
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (take)
+                fds[i] = fd;
+            else
+                close(fd);
+        }
+    }
+    if (got != sizeof(hdr) || (msg.msg_flags & MSG_CTRUNC) ||
+        fds[0] < 0 || fds[1] < 0 || memcmp(hdr.magic, DAEMON_MAGIC, 4) ||
+        hdr.length > DAEMON_MAX_REQUEST)
+        goto out;
+
+    payload = malloc(hdr.length + 1);
+    if (!payload || read_all(c, payload, hdr.length))
+        goto out;
+    payload[hdr.length] = '\0';
+    for (argc = 1, p = payload; p < payload + hdr.length; p += strlen(p) + 1)
+        argc++;
+    if (!(argv = malloc((argc + 1) * sizeof(char *))))
+        goto out;
+    argv[0] = (char *)program_name;
+    for (i = 1, p = payload; i < argc; p += strlen(p) + 1)
+        argv[i++] = p;
+    argv[argc] = NULL;
+
+    /*
+     * A client that stops reading its output loses the rest of it rather
+     * than stall the daemon for everyone.  The flag is the client's as
+     * much as ours, so it is put back after.
+     */
+    for (i = 0; i < 2; i++)
+        flags[i] = fcntl(fds[i], F_GETFL);
+    for (i = 0; i < 2; i++)
+        if (flags[i] >= 0)
+            fcntl(fds[i], F_SETFL, flags[i] | O_NONBLOCK);
+    fflush(stdout);
+    fflush(stderr);
+    saved[0] = dup(1);
+    saved[1] = dup(2);
+    dup2(fds[0], 1);
+    dup2(fds[1], 2);
+    status = apply(argc, argv);
+    fflush(stdout);
+    fflush(stderr);
+    clearerr(stdout);
+    clearerr(stderr);
+    dup2(saved[0], 1);
+    dup2(saved[1], 2);
+    close(saved[0]);
+    close(saved[1]);
+    for (i = 0; i < 2; i++)
+        if (flags[i] >= 0)
+            fcntl(fds[i], F_SETFL, flags[i]);
+
+out:
+    write_all(c, &status, sizeof(status));
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    free(argv);
+    free(payload);
+}
+
+/*
+ * DaemonServe: Listen for commands until a signal says stop or the display
+ * connection is lost.  Returns the exit status for the daemon.
+ */
+int
+DaemonServe(const char *program_name, const char *display_name, int display_fd,
+            DaemonApplyProc apply, DaemonIdleProc idle)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    struct pollfd fds[2];
+    mode_t mask;
+    int lfd, c, status = 0;
+
+    if (daemon_address(program_name, display_name, &addr) < 0)
+        return 2;
+
+    /* a socket nobody answers on was left behind by a daemon that died */
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        goto fail;
+    if (connect(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+        fprintf(stderr, "%s: a daemon is already listening on %s\n",
+                program_name, addr.sun_path);
+        close(lfd);
+        return 2;
+    }
+    close(lfd);
+    unlink(addr.sun_path);
+
+    if ((lfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        goto fail;
+    mask = umask(077);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        umask(mask);
+        goto fail;
+    }
+    umask(mask);
+    if (listen(lfd, 16) < 0)
+        goto fail;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = catch_stop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL);
+
+    fds[0].fd = lfd;
+    fds[1].fd = display_fd;
+    fds[0].events = fds[1].events = POLLIN;
+    while (!stop_serving) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if ((fds[0].revents & POLLIN) &&
+            (c = accept(lfd, NULL, NULL)) >= 0) {
+            serve_client(program_name, c, apply);
+            close(c);
+            fds[1].revents = POLLIN;    /* the command may have queued events */
+        }
+        if (fds[1].revents && idle()) {
+            fprintf(stderr, "%s: lost the connection to the display\n", program_name);
+            status = 2;
+            break;
+        }
+    }
+    close(lfd);
+    unlink(addr.sun_path);
+    return status;
+
+fail:
+    fprintf(stderr, "%s: can't listen on %s: %s\n", program_name, addr.sun_path,
+            strerror(errno));
+    if (lfd >= 0)
+        close(lfd);
+    return 2;
+}
+
+/*
+ * DaemonForward: Hand argv (without the program name) to the daemon for
+ * 'display_name' and return the status it answers with.
+ */
+int
+DaemonForward(const char *program_name, const char *display_name,
+              int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    DaemonHeader hdr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    int fds[2] = { 1, 2 };
+    char *payload, *p;
+    size_t len = 0;
+    int32_t status;
+    int s, i;
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+#endif
+
+    if (daemon_address(program_name, display_name, &addr) < 0)
+        return 2;
+    for (i = 0; i < argc; i++)
+        len += strlen(argv[i]) + 1;
+    if (len > DAEMON_MAX_REQUEST || !(payload = malloc(len + 1))) {
+        fprintf(stderr, "%s: command line too long for the daemon\n", program_name);
+        return 2;
+    }
+    for (i = 0, p = payload; i < argc; i++) {
+        strcpy(p, argv[i]);
+        p += strlen(p) + 1;
+    }
+
+    if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(s, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "%s: no daemon is listening on %s\n", program_name,
+                addr.sun_path);
+        free(payload);
+        return 2;
+    }
+#ifdef SO_PEERCRED
+    /* our output goes only to a daemon of our own */
+    if (getsockopt(s, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) < 0 ||
+        cred.uid != getuid()) {
+        fprintf(stderr, "%s: the daemon on %s is not yours\n", program_name,
+                addr.sun_path);
+        close(s);
+        free(payload);
+        return 2;
+    }
+#endif
+
+    memcpy(hdr.magic, DAEMON_MAGIC, 4);
+    hdr.length = len;
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(s, &msg, 0) != sizeof(hdr) || write_all(s, payload, len) ||
+        read_all(s, &status, sizeof(status))) {
+        fprintf(stderr, "%s: the daemon on %s did not answer\n", program_name,
+                addr.sun_path);
+        status = 2;
+    }
+    close(s);
+    free(payload);
+    return status;
+}
+/* vim: set ts=4 sw=4 et cindent: */
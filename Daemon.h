@@ -0,0 +1,20 @@
+/* Daemon.h */
+
+#ifndef _DAEMON_H_
+#define _DAEMON_H_
+
+#include <stddef.h>
+
+/* Runs one forwarded command line; returns its exit status. */
+typedef int (*DaemonApplyProc)(int argc, char **argv);
+/* Called when the display connection is readable; nonzero means it died. */
+typedef int (*DaemonIdleProc)(void);
+
+extern int DaemonSocketPath(const char *display_name, char *path, size_t len);
+extern int DaemonServe(const char *program_name, const char *display_name,
+                       int display_fd, DaemonApplyProc apply, DaemonIdleProc idle);
+extern int DaemonForward(const char *program_name, const char *display_name,
+                         int argc, char **argv);
+
+#endif /* _DAEMON_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,628 @@
+/* DiskCache.c
+ *
+ * The on-disk cache of finished pixmap contents.  An entry is a header of
+ * one page, the key and what the pixels are, then the scanlines, so that
+ * they start page aligned and can be mapped or handed to the server as
+ * they are.  Entries are named by the xxHash64 of their key; source files
+ * are hashed the same way, a megabyte at a time, and what a file hashed to
+ * is remembered in a small entry of its own, named by the file's device,
+ * inode, size and times, so that it need not be read again while those
+ * stay the same.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* mkostemp */
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "DiskCache.h"
+
+#define CACHE_MAGIC     "XSRCACHE"
+#define CACHE_VERSION   1
+#define HEADER_SIZE     4096
+#define DEFAULT_LIMIT   256     /* megabytes, unless $XSETROOT_CACHE_SIZE says */
+#define STALE_SECONDS   3600    /* a temporary file this old was abandoned */
+#define READ_CHUNK      (1 << 20)
+#define FILE_MAGIC      "XSRFILE"
+#define RACY_SECONDS    2       /* a file changed this recently may change again unseen */
+#define LOCK_SECONDS    10      /* longest wait for another process making an entry */
+#define LOCK_POLL_NS    10000000
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_len;
+    uint64_t size;              /* of the whole file */
+    DiskCacheInfo info;
+    uint8_t key[DISK_CACHE_KEY_MAX];
+} Header;
+
+/* What a source file is, as far as stat() can tell. */
+typedef struct {
+    uint64_t dev, ino, size;
+    int64_t mtime, mtime_ns, ctime, ctime_ns;
+} FileId;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad_;
+    FileId id;
+    uint64_t hash;              /* of its contents */
+} FileMemo;
+
+typedef struct {
+    char name[32];
+    time_t used;
+    off_t size;
+} Entry;
+
+#define P1  0x9E3779B185EBCA87ULL
+#define P2  0xC2B2AE3D27D4EB4FULL
+#define P3  0x165667B19E3779F9ULL
+#define P4  0x85EBCA77C2B2AE63ULL
+#define P5  0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+rotl(uint64_t x, int r)
+{
+    return x << r | x >> (64 - r);
+}
+
+static inline uint64_t
+round64(uint64_t acc, uint64_t v)
+{
+    return rotl(acc + v * P2, 31) * P1;
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/*
+ * DiskCacheHash: xxHash64 of len bytes, four lanes of eight bytes at a
+ *                time; words are read in host order, as entries are only
+ *                ever read on the machine that wrote them.
+ */
+uint64_t
+DiskCacheHash(const void *data, size_t len, uint64_t seed)
+{
+    const uint8_t *p = data, *end = p + len;
+    uint64_t h, v1, v2, v3, v4;
+    uint32_t w;
+
+    if (len >= 32) {
+        v1 = seed + P1 + P2;
+        v2 = seed + P2;
+        v3 = seed;
+        v4 = seed - P1;
+        do {
+            v1 = round64(v1, read64(p));
+            v2 = round64(v2, read64(p + 8));
+            v3 = round64(v3, read64(p + 16));
+            v4 = round64(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+        h = (h ^ round64(0, v1)) * P1 + P4;
+        h = (h ^ round64(0, v2)) * P1 + P4;
+        h = (h ^ round64(0, v3)) * P1 + P4;
+        h = (h ^ round64(0, v4)) * P1 + P4;
+    }
+    else
+        h = seed + P5;
+    h += len;
+    for (; p + 8 <= end; p += 8)
+        h = rotl(h ^ round64(0, read64(p)), 27) * P1 + P4;
+    if (p + 4 <= end) {
+        memcpy(&w, p, sizeof(w));
+        h = rotl(h ^ w * P1, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = rotl(h ^ *p * P5, 11) * P1;
+    h = (h ^ h >> 33) * P2;
+    h = (h ^ h >> 29) * P3;
+    return h ^ h >> 32;
+}
+
+/*
+ * DiskCacheDir: Find the cache directory, making it if need be:
+ *               $XSETROOT_CACHE_DIR, which may be shared, else the user's
+ *               own.  Returns 0 if there is none to be had.
+ */
+int
+DiskCacheDir(char *dir, size_t len)
+{
+    const char *base = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+    const char *shared = getenv("XSETROOT_CACHE_DIR");
+    char *slash;
+    int n;
+
+    if (shared && shared[0] == '/') {
+        n = snprintf(dir, len, "%s", shared);
+        return n > 0 && (size_t)n < len && (mkdir(dir, 0700) == 0 || errno == EEXIST);
+    }
+    if (base && base[0] == '/')
+        n = snprintf(dir, len, "%s/xsetroot_xcb", base);
+    else if (home && home[0] == '/')
+        n = snprintf(dir, len, "%s/.cache/xsetroot_xcb", home);
+    else
+        return 0;
+    if (n < 0 || (size_t)n >= len)
+        return 0;
+    if (mkdir(dir, 0700) == 0 || errno == EEXIST)
+        return 1;
+    /* $HOME/.cache may not be there yet */
+    slash = strrchr(dir, '/');
+    *slash = '\0';
+    n = mkdir(dir, 0700) == 0 || errno == EEXIST;
+    *slash = '/';
+    return n && (mkdir(dir, 0700) == 0 || errno == EEXIST);
+}
+
+void
+DiskCacheKeyInit(DiskCacheKey *key, const char *kind)
+{
+    key->len = 0;
+    key->overflow = 0;
+    DiskCacheKeyAdd(key, kind, strlen(kind) + 1);
+}
+
+void
+DiskCacheKeyAdd(DiskCacheKey *key, const void *data, size_t len)
+{
+    if (len > sizeof(key->data) - key->len) {
+        key->overflow = 1;
+        return;
+    }
+    memcpy(key->data + key->len, data, len);
+    key->len += len;
+}
+
+static int lock_key(const char *dir, const DiskCacheKey *key);
+
+static int
+entry_path(char *path, size_t len, const char *dir, const DiskCacheKey *key)
+{
+    int n = snprintf(path, len, "%s/%016llx", dir,
+                     (unsigned long long)DiskCacheHash(key->data, key->len, 0));
+
+    return !key->overflow && n > 0 && (size_t)n < len;
+}
+
+/*
+ * The mode of the cache's files: readable by whoever may search its
+ * directory, and by nobody writable, as readers map them shared.
+ */
+static mode_t
+entry_mode(const char *dir)
+{
+    struct stat st;
+
+    return stat(dir, &st) < 0 ? 0400 : (st.st_mode & 0111) << 2;
+}
+
+/*
+ * Whether an open file of the cache can be believed: one this user or root
+ * made, which nobody else could still write to.  Anyone who can write to a
+ * shared directory could otherwise leave pixels there, or what a file
+ * hashed to, under the name of someone else's wallpaper.
+ */
+static int
+trusted(const struct stat *st)
+{
+    return S_ISREG(st->st_mode) && (st->st_uid == getuid() || st->st_uid == 0) &&
+           !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+/*
+ * Open a file of the cache for reading without waiting on what isn't a
+ * regular one: a FIFO left in a shared directory where an entry or a
+ * lock would be would otherwise block the open for good.
+ */
+static int
+open_regular(const char *path, int flags, mode_t mode, struct stat *st)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC | flags, mode);
+
+    if (fd >= 0 && (fstat(fd, st) < 0 || !S_ISREG(st->st_mode))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Write a whole file under a temporary name and rename it to path, so
+ * that readers see all of it or nothing.
+ */
+static int
+write_atomic(const char *dir, const char *path, const void *data, size_t len)
+{
+    char tmp[4096];
+    ssize_t n;
+    int fd, ok;
+
+    n = snprintf(tmp, sizeof(tmp), "%s/tmp.XXXXXX", dir);
+    if (n < 0 || (size_t)n >= sizeof(tmp) || (fd = mkostemp(tmp, O_CLOEXEC)) < 0)
+        return 0;
+    ok = fchmod(fd, entry_mode(dir)) == 0 && write(fd, data, len) == (ssize_t)len;
+    ok = close(fd) == 0 && ok && rename(tmp, path) == 0;
+    if (!ok)
+        unlink(tmp);
+    return ok;
+}
+
+static uint64_t
+hash_file(int fd, int *ok)
+{
+    uint64_t hash = 0;
+    uint8_t *buf;
+    ssize_t n;
+
+    if (!(buf = malloc(READ_CHUNK))) {
+        *ok = 0;
+        return 0;
+    }
+    for (;;) {
+        n = read(fd, buf, READ_CHUNK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        hash = DiskCacheHash(buf, n, hash);
+    }
+    free(buf);
+    *ok = n == 0;
+    return hash;
+}
+
+/*
+ * DiskCacheKeyFile: Add the size and hash of a file's contents to a key.
+ *                   What the file hashed to is remembered in dir, unless
+ *                   it is NULL, and believed while the file's inode, size
+ *                   and times are the same; one changed too recently to
+ *                   tell is hashed every time.  Returns 0 if it can't be
+ *                   read.
+ */
+int
+DiskCacheKeyFile(const char *dir, DiskCacheKey *key, const char *file)
+{
+    FileMemo memo, old;
+    char path[4096];
+    struct stat st;
+    int fd, memo_fd, n, ok;
+
+    if ((fd = open(file, O_RDONLY | O_CLOEXEC)) < 0)
+        return 0;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return 0;
+    }
+    memset(&memo, 0, sizeof(memo));
+    memcpy(memo.magic, FILE_MAGIC, sizeof(memo.magic));
+    memo.version = CACHE_VERSION;
+    memo.id.dev = st.st_dev;
+    memo.id.ino = st.st_ino;
+    memo.id.size = st.st_size;
+    memo.id.mtime = st.st_mtim.tv_sec;
+    memo.id.mtime_ns = st.st_mtim.tv_nsec;
+    memo.id.ctime = st.st_ctim.tv_sec;
+    memo.id.ctime_ns = st.st_ctim.tv_nsec;
+    n = dir ? snprintf(path, sizeof(path), "%s/%016llx", dir,
+                       (unsigned long long)DiskCacheHash(&memo, sizeof(memo), 1)) : -1;
+    if (n < 0 || (size_t)n >= sizeof(path))
+        dir = NULL;
+
+    ok = 0;
+    if (dir && (memo_fd = open_regular(path, 0, 0, &st)) >= 0) {
+        ok = trusted(&st) &&
+             pread(memo_fd, &old, sizeof(old), 0) == sizeof(old) &&
+             !memcmp(old.magic, memo.magic, sizeof(old.magic)) &&
+             old.version == memo.version && !memcmp(&old.id, &memo.id, sizeof(old.id));
+        close(memo_fd);
+    }
+    if (ok)
+        memo.hash = old.hash;
+    else {
+        memo.hash = hash_file(fd, &ok);
+        if (ok && dir && time(NULL) - memo.id.ctime > RACY_SECONDS &&
+            time(NULL) - memo.id.mtime > RACY_SECONDS)
+            write_atomic(dir, path, &memo, sizeof(memo));
+    }
+    close(fd);
+    if (!ok)
+        return 0;
+    DiskCacheKeyAdd(key, &memo.id.size, sizeof(memo.id.size));
+    DiskCacheKeyAdd(key, &memo.hash, sizeof(memo.hash));
+    return 1;
+}
+
+/*
+ * DiskCacheLookup: Map the entry for a key, if there is a good one, and
+ *                  mark it used.  A bad one is removed.
+ */
+int
+DiskCacheLookup(const char *dir, const DiskCacheKey *key, DiskCacheEntry *e)
+{
+    char path[4096];
+    const Header *h;
+    struct stat st;
+
+    if (!entry_path(path, sizeof(path), dir, key) ||
+        (e->fd = open_regular(path, 0, 0, &st)) < 0)
+        return 0;
+    if (!trusted(&st) || st.st_size < HEADER_SIZE ||
+        (e->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, e->fd, 0)) == MAP_FAILED) {
+        close(e->fd);
+        return 0;
+    }
+    e->map_size = st.st_size;
+    h = (const Header *)e->map;
+    if (memcmp(h->magic, CACHE_MAGIC, sizeof(h->magic)) || h->version != CACHE_VERSION ||
+        h->size != (uint64_t)st.st_size ||
+        h->size != HEADER_SIZE + (uint64_t)h->info.stride * h->info.height) {
+        unlink(path);
+        DiskCacheRelease(e);
+        return 0;
+    }
+    if (h->key_len != key->len || memcmp(h->key, key->data, key->len)) {
+        DiskCacheRelease(e);
+        return 0;
+    }
+    e->info = h->info;
+    e->offset = HEADER_SIZE;
+    e->data = e->map + HEADER_SIZE;
+    futimens(e->fd, NULL);
+    return 1;
+}
+
+void
+DiskCacheRelease(DiskCacheEntry *e)
+{
+    munmap(e->map, e->map_size);
+    close(e->fd);
+}
+
+/*
+ * DiskCacheFind: Look a key up, and on a miss claim the making of its
+ *                entry, waiting while another process has it and looking
+ *                again.  Returns 1 on a hit.  On a miss *lock is the claim,
+ *                or -1, for DiskCacheUnlock() once the entry is made.
+ */
+int
+DiskCacheFind(const char *dir, const DiskCacheKey *key, DiskCacheEntry *e, int *lock)
+{
+    *lock = -1;
+    if (DiskCacheLookup(dir, key, e))
+        return 1;
+    if ((*lock = lock_key(dir, key)) >= 0 && DiskCacheLookup(dir, key, e)) {
+        DiskCacheUnlock(dir, key, *lock);
+        *lock = -1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Wait while another process makes the entry for a key, but no longer
+ * than LOCK_SECONDS: it may be stuck on a slow server.  Returns the lock,
+ * or -1 if there is none to be had.
+ */
+static int
+lock_key(const char *dir, const DiskCacheKey *key)
+{
+    struct timespec poll = { 0, LOCK_POLL_NS };
+    char path[4096 + 8];
+    struct stat st;
+    int fd, i;
+
+    if (!entry_path(path, sizeof(path) - 5, dir, key))
+        return -1;
+    strcat(path, ".lock");
+    if ((fd = open_regular(path, O_CREAT, entry_mode(dir), &st)) < 0)
+        return -1;
+    for (i = 0; i < LOCK_SECONDS * (1000000000 / LOCK_POLL_NS); i++) {
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0)
+            return fd;
+        if (errno != EWOULDBLOCK && errno != EINTR)
+            break;
+        nanosleep(&poll, NULL);
+    }
+    close(fd);
+    return -1;
+}
+
+/*
+ * DiskCacheUnlock: Let the processes waiting on a key go, to find its
+ *                  entry made, or to make it themselves if it wasn't.
+ */
+void
+DiskCacheUnlock(const char *dir, const DiskCacheKey *key, int lock)
+{
+    char path[4096 + 8];
+
+    if (lock < 0)
+        return;
+    if (entry_path(path, sizeof(path) - 5, dir, key)) {
+        strcat(path, ".lock");
+        unlink(path);
+    }
+    close(lock);
+}
+
+/*
+ * DiskCacheCreate: Start writing the entry for a key, to a temporary file
+ *                  the pixels are then written to in order.  Returns 0 if
+ *                  it can't be.
+ */
+int
+DiskCacheCreate(const char *dir, const DiskCacheKey *key, const DiskCacheInfo *info,
+                DiskCacheWriter *w)
+{
+    Header *h;
+    int n;
+
+    memset(w, 0, sizeof(*w));
+    n = snprintf(w->tmp, sizeof(w->tmp), "%s/tmp.XXXXXX", dir);
+    if (!entry_path(w->path, sizeof(w->path), dir, key) || n < 0 || (size_t)n >= sizeof(w->tmp) ||
+        !(h = calloc(1, HEADER_SIZE)))
+        return 0;
+    if ((w->fd = mkostemp(w->tmp, O_CLOEXEC)) < 0) {
+        free(h);
+        return 0;
+    }
+    fchmod(w->fd, entry_mode(dir));
+    memcpy(h->magic, CACHE_MAGIC, sizeof(h->magic));
+    h->version = CACHE_VERSION;
+    h->key_len = key->len;
+    memcpy(h->key, key->data, key->len);
+    h->info = *info;
+    w->expected = (size_t)info->stride * info->height;
+    h->size = HEADER_SIZE + w->expected;
+    DiskCacheWrite(w, h, HEADER_SIZE);
+    free(h);
+    w->written = 0;
+    return 1;
+}
+
+void
+DiskCacheWrite(DiskCacheWriter *w, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    ssize_t n;
+
+    while (len && !w->failed) {
+        if ((n = write(w->fd, p, len)) < 0) {
+            w->failed = errno != EINTR;
+            continue;
+        }
+        p += n;
+        len -= n;
+        w->written += n;
+    }
+}
+
+static int
+by_use(const void *a, const void *b)
+{
+    const Entry *ea = a, *eb = b;
+
+    return ea->used < eb->used ? -1 : ea->used > eb->used;
+}
+
+/*
+ * The cache's limit in bytes: $XSETROOT_CACHE_SIZE megabytes, as much as
+ * can be counted if it says more, or DEFAULT_LIMIT if it isn't a number.
+ */
+static uint64_t
+cache_limit(void)
+{
+    const char *env = getenv("XSETROOT_CACHE_SIZE");
+    unsigned long long mb;
+    char *end;
+
+    if (!env || *env < '0' || *env > '9')
+        return (uint64_t)DEFAULT_LIMIT << 20;
+    errno = 0;
+    mb = strtoull(env, &end, 10);
+    if (*end)
+        return (uint64_t)DEFAULT_LIMIT << 20;
+    if (errno == ERANGE || mb > UINT64_MAX >> 20)
+        return UINT64_MAX;
+    return (uint64_t)mb << 20;
+}
+
+/*
+ * Remove the least recently used entries until the cache fits its limit,
+ * and temporary files left behind by writers that died.
+ */
+static void
+evict(const char *dir)
+{
+    uint64_t limit = cache_limit(), total = 0;
+    Entry *entries = NULL, *more;
+    struct dirent *d;
+    struct stat st;
+    size_t n = 0, max = 0, i;
+    time_t now = time(NULL);
+    DIR *dp;
+
+    if (!(dp = opendir(dir)))
+        return;
+    while ((d = readdir(dp))) {
+        if (fstatat(dirfd(dp), d->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode))
+            continue;
+        if (!strncmp(d->d_name, "tmp.", 4) || strstr(d->d_name, ".lock")) {
+            if (now - st.st_mtime > STALE_SECONDS)
+                unlinkat(dirfd(dp), d->d_name, 0);
+            continue;
+        }
+        if (strlen(d->d_name) != 16 || strspn(d->d_name, "0123456789abcdef") != 16)
+            continue;
+        if (n == max) {
+            max = max ? 2 * max : 64;
+            if (!(more = realloc(entries, max * sizeof(Entry))))
+                break;
+            entries = more;
+        }
+        strcpy(entries[n].name, d->d_name);
+        entries[n].used = st.st_mtime;
+        entries[n].size = st.st_size;
+        total += st.st_size;
+        n++;
+    }
+    if (total > limit) {
+        qsort(entries, n, sizeof(Entry), by_use);
+        for (i = 0; i < n && total > limit; i++)
+            if (unlinkat(dirfd(dp), entries[i].name, 0) == 0 || errno == ENOENT)
+                total -= entries[i].size;
+    }
+    closedir(dp);
+    free(entries);
+}
+
+/*
+ * DiskCacheCommit: Put a completely written entry in place, then keep the
+ *                  cache to its size.  Returns 0 if it was thrown away.
+ */
+int
+DiskCacheCommit(const char *dir, DiskCacheWriter *w)
+{
+    if (w->failed || w->written != w->expected) {
+        DiskCacheAbort(w);
+        return 0;
+    }
+    if (close(w->fd) < 0 || rename(w->tmp, w->path) < 0) {
+        unlink(w->tmp);
+        return 0;
+    }
+    evict(dir);
+    return 1;
+}
+
+void
+DiskCacheAbort(DiskCacheWriter *w)
+{
+    close(w->fd);
+    unlink(w->tmp);
+}
+/* vim: set ts=4 sw=4 et cindent: */
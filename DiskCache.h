@@ -0,0 +1,85 @@
+/* DiskCache.h */
+
+#ifndef _DISKCACHE_H_
+#define _DISKCACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A cache of finished pixmap contents on disk, in $XDG_CACHE_HOME/
+ * xsetroot_xcb, so that the same background set again costs neither
+ * decoding nor converting.  An entry holds the scanlines exactly as the
+ * server takes them, after a header, and is named by a hash of its key:
+ * whatever the pixels depend on, added to a DiskCacheKey piece by piece,
+ * source file contents included.  The key is kept in the header too, so
+ * a hash collision is a miss.
+ *
+ * Entries are written to a temporary file and renamed into place, so
+ * readers see whole entries or none, and are never changed after: a
+ * reader's mapping stays good even if the entry is replaced or evicted.
+ * A hit touches the entry's modification time; once the cache outgrows
+ * its limit the least recently used entries are removed.
+ *
+ * The cache may be shared by the processes of many sessions, of many
+ * users too if $XSETROOT_CACHE_DIR names a directory they can all write
+ * to: when they start at once the first to miss an entry locks its key
+ * while making it and the others wait, then map what it made.  A reader
+ * holds an entry by its mapping, so one evicted while in use goes away
+ * only when the last reader lets go.  Entries are made readable by all
+ * who can reach the directory, and writable by none, but only those of
+ * the same user or root are believed.
+ */
+#define DISK_CACHE_KEY_MAX  1024
+
+typedef struct {
+    size_t len;
+    uint8_t data[DISK_CACHE_KEY_MAX];
+    int overflow;               /* too long to be used */
+} DiskCacheKey;
+
+/* What the pixels are: a pixmap of width x height to put at (x, y). */
+typedef struct {
+    uint16_t width, height;
+    uint8_t depth;
+    uint8_t format;             /* XCB_IMAGE_FORMAT_* */
+    uint16_t pad_;
+    uint32_t stride;
+    int32_t x, y;
+} DiskCacheInfo;
+
+typedef struct {
+    int fd;
+    uint8_t *map;
+    size_t map_size;
+    DiskCacheInfo info;
+    size_t offset;              /* of the pixels in the file */
+    const uint8_t *data;
+} DiskCacheEntry;
+
+typedef struct {
+    int fd;
+    char tmp[4096];
+    char path[4096];
+    size_t written, expected;
+    int failed;
+} DiskCacheWriter;
+
+extern int DiskCacheDir(char *dir, size_t len);
+extern uint64_t DiskCacheHash(const void *data, size_t len, uint64_t seed);
+extern void DiskCacheKeyInit(DiskCacheKey *key, const char *kind);
+extern void DiskCacheKeyAdd(DiskCacheKey *key, const void *data, size_t len);
+extern int DiskCacheKeyFile(const char *dir, DiskCacheKey *key, const char *file);
+extern int DiskCacheLookup(const char *dir, const DiskCacheKey *key, DiskCacheEntry *e);
+extern void DiskCacheRelease(DiskCacheEntry *e);
+extern int DiskCacheFind(const char *dir, const DiskCacheKey *key, DiskCacheEntry *e,
+                         int *lock);
+extern void DiskCacheUnlock(const char *dir, const DiskCacheKey *key, int lock);
+extern int DiskCacheCreate(const char *dir, const DiskCacheKey *key,
+                           const DiskCacheInfo *info, DiskCacheWriter *w);
+extern void DiskCacheWrite(DiskCacheWriter *w, const void *data, size_t len);
+extern int DiskCacheCommit(const char *dir, DiskCacheWriter *w);
+extern void DiskCacheAbort(DiskCacheWriter *w);
+
+#endif /* _DISKCACHE_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,249 @@
+/* Dither.c
+ *
+ * Ordered and error diffusion dithering of 8-bit ARGB rows down to a few
+ * levels of each channel.  The levels are those the packers round to, so
+ * dithering only has to move each channel to where rounding lands on the
+ * level it wants.  For ordered dithering that is a per-position offset,
+ * added with byte saturation; the SSE2 version does four pixels an
+ * instruction.  Error diffusion quantizes each pixel itself to find its
+ * error; the SSE2 version does the three channels of a pixel at once in
+ * 16-bit lanes.  Both versions of each give the same bytes.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "Dither.h"
+
+/*
+ * Channel values in diffusion: the level nearest v, as the packers round,
+ * and the 8-bit value that rounds back to level i.  Exact for 2 to 128
+ * levels and for 256, what DitherNew() takes.
+ */
+#define LEVEL(v, max)       (((v) * (max) + 127) / 255)
+#define VALUE(i, scale)     (((i) * (scale) + 128) >> 8)
+
+/* position (x, y) of the 8x8 Bayer matrix, 0 to 63 */
+static int
+bayer(int x, int y)
+{
+    int i, v = 0;
+
+    for (i = 0; i < 3; i++)
+        v = v << 2 | (((x ^ y) >> i) & 1) << 1 | ((y >> i) & 1);
+    return v;
+}
+
+static inline int
+clamp255(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+/* pixels x to width - 1 of a row */
+static inline void
+ordered_span(const Dither *d, int y, uint32_t *argb, int x, int width)
+{
+    const uint32_t *plus = d->plus[y & 7], *minus = d->minus[y & 7];
+    uint32_t c, out;
+    int k, v;
+
+    for (; x < width; x++) {
+        c = argb[x];
+        out = c & 0xff000000;
+        for (k = 0; k < 24; k += 8) {
+            v = (c >> k & 0xff) + (plus[x & 7] >> k & 0xff);
+            v = (v > 255 ? 255 : v) - (minus[x & 7] >> k & 0xff);
+            out |= (uint32_t)(v < 0 ? 0 : v) << k;
+        }
+        argb[x] = out;
+    }
+}
+
+static void
+ordered_scalar(Dither *d, int y, uint32_t *argb)
+{
+    ordered_span(d, y, argb, 0, d->width);
+}
+
+/*
+ * Floyd-Steinberg, left to right: 7/16 of a pixel's error goes to the
+ * next pixel, 3/16, 5/16 and 1/16 to the three below it.  The errors of
+ * the row below are kept summed in sixteenths, four to a pixel, with a
+ * pixel to spare before the row.  Rows take turns with the two rows of
+ * d->err.
+ */
+#define ERR_ROW(d, y)   ((d)->err + ((y) & 1) * ((d)->width + 2) * 4 + 4)
+
+static void
+diffusion_scalar(Dither *d, int y, uint32_t *argb)
+{
+    int16_t *carry = ERR_ROW(d, y), *err = ERR_ROW(d, y + 1);
+    int right[3] = { 0, 0, 0 }, below[3] = { 0, 0, 0 }, after[3] = { 0, 0, 0 };
+    uint32_t c, out;
+    int x, k, v, q, e;
+
+    if (y == 0)
+        memset(carry, 0, d->width * 4 * sizeof(int16_t));
+    for (x = 0; x < d->width; x++) {
+        c = argb[x];
+        out = c & 0xff000000;
+        for (k = 0; k < 3; k++) {
+            v = (c >> 8 * k & 0xff) + ((carry[4 * x + k] + right[k] + 8) >> 4);
+            v = clamp255(v);
+            q = VALUE(LEVEL(v, d->max[k]), d->scale[k]);
+            e = v - q;
+            out |= (uint32_t)q << 8 * k;
+            err[4 * (x - 1) + k] = below[k] + 3 * e;
+            below[k] = after[k] + 5 * e;
+            after[k] = e;
+            right[k] = 7 * e;
+        }
+        argb[x] = out;
+    }
+    for (k = 0; k < 3; k++)
+        err[4 * (x - 1) + k] = below[k];
+}
+
+#if defined(__SSE2__)
+static void
+ordered_sse2(Dither *d, int y, uint32_t *argb)
+{
+    const uint32_t *plus = d->plus[y & 7], *minus = d->minus[y & 7];
+    __m128i p0 = _mm_loadu_si128((const __m128i *)plus);
+    __m128i p1 = _mm_loadu_si128((const __m128i *)(plus + 4));
+    __m128i m0 = _mm_loadu_si128((const __m128i *)minus);
+    __m128i m1 = _mm_loadu_si128((const __m128i *)(minus + 4));
+    __m128i *p;
+    int x, width = d->width;
+
+    for (x = 0; x + 8 <= width; x += 8) {
+        p = (__m128i *)(argb + x);
+        _mm_storeu_si128(p, _mm_subs_epu8(_mm_adds_epu8(_mm_loadu_si128(p), p0), m0));
+        _mm_storeu_si128(p + 1, _mm_subs_epu8(_mm_adds_epu8(_mm_loadu_si128(p + 1), p1), m1));
+    }
+    ordered_span(d, y, argb, x, width);
+}
+
+static void
+diffusion_sse2(Dither *d, int y, uint32_t *argb)
+{
+    int16_t *carry = ERR_ROW(d, y), *err = ERR_ROW(d, y + 1);
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(8);
+    const __m128i top = _mm_set1_epi16(255), half = _mm_set1_epi16(127);
+    const __m128i div255 = _mm_set1_epi16((short)0x8081), half8 = _mm_set1_epi16(128);
+    const __m128i rgb = _mm_set_epi16(0, 0, 0, 0, 0, -1, -1, -1);
+    const __m128i max = _mm_loadl_epi64((const __m128i *)d->max);
+    const __m128i scale = _mm_loadl_epi64((const __m128i *)d->scale);
+    __m128i right = zero, below = zero, after = zero, v, i, e;
+    int x;
+
+    if (y == 0)
+        memset(carry, 0, d->width * 4 * sizeof(int16_t));
+    for (x = 0; x < d->width; x++) {
+        v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(argb[x]), zero);
+        e = _mm_add_epi16(_mm_loadl_epi64((const __m128i *)(carry + 4 * x)), right);
+        v = _mm_add_epi16(v, _mm_srai_epi16(_mm_add_epi16(e, round), 4));
+        v = _mm_min_epi16(_mm_max_epi16(v, zero), top);
+        /* LEVEL() with the division by 255 as a multiply, then VALUE() */
+        i = _mm_add_epi16(_mm_mullo_epi16(v, max), half);
+        i = _mm_srli_epi16(_mm_mulhi_epu16(i, div255), 7);
+        i = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(i, scale), half8), 8);
+        e = _mm_and_si128(_mm_sub_epi16(v, i), rgb);
+        argb[x] = (argb[x] & 0xff000000) |
+                  (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(i, zero));
+        /* 7e, the next pixel's, first: it is what the loop waits on */
+        right = _mm_sub_epi16(_mm_slli_epi16(e, 3), e);
+        _mm_storel_epi64((__m128i *)(err + 4 * (x - 1)),
+                         _mm_add_epi16(below, _mm_add_epi16(_mm_slli_epi16(e, 1), e)));
+        below = _mm_add_epi16(after, _mm_add_epi16(_mm_slli_epi16(e, 2), e));
+        after = e;
+    }
+    _mm_storel_epi64((__m128i *)(err + 4 * (x - 1)), below);
+}
+#endif
+
+/* The ditherers, fastest first. */
+const DitherKernel dither_kernels[] = {
+#if defined(__SSE2__)
+    { "ordered_sse2",   DITHER_ORDERED,     ordered_sse2 },
+    { "diffusion_sse2", DITHER_DIFFUSION,   diffusion_sse2 },
+#endif
+    { "ordered",        DITHER_ORDERED,     ordered_scalar },
+    { "diffusion",      DITHER_DIFFUSION,   diffusion_scalar },
+};
+const int n_dither_kernels = sizeof(dither_kernels) / sizeof(dither_kernels[0]);
+
+/*
+ * DitherNew: Set up dithering rows of width pixels to the given levels of
+ *            red, green and blue, 2 to 128 each or 256 for a channel left
+ *            alone.  NULL if out of memory or the levels won't do.
+ */
+Dither *
+DitherNew(int kind, const int levels[3], int width)
+{
+    Dither *d;
+    int i, k, x, y, max, num, den, off;
+
+    for (k = 0; k < 3; k++)
+        if (levels[k] < 2 || (levels[k] > 128 && levels[k] != 256))
+            return NULL;
+    if (!(d = calloc(1, sizeof(Dither))))
+        return NULL;
+    d->kind = kind;
+    d->width = width;
+    for (k = 0; k < 3; k++) {
+        d->levels[k] = levels[k];
+        max = levels[2 - k] - 1;
+        d->max[k] = max;
+        d->scale[k] = (255 * 256 + max / 2) / max;
+        /* half a level either way, the middle of the matrix at none */
+        for (y = 0; y < 8; y++)
+            for (x = 0; x < 8; x++) {
+                num = (2 * bayer(x, y) - 63) * 255;
+                den = 128 * max;
+                off = (abs(num) + den / 2) / den;
+                if (num < 0)
+                    d->minus[y][x] |= (uint32_t)off << 8 * k;
+                else
+                    d->plus[y][x] |= (uint32_t)off << 8 * k;
+            }
+    }
+    if (kind == DITHER_DIFFUSION &&
+        !(d->err = calloc(2 * (width + 2) * 4, sizeof(int16_t)))) {
+        free(d);
+        return NULL;
+    }
+    for (i = 0; i < n_dither_kernels; i++)
+        if (dither_kernels[i].kind == kind) {
+            d->dither = dither_kernels[i].dither;
+            d->kernel = dither_kernels[i].name;
+            break;
+        }
+    return d;
+}
+
+/*
+ * DitherRow: Dither row y of the image in place.  Rows of error diffusion
+ *            must come in order, starting again at 0.
+ */
+void
+DitherRow(Dither *d, int y, uint32_t *argb)
+{
+    d->dither(d, y, argb);
+}
+
+void
+DitherFree(Dither *d)
+{
+    if (!d)
+        return;
+    free(d->err);
+    free(d);
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,53 @@
+/* Dither.h */
+
+#ifndef _DITHER_H_
+#define _DITHER_H_
+
+#include <stdint.h>
+
+/*
+ * Dithering rows of 0xAARRGGBB for pixels with only a few levels of each
+ * channel: a TrueColor visual of less than 8 bits a channel, or a color
+ * cube allocated in a colormap.  A dithered row is still 8-bit ARGB, each
+ * channel nudged so that the packer's rounding to the nearest level gives
+ * the dithered one.
+ *
+ * Ordered (8x8 Bayer) dithering only reads the Dither, so rows may be done
+ * in any order and on any thread.  Error diffusion (Floyd-Steinberg)
+ * carries errors down from row to row, so its rows must be done one after
+ * another from the top.
+ */
+enum { DITHER_ORDERED, DITHER_DIFFUSION };
+
+typedef struct _Dither Dither;
+
+typedef void (*DitherProc)(Dither *d, int y, uint32_t *argb);
+
+struct _Dither {
+    int kind;
+    int width;
+    int levels[3];              /* of red, green and blue */
+    /* ordered: what each position adds to and takes off its channels */
+    uint32_t plus[8][8], minus[8][8];
+    /* diffusion, in blue, green, red order: levels - 1, and 255 over it in 8.8 */
+    uint16_t max[4], scale[4];
+    int16_t *err;               /* diffusion: errors carried down, two rows */
+    DitherProc dither;
+    const char *kernel;         /* name of the ditherer picked */
+};
+
+typedef struct {
+    const char *name;
+    int kind;
+    DitherProc dither;
+} DitherKernel;
+
+extern const DitherKernel dither_kernels[];
+extern const int n_dither_kernels;
+
+extern Dither *DitherNew(int kind, const int levels[3], int width);
+extern void DitherRow(Dither *d, int y, uint32_t *argb);
+extern void DitherFree(Dither *d);
+
+#endif /* _DITHER_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
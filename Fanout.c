@@ -0,0 +1,290 @@
+/* Fanout.c
+ *
+ * -displays: make the same change on many displays at once.  Every display
+ * gets a forked worker with a connection of its own, at most 'jobs' of them
+ * at a time.  Whatever was parsed before FanoutRun() is shared by all of
+ * them, and only the X traffic happens in parallel.  A worker's standard
+ * error is collected through a pipe, and one key=value report line per
+ * display, with its latency and any messages, is printed as it finishes.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <glob.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "Fanout.h"
+
+#define MAX_RANGE   65536       /* displays in one ":a-b" entry */
+
+typedef struct {
+    pid_t pid;
+    int fd;                     /* read end of the worker's stderr */
+    const char *display;
+    double start;
+    char *out;
+    size_t len;
+} Worker;
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+add_display(char ***displays, int *n, int *size, const char *name)
+{
+    char **grown;
+
+    if (*n == *size) {
+        *size = *size ? *size * 2 : 64;
+        if (!(grown = realloc(*displays, *size * sizeof(char *))))
+            return -1;
+        *displays = grown;
+    }
+    if (!((*displays)[*n] = strdup(name)))
+        return -1;
+    (*n)++;
+    return 0;
+}
+
+/*
+ * Add one list entry, expanding "host:a-b.s" into host:a.s ... host:b.s.
+ */
+static int
+add_entry(char ***displays, int *n, int *size, const char *entry)
+{
+    const char *colon = strrchr(entry, ':');
+    char name[512], *end;
+    long first, last, i;
+
+    if (!colon || !strchr(colon, '-'))
+        return add_display(displays, n, size, entry);
+    first = strtol(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '-')
+        return add_display(displays, n, size, entry);
+    last = strtol(end + 1, &end, 10);
+    if (last < first || last - first >= MAX_RANGE || (*end && *end != '.'))
+        return add_display(displays, n, size, entry);
+    for (i = first; i <= last; i++) {
+        snprintf(name, sizeof(name), "%.*s:%ld%s", (int)(colon - entry), entry, i, end);
+        if (add_display(displays, n, size, name))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * FanoutDisplays: Expand a -displays argument into display names.  It is
+ * a file with one display per line ("-" for standard input), a glob over
+ * server sockets such as "/tmp/.X11-unix/X*", or a comma separated list
+ * whose entries may be ranges like ":10-99".  Returns the number of
+ * displays, or -1 if the file can't be read or memory runs out.
+ */
+int
+FanoutDisplays(const char *spec, char ***displays)
+{
+    struct stat st;
+    FILE *f;
+    glob_t g;
+    char *line = NULL, *list, *entry, *base, *end, name[32];
+    size_t size = 0;
+    ssize_t len;
+    int n = 0, alloc = 0, failed = 0;
+    size_t i;
+
+    *displays = NULL;
+    if (!strcmp(spec, "-") || (stat(spec, &st) == 0 && S_ISREG(st.st_mode))) {
+        if (!(f = strcmp(spec, "-") ? fopen(spec, "r") : stdin))
+            return -1;
+        while (!failed && (len = getline(&line, &size, f)) != -1) {
+            while (len && strchr(" \t\r\n", line[len - 1]))
+                line[--len] = '\0';
+            for (entry = line; *entry == ' ' || *entry == '\t'; entry++)
+                ;
+            if (*entry && *entry != '#')
+                failed = add_entry(displays, &n, &alloc, entry);
+        }
+        free(line);
+        if (f != stdin)
+            fclose(f);
+    }
+    else if (strpbrk(spec, "*?[")) {
+        /* server sockets are named X<display number> */
+        if (glob(spec, 0, NULL, &g) == 0) {
+            for (i = 0; !failed && i < g.gl_pathc; i++) {
+                base = strrchr(g.gl_pathv[i], '/');
+                base = base ? base + 1 : g.gl_pathv[i];
+                if (base[0] != 'X' || strtol(base + 1, &end, 10) < 0 ||
+                    end == base + 1 || *end)
+                    continue;
+                snprintf(name, sizeof(name), ":%s", base + 1);
+                failed = add_display(displays, &n, &alloc, name);
+            }
+            globfree(&g);
+        }
+    }
+    else {
+        if (!(list = strdup(spec)))
+            return -1;
+        for (entry = strtok(list, ", \t"); !failed && entry; entry = strtok(NULL, ", \t"))
+            failed = add_entry(displays, &n, &alloc, entry);
+        free(list);
+    }
+    return failed ? -1 : n;
+}
+
+/* Print a worker's report line, quoting what it said on stderr. */
+static void
+report(Worker *w, int status)
+{
+    size_t i;
+    int sep = 0;
+
+    printf("display=%s status=%d latency_ms=%.3f", w->display, status,
+           (now() - w->start) * 1000);
+    if (w->len) {
+        fputs(" error=\"", stdout);
+        for (i = 0; i < w->len; i++) {
+            if (w->out[i] == '\n') {
+                sep = 1;
+                continue;
+            }
+            if (sep)
+                fputs("; ", stdout);
+            sep = 0;
+            if (w->out[i] == '"' || w->out[i] == '\\')
+                putchar('\\');
+            putchar(w->out[i]);
+        }
+        putchar('"');
+    }
+    putchar('\n');
+    fflush(stdout);
+}
+
+static int
+start(Worker *w, const char *display, FanoutProc work)
+{
+    int fds[2];
+
+    if (pipe(fds) < 0)
+        return -1;
+    fflush(stdout);
+    fflush(stderr);
+    if ((w->pid = fork()) < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (w->pid == 0) {
+        close(fds[0]);
+        dup2(fds[1], 2);
+        close(fds[1]);
+        _exit(work(display));
+    }
+    close(fds[1]);
+    w->fd = fds[0];
+    w->display = display;
+    w->start = now();
+    w->out = NULL;
+    w->len = 0;
+    return 0;
+}
+
+/*
+ * FanoutRun: Run 'work' for every display with at most 'jobs' workers at a
+ * time.  Reports each display as it finishes and a total at the end, and
+ * returns the worst exit status.
+ */
+int
+FanoutRun(const char *program_name, char **displays, int n_displays, int jobs,
+          FanoutProc work)
+{
+    Worker *workers;
+    struct pollfd *fds;
+    char buf[4096], *grown;
+    double t0 = now();
+    ssize_t len;
+    int next = 0, running = 0, failed = 0, worst = 0;
+    int i, j, wstatus, status;
+
+    if (jobs > n_displays)
+        jobs = n_displays;
+    workers = calloc(jobs, sizeof(Worker));
+    fds = calloc(jobs, sizeof(struct pollfd));
+    if (!workers || !fds) {
+        fprintf(stderr, "%s: out of memory\n", program_name);
+        return 2;
+    }
+
+    while (next < n_displays || running) {
+        while (running < jobs && next < n_displays) {
+            if (start(&workers[running], displays[next], work) < 0) {
+                fprintf(stderr, "%s: can't start a worker: %s\n", program_name,
+                        strerror(errno));
+                if (!running)
+                    return 2;
+                break;
+            }
+            running++;
+            next++;
+        }
+        for (i = 0; i < running; i++) {
+            fds[i].fd = workers[i].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, running, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (i = running - 1; i >= 0; i--) {
+            if (!fds[i].revents)
+                continue;
+            if ((len = read(workers[i].fd, buf, sizeof(buf))) > 0) {
+                if ((grown = realloc(workers[i].out, workers[i].len + len))) {
+                    memcpy(grown + workers[i].len, buf, len);
+                    workers[i].out = grown;
+                    workers[i].len += len;
+                }
+                continue;
+            }
+            if (len < 0 && errno == EINTR)
+                continue;
+            /* stderr closed: the worker is done */
+            close(workers[i].fd);
+            while (waitpid(workers[i].pid, &wstatus, 0) < 0 && errno == EINTR)
+                ;
+            status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 2;
+            report(&workers[i], status);
+            if (status) {
+                failed++;
+                if (status > worst)
+                    worst = status;
+            }
+            free(workers[i].out);
+            for (j = i; j < running - 1; j++)
+                workers[j] = workers[j + 1];
+            running--;
+        }
+    }
+    printf("displays=%d ok=%d failed=%d wall_ms=%.3f\n", n_displays,
+           n_displays - failed, failed, (now() - t0) * 1000);
+    fflush(stdout);
+    free(workers);
+    free(fds);
+    return worst;
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,14 @@
+/* Fanout.h */
+
+#ifndef _FANOUT_H_
+#define _FANOUT_H_
+
+/* Does the work for one display in a worker; returns its exit status. */
+typedef int (*FanoutProc)(const char *display_name);
+
+extern int FanoutDisplays(const char *spec, char ***displays);
+extern int FanoutRun(const char *program_name, char **displays, int n_displays,
+                     int jobs, FanoutProc work);
+
+#endif /* _FANOUT_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,415 @@
+/* Pack.c
+ *
+ * Packing rows of 8-bit ARGB into the pixels of a TrueColor visual.  The
+ * layouts servers actually use have packers of their own, generated from
+ * a pixel expression and a store for the bits per pixel and byte order,
+ * with SSE2 or SSSE3 versions where the shuffling pays.  Any other layout,
+ * and 16-bit ones without SSE2, where a lookup beats the arithmetic, go
+ * through per-channel tables.  The generic packer, which also looks
+ * up the layout per pixel, is what the others are measured against.
+ * Colormapped visuals get a palette packer, which looks the pixel up in
+ * a color cube.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_SSSE3_TARGET 1
+#endif
+#include "Pack.h"
+
+#define CH(c, shift)    (((c) >> (shift)) & 0xff)
+
+#define PIXEL_TABLE(pf, c)  ((pf)->red[CH(c, 16)] | (pf)->green[CH(c, 8)] | \
+                             (pf)->blue[CH(c, 0)])
+#define PIXEL_PALETTE(pf, c) ((pf)->colors[(pf)->red[CH(c, 16)] + (pf)->green[CH(c, 8)] + \
+                                            (pf)->blue[CH(c, 0)]])
+#define PIXEL_RGB888(pf, c) ((c) & 0xffffff)
+#define PIXEL_BGR888(pf, c) (CH(c, 0) << 16 | ((c) & 0xff00) | CH(c, 16))
+
+/* bpp and msb are constants wherever this is inlined */
+static inline void
+store_pixel(uint8_t *p, uint32_t v, int bpp, int msb)
+{
+    switch (bpp) {
+    case 8:
+        p[0] = v;
+        break;
+    case 16:
+        p[msb ? 1 : 0] = v;
+        p[msb ? 0 : 1] = v >> 8;
+        break;
+    case 24:
+        p[msb ? 2 : 0] = v;
+        p[1] = v >> 8;
+        p[msb ? 0 : 2] = v >> 16;
+        break;
+    default:
+        p[msb ? 3 : 0] = v;
+        p[msb ? 2 : 1] = v >> 8;
+        p[msb ? 1 : 2] = v >> 16;
+        p[msb ? 0 : 3] = v >> 24;
+        break;
+    }
+}
+
+#define DEFINE_PACK(name, BPP, MSB, PIXEL)                                  \
+static void                                                                 \
+name(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)  \
+{                                                                           \
+    uint32_t c;                                                             \
+    int x;                                                                  \
+                                                                            \
+    (void)pf;                                                               \
+    for (x = 0; x < width; x++, out += (BPP) / 8) {                         \
+        c = argb[x];                                                        \
+        store_pixel(out, PIXEL(pf, c), BPP, MSB);                           \
+    }                                                                       \
+}
+
+DEFINE_PACK(pack_xrgb32_lsb, 32, 0, PIXEL_RGB888)
+DEFINE_PACK(pack_xrgb32_msb, 32, 1, PIXEL_RGB888)
+DEFINE_PACK(pack_xbgr32_lsb, 32, 0, PIXEL_BGR888)
+DEFINE_PACK(pack_xbgr32_msb, 32, 1, PIXEL_BGR888)
+DEFINE_PACK(pack_rgb24_lsb, 24, 0, PIXEL_RGB888)
+DEFINE_PACK(pack_rgb24_msb, 24, 1, PIXEL_RGB888)
+DEFINE_PACK(pack_table8, 8, 0, PIXEL_TABLE)
+DEFINE_PACK(pack_table16_lsb, 16, 0, PIXEL_TABLE)
+DEFINE_PACK(pack_table16_msb, 16, 1, PIXEL_TABLE)
+DEFINE_PACK(pack_table24_lsb, 24, 0, PIXEL_TABLE)
+DEFINE_PACK(pack_table24_msb, 24, 1, PIXEL_TABLE)
+DEFINE_PACK(pack_table32_lsb, 32, 0, PIXEL_TABLE)
+DEFINE_PACK(pack_table32_msb, 32, 1, PIXEL_TABLE)
+DEFINE_PACK(pack_palette8, 8, 0, PIXEL_PALETTE)
+
+static void
+pack_generic(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++, out += pf->bpp / 8)
+        store_pixel(out, PIXEL_TABLE(pf, argb[x]), pf->bpp, pf->msb_first);
+}
+
+static void
+pack_palette(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++, out += pf->bpp / 8)
+        store_pixel(out, PIXEL_PALETTE(pf, argb[x]), pf->bpp, pf->msb_first);
+}
+
+#if defined(__SSE2__)
+/*
+ * The SIMD packers do four or eight pixels of input at a time and leave the
+ * rest of a row to a scalar packer of the same layout.  Each 32-bit pixel below
+ * is what a little-endian store puts in memory in the server's order.
+ */
+static inline __m128i
+xrgb32_msb_sse2(__m128i c)
+{
+    return _mm_or_si128(_mm_slli_epi32(c, 24),
+                        _mm_or_si128(_mm_and_si128(_mm_slli_epi32(c, 8),
+                                                   _mm_set1_epi32(0xff0000)),
+                                     _mm_and_si128(_mm_srli_epi32(c, 8),
+                                                   _mm_set1_epi32(0xff00))));
+}
+
+static inline __m128i
+xbgr32_lsb_sse2(__m128i c)
+{
+    return _mm_or_si128(_mm_and_si128(_mm_slli_epi32(c, 16), _mm_set1_epi32(0xff0000)),
+                        _mm_or_si128(_mm_and_si128(c, _mm_set1_epi32(0xff00)),
+                                     _mm_and_si128(_mm_srli_epi32(c, 16),
+                                                   _mm_set1_epi32(0xff))));
+}
+
+static inline __m128i
+xrgb32_lsb_sse2(__m128i c)
+{
+    return _mm_and_si128(c, _mm_set1_epi32(0xffffff));
+}
+
+static inline __m128i
+xbgr32_msb_sse2(__m128i c)
+{
+    return _mm_and_si128(_mm_slli_epi32(c, 8), _mm_set1_epi32(0xffffff00));
+}
+
+#define DEFINE_PACK32_SSE2(name, SHUFFLE, scalar)                           \
+static void                                                                 \
+name(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)  \
+{                                                                           \
+    int x;                                                                  \
+                                                                            \
+    for (x = 0; x + 4 <= width; x += 4)                                     \
+        _mm_storeu_si128((__m128i *)(out + 4 * x),                          \
+                         SHUFFLE(_mm_loadu_si128((const __m128i *)(argb + x)))); \
+    scalar(pf, argb + x, out + 4 * x, width - x);                           \
+}
+
+DEFINE_PACK32_SSE2(pack_xrgb32_lsb_sse2, xrgb32_lsb_sse2, pack_xrgb32_lsb)
+DEFINE_PACK32_SSE2(pack_xrgb32_msb_sse2, xrgb32_msb_sse2, pack_xrgb32_msb)
+DEFINE_PACK32_SSE2(pack_xbgr32_lsb_sse2, xbgr32_lsb_sse2, pack_xbgr32_lsb)
+DEFINE_PACK32_SSE2(pack_xbgr32_msb_sse2, xbgr32_msb_sse2, pack_xbgr32_msb)
+
+/*
+ * An 8-bit channel rounded to max in 32-bit lanes, as the tables round it:
+ * (v * max + 127) / 255, the division done as (t + 1 + (t >> 8)) >> 8.
+ */
+static inline __m128i
+narrow_sse2(__m128i v, int max)
+{
+    __m128i t = _mm_add_epi32(_mm_mullo_epi16(v, _mm_set1_epi32(max)),
+                              _mm_set1_epi32(127));
+
+    return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(t, _mm_set1_epi32(1)),
+                                        _mm_srli_epi32(t, 8)), 8);
+}
+
+/* 16-bit pixels in 32-bit lanes, for 5-6-5 (green 63) or 5-5-5 (green 31) */
+static inline __m128i
+rgb16_sse2(__m128i c, int green_max)
+{
+    __m128i m = _mm_set1_epi32(0xff);
+    __m128i r = narrow_sse2(_mm_and_si128(_mm_srli_epi32(c, 16), m), 31);
+    __m128i g = narrow_sse2(_mm_and_si128(_mm_srli_epi32(c, 8), m), green_max);
+    __m128i b = narrow_sse2(_mm_and_si128(c, m), 31);
+
+    r = _mm_slli_epi32(r, green_max == 63 ? 11 : 10);
+    return _mm_or_si128(r, _mm_or_si128(_mm_slli_epi32(g, 5), b));
+}
+
+/* eight 16-bit pixels from two vectors of them in 32-bit lanes */
+static inline __m128i
+narrow16_sse2(__m128i lo, __m128i hi, int msb)
+{
+    __m128i v = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(lo, 16), 16),
+                                _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16));
+
+    return msb ? _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)) : v;
+}
+
+#define DEFINE_PACK16_SSE2(name, GREEN, MSB, scalar)                        \
+static void                                                                 \
+name(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)  \
+{                                                                           \
+    __m128i lo, hi;                                                         \
+    int x;                                                                  \
+                                                                            \
+    for (x = 0; x + 8 <= width; x += 8) {                                   \
+        lo = rgb16_sse2(_mm_loadu_si128((const __m128i *)(argb + x)), GREEN); \
+        hi = rgb16_sse2(_mm_loadu_si128((const __m128i *)(argb + x + 4)), GREEN); \
+        _mm_storeu_si128((__m128i *)(out + 2 * x), narrow16_sse2(lo, hi, MSB)); \
+    }                                                                       \
+    scalar(pf, argb + x, out + 2 * x, width - x);                           \
+}
+
+DEFINE_PACK16_SSE2(pack_rgb565_lsb_sse2, 63, 0, pack_table16_lsb)
+DEFINE_PACK16_SSE2(pack_rgb565_msb_sse2, 63, 1, pack_table16_msb)
+DEFINE_PACK16_SSE2(pack_rgb555_lsb_sse2, 31, 0, pack_table16_lsb)
+DEFINE_PACK16_SSE2(pack_rgb555_msb_sse2, 31, 1, pack_table16_msb)
+#endif
+
+#if defined(HAVE_SSSE3_TARGET)
+/*
+ * 24 bits per pixel: four pixels become twelve bytes with one shuffle.
+ * Each store writes four bytes more, which the next one overwrites, so the
+ * last pixels of a row are left to the scalar packer.
+ */
+#define DEFINE_PACK24_SSSE3(name, B0, B1, B2, scalar)                       \
+__attribute__((target("ssse3")))                                            \
+static void                                                                 \
+name(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)  \
+{                                                                           \
+    const __m128i shuffle = _mm_setr_epi8(B0, B1, B2, B0 + 4, B1 + 4, B2 + 4, \
+                                          B0 + 8, B1 + 8, B2 + 8,           \
+                                          B0 + 12, B1 + 12, B2 + 12,        \
+                                          -1, -1, -1, -1);                  \
+    int x;                                                                  \
+                                                                            \
+    for (x = 0; x + 6 <= width; x += 4)                                     \
+        _mm_storeu_si128((__m128i *)(out + 3 * x),                          \
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(argb + x)), \
+                                          shuffle));                        \
+    scalar(pf, argb + x, out + 3 * x, width - x);                           \
+}
+
+DEFINE_PACK24_SSSE3(pack_rgb24_lsb_ssse3, 0, 1, 2, pack_rgb24_lsb)
+DEFINE_PACK24_SSSE3(pack_rgb24_msb_ssse3, 2, 1, 0, pack_rgb24_msb)
+#endif
+
+#define RGB888  0xff0000, 0xff00, 0xff
+#define BGR888  0xff, 0xff00, 0xff0000
+#define RGB565  0xf800, 0x7e0, 0x1f
+#define RGB555  0x7c00, 0x3e0, 0x1f
+#define ANY     0, 0, 0
+
+const PackKernel pack_kernels[] = {
+#if defined(__SSE2__)
+    { "xrgb32_lsb_sse2",  32,  0, RGB888, PACK_CPU_ANY,   pack_xrgb32_lsb_sse2 },
+    { "xrgb32_msb_sse2",  32,  1, RGB888, PACK_CPU_ANY,   pack_xrgb32_msb_sse2 },
+    { "xbgr32_lsb_sse2",  32,  0, BGR888, PACK_CPU_ANY,   pack_xbgr32_lsb_sse2 },
+    { "xbgr32_msb_sse2",  32,  1, BGR888, PACK_CPU_ANY,   pack_xbgr32_msb_sse2 },
+    { "rgb565_lsb_sse2",  16,  0, RGB565, PACK_CPU_ANY,   pack_rgb565_lsb_sse2 },
+    { "rgb565_msb_sse2",  16,  1, RGB565, PACK_CPU_ANY,   pack_rgb565_msb_sse2 },
+    { "rgb555_lsb_sse2",  16,  0, RGB555, PACK_CPU_ANY,   pack_rgb555_lsb_sse2 },
+    { "rgb555_msb_sse2",  16,  1, RGB555, PACK_CPU_ANY,   pack_rgb555_msb_sse2 },
+#endif
+#if defined(HAVE_SSSE3_TARGET)
+    { "rgb24_lsb_ssse3",  24,  0, RGB888, PACK_CPU_SSSE3, pack_rgb24_lsb_ssse3 },
+    { "rgb24_msb_ssse3",  24,  1, RGB888, PACK_CPU_SSSE3, pack_rgb24_msb_ssse3 },
+#endif
+    { "xrgb32_lsb",       32,  0, RGB888, PACK_CPU_ANY,   pack_xrgb32_lsb },
+    { "xrgb32_msb",       32,  1, RGB888, PACK_CPU_ANY,   pack_xrgb32_msb },
+    { "xbgr32_lsb",       32,  0, BGR888, PACK_CPU_ANY,   pack_xbgr32_lsb },
+    { "xbgr32_msb",       32,  1, BGR888, PACK_CPU_ANY,   pack_xbgr32_msb },
+    { "rgb24_lsb",        24,  0, RGB888, PACK_CPU_ANY,   pack_rgb24_lsb },
+    { "rgb24_msb",        24,  1, RGB888, PACK_CPU_ANY,   pack_rgb24_msb },
+    { "table8",            8, -1, ANY,    PACK_CPU_ANY,   pack_table8 },
+    { "table16_lsb",      16,  0, ANY,    PACK_CPU_ANY,   pack_table16_lsb },
+    { "table16_msb",      16,  1, ANY,    PACK_CPU_ANY,   pack_table16_msb },
+    { "table24_lsb",      24,  0, ANY,    PACK_CPU_ANY,   pack_table24_lsb },
+    { "table24_msb",      24,  1, ANY,    PACK_CPU_ANY,   pack_table24_msb },
+    { "table32_lsb",      32,  0, ANY,    PACK_CPU_ANY,   pack_table32_lsb },
+    { "table32_msb",      32,  1, ANY,    PACK_CPU_ANY,   pack_table32_msb },
+    { "generic",           0, -1, ANY,    PACK_CPU_ANY,   pack_generic },
+};
+
+const int n_pack_kernels = sizeof(pack_kernels) / sizeof(pack_kernels[0]);
+
+/*
+ * PackKernelUsable: Whether this CPU can run a packer.
+ */
+int
+PackKernelUsable(const PackKernel *k)
+{
+#if defined(HAVE_SSSE3_TARGET)
+    if (k->cpu == PACK_CPU_SSSE3) {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("ssse3");
+    }
+#endif
+    return k->cpu == PACK_CPU_ANY;
+}
+
+/*
+ * PackInit: Describe a pixel layout and pick the first packer that fits
+ *           it.  Returns 0 if pixels of bpp bits can't be packed.
+ */
+int
+PackInit(PixelFormat *pf, int bpp, int pad, int msb_first,
+         uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask)
+{
+    uint32_t masks[3] = { red_mask, green_mask, blue_mask };
+    uint32_t *tables[3] = { pf->red, pf->green, pf->blue };
+    const PackKernel *k;
+    uint32_t v;
+    int i, shift;
+
+    if ((bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32) || pad < 8 || pad % 8)
+        return 0;
+    pf->bpp = bpp;
+    pf->pad = pad;
+    pf->msb_first = msb_first;
+    pf->red_mask = red_mask;
+    pf->green_mask = green_mask;
+    pf->blue_mask = blue_mask;
+    pf->cube = 0;
+    for (i = 0; i < 3; i++) {
+        for (shift = 0; masks[i] && !(masks[i] & (1u << shift)); shift++)
+            ;
+        for (v = 0; v < 256; v++)
+            tables[i][v] = (((v * 257) * (masks[i] >> shift) + 32767) / 65535) << shift;
+    }
+
+    for (i = 0; i < n_pack_kernels; i++) {
+        k = &pack_kernels[i];
+        if ((k->bpp && k->bpp != bpp) ||
+            (k->msb_first >= 0 && k->msb_first != msb_first) ||
+            ((k->red_mask || k->green_mask || k->blue_mask) &&
+             (k->red_mask != red_mask || k->green_mask != green_mask ||
+              k->blue_mask != blue_mask)) ||
+            !PackKernelUsable(k))
+            continue;
+        pf->pack = k->pack;
+        pf->kernel = k->name;
+        break;
+    }
+    return 1;
+}
+
+/*
+ * PackInitPalette: Set up packing for a colormapped visual with a color
+ *                  cube of cube levels of each channel, colors holding the
+ *                  pixel of each color, blue varying fastest.  Channels
+ *                  round to the nearest level, as PackInit()'s do.
+ */
+int
+PackInitPalette(PixelFormat *pf, int bpp, int pad, int msb_first,
+                int cube, const uint32_t *colors)
+{
+    uint32_t v;
+
+    if ((bpp != 8 && bpp != 16 && bpp != 24 && bpp != 32) || pad < 8 || pad % 8 ||
+        cube < 2 || cube * cube * cube > 256)
+        return 0;
+    memset(pf, 0, sizeof(PixelFormat));
+    pf->bpp = bpp;
+    pf->pad = pad;
+    pf->msb_first = msb_first;
+    pf->cube = cube;
+    memcpy(pf->colors, colors, cube * cube * cube * sizeof(uint32_t));
+    for (v = 0; v < 256; v++) {
+        pf->blue[v] = ((v * 257) * (cube - 1) + 32767) / 65535;
+        pf->green[v] = pf->blue[v] * cube;
+        pf->red[v] = pf->blue[v] * cube * cube;
+    }
+    pf->pack = bpp == 8 ? pack_palette8 : pack_palette;
+    pf->kernel = bpp == 8 ? "palette8" : "palette";
+    return 1;
+}
+
+/*
+ * PackLevels: How many levels of red, green and blue pixels in a format
+ *             have, 256 for 8 bits or more.
+ */
+void
+PackLevels(const PixelFormat *pf, int levels[3])
+{
+    uint32_t masks[3] = { pf->red_mask, pf->green_mask, pf->blue_mask };
+    int i, bits;
+
+    for (i = 0; i < 3; i++) {
+        for (bits = 0; masks[i]; masks[i] &= masks[i] - 1)
+            bits++;
+        levels[i] = pf->cube ? pf->cube : bits < 8 ? 1 << bits : 256;
+    }
+}
+
+size_t
+PackStride(const PixelFormat *pf, int width)
+{
+    return ((size_t)width * pf->bpp + pf->pad - 1) / pf->pad * pf->pad / 8;
+}
+
+/*
+ * PackRow: Turn a row of 0xAARRGGBB pixels into a ZPixmap scanline, its
+ *          padding cleared.  Alpha is dropped.
+ */
+void
+PackRow(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)
+{
+    size_t used = (size_t)width * pf->bpp / 8;
+
+    pf->pack(pf, argb, out, width);
+    memset(out + used, 0, PackStride(pf, width) - used);
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,63 @@
+/* Pack.h */
+
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * How pixels of a TrueColor visual are laid out in a ZPixmap scanline.
+ * PackInit() picks the packer for it once; the tables map each value of an
+ * 8-bit channel to its pixel bits, for the packers that need them.
+ *
+ * On a colormapped visual PackInitPalette() sets one up for a color cube
+ * allocated in the colormap instead: the tables then map each channel to
+ * its part of the index into the cube, and colors holds the pixels.
+ */
+typedef struct _PixelFormat PixelFormat;
+
+typedef void (*PackProc)(const PixelFormat *pf, const uint32_t *argb,
+                         uint8_t *out, int width);
+
+struct _PixelFormat {
+    int bpp;                    /* 8, 16, 24 or 32 bits per pixel */
+    int pad;                    /* scanline pad in bits */
+    int msb_first;              /* image byte order */
+    uint32_t red_mask, green_mask, blue_mask;
+    uint32_t red[256], green[256], blue[256];
+    int cube;                   /* levels of each channel in a palette, or 0 */
+    uint32_t colors[256];       /* the palette's pixels */
+    PackProc pack;
+    const char *kernel;         /* name of the packer picked */
+};
+
+/*
+ * The packers, most specialized first.  A bpp of 0 or masks of 0 match
+ * any; cpu names an instruction set the packer needs beyond the baseline.
+ */
+enum { PACK_CPU_ANY, PACK_CPU_SSSE3 };
+
+typedef struct {
+    const char *name;
+    int bpp;
+    int msb_first;
+    uint32_t red_mask, green_mask, blue_mask;
+    int cpu;
+    PackProc pack;
+} PackKernel;
+
+extern const PackKernel pack_kernels[];
+extern const int n_pack_kernels;
+
+extern int PackInit(PixelFormat *pf, int bpp, int pad, int msb_first,
+                    uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask);
+extern int PackInitPalette(PixelFormat *pf, int bpp, int pad, int msb_first,
+                           int cube, const uint32_t *colors);
+extern int PackKernelUsable(const PackKernel *k);
+extern void PackLevels(const PixelFormat *pf, int levels[3]);
+extern size_t PackStride(const PixelFormat *pf, int width);
+extern void PackRow(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width);
+
+#endif /* _PACK_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
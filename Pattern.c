@@ -0,0 +1,400 @@
+/* Pattern.c
+ *
+ * The patterns of -pattern.  Each pixel is given a place on a ramp of
+ * colors running from the first color to the second, and a row depends on
+ * nothing but its y, so any number of threads may make rows at once.  The
+ * radial gradient and the noise are worked out four and eight pixels at a
+ * time with SSE2; the other patterns are table lookups and fills.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "Pattern.h"
+
+#define RAMP_SIZE   1024
+#define RAMP_MAX    (RAMP_SIZE - 1)
+#define FIX         16          /* fraction bits of ramp and stripe positions */
+#define MAX_SIZE    4096
+#define MAX_ANGLE   100000
+#define OCTAVES     4
+
+static const struct {
+    const char *name;
+    int kind;
+    const char *params;         /* what the numbers after the name are */
+    int size, angle;            /* defaults */
+} kinds[] = {
+    { "linear",  PATTERN_LINEAR,  "a",  0,   90 },
+    { "radial",  PATTERN_RADIAL,  "",   0,   0 },
+    { "checker", PATTERN_CHECKER, "s",  32,  0 },
+    { "stripes", PATTERN_STRIPES, "sa", 16,  45 },
+    { "hatch",   PATTERN_HATCH,   "s",  16,  0 },
+    { "noise",   PATTERN_NOISE,   "s",  128, 0 },
+};
+
+struct _Pattern {
+    PatternSpec spec;
+    int width, height;
+    uint32_t ramp[RAMP_SIZE];
+    /* linear and stripes: position (x + .5) * dx + (y + .5) * dy + offset */
+    double dx, dy, offset, scale;
+    /* radial */
+    float cx, cy, radial_scale;
+    /* noise: cell sizes, smoothstep over each cell, and weights */
+    int octaves;
+    int cell[OCTAVES];
+    int shift[OCTAVES];
+    int16_t *smooth[OCTAVES];
+    uint32_t norm;
+};
+
+/*
+ * PatternParse: Read a pattern spec.  Returns 0 if it is not one.
+ */
+int
+PatternParse(const char *spec, PatternSpec *ps)
+{
+    size_t i, len = strcspn(spec, ",");
+    const char *p;
+    char *end;
+    long v;
+
+    for (i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+        if (strlen(kinds[i].name) == len && !strncmp(spec, kinds[i].name, len))
+            break;
+    if (i == sizeof(kinds) / sizeof(kinds[0]))
+        return 0;
+    ps->kind = kinds[i].kind;
+    ps->size = kinds[i].size;
+    ps->angle = kinds[i].angle;
+
+    for (spec += len, p = kinds[i].params; *spec; p++) {
+        if (!*p || *spec != ',')
+            return 0;
+        v = strtol(spec + 1, &end, 10);
+        if (end == spec + 1 || (*end && *end != ','))
+            return 0;
+        if (*p == 's') {
+            if (v < (ps->kind == PATTERN_CHECKER || ps->kind == PATTERN_STRIPES ? 1 : 2) ||
+                v > MAX_SIZE)
+                return 0;
+            ps->size = v;
+        }
+        else {
+            if (v < -MAX_ANGLE || v > MAX_ANGLE)
+                return 0;
+            ps->angle = v;
+        }
+        spec = end;
+    }
+    return 1;
+}
+
+static uint32_t
+mix(uint32_t from, uint32_t to, int i)
+{
+    uint32_t c = 0xff000000;
+    int shift;
+
+    for (shift = 0; shift < 24; shift += 8)
+        c |= (((from >> shift & 0xff) * (RAMP_MAX - i) +
+               (to >> shift & 0xff) * i + RAMP_MAX / 2) / RAMP_MAX) << shift;
+    return c;
+}
+
+/*
+ * PatternNew: Get ready to make a pattern of width by height pixels from
+ *             the 0xRRGGBB color from to the color to.  NULL if out of
+ *             memory.
+ */
+Pattern *
+PatternNew(const PatternSpec *ps, uint32_t from, uint32_t to, int width, int height)
+{
+    Pattern *p;
+    double a, c, s, t, tmin, tmax;
+    int i, j, total;
+
+    if (!(p = calloc(1, sizeof(Pattern))))
+        return NULL;
+    p->spec = *ps;
+    p->width = width;
+    p->height = height;
+    for (i = 0; i < RAMP_SIZE; i++)
+        p->ramp[i] = mix(from, to, i);
+
+    a = (ps->angle % 360) * M_PI / 180;
+    c = cos(a);
+    s = sin(a);
+    switch (ps->kind) {
+    case PATTERN_LINEAR:
+        /* the corners' pixels are the ends of the ramp */
+        tmin = tmax = 0.5 * c + 0.5 * s;
+        for (i = 0; i < 4; i++) {
+            t = ((i & 1) ? width - 0.5 : 0.5) * c + ((i & 2) ? height - 0.5 : 0.5) * s;
+            tmin = t < tmin ? t : tmin;
+            tmax = t > tmax ? t : tmax;
+        }
+        p->scale = tmax > tmin ? RAMP_MAX / (tmax - tmin) : 0;
+        p->dx = c * p->scale;
+        p->dy = s * p->scale;
+        p->offset = -tmin * p->scale;
+        break;
+    case PATTERN_STRIPES:
+        p->dx = c;
+        p->dy = s;
+        break;
+    case PATTERN_RADIAL:
+        p->cx = width / 2.0f;
+        p->cy = height / 2.0f;
+        p->radial_scale = RAMP_MAX / sqrtf(p->cx * p->cx + p->cy * p->cy);
+        break;
+    case PATTERN_NOISE:
+        /* halving octaves weighted 8, 4, 2, 2, summing to 12-bit values */
+        total = 0;
+        for (i = 0; i < OCTAVES && (ps->size >> i) >= 2; i++) {
+            p->cell[i] = ps->size >> i;
+            p->shift[i] = i < 3 ? 3 - i : 1;
+            total += 1 << p->shift[i];
+            if (!(p->smooth[i] = malloc(p->cell[i] * sizeof(int16_t)))) {
+                PatternFree(p);
+                return NULL;
+            }
+            for (j = 0; j < p->cell[i]; j++) {
+                t = (double)j / p->cell[i];
+                p->smooth[i][j] = lround(32767 * t * t * (3 - 2 * t));
+            }
+        }
+        p->octaves = i;
+        p->norm = ((uint32_t)RAMP_MAX << 16) / (4095 * total);
+        break;
+    }
+    return p;
+}
+
+void
+PatternFree(Pattern *p)
+{
+    int i;
+
+    for (i = 0; i < OCTAVES; i++)
+        free(p->smooth[i]);
+    free(p);
+}
+
+static void
+fill(uint32_t *out, uint32_t c, int n)
+{
+    while (n-- > 0)
+        *out++ = c;
+}
+
+/* a row of its first period over and over */
+static void
+repeat(uint32_t *out, int period, int width)
+{
+    int n;
+
+    for (n = period; n < width; n *= 2)
+        memcpy(out + n, out, (width - n < n ? width - n : n) * sizeof(uint32_t));
+}
+
+static void
+linear_row(const Pattern *p, int y, uint32_t *out)
+{
+    int64_t v = llround((0.5 * p->dx + (y + 0.5) * p->dy + p->offset) * (1 << FIX));
+    int64_t step = llround(p->dx * (1 << FIX));
+    int64_t i;
+    int x;
+
+    for (x = 0; x < p->width; x++, v += step) {
+        i = v >> FIX;
+        out[x] = p->ramp[i < 0 ? 0 : i > RAMP_MAX ? RAMP_MAX : i];
+    }
+}
+
+/*
+ * Stripes take turns over a period of twice their size; a pixel's color is
+ * how much of it the second stripe covers, so edges at an angle are smooth.
+ */
+static void
+stripes_row(const Pattern *p, int y, uint32_t *out)
+{
+    int64_t size = (int64_t)p->spec.size << FIX, period = 2 * size;
+    int64_t v = llround((0.5 * p->dx + (y + 0.5) * p->dy) * (1 << FIX));
+    int64_t step = llround(p->dx * (1 << FIX));
+    int64_t d, w;
+    int x;
+
+    v %= period;
+    if (v < 0)
+        v += period;
+    for (x = 0; x < p->width; x++) {
+        /* distance from the middle of the second stripe */
+        d = v - size - size / 2;
+        if (d < -size)
+            d += period;
+        d = d < 0 ? -d : d;
+        w = size / 2 - d + (1 << (FIX - 1));
+        w = w < 0 ? 0 : w > (1 << FIX) ? (1 << FIX) : w;
+        out[x] = p->ramp[(w * RAMP_MAX) >> FIX];
+        v += step;
+        if (v >= period)
+            v -= period;
+        else if (v < 0)
+            v += period;
+    }
+}
+
+static void
+checker_row(const Pattern *p, int y, uint32_t *out)
+{
+    int size = p->spec.size, odd = (y / size) & 1;
+
+    fill(out, p->ramp[odd ? RAMP_MAX : 0], p->width < size ? p->width : size);
+    if (p->width > size)
+        fill(out + size, p->ramp[odd ? 0 : RAMP_MAX],
+             p->width - size < size ? p->width - size : size);
+    repeat(out, 2 * size, p->width);
+}
+
+static void
+hatch_row(const Pattern *p, int y, uint32_t *out)
+{
+    int size = p->spec.size, line = size / 8 ? size / 8 : 1;
+    int a = y % size, b = (size - a) % size, x;
+
+    for (x = 0; x < p->width && x < size; x++) {
+        out[x] = p->ramp[(a < line || b < line) ? 0 : RAMP_MAX];
+        if (++a == size)
+            a = 0;
+        if (++b == size)
+            b = 0;
+    }
+    repeat(out, size, p->width);
+}
+
+static void
+radial_row(const Pattern *p, int y, uint32_t *out)
+{
+    float fy = y + 0.5f - p->cy, fy2 = fy * fy, fx, d;
+    int x = 0;
+#if defined(__SSE2__)
+    __m128 vfy2 = _mm_set1_ps(fy2), half = _mm_set1_ps(0.5f);
+    __m128 cx = _mm_set1_ps(p->cx), scale = _mm_set1_ps(p->radial_scale);
+    __m128 top = _mm_set1_ps(RAMP_MAX);
+    __m128i vx = _mm_setr_epi32(0, 1, 2, 3), four = _mm_set1_epi32(4);
+    __m128 vf;
+    int32_t i[4];
+
+    for (; x + 4 <= p->width; x += 4, vx = _mm_add_epi32(vx, four)) {
+        vf = _mm_sub_ps(_mm_add_ps(_mm_cvtepi32_ps(vx), half), cx);
+        vf = _mm_mul_ps(_mm_sqrt_ps(_mm_add_ps(_mm_mul_ps(vf, vf), vfy2)), scale);
+        _mm_storeu_si128((__m128i *)i, _mm_cvttps_epi32(_mm_min_ps(vf, top)));
+        out[x] = p->ramp[i[0]];
+        out[x + 1] = p->ramp[i[1]];
+        out[x + 2] = p->ramp[i[2]];
+        out[x + 3] = p->ramp[i[3]];
+    }
+#endif
+    for (; x < p->width; x++) {
+        fx = x + 0.5f - p->cx;
+        d = sqrtf(fx * fx + fy2) * p->radial_scale;
+        out[x] = p->ramp[(int)(d < RAMP_MAX ? d : RAMP_MAX)];
+    }
+}
+
+/* a 12-bit value for each corner of the lattice of an octave */
+static inline int
+lattice(uint32_t i, uint32_t j, uint32_t octave)
+{
+    uint32_t h = i * 0x8da6b343u ^ j * 0xd8163841u ^ octave * 0xcb1ab31fu;
+
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h >> 20;
+}
+
+/*
+ * Add one cell of an octave, c0 at its left edge easing into c0 + d2 / 2
+ * at its right one, to n sums.
+ */
+static void
+noise_cell(uint16_t *sum, const int16_t *smooth, int n, int c0, int d2, int shift)
+{
+    int x = 0;
+#if defined(__SSE2__)
+    __m128i vc0 = _mm_set1_epi16(c0), vd2 = _mm_set1_epi16(d2);
+    __m128i count = _mm_cvtsi32_si128(shift), v;
+
+    for (; x + 8 <= n; x += 8) {
+        v = _mm_mulhi_epi16(vd2, _mm_loadu_si128((const __m128i *)(smooth + x)));
+        v = _mm_sll_epi16(_mm_add_epi16(vc0, v), count);
+        _mm_storeu_si128((__m128i *)(sum + x),
+                         _mm_add_epi16(_mm_loadu_si128((const __m128i *)(sum + x)), v));
+    }
+#endif
+    for (; x < n; x++)
+        sum[x] += (c0 + ((d2 * smooth[x]) >> 16)) << shift;
+}
+
+/*
+ * The octaves are summed in the upper half of the row, as 16-bit values,
+ * and then looked up on the ramp front to back: out[x] never reaches a sum
+ * not yet read.
+ */
+static void
+noise_row(const Pattern *p, int y, uint32_t *out)
+{
+    uint16_t *sum = (uint16_t *)out + p->width;
+    int k, s, i, x, n, wy, iy, a0, a1, c0, c1;
+    uint32_t v;
+
+    memset(sum, 0, p->width * sizeof(uint16_t));
+    for (k = 0; k < p->octaves; k++) {
+        s = p->cell[k];
+        iy = y / s;
+        wy = p->smooth[k][y % s];
+        a0 = lattice(0, iy, k);
+        a1 = lattice(0, iy + 1, k);
+        c1 = a0 + (((a1 - a0) * wy) >> 15);
+        for (i = 0, x = 0; x < p->width; i++, x += s) {
+            c0 = c1;
+            a0 = lattice(i + 1, iy, k);
+            a1 = lattice(i + 1, iy + 1, k);
+            c1 = a0 + (((a1 - a0) * wy) >> 15);
+            n = p->width - x < s ? p->width - x : s;
+            noise_cell(sum + x, p->smooth[k], n, c0, 2 * (c1 - c0), p->shift[k]);
+        }
+    }
+    for (x = 0; x < p->width; x++) {
+        v = (sum[x] * p->norm) >> 16;
+        out[x] = p->ramp[v > RAMP_MAX ? RAMP_MAX : v];
+    }
+}
+
+/*
+ * PatternRow: Make row y of a pattern, width pixels of 0xAARRGGBB.
+ */
+void
+PatternRow(const Pattern *p, int y, uint32_t *argb)
+{
+    switch (p->spec.kind) {
+    case PATTERN_LINEAR:    linear_row(p, y, argb);     break;
+    case PATTERN_RADIAL:    radial_row(p, y, argb);     break;
+    case PATTERN_CHECKER:   checker_row(p, y, argb);    break;
+    case PATTERN_STRIPES:   stripes_row(p, y, argb);    break;
+    case PATTERN_HATCH:     hatch_row(p, y, argb);      break;
+    default:                noise_row(p, y, argb);      break;
+    }
+}
+/* vim: set ts=4 sw=4 et cindent: */
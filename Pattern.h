@@ -0,0 +1,41 @@
+/* Pattern.h */
+
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+#include <stdint.h>
+
+/*
+ * Procedural backgrounds, made a row at a time in 0xAARRGGBB at whatever
+ * size the root is.  A spec is "kind[,n[,n]]":
+ *
+ *   linear[,angle]         gradient from the first color to the second
+ *   radial                 gradient from the center out to the corners
+ *   checker[,size]         squares of size pixels
+ *   stripes[,size[,angle]] stripes size pixels wide
+ *   hatch[,size]           crossed diagonal lines size pixels apart
+ *   noise[,size]           value noise with features about size pixels
+ *
+ * Angles are in degrees, 0 running left to right and 90 top to bottom.
+ */
+enum {
+    PATTERN_LINEAR, PATTERN_RADIAL, PATTERN_CHECKER, PATTERN_STRIPES,
+    PATTERN_HATCH, PATTERN_NOISE
+};
+
+typedef struct {
+    int kind;
+    int size;
+    int angle;
+} PatternSpec;
+
+typedef struct _Pattern Pattern;
+
+extern int PatternParse(const char *spec, PatternSpec *ps);
+extern Pattern *PatternNew(const PatternSpec *ps, uint32_t from, uint32_t to,
+                           int width, int height);
+extern void PatternRow(const Pattern *p, int y, uint32_t *argb);
+extern void PatternFree(Pattern *p);
+
+#endif /* _PATTERN_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,130 @@
+/* Period.c
+ *
+ * Periods are tested with memcmp(), which the C library does a vector at a
+ * time: a row repeats every p pixels if its first width - p pixels are its
+ * last width - p, and rows repeat every q if each is the one q above it.
+ * The rows of a photograph mostly differ within their first few bytes, so
+ * one that doesn't repeat costs little more than copying the rows held.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include "Period.h"
+
+/* The smallest divisor of n greater than d that is a multiple of m. */
+static int
+next_divisor(int n, int d, int m)
+{
+    int k;
+
+    for (k = (d / m + 1) * m; k < n; k += m)
+        if (n % k == 0)
+            return k;
+    return n;
+}
+
+static const uint8_t *
+held_row(const PeriodFinder *f, int y)
+{
+    return f->data + (size_t)y * f->width * f->bpp;
+}
+
+/* Whether rows 0 to y, row y being r and the rest held, repeat every period_y. */
+static int
+repeats_down(const PeriodFinder *f, const uint8_t *r, int y)
+{
+    size_t stride = (size_t)f->width * f->bpp;
+    int i;
+
+    for (i = f->period_y; i < y; i++)
+        if (memcmp(held_row(f, i), held_row(f, i - f->period_y), stride))
+            return 0;
+    return !memcmp(r, held_row(f, y - f->period_y), stride);
+}
+
+/*
+ * PeriodFinderNew: Start looking for the tile of a width x height image of
+ *                  bpp bytes a pixel, holding up to max_bytes of its rows.
+ *                  Returns NULL if out of memory.
+ */
+PeriodFinder *
+PeriodFinderNew(int width, int height, int bpp, size_t max_bytes)
+{
+    size_t stride = (size_t)width * bpp;
+    PeriodFinder *f;
+
+    if (!(f = calloc(1, sizeof(PeriodFinder))))
+        return NULL;
+    f->width = width;
+    f->height = height;
+    f->bpp = bpp;
+    f->period_x = f->period_y = 1;
+    f->max_held = stride ? max_bytes / stride : 0;
+    if (f->max_held > height)
+        f->max_held = height;
+    if (f->max_held && !(f->data = malloc(f->max_held * stride))) {
+        free(f);
+        return NULL;
+    }
+    return f;
+}
+
+/*
+ * PeriodFinderAdd: Take the next row into account.  Returns 0 once the
+ *                  image can't be made of a smaller tile than itself, or
+ *                  of one from the rows held: there is no need to add
+ *                  more.
+ */
+int
+PeriodFinderAdd(PeriodFinder *f, const void *row)
+{
+    const uint8_t *r = row;
+    size_t stride = (size_t)f->width * f->bpp;
+    int y = f->rows++, step = f->period_x;
+
+    /* each row's periods across are the multiples of its smallest */
+    while (f->period_x < f->width &&
+           memcmp(r, r + (size_t)f->period_x * f->bpp, stride - (size_t)f->period_x * f->bpp))
+        f->period_x = next_divisor(f->width, f->period_x, step);
+
+    if (f->period_y < f->height && y >= f->period_y) {
+        if (y % f->period_y >= f->held)
+            f->period_y = f->height;    /* what it would be checked against is gone */
+        else if (memcmp(r, held_row(f, y % f->period_y), stride)) {
+            /* a greater one must hold for every row down to this one */
+            if (y > f->held)
+                f->period_y = f->height;
+            while (f->period_y < f->height) {
+                f->period_y = next_divisor(f->height, f->period_y, 1);
+                if (f->period_y > y || repeats_down(f, r, y))
+                    break;
+            }
+        }
+    }
+
+    if (f->held == y && f->held < f->max_held)
+        memcpy(f->data + (size_t)f->held++ * stride, r, stride);
+
+    return (f->period_x < f->width || f->period_y < f->height) && f->period_y <= f->max_held;
+}
+
+/*
+ * PeriodFinderRow: Row y of the image, if held.
+ */
+const void *
+PeriodFinderRow(const PeriodFinder *f, int y)
+{
+    return y < f->held ? held_row(f, y) : NULL;
+}
+
+void
+PeriodFinderFree(PeriodFinder *f)
+{
+    if (!f)
+        return;
+    free(f->data);
+    free(f);
+}
+/* vim: set ts=4 sw=4 et cindent: */
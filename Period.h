@@ -0,0 +1,38 @@
+/* Period.h */
+
+#ifndef _PERIOD_H_
+#define _PERIOD_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Finding the smallest tile an image is made of, as its rows stream by,
+ * so that a repeating wallpaper can be sent as one tile for the server to
+ * repeat.  Only tiles whose width and height divide the image's count, as
+ * only those tile it without a seam.
+ *
+ * Across, a row repeats every p pixels if it is the same shifted by p; the
+ * periods dividing the width a row has are the multiples of its smallest,
+ * so the image's is the least common multiple of its rows'.  Down, each
+ * row is compared with the one a period above it, which must still be
+ * held: the first rows are kept, up to max_bytes of them, and a period
+ * further down than that isn't looked for.  The tile is then the first
+ * rows held, cut to the period across.
+ */
+typedef struct {
+    int width, height;
+    int bpp;                    /* bytes a pixel */
+    int period_x, period_y;     /* the smallest the rows so far allow */
+    int rows;                   /* rows added */
+    int held, max_held;         /* of them kept, at most */
+    uint8_t *data;              /* the rows kept */
+} PeriodFinder;
+
+extern PeriodFinder *PeriodFinderNew(int width, int height, int bpp, size_t max_bytes);
+extern int PeriodFinderAdd(PeriodFinder *f, const void *row);
+extern const void *PeriodFinderRow(const PeriodFinder *f, int y);
+extern void PeriodFinderFree(PeriodFinder *f);
+
+#endif /* _PERIOD_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
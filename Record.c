@@ -0,0 +1,237 @@
+/* Record.c
+ *
+ * -record: capture the exact byte stream xsetroot sends to the server.
+ *
+ * The real connection is made by xcb_connect() so that display names and
+ * authorization work as usual.  A forked proxy then owns that socket and
+ * hands xcb the other end of a socketpair, answering xcb's connection setup
+ * with the setup reply the server already sent.  Everything the client
+ * writes is forwarded and logged, and the arrival of each reply or error is
+ * logged in between, which marks where the client could be waiting.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "Record.h"
+#include "Trace.h"
+
+#define PROXY_BUFSIZE   65536
+
+static pid_t proxy_pid = -1;
+static struct timespec start;
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int
+read_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    ssize_t n;
+
+    while (len) {
+        n = read(fd, p, len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void
+trace_record(FILE *trace, uint8_t type, uint32_t value)
+{
+    struct timespec now;
+    TraceRecord rec;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.usec = (now.tv_sec - start.tv_sec) * 1000000 +
+               (now.tv_nsec - start.tv_nsec) / 1000;
+    rec.value = value;
+    fwrite(&rec, sizeof(rec), 1, trace);
+}
+
+/*
+ * Frame the server's byte stream into 32 byte packets plus any reply data,
+ * and log the sequence number of every reply and error.
+ */
+static void
+trace_server(FILE *trace, const uint8_t *buf, size_t len)
+{
+    static uint8_t pkt[32];
+    static size_t have;
+    static uint32_t skip;
+    size_t n;
+
+    while (len) {
+        if (skip) {
+            n = len < skip ? len : skip;
+            skip -= n;
+        }
+        else {
+            n = len < sizeof(pkt) - have ? len : sizeof(pkt) - have;
+            memcpy(pkt + have, buf, n);
+            if ((have += n) == sizeof(pkt)) {
+                have = 0;
+                if (pkt[0] == 0)
+                    trace_record(trace, TRACE_ERROR, *(uint16_t *)(pkt + 2));
+                else if (pkt[0] == 1)
+                    trace_record(trace, TRACE_REPLY, *(uint16_t *)(pkt + 2));
+                /* replies and generic events carry extra data */
+                if ((pkt[0] & 0x7f) == 1 || (pkt[0] & 0x7f) == XCB_GE_GENERIC)
+                    skip = *(uint32_t *)(pkt + 4) * 4;
+            }
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+static void
+proxy(int client, int server, const xcb_setup_t *setup, FILE *trace)
+{
+    uint8_t *buf = malloc(PROXY_BUFSIZE);
+    uint8_t hdr[12];
+    uint16_t name_len, data_len;
+    struct pollfd fds[2];
+    ssize_t n;
+
+    /* swallow the client's setup request and replay the server's answer */
+    if (!buf || read_all(client, hdr, sizeof(hdr)))
+        return;
+    memcpy(&name_len, hdr + 6, 2);
+    memcpy(&data_len, hdr + 8, 2);
+    if (read_all(client, buf, ((name_len + 3) & ~3) + ((data_len + 3) & ~3)) ||
+        write_all(client, setup, 8 + setup->length * 4))
+        return;
+
+    fds[0].fd = client;
+    fds[1].fd = server;
+    fds[0].events = fds[1].events = POLLIN;
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents) {
+            if ((n = read(client, buf, PROXY_BUFSIZE)) <= 0)
+                break;
+            if (write_all(server, buf, n))
+                break;
+            trace_record(trace, TRACE_REQUESTS, n);
+            fwrite(buf, 1, n, trace);
+        }
+        if (fds[1].revents) {
+            if ((n = read(server, buf, PROXY_BUFSIZE)) <= 0)
+                break;
+            trace_server(trace, buf, n);
+            if (write_all(client, buf, n))
+                break;
+        }
+    }
+    free(buf);
+}
+
+/*
+ * RecordConnect: Connect to the display through a recording proxy.
+ * Returns NULL if the trace file cannot be written.
+ */
+xcb_connection_t *
+RecordConnect(const char *display_name, int *screenp, const char *trace_file)
+{
+    xcb_connection_t *real;
+    const xcb_setup_t *setup;
+    FILE *trace;
+    uint32_t word;
+    char order[4] = { TRACE_BYTE_ORDER, 0, 0, 0 };
+    int sv[2];
+
+    real = xcb_connect(display_name, screenp);
+    if (xcb_connection_has_error(real))
+        return real;
+    if (!(trace = fopen(trace_file, "wb"))) {
+        xcb_disconnect(real);
+        return NULL;
+    }
+
+    setup = xcb_get_setup(real);
+    fwrite(TRACE_MAGIC, 1, 4, trace);
+    fwrite(order, 1, 4, trace);
+    word = TRACE_VERSION;
+    fwrite(&word, 4, 1, trace);
+    word = 8 + setup->length * 4;
+    fwrite(&word, 4, 1, trace);
+    fwrite(setup, 1, word, trace);
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+        fclose(trace);
+        xcb_disconnect(real);
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(NULL);
+    proxy_pid = fork();
+    if (proxy_pid == 0) {
+        close(sv[0]);
+        proxy(sv[1], xcb_get_file_descriptor(real), setup, trace);
+        fclose(trace);
+        _exit(0);
+    }
+    fclose(trace);
+    close(sv[1]);
+    /*
+     * xcb_disconnect() would shut the socket down under the proxy as well,
+     * so just drop our copy of it; 'real' is never used again.
+     */
+    close(xcb_get_file_descriptor(real));
+    if (proxy_pid < 0) {
+        close(sv[0]);
+        return NULL;
+    }
+    return xcb_connect_to_fd(sv[0], NULL);
+}
+
+/*
+ * RecordFinish: Wait for the proxy to write out the end of the trace.  The
+ * connection must have been closed first.
+ */
+void
+RecordFinish(void)
+{
+    if (proxy_pid > 0)
+        waitpid(proxy_pid, NULL, 0);
+    proxy_pid = -1;
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,13 @@
+/* Record.h */
+
+#ifndef _RECORD_H_
+#define _RECORD_H_
+
+#include <xcb/xcb.h>
+
+extern xcb_connection_t *RecordConnect(const char *display_name, int *screenp,
+                                       const char *trace_file);
+extern void RecordFinish(void);
+
+#endif /* _RECORD_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
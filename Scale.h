@@ -0,0 +1,65 @@
+/* Scale.h */
+
+#ifndef _SCALE_H_
+#define _SCALE_H_
+
+#include <stdint.h>
+
+/*
+ * Resampling rows of 0xAARRGGBB from an image to a new size.  A Scaler
+ * makes a width x height window of the image scaled to dst_w x dst_h,
+ * starting at (x, y) of the scaled image, one row at a time from the
+ * source rows ScalerSourceRows() says it needs.  Rows may be made in any
+ * order and on any thread, so the source can be streamed through a
+ * window of rows and never held whole.
+ *
+ * Each output pixel is a weighted sum of a few neighbouring source
+ * pixels, the same few for every pixel of a row or column: the nearest
+ * one, the two around it (bilinear), or all those it covers, weighted by
+ * how much (box, area averaging).  SCALE_AUTO is box along the axes the
+ * image shrinks and bilinear along those it grows.
+ */
+enum { SCALE_AUTO, SCALE_NEAREST, SCALE_BILINEAR, SCALE_BOX };
+
+#define SCALE_MAX_TAPS  256     /* most source pixels in an output one, each way */
+
+/* out[i] = sum of w[k] * rows[k][i] over taps rows, weights in 2.14 */
+typedef void (*ScaleVProc)(const uint32_t *const *rows, const int16_t *w, int taps,
+                           uint32_t *out, int n);
+/* out[i] = sum of w[taps * i + k] * in[start[i] - base + k] */
+typedef void (*ScaleHProc)(const uint32_t *in, int base, const int *start, const int16_t *w,
+                           int taps, uint32_t *out, int n);
+
+typedef struct {
+    int n;                      /* output pixels */
+    int taps;
+    int *start;                 /* [n], source pixel of each one's first tap */
+    int16_t *w;                 /* [n * taps] */
+} ScaleAxis;
+
+typedef struct {
+    ScaleAxis x, y;
+    int width, height;          /* of the window made */
+    ScaleVProc vert;
+    ScaleHProc horiz;
+    const char *kernel;         /* name of the kernels picked */
+} Scaler;
+
+typedef struct {
+    const char *name;
+    ScaleVProc vert;
+    ScaleHProc horiz;
+} ScaleKernel;
+
+extern const ScaleKernel scale_kernels[];
+extern const int n_scale_kernels;
+
+extern Scaler *ScalerNew(int filter, int src_w, int src_h, int dst_w, int dst_h,
+                         int x, int y, int width, int height);
+extern void ScalerSourceRows(const Scaler *s, int y, int n, int *first, int *count);
+extern void ScalerRow(const Scaler *s, int y, const uint32_t *const *src, int first,
+                      uint32_t *argb);
+extern void ScalerFree(Scaler *s);
+
+#endif /* _SCALE_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,218 @@
+/* Stats.c
+ *
+ * Protocol accounting for -stats.  Every request a context sends is reported
+ * to its Stats with its opcode, wire size and sequence number, and every
+ * blocking reply or error check with the time spent waiting for it.  A wait counts as
+ * a round trip only if its request was sent after the previous round trip
+ * began: whatever was already on the wire by then travelled with it.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <string.h>
+#include <time.h>
+#include <xcb/xcb.h>
+#include "Stats.h"
+
+static const char *const opcode_names[128] = {
+    [XCB_CREATE_WINDOW] = "CreateWindow",
+    [XCB_CHANGE_WINDOW_ATTRIBUTES] = "ChangeWindowAttributes",
+    [XCB_GET_WINDOW_ATTRIBUTES] = "GetWindowAttributes",
+    [XCB_DESTROY_WINDOW] = "DestroyWindow",
+    [XCB_DESTROY_SUBWINDOWS] = "DestroySubwindows",
+    [XCB_CHANGE_SAVE_SET] = "ChangeSaveSet",
+    [XCB_REPARENT_WINDOW] = "ReparentWindow",
+    [XCB_MAP_WINDOW] = "MapWindow",
+    [XCB_MAP_SUBWINDOWS] = "MapSubwindows",
+    [XCB_UNMAP_WINDOW] = "UnmapWindow",
+    [XCB_UNMAP_SUBWINDOWS] = "UnmapSubwindows",
+    [XCB_CONFIGURE_WINDOW] = "ConfigureWindow",
+    [XCB_CIRCULATE_WINDOW] = "CirculateWindow",
+    [XCB_GET_GEOMETRY] = "GetGeometry",
+    [XCB_QUERY_TREE] = "QueryTree",
+    [XCB_INTERN_ATOM] = "InternAtom",
+    [XCB_GET_ATOM_NAME] = "GetAtomName",
+    [XCB_CHANGE_PROPERTY] = "ChangeProperty",
+    [XCB_DELETE_PROPERTY] = "DeleteProperty",
+    [XCB_GET_PROPERTY] = "GetProperty",
+    [XCB_LIST_PROPERTIES] = "ListProperties",
+    [XCB_SET_SELECTION_OWNER] = "SetSelectionOwner",
+    [XCB_GET_SELECTION_OWNER] = "GetSelectionOwner",
+    [XCB_CONVERT_SELECTION] = "ConvertSelection",
+    [XCB_SEND_EVENT] = "SendEvent",
+    [XCB_GRAB_POINTER] = "GrabPointer",
+    [XCB_UNGRAB_POINTER] = "UngrabPointer",
+    [XCB_GRAB_BUTTON] = "GrabButton",
+    [XCB_UNGRAB_BUTTON] = "UngrabButton",
+    [XCB_CHANGE_ACTIVE_POINTER_GRAB] = "ChangeActivePointerGrab",
+    [XCB_GRAB_KEYBOARD] = "GrabKeyboard",
+    [XCB_UNGRAB_KEYBOARD] = "UngrabKeyboard",
+    [XCB_GRAB_KEY] = "GrabKey",
+    [XCB_UNGRAB_KEY] = "UngrabKey",
+    [XCB_ALLOW_EVENTS] = "AllowEvents",
+    [XCB_GRAB_SERVER] = "GrabServer",
+    [XCB_UNGRAB_SERVER] = "UngrabServer",
+    [XCB_QUERY_POINTER] = "QueryPointer",
+    [XCB_GET_MOTION_EVENTS] = "GetMotionEvents",
+    [XCB_TRANSLATE_COORDINATES] = "TranslateCoordinates",
+    [XCB_WARP_POINTER] = "WarpPointer",
+    [XCB_SET_INPUT_FOCUS] = "SetInputFocus",
+    [XCB_GET_INPUT_FOCUS] = "GetInputFocus",
+    [XCB_QUERY_KEYMAP] = "QueryKeymap",
+    [XCB_OPEN_FONT] = "OpenFont",
+    [XCB_CLOSE_FONT] = "CloseFont",
+    [XCB_QUERY_FONT] = "QueryFont",
+    [XCB_QUERY_TEXT_EXTENTS] = "QueryTextExtents",
+    [XCB_LIST_FONTS] = "ListFonts",
+    [XCB_LIST_FONTS_WITH_INFO] = "ListFontsWithInfo",
+    [XCB_SET_FONT_PATH] = "SetFontPath",
+    [XCB_GET_FONT_PATH] = "GetFontPath",
+    [XCB_CREATE_PIXMAP] = "CreatePixmap",
+    [XCB_FREE_PIXMAP] = "FreePixmap",
+    [XCB_CREATE_GC] = "CreateGC",
+    [XCB_CHANGE_GC] = "ChangeGC",
+    [XCB_COPY_GC] = "CopyGC",
+    [XCB_SET_DASHES] = "SetDashes",
+    [XCB_SET_CLIP_RECTANGLES] = "SetClipRectangles",
+    [XCB_FREE_GC] = "FreeGC",
+    [XCB_CLEAR_AREA] = "ClearArea",
+    [XCB_COPY_AREA] = "CopyArea",
+    [XCB_COPY_PLANE] = "CopyPlane",
+    [XCB_POLY_POINT] = "PolyPoint",
+    [XCB_POLY_LINE] = "PolyLine",
+    [XCB_POLY_SEGMENT] = "PolySegment",
+    [XCB_POLY_RECTANGLE] = "PolyRectangle",
+    [XCB_POLY_ARC] = "PolyArc",
+    [XCB_FILL_POLY] = "FillPoly",
+    [XCB_POLY_FILL_RECTANGLE] = "PolyFillRectangle",
+    [XCB_POLY_FILL_ARC] = "PolyFillArc",
+    [XCB_PUT_IMAGE] = "PutImage",
+    [XCB_GET_IMAGE] = "GetImage",
+    [XCB_POLY_TEXT_8] = "PolyText8",
+    [XCB_POLY_TEXT_16] = "PolyText16",
+    [XCB_IMAGE_TEXT_8] = "ImageText8",
+    [XCB_IMAGE_TEXT_16] = "ImageText16",
+    [XCB_CREATE_COLORMAP] = "CreateColormap",
+    [XCB_FREE_COLORMAP] = "FreeColormap",
+    [XCB_COPY_COLORMAP_AND_FREE] = "CopyColormapAndFree",
+    [XCB_INSTALL_COLORMAP] = "InstallColormap",
+    [XCB_UNINSTALL_COLORMAP] = "UninstallColormap",
+    [XCB_LIST_INSTALLED_COLORMAPS] = "ListInstalledColormaps",
+    [XCB_ALLOC_COLOR] = "AllocColor",
+    [XCB_ALLOC_NAMED_COLOR] = "AllocNamedColor",
+    [XCB_ALLOC_COLOR_CELLS] = "AllocColorCells",
+    [XCB_ALLOC_COLOR_PLANES] = "AllocColorPlanes",
+    [XCB_FREE_COLORS] = "FreeColors",
+    [XCB_STORE_COLORS] = "StoreColors",
+    [XCB_STORE_NAMED_COLOR] = "StoreNamedColor",
+    [XCB_QUERY_COLORS] = "QueryColors",
+    [XCB_LOOKUP_COLOR] = "LookupColor",
+    [XCB_CREATE_CURSOR] = "CreateCursor",
+    [XCB_CREATE_GLYPH_CURSOR] = "CreateGlyphCursor",
+    [XCB_FREE_CURSOR] = "FreeCursor",
+    [XCB_RECOLOR_CURSOR] = "RecolorCursor",
+    [XCB_QUERY_BEST_SIZE] = "QueryBestSize",
+    [XCB_QUERY_EXTENSION] = "QueryExtension",
+    [XCB_LIST_EXTENSIONS] = "ListExtensions",
+    [XCB_CHANGE_KEYBOARD_MAPPING] = "ChangeKeyboardMapping",
+    [XCB_GET_KEYBOARD_MAPPING] = "GetKeyboardMapping",
+    [XCB_CHANGE_KEYBOARD_CONTROL] = "ChangeKeyboardControl",
+    [XCB_GET_KEYBOARD_CONTROL] = "GetKeyboardControl",
+    [XCB_BELL] = "Bell",
+    [XCB_CHANGE_POINTER_CONTROL] = "ChangePointerControl",
+    [XCB_GET_POINTER_CONTROL] = "GetPointerControl",
+    [XCB_SET_SCREEN_SAVER] = "SetScreenSaver",
+    [XCB_GET_SCREEN_SAVER] = "GetScreenSaver",
+    [XCB_CHANGE_HOSTS] = "ChangeHosts",
+    [XCB_LIST_HOSTS] = "ListHosts",
+    [XCB_SET_ACCESS_CONTROL] = "SetAccessControl",
+    [XCB_SET_CLOSE_DOWN_MODE] = "SetCloseDownMode",
+    [XCB_KILL_CLIENT] = "KillClient",
+    [XCB_ROTATE_PROPERTIES] = "RotateProperties",
+    [XCB_FORCE_SCREEN_SAVER] = "ForceScreenSaver",
+    [XCB_SET_POINTER_MAPPING] = "SetPointerMapping",
+    [XCB_GET_POINTER_MAPPING] = "GetPointerMapping",
+    [XCB_SET_MODIFIER_MAPPING] = "SetModifierMapping",
+    [XCB_GET_MODIFIER_MAPPING] = "GetModifierMapping",
+    [XCB_NO_OPERATION] = "NoOperation",
+};
+
+void
+StatsRequest(Stats *stats, uint8_t opcode, uint32_t bytes, unsigned int sequence)
+{
+    if (!stats->enabled)
+        return;
+    stats->counters[opcode].requests++;
+    stats->counters[opcode].bytes += bytes;
+    if (sequence > stats->last_sent)
+        stats->last_sent = sequence;
+}
+
+uint64_t
+StatsNow(const Stats *stats)
+{
+    struct timespec ts;
+
+    if (!stats->enabled)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/*
+ * StatsWait: Account a blocking wait for the reply to 'sequence'.
+ */
+void
+StatsWait(Stats *stats, uint8_t opcode, unsigned int sequence, uint64_t start)
+{
+    if (!stats->enabled)
+        return;
+    stats->counters[opcode].waits++;
+    stats->counters[opcode].blocked_ns += StatsNow(stats) - start;
+    if (sequence > stats->answered) {
+        stats->counters[opcode].round_trips++;
+        stats->answered = stats->last_sent;
+    }
+}
+
+/*
+ * StatsSync: Account xcb_request_check() on a request without a reply.
+ * xcb syncs past the newest request it has sent, so the accounting is the
+ * same as for a reply.
+ */
+void
+StatsSync(Stats *stats, uint8_t opcode, unsigned int sequence, uint64_t start)
+{
+    StatsWait(stats, opcode, sequence, start);
+}
+
+/*
+ * StatsExtension: Name the requests of an extension by its major opcode.
+ */
+void
+StatsExtension(Stats *stats, uint8_t opcode, const char *name)
+{
+    if (opcode >= 128)
+        stats->extension_names[opcode - 128] = name;
+}
+
+const char *
+StatsOpcodeName(const Stats *stats, uint8_t opcode)
+{
+    if (opcode < 128 && opcode_names[opcode])
+        return opcode_names[opcode];
+    if (opcode >= 128 && stats->extension_names[opcode - 128])
+        return stats->extension_names[opcode - 128];
+    return opcode < 128 ? "Unknown" : "Extension";
+}
+
+/*
+ * StatsReset: Start counting afresh, as a daemon does for every command.
+ */
+void
+StatsReset(Stats *stats)
+{
+    memset(stats->counters, 0, sizeof(stats->counters));
+    stats->last_sent = stats->answered = 0;
+}
+/* vim: set ts=4 sw=4 et cindent: */
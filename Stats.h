@@ -0,0 +1,40 @@
+/* Stats.h */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+/* Wire size of a request's variable part, padded to 4 bytes. */
+#define STATS_PAD(n)    ((((uint32_t)(n)) + 3) & ~3u)
+
+/*
+ * The accounting of one connection, kept in its XsrContext: sequence
+ * numbers mean nothing on any other, and contexts may be used from
+ * different threads.  Nothing is counted unless it is enabled, but the
+ * names of extensions are learned either way.
+ */
+typedef struct {
+    int enabled;
+    struct {
+        unsigned long requests;
+        unsigned long long bytes;
+        unsigned long waits;
+        unsigned long round_trips;
+        uint64_t blocked_ns;
+    } counters[256];
+    const char *extension_names[128];
+    unsigned int last_sent;     /* newest sequence number sent */
+    unsigned int answered;      /* sent before the last round trip */
+} Stats;
+
+extern void StatsRequest(Stats *stats, uint8_t opcode, uint32_t bytes, unsigned int sequence);
+extern uint64_t StatsNow(const Stats *stats);
+extern void StatsWait(Stats *stats, uint8_t opcode, unsigned int sequence, uint64_t start);
+extern void StatsSync(Stats *stats, uint8_t opcode, unsigned int sequence, uint64_t start);
+extern void StatsExtension(Stats *stats, uint8_t opcode, const char *name);
+extern const char *StatsOpcodeName(const Stats *stats, uint8_t opcode);
+extern void StatsReset(Stats *stats);
+
+#endif /* _STATS_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,42 @@
+/* Trace.h
+ *
+ * On-disk format shared by the -record proxy and xsetroot_replay.
+ *
+ *   header:  "XSRT", uint8 byte order ('l' or 'B'), 3 pad bytes,
+ *            uint32 version, uint32 setup length, setup reply bytes
+ *   records: uint8 type, 3 pad bytes, uint32 microseconds since start, then
+ *            TRACE_REQUESTS:  uint32 length, raw client-to-server bytes
+ *            TRACE_REPLY:     uint32 sequence of a reply that arrived
+ *            TRACE_ERROR:     uint32 sequence of an error that arrived
+ *
+ * All integers are in the byte order named in the header, which is also the
+ * byte order of the recorded X connection.
+ */
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+
+#define TRACE_MAGIC         "XSRT"
+#define TRACE_VERSION       1
+
+#define TRACE_REQUESTS      1
+#define TRACE_REPLY         2
+#define TRACE_ERROR         3
+
+typedef struct {
+    uint8_t type;
+    uint8_t pad[3];
+    uint32_t usec;
+    uint32_t value;         /* length for requests, sequence otherwise */
+} TraceRecord;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+# define TRACE_BYTE_ORDER   'B'
+#else
+# define TRACE_BYTE_ORDER   'l'
+#endif
+
+#endif /* _TRACE_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
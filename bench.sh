@@ -0,0 +1,106 @@
+#!/bin/sh
+#
+# End-to-end benchmark: runs xsetroot_xcb against a private Xvfb and prints
+# one key=value line per case with the median and 99th percentile wall time
+# of a complete run (connect, apply, disconnect).  Each case is also
+# recorded once with -record and replayed with xsetroot_replay, which
+# measures the server side of the same request stream without process
+# startup.
+#
+#   bench.sh <xsetroot_xcb> <xsetroot_replay> <xbmbench>
+#
+# ITERATIONS (default 200) and BENCH_DISPLAY (default :97) may be set in
+# the environment.  Without Xvfb the cases are reported as skipped.
+
+XSETROOT=$1
+REPLAY=$2
+XBMBENCH=$3
+ITERATIONS=${ITERATIONS:-200}
+DPY=${BENCH_DISPLAY:-:97}
+
+if [ $# -ne 3 ]; then
+    echo "usage: $0 <xsetroot_xcb> <xsetroot_replay> <xbmbench>" >&2
+    exit 1
+fi
+
+CASES="solid gray mod bitmap cursor cursor_name pattern gradient image"
+
+if ! command -v Xvfb >/dev/null 2>&1; then
+    for c in $CASES; do
+        echo "bench=e2e case=$c skipped=no_xvfb"
+    done
+    exit 0
+fi
+
+TMP=$(mktemp -d /tmp/xsetroot-bench.XXXXXX) || exit 1
+Xvfb $DPY -nolisten tcp -screen 0 1920x1080x24 >"$TMP/xvfb.log" 2>&1 &
+XVFB_PID=$!
+trap 'kill $XVFB_PID 2>/dev/null; rm -rf "$TMP"' EXIT INT TERM
+
+i=0
+until "$XSETROOT" -display $DPY -name bench 2>/dev/null; do
+    i=$((i + 1))
+    if [ $i -ge 50 ]; then
+        echo "$0: Xvfb did not start on $DPY" >&2
+        exit 1
+    fi
+    sleep 0.1
+done
+
+"$XBMBENCH" -write x11 256 256 "$TMP/bitmap.xbm"
+"$XBMBENCH" -write x11 32 32 "$TMP/cursor.xbm"
+"$XBMBENCH" -write x11 32 32 "$TMP/mask.xbm"
+# a 6K photograph's worth of noise, scaled down to cover the root
+{ printf 'P6\n6144 3456\n255\n'; head -c $((6144 * 3456 * 3)) /dev/urandom; } > "$TMP/image.ppm"
+
+args() {
+    case $1 in
+    solid)          echo "-solid steelblue" ;;
+    gray)           echo "-gray" ;;
+    mod)            echo "-mod 16 16" ;;
+    bitmap)         echo "-bitmap $TMP/bitmap.xbm" ;;
+    cursor)         echo "-cursor $TMP/cursor.xbm $TMP/mask.xbm" ;;
+    cursor_name)    echo "-cursor_name left_ptr" ;;
+    pattern)        echo "-pattern noise" ;;
+    gradient)       echo "-gradient 45" ;;
+    image)          echo "-image $TMP/image.ppm -fill" ;;
+    esac
+}
+
+now_us() {
+    echo $(($(date +%s%N) / 1000))
+}
+
+# "median p99" of the microsecond times on stdin
+percentiles() {
+    sort -n | awk '{ v[NR] = $1 }
+        END {
+            m = int((NR + 1) / 2); p = int(NR * 0.99 + 0.999)
+            if (p < 1) p = 1
+            print v[m], v[p]
+        }'
+}
+
+for c in $CASES; do
+    set -- $(args $c)
+    n=0
+    : > "$TMP/times"
+    while [ $n -lt $ITERATIONS ]; do
+        t0=$(now_us)
+        "$XSETROOT" -display $DPY "$@" || exit 1
+        t1=$(now_us)
+        echo $((t1 - t0)) >> "$TMP/times"
+        n=$((n + 1))
+    done
+    set -- $(percentiles < "$TMP/times")
+    echo "bench=e2e case=$c iterations=$ITERATIONS median_us=$1 p99_us=$2"
+
+    set -- $(args $c)
+    "$XSETROOT" -display $DPY -record "$TMP/$c.trace" "$@" || exit 1
+    "$REPLAY" -display $DPY -n $ITERATIONS "$TMP/$c.trace" |
+        awk -v c=$c -v n=$ITERATIONS '/^latency_us / {
+            for (i = 2; i <= NF; i++) { split($i, kv, "="); v[kv[1]] = kv[2] }
+            printf "bench=replay case=%s iterations=%d median_us=%s p99_us=%s\n",
+                   c, n, v["median"], v["p99"]
+        }'
+done
@@ -0,0 +1,121 @@
+/* colorcheck.c
+ *
+ * Checks that PackPixel() gives the pixel the server's AllocColor does for
+ * numeric color specs on a TrueColor visual: on a 24 bit one made up here,
+ * against the values miResolveColor() settles on, and on the root visual of
+ * $DISPLAY, against AllocColor itself, when there is a display to ask.
+ * One key=value line is printed per case.
+ *
+ *   colorcheck
+ *
+ * Exits 1 if any case differs.  The cases on the made-up visual always
+ * run, so with no TrueColor display to ask the check still passes on them.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <xcb/xcb.h>
+#include <xcb/xcb_aux.h>
+#include "ColorDB.h"
+
+static const struct {
+    const char *spec;
+    uint32_t pixel;             /* on a 24 bit visual of 8 bits per channel */
+} cases[] = {
+    { "#ffffff", 0xffffff },
+    { "#f0f0f0", 0xf0f0f0 },
+    { "#fff", 0xf0f0f0 },           /* Xlib takes it as #f000f000f000 */
+    { "#808080", 0x808080 },
+    { "#123456", 0x123456 },
+    { "rgb:ff/80/0", 0xff8000 },
+};
+
+#define N_CASES (sizeof(cases) / sizeof(cases[0]))
+
+static int
+check_made_up(void)
+{
+    xcb_visualtype_t visual = { 0 };
+    uint16_t r, g, b;
+    uint32_t pixel;
+    int bad = 0;
+    size_t i;
+
+    visual._class = XCB_VISUAL_CLASS_TRUE_COLOR;
+    visual.bits_per_rgb_value = 8;
+    visual.red_mask = 0xff0000;
+    visual.green_mask = 0x00ff00;
+    visual.blue_mask = 0x0000ff;
+
+    for (i = 0; i < N_CASES; i++) {
+        ParseColorSpec(cases[i].spec, &r, &g, &b);
+        pixel = PackPixel(&visual, r, g, b);
+        printf("check=pack spec=%s pixel=0x%06x expected=0x%06x %s\n",
+               cases[i].spec, pixel, cases[i].pixel,
+               pixel == cases[i].pixel ? "ok" : "FAILED");
+        bad += pixel != cases[i].pixel;
+    }
+    return bad;
+}
+
+/* -1 if there is no TrueColor root to check against. */
+static int
+check_server(void)
+{
+    xcb_connection_t *c;
+    xcb_screen_t *screen;
+    xcb_visualtype_t *visual;
+    xcb_alloc_color_cookie_t cookies[N_CASES];
+    xcb_alloc_color_reply_t *reply;
+    uint16_t r, g, b;
+    uint32_t pixel;
+    int screen_num, bad = 0;
+    size_t i;
+
+    c = xcb_connect(NULL, &screen_num);
+    if (xcb_connection_has_error(c)) {
+        xcb_disconnect(c);
+        return -1;
+    }
+    screen = xcb_aux_get_screen(c, screen_num);
+    visual = screen ? xcb_aux_get_visualtype(c, screen_num, screen->root_visual) : NULL;
+    if (!visual || visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR) {
+        xcb_disconnect(c);
+        return -1;
+    }
+
+    for (i = 0; i < N_CASES; i++) {
+        ParseColorSpec(cases[i].spec, &r, &g, &b);
+        cookies[i] = xcb_alloc_color(c, screen->default_colormap, r, g, b);
+    }
+    for (i = 0; i < N_CASES; i++) {
+        ParseColorSpec(cases[i].spec, &r, &g, &b);
+        pixel = PackPixel(visual, r, g, b);
+        if (!(reply = xcb_alloc_color_reply(c, cookies[i], NULL))) {
+            printf("check=alloc spec=%s FAILED\n", cases[i].spec);
+            bad++;
+            continue;
+        }
+        printf("check=alloc spec=%s pixel=0x%06x server=0x%06x %s\n",
+               cases[i].spec, pixel, reply->pixel,
+               pixel == reply->pixel ? "ok" : "FAILED");
+        bad += pixel != reply->pixel;
+        free(reply);
+    }
+    xcb_disconnect(c);
+    return bad;
+}
+
+int
+main(void)
+{
+    int bad = check_made_up(), server = check_server();
+
+    if (server < 0)
+        printf("check=alloc skipped=no_truecolor_display\n");
+    return bad || server > 0;
+}
+/* vim: set ts=4 sw=4 et cindent: */
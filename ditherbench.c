@@ -0,0 +1,142 @@
+/* ditherbench.c
+ *
+ * Microbenchmark for the ditherers in Dither.c: every one but the plain C
+ * ones dithers rows of a 4K wide image to the levels of a few common
+ * shallow visuals, and so does the plain C one of the same kind.
+ * Throughput of both, the speedup and whether the output matched byte for
+ * byte (on an odd width too, for the tails) are reported as key=value
+ * lines.
+ *
+ *   ditherbench [-width <pixels>]
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <err.h>
+#include "Dither.h"
+
+#define MIN_SECONDS     0.2
+#define ROWS            64
+
+/* levels of red, green and blue: 565, 555 and 332 TrueColor, a 6x6x6 cube */
+static const int level_sets[][3] = {
+    { 32, 64, 32 }, { 32, 32, 32 }, { 8, 8, 4 }, { 6, 6, 6 }
+};
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Megapixels per second dithering copies of the ROWS rows in turn. */
+static double
+run_ditherer(Dither *d, const uint32_t *argb, uint32_t *row)
+{
+    double t0 = now(), elapsed;
+    long n = 0;
+
+    do {
+        memcpy(row, argb + (size_t)(n % ROWS) * d->width, d->width * sizeof(uint32_t));
+        DitherRow(d, n % ROWS, row);
+        n++;
+    } while (n % ROWS || (elapsed = now() - t0) < MIN_SECONDS);
+    return (double)n * d->width / elapsed / 1e6;
+}
+
+static int
+same_output(const DitherKernel *a, const DitherKernel *b, const int levels[3],
+            const uint32_t *argb, uint32_t *row_a, uint32_t *row_b, int width)
+{
+    Dither *da = DitherNew(a->kind, levels, width), *db = DitherNew(b->kind, levels, width);
+    int y, same = 1;
+
+    if (!da || !db)
+        errx(1, "can't dither to %d/%d/%d", levels[0], levels[1], levels[2]);
+    da->dither = a->dither;
+    db->dither = b->dither;
+    for (y = 0; y < ROWS && same; y++) {
+        memcpy(row_a, argb + (size_t)y * width, width * sizeof(uint32_t));
+        memcpy(row_b, argb + (size_t)y * width, width * sizeof(uint32_t));
+        DitherRow(da, y, row_a);
+        DitherRow(db, y, row_b);
+        same = !memcmp(row_a, row_b, width * sizeof(uint32_t));
+    }
+    DitherFree(da);
+    DitherFree(db);
+    return same;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const DitherKernel *k, *plain;
+    const int *levels;
+    Dither *d, *ref;
+    uint32_t *argb, *row, seed = 12345;
+    double rate, plain_rate;
+    int width = 3840, i, j, s, match;
+    size_t n;
+
+    if (argc == 3 && !strcmp(argv[1], "-width"))
+        width = atoi(argv[2]);
+    else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-width <pixels>]\n", argv[0]);
+        return 1;
+    }
+    if (width < 1)
+        errx(1, "bad width");
+
+    /* smooth ramps with a little noise, what dithering is for */
+    n = (size_t)width * ROWS;
+    argb = malloc(n * sizeof(uint32_t));
+    row = malloc(2 * width * sizeof(uint32_t));
+    if (!argb || !row)
+        err(1, "malloc");
+    for (i = 0; (size_t)i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        j = i % width * 255 / width;
+        argb[i] = 0xff000000 | j << 16 | (255 - j) << 8 | ((j + i / width * 4) & 0xff);
+        argb[i] ^= seed >> 29;
+    }
+
+    for (i = 0; i < n_dither_kernels; i++) {
+        k = &dither_kernels[i];
+        for (plain = NULL, j = 0; j < n_dither_kernels; j++)
+            if (dither_kernels[j].kind == k->kind)
+                plain = &dither_kernels[j];
+        if (k == plain)
+            continue;
+        for (s = 0; s < (int)(sizeof(level_sets) / sizeof(level_sets[0])); s++) {
+            levels = level_sets[s];
+            match = same_output(k, plain, levels, argb, row, row + width, width) &&
+                    same_output(k, plain, levels, argb, row, row + width,
+                                width > 4 ? (width - 4) | 1 : width);
+            d = DitherNew(k->kind, levels, width);
+            ref = DitherNew(k->kind, levels, width);
+            if (!d || !ref)
+                err(1, "malloc");
+            d->dither = k->dither;
+            ref->dither = plain->dither;
+            rate = run_ditherer(d, argb, row);
+            plain_rate = run_ditherer(ref, argb, row);
+            printf("bench=dither kernel=%s levels=%d/%d/%d width=%d mpix_per_s=%.1f "
+                   "plain_mpix_per_s=%.1f speedup=%.2f match=%s\n",
+                   k->name, levels[0], levels[1], levels[2], width, rate, plain_rate,
+                   rate / plain_rate, match ? "yes" : "no");
+            fflush(stdout);
+            DitherFree(d);
+            DitherFree(ref);
+        }
+    }
+    return 0;
+}
+/* vim: set ts=4 sw=4 et cindent: */
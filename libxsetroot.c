@@ -0,0 +1,3857 @@
+/*
+ *
+Copyright 1987, 1998  The Open Group
+
+Permission to use, copy, modify, distribute, and sell this software and its
+documentation for any purpose is hereby granted without fee, provided that
+the above copyright notice appear in all copies and that both that
+copyright notice and this permission notice appear in supporting
+documentation.
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+OPEN GROUP BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN
+AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+Except as contained in this notice, the name of The Open Group shall not be
+used in advertising or otherwise to promote the sale, use or other dealings
+in this Software without prior written authorization from The Open Group.
+ */
+
+/*
+ * libxsetroot.c  The root window parameter setting of xsetroot, on a
+ *        connection and context supplied by the caller.  xsetroot.c is a
+ *        command line around it.
+ *
+ *  Author:    Mark Lillibridge, MIT Project Athena
+ *        11-Jun-87
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* memfd_create */
+#endif
+
+#include <xcb/xcb.h>
+#include <xcb/xcb_aux.h>
+#include <xcb/xcb_cursor.h>
+#include <xcb/shm.h>
+#include <xcb/render.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/ipc.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <X11/Xfuncproto.h>
+#include <X11/bitmaps/gray>
+#include "ColorDB.h"
+#include "CurUtil.h"
+#include "DiskCache.h"
+#include "Dither.h"
+#include "Pack.h"
+#include "Pattern.h"
+#include "Period.h"
+#include "Scale.h"
+#include "Stats.h"
+#include "libxsetroot.h"
+#include "readbitmap.h"
+#include "readimage.h"
+
+#define Dynamic 1
+
+static const char *cursor_font = "cursor";
+
+/*
+ * Colors are resolved in two steps so that every lookup can be on the wire
+ * before any reply is awaited: RequestColor() sends the query for a slot and
+ * CollectColor() later picks up the answer.
+ */
+enum { COLOR_NONE, COLOR_ALLOC, COLOR_ALLOC_RGB, COLOR_LOOKUP, COLOR_QUERY };
+
+typedef struct {
+    char *name;                 /* color name, NULL or "" for the default */
+    uint32_t pixel;             /* default pixel, then the resolved one */
+    int want_pixel;             /* an allocated pixel value is needed */
+    int want_rgb;               /* the exact RGB value is needed */
+    int pending;                /* which request is outstanding */
+    union {
+        xcb_alloc_named_color_cookie_t alloc;
+        xcb_alloc_color_cookie_t alloc_rgb;
+        xcb_lookup_color_cookie_t lookup;
+        xcb_query_colors_cookie_t query;
+    } cookie;
+    xcb_coloritem_t color;
+} ColorSlot;
+
+/*
+ * What a root shows is recorded in its _XSETROOT_XCB_APPLIED property as
+ * a hash of everything each part of it was made from, so that a command
+ * asking for what is already there can leave that part alone.  The
+ * property holds the hashes, two words each, then the _XROOTPMAP_ID the
+ * background was set under.  Another program's background shows up only if
+ * it changed _XROOTPMAP_ID, and its cursor not at all, as there is no
+ * reading a cursor back; WM_NAME is read back and compared.
+ */
+enum { APPLIED_BACK, APPLIED_CURSOR, APPLIED_NAME, N_APPLIED };
+
+#define APPLIED_WORDS   (2 * N_APPLIED + 1)
+#define APPLIED_NAME_MAX    1024    /* a longer WM_NAME never matches */
+
+/* Atoms of root properties, interned together on first use. */
+enum { ATOM_XROOTPMAP_ID, ATOM_ESETROOT_PMAP_ID, ATOM_APPLIED, N_ROOT_ATOMS };
+
+static const char *root_atom_names[N_ROOT_ATOMS] = {
+    "_XROOTPMAP_ID", "ESETROOT_PMAP_ID", "_XSETROOT_XCB_APPLIED"
+};
+
+/*
+ * Per-screen state: the color slots of the command in progress, the
+ * _XSETROOT_ID bookkeeping FixupState() does for the screen's root, the
+ * _XROOTPMAP_ID bookkeeping PublishRoots() does, what the root shows as
+ * _XSETROOT_XCB_APPLIED records it, the packer XsrOpen() picked for its
+ * pixels or the color cube ImageFormat() allocated, and, once
+ * RenderAvailable() has asked, the RENDER picture format of its root
+ * visual.
+ * SelectScreen() points cur, screen, root and visual at one of them.
+ */
+typedef struct {
+    xcb_screen_t *screen;
+    xcb_visualtype_t *visual;
+    ColorSlot fg_slot, bg_slot, solid_slot;
+    int save_colors;            /* colors were allocated and must be kept */
+    int unsave_past;            /* the background changed */
+    xcb_pixmap_t save_pixmap;
+    int state_is_ours;          /* _XSETROOT_ID names one of our pixmaps */
+    xcb_get_property_cookie_t state_c;
+    int state_pending;
+    xcb_pixmap_t killed;        /* whose client FixupState() killed */
+    int pmap_changed;           /* the background changed */
+    int pmap_publish;           /* under -publish */
+    xcb_pixmap_t pmap_new;      /* the background to publish, or None */
+    xcb_pixmap_t pmap;          /* ours, that _XROOTPMAP_ID names */
+    xcb_get_property_cookie_t pmap_c[2];
+    int pmap_pending;
+    uint64_t applied[N_APPLIED];    /* hashes of what the root shows, 0 if unknown */
+    xcb_pixmap_t applied_pmap;  /* _XROOTPMAP_ID as of applied[APPLIED_BACK] */
+    int applied_known;          /* read since the last XsrComplete() */
+    int applied_dirty;          /* changed, to be written back */
+    int applied_failed;         /* a request the window's part needed failed */
+    xcb_get_property_cookie_t applied_c[3];
+    int applied_pending;
+    PixelFormat *pixels;        /* for full color images, if TrueColor */
+    PixelFormat *palette;       /* or a color cube, if colormapped */
+    xcb_render_pictformat_t root_format;    /* RENDER's, for the root visual */
+} ScreenState;
+
+/*
+ * Everything a run changes on a window is collected into a Plan first.
+ * CommitPlan() then sends a single ChangeWindowAttributes and clears the
+ * window only if its background was part of the change.
+ */
+typedef struct {
+    xcb_window_t window;
+    uint32_t mask;              /* XCB_CW_BACK_PIXMAP/BACK_PIXEL/CURSOR */
+    xcb_pixmap_t back_pixmap;
+    uint32_t back_pixel;
+    xcb_cursor_t cursor;
+    int own_cursor;             /* free cursor once it is installed */
+    xcb_pixmap_t free_pixmap;   /* background pixmap to free after commit */
+    char *name;                 /* new WM_NAME, or NULL */
+} Plan;
+
+/*
+ * Requests whose failure we want to report are sent checked and their
+ * cookies parked in the context; CheckDeferred() collects all of them at the
+ * end of the run with a single round trip.
+ */
+#define MAX_DEFERRED 16
+
+/*
+ * A context that is kept warm keeps what earlier commands cost a round trip
+ * or an upload: colors the server resolved and depth-1 bitmaps, the latter
+ * keyed by where they came from.  Both caches are small; colors are replaced
+ * in turn, bitmaps least recently used first.
+ */
+#define MAX_CACHED_COLORS   32
+#define MAX_CACHED_BITMAPS  16
+#define CACHE_KEY_MAX       1024
+
+struct _XsrContext {
+    xcb_connection_t *dpy;
+    int keep_warm;              /* keep resources between commands */
+    int screen_nbr;             /* the display's own screen */
+    ScreenState *screens;
+    int n_screens;
+    ScreenState *cur;
+    xcb_screen_t *screen;
+    xcb_window_t root;
+    xcb_visualtype_t *visual;
+    uint32_t fg_pixel;
+    uint32_t bg_pixel;
+    xcb_font_t cursor_fid;
+    xcb_atom_t state_atom;
+    xcb_intern_atom_cookie_t state_atom_c;
+    int state_atom_pending;
+    xcb_atom_t root_atoms[N_ROOT_ATOMS];
+    xcb_intern_atom_cookie_t root_atoms_c[N_ROOT_ATOMS];
+    int root_atoms_pending;
+
+    int shm;                    /* SHM_UNKNOWN, SHM_NONE, SHM_SYSV or SHM_FD */
+    int shm_trusted;            /* the server has attached one of ours */
+    uint8_t shm_opcode;
+    int render;                 /* RENDER_UNKNOWN, RENDER_NONE or RENDER_GRADIENTS */
+    uint8_t render_opcode;
+
+    int disk_cache;             /* files are looked up in cache_dir */
+    char cache_dir[4096];
+    DiskCacheWriter *store;     /* the next upload is written here too */
+
+    XsrOptions *cmd;            /* submitted, waiting for its replies */
+    int first, last;            /* the screens it works on */
+    XsrStatus status;           /* first failure since XsrComplete() */
+
+    XsrErrorProc error_proc;
+    void *error_closure;
+    char message[1024];
+    XsrStatus reported;         /* the status message went with */
+
+    Stats stats;                /* counted while XsrSetStats() has it on */
+
+    struct {
+        xcb_void_cookie_t cookie;
+        uint8_t opcode;
+        XsrStatus status;
+        const char *what;
+        ScreenState *screen;    /* whose root it was for */
+    } deferred[MAX_DEFERRED];
+    int n_deferred;
+
+    struct {
+        char *name;             /* "" for a slot's default color */
+        xcb_colormap_t colormap;
+        uint32_t def_pixel;     /* the default, when name is "" */
+        int have_pixel;         /* pixel was allocated, not just looked up */
+        uint32_t pixel;
+        xcb_coloritem_t color;
+    } color_cache[MAX_CACHED_COLORS];
+    int next_cached_color;
+
+    struct {
+        char *key;
+        xcb_window_t root;      /* bitmaps belong to a screen */
+        xcb_pixmap_t bitmap;
+        uint16_t width, height;
+        unsigned long used;
+    } bitmap_cache[MAX_CACHED_BITMAPS];
+    unsigned long cache_clock;
+};
+
+/*
+ * Images of SHM_MIN_BYTES or more go through a MIT-SHM segment when the
+ * server is on this host: passed as a file descriptor if it has MIT-SHM
+ * 1.2, else as a SysV id.  Smaller ones aren't worth the segment.
+ */
+#define SHM_MIN_BYTES   (64 * 1024)
+
+enum { SHM_UNKNOWN, SHM_NONE, SHM_SYSV, SHM_FD };
+
+typedef struct {
+    xcb_shm_seg_t seg;
+    uint8_t *addr;
+    size_t size;
+    int sysv;
+} ShmSegment;
+
+/*
+ * Images go to the server a band of scanlines per PutImage, so that no
+ * request outgrows what the server takes and a file's first rows are on
+ * the wire while the rest is still being decoded.  Through MIT-SHM the
+ * segment holds two bands, one filled while the server reads the other;
+ * before a half is filled again a GetInputFocus sent behind the put that
+ * used it must have been answered.  A BandProc hands out the next len
+ * bytes of XBM ordered rows, or NULL if there are none.
+ */
+#define BAND_BYTES  (1 << 20)
+
+typedef struct {
+    size_t stride;              /* bytes per scanline */
+    size_t rows;                /* scanlines per band */
+    uint16_t height;
+    int band;                   /* bands sent so far */
+    uint8_t *buf;               /* the band being filled, without MIT-SHM */
+    int use_shm;
+    ShmSegment shm;
+    xcb_get_input_focus_cookie_t fence[2];
+    int fenced[2];
+    DiskCacheWriter *store;     /* gets a copy of every band sent */
+} Upload;
+
+/*
+ * -gradient and -radial are drawn by the server when it has RENDER 0.10 or
+ * later, which added gradient pictures; else they are made here as the
+ * -pattern of the same name and uploaded.
+ */
+enum { RENDER_UNKNOWN, RENDER_NONE, RENDER_GRADIENTS };
+
+typedef const uint8_t *(*BandProc)(void *closure, size_t len);
+
+typedef struct {
+    const uint8_t *data;
+    size_t offset;
+} MemoryBands;
+
+typedef struct {
+    BitmapStream *stream;
+    uint8_t *buf;
+    int status;
+} FileBands;
+
+/*
+ * Full color images are made a row of 0xAARRGGBB at a time by a RowProc,
+ * which returns 0 if it can't make one, and packed into each band for the
+ * root's pixel format.  Rows that may be made in any order are shared out
+ * among up to MT_MAX threads, one for each MT_PIXELS of the image; the
+ * band is sent once all of its rows are in.  On roots with few levels of
+ * each channel the rows are dithered before they are packed: ordered
+ * dithering row by row on the threads, error diffusion down the band's
+ * rows in order once they are all made.  A BandStartProc, if given, is
+ * called before the rows of each band are handed out, to ready what they
+ * are made from; it returns 0 if it can't.
+ */
+#define MT_PIXELS   (1 << 18)   /* least pixels worth a thread of their own */
+#define MT_MAX      16
+
+typedef int (*RowProc)(void *closure, int y, uint32_t *argb);
+typedef int (*BandStartProc)(void *closure, int y, int n);
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start, done;
+    RowProc make_row;
+    void *closure;
+    const PixelFormat *pf;
+    Dither *dither;             /* or NULL */
+    uint32_t *rows;             /* the band's rows, for error diffusion */
+    uint16_t width;
+    size_t stride;
+    uint8_t *band;              /* the band being filled */
+    int y, n;                   /* its first row and number of rows */
+    int next, finished;         /* its rows handed out and made */
+    unsigned long band_nbr;
+    int failed;
+    int quit;
+} BandFill;
+
+typedef struct {
+    BandFill *fill;
+    uint32_t *argb;             /* the row being made */
+    pthread_t thread;
+} Filler;
+
+/*
+ * An -image scaled or cropped to the root is made from a window of its
+ * rows, read on the main thread as each band starts: rows no band below
+ * needs are dropped and their buffers reused, so only about a band's worth
+ * of the image is ever held.  The rows of the window are then scaled on
+ * as many threads as the band is worth.
+ */
+typedef struct {
+    int scaled_w, scaled_h;     /* the whole image scaled */
+    int src_x, src_y;           /* the part of it on the root */
+    int x, y, width, height;    /* where that goes on the root */
+    int solid;                  /* it is all one pixel, and no pixmap was made */
+    uint32_t pixel;
+} Placement;
+
+/*
+ * An image tiled at its own size is first read until it is known whether
+ * it repeats a smaller tile, holding up to TILE_MAX_HELD of its rows: then
+ * just the tile is sent, or, for an image of one color, nothing at all.
+ */
+#define TILE_MAX_HELD   (8 << 20)
+
+typedef struct {
+    ImageStream *stream;
+    int status;
+    uint16_t width;
+    Scaler *scaler;             /* or NULL, read as it is */
+    uint32_t **window;          /* size rows, then size spare pointers */
+    int size;
+    int first, count;           /* the source rows in the window */
+    int next;                   /* source rows read */
+    PeriodFinder *tile;         /* or NULL, rows FindTile() read ahead */
+} ImageRows;
+
+static XsrStatus Report(XsrContext *ctx, XsrStatus status, const char *fmt, ...)
+    _X_ATTRIBUTE_PRINTF(3, 4);
+static XsrOptions *CopyOptions(const XsrOptions *opts);
+static void ApplyStart(XsrContext *ctx);
+static XsrStatus ApplyFinish(XsrContext *ctx);
+static XsrStatus FinishCommand(XsrContext *ctx);
+static void SelectScreen(XsrContext *ctx, int n);
+static void FixupState(XsrContext *ctx);
+static void PublishRoots(XsrContext *ctx);
+static void InternRootAtoms(XsrContext *ctx);
+static void CollectRootAtoms(XsrContext *ctx);
+static void RequestApplied(XsrContext *ctx);
+static void CollectApplied(XsrContext *ctx);
+static int AppliedHashes(XsrContext *ctx, const XsrOptions *opts, int reset_back, int reset_cursor, uint64_t *want);
+static uint64_t HashParts(const char *dir, const char *const *strings, int n_strings, const int32_t *numbers, int n_numbers, const char *const *files, int n_files);
+static void RecordApplied(XsrContext *ctx);
+static xcb_pixmap_t SolidPixmap(XsrContext *ctx, uint32_t pixel);
+static void SetBackgroundToBitmap(XsrContext *ctx, Plan *plan, xcb_pixmap_t bitmap, uint16_t width, uint16_t height);
+static void SetBackgroundToPixmap(XsrContext *ctx, Plan *plan, xcb_pixmap_t pix);
+static void PlanCursor(XsrContext *ctx, Plan *plan, xcb_cursor_t cursor, int owned);
+static void PlanBackPixmap(XsrContext *ctx, Plan *plan, xcb_pixmap_t pixmap, int owned);
+static void PlanBackPixel(XsrContext *ctx, Plan *plan, uint32_t pixel);
+static void CommitPlan(XsrContext *ctx, Plan *plan);
+static xcb_cursor_t CreateCursorFromFiles(XsrContext *ctx, char *cursor_file, char *mask_file);
+static xcb_cursor_t CreateCursorFromName(XsrContext *ctx, int index);
+static xcb_pixmap_t MakeModulaBitmap(XsrContext *ctx, int mod_x, int mod_y);
+static xcb_pixmap_t UploadBitmap(XsrContext *ctx, uint8_t *data, uint16_t width, uint16_t height);
+static xcb_pixmap_t PutBitmap(XsrContext *ctx, uint16_t width, uint16_t height, BandProc next, void *closure);
+static const uint8_t *NextMemoryBand(void *closure, size_t len);
+static const uint8_t *NextFileBand(void *closure, size_t len);
+static int StartUpload(XsrContext *ctx, Upload *up, size_t stride, uint16_t height);
+static size_t BandRows(XsrContext *ctx, size_t stride, uint16_t height);
+static uint8_t *UploadBand(XsrContext *ctx, Upload *up);
+static void SendBand(XsrContext *ctx, Upload *up, xcb_drawable_t drawable, xcb_gcontext_t gc, uint8_t format, uint8_t depth, uint16_t width, uint16_t y, uint16_t n);
+static void FinishUpload(XsrContext *ctx, Upload *up);
+static xcb_pixmap_t PutCached(XsrContext *ctx, const DiskCacheEntry *e);
+static xcb_pixmap_t PutPixels(XsrContext *ctx, const PixelFormat *pf, uint16_t width, uint16_t height, BandStartProc start_band, RowProc make_row, void *closure, int threads);
+static void FillBand(BandFill *fill, uint32_t *argb);
+static void *FillThread(void *arg);
+static int FillThreads(uint16_t width, uint16_t height);
+static int ShmAvailable(XsrContext *ctx);
+static int ShmAttach(XsrContext *ctx, ShmSegment *shm, size_t size);
+static int ShmConnect(XsrContext *ctx, xcb_shm_seg_t seg, int fd, int id);
+static void ShmDetach(XsrContext *ctx, ShmSegment *shm);
+static int RenderAvailable(XsrContext *ctx);
+static void RequestColor(XsrContext *ctx, ColorSlot *slot);
+static int CollectColor(XsrContext *ctx, ColorSlot *slot);
+static void DiscardColor(XsrContext *ctx, ColorSlot *slot);
+static int CachedColor(XsrContext *ctx, ColorSlot *slot);
+static void CacheColor(XsrContext *ctx, ColorSlot *slot, int have_pixel);
+static void FileKey(XsrContext *ctx, char *key, size_t len, const char *prefix, const char *file);
+static xcb_pixmap_t CachedBitmap(XsrContext *ctx, const char *key, uint16_t *width, uint16_t *height);
+static void CacheBitmap(XsrContext *ctx, const char *key, xcb_pixmap_t bitmap, uint16_t width, uint16_t height);
+static int CacheHoldsBitmap(XsrContext *ctx, xcb_pixmap_t bitmap);
+static void DeferCheck(XsrContext *ctx, xcb_void_cookie_t cookie, uint8_t opcode, XsrStatus status, const char *what);
+static void CheckDeferred(XsrContext *ctx);
+static const char *BitmapError(int status);
+static int BitmapKey(XsrContext *ctx, const char *filename, DiskCacheKey *key);
+static PixelFormat *RootPixelFormat(xcb_connection_t *c, xcb_screen_t *screen, xcb_visualtype_t *visual);
+static XsrStatus ImageFormat(XsrContext *ctx, const char *what, const PixelFormat **pf);
+static PixelFormat *AllocPalette(XsrContext *ctx);
+static xcb_pixmap_t ReadBitmapFile(XsrContext *ctx, char *filename, const XsrBitmapData *parsed, uint16_t *width, uint16_t *height, int16_t *x_hot, int16_t *y_hot);
+static const char *ImageError(int status);
+static xcb_pixmap_t ReadImageFile(XsrContext *ctx, char *filename, Placement *place);
+static int ImageKey(XsrContext *ctx, const char *filename, const PixelFormat *pf, DiskCacheKey *key);
+static void PlaceImage(XsrContext *ctx, int src_w, int src_h, Placement *place);
+static int FindTile(XsrContext *ctx, ImageRows *rows, const char *filename, const PixelFormat *pf, uint16_t height, Placement *place);
+static uint32_t PixelValue(const PixelFormat *pf, const uint8_t *p);
+static xcb_pixmap_t PadImage(XsrContext *ctx, xcb_pixmap_t image, const Placement *place);
+static int NextImageRow(void *closure, int y, uint32_t *argb);
+static int StartImageBand(void *closure, int y, int n);
+static int NextScaledRow(void *closure, int y, uint32_t *argb);
+static XsrStatus MakePattern(XsrContext *ctx, const PatternSpec *ps, xcb_pixmap_t *pix);
+static int NextPatternRow(void *closure, int y, uint32_t *argb);
+static XsrStatus MakeGradient(XsrContext *ctx, int gradient, int angle, xcb_pixmap_t *pix);
+
+/*
+ * XsrOpen: Make a context for a connection, working on the given screen
+ *          unless a command names another.  Returns NULL if out of memory.
+ */
+XsrContext *
+XsrOpen(xcb_connection_t *c, int screen, int flags)
+{
+    const xcb_setup_t *setup = xcb_get_setup(c);
+    xcb_screen_iterator_t it;
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    XsrContext *ctx;
+    int i;
+
+    if (!(ctx = calloc(1, sizeof(XsrContext))))
+        return NULL;
+    ctx->dpy = c;
+    ctx->keep_warm = (flags & XSR_KEEP_WARM) != 0;
+    ctx->shm = (flags & XSR_NO_SHM) ? SHM_NONE : SHM_UNKNOWN;
+    ctx->disk_cache = (flags & XSR_DISK_CACHE) &&
+                      DiskCacheDir(ctx->cache_dir, sizeof(ctx->cache_dir));
+    /* MIT-SHM needs the server on this host */
+    addr_len = sizeof(addr);
+    if (getsockname(xcb_get_file_descriptor(c), (struct sockaddr *)&addr, &addr_len) < 0 ||
+        addr.ss_family != AF_UNIX)
+        ctx->shm = SHM_NONE;
+    ctx->n_screens = xcb_setup_roots_length(setup);
+    if (!(ctx->screens = calloc(ctx->n_screens, sizeof(ScreenState)))) {
+        free(ctx);
+        return NULL;
+    }
+    for (it = xcb_setup_roots_iterator(setup), i = 0; it.rem; xcb_screen_next(&it), i++) {
+        ctx->screens[i].screen = it.data;
+        ctx->screens[i].visual = xcb_aux_get_visualtype(c, i, it.data->root_visual);
+        ctx->screens[i].pixels = RootPixelFormat(c, it.data, ctx->screens[i].visual);
+    }
+    ctx->screen_nbr = (screen >= 0 && screen < ctx->n_screens) ? screen : 0;
+    SelectScreen(ctx, ctx->screen_nbr);
+    return ctx;
+}
+
+/*
+ * XsrClose: Finish what is outstanding and free the context with what it
+ *           kept.  The connection stays open; colors kept for a background
+ *           stay allocated.
+ */
+void
+XsrClose(XsrContext *ctx)
+{
+    int i;
+
+    XsrComplete(ctx);
+    if (!xcb_connection_has_error(ctx->dpy)) {
+        for (i = 0; i < MAX_CACHED_BITMAPS; i++)
+            if (ctx->bitmap_cache[i].key)
+                StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8,
+                             xcb_free_pixmap(ctx->dpy, ctx->bitmap_cache[i].bitmap).sequence);
+        if (ctx->cursor_fid)
+            StatsRequest(&ctx->stats, XCB_CLOSE_FONT, 8,
+                         xcb_close_font(ctx->dpy, ctx->cursor_fid).sequence);
+        xcb_flush(ctx->dpy);
+    }
+    for (i = 0; i < MAX_CACHED_BITMAPS; i++)
+        free(ctx->bitmap_cache[i].key);
+    for (i = 0; i < MAX_CACHED_COLORS; i++)
+        free(ctx->color_cache[i].name);
+    for (i = 0; i < ctx->n_screens; i++) {
+        free(ctx->screens[i].pixels);
+        free(ctx->screens[i].palette);
+    }
+    free(ctx->screens);
+    free(ctx);
+}
+
+void
+XsrSetErrorHandler(XsrContext *ctx, XsrErrorProc proc, void *closure)
+{
+    ctx->error_proc = proc;
+    ctx->error_closure = closure;
+}
+
+/*
+ * XsrErrorMessage: The last message reported, or "" if there was none.
+ */
+const char *
+XsrErrorMessage(XsrContext *ctx)
+{
+    return ctx->message;
+}
+
+/*
+ * XsrSetStats: Start counting the requests sent and the replies waited on
+ *              afresh, or stop.
+ */
+void
+XsrSetStats(XsrContext *ctx, int enable)
+{
+    StatsReset(&ctx->stats);
+    ctx->stats.enabled = enable;
+}
+
+/*
+ * XsrGetStats: What was counted of one request type, by major opcode.
+ *              Returns 0 if none of it was sent or waited on.
+ */
+int
+XsrGetStats(XsrContext *ctx, int opcode, XsrRequestStats *stats)
+{
+    if (opcode < 0 || opcode > 255 ||
+        (!ctx->stats.counters[opcode].requests && !ctx->stats.counters[opcode].waits))
+        return 0;
+    stats->name = StatsOpcodeName(&ctx->stats, opcode);
+    stats->requests = ctx->stats.counters[opcode].requests;
+    stats->bytes = ctx->stats.counters[opcode].bytes;
+    stats->waits = ctx->stats.counters[opcode].waits;
+    stats->round_trips = ctx->stats.counters[opcode].round_trips;
+    stats->blocked_ns = ctx->stats.counters[opcode].blocked_ns;
+    return 1;
+}
+
+/*
+ * Report: Pass a message to the error handler, and remember the first
+ *         failure for XsrComplete().  Returns the status given.
+ */
+static XsrStatus
+Report(XsrContext *ctx, XsrStatus status, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(ctx->message, sizeof(ctx->message), fmt, ap);
+    va_end(ap);
+    ctx->reported = status;
+    if (ctx->error_proc)
+        ctx->error_proc(ctx->error_closure, status, ctx->message);
+    if (status && !ctx->status)
+        ctx->status = status;
+    return status;
+}
+
+const char *
+XsrStatusString(XsrStatus status)
+{
+    switch (status) {
+    case XSR_SUCCESS:           return "success";
+    case XSR_BAD_COMMAND:       return "bad command";
+    case XSR_BAD_SCREEN:        return "no such screen";
+    case XSR_BAD_COLOR:         return "bad color";
+    case XSR_BAD_FILE:          return "bad bitmap file";
+    case XSR_BAD_CURSOR:        return "can't make cursor";
+    case XSR_SERVER_ERROR:      return "server error";
+    case XSR_NO_CURSOR_CONTEXT: return "can't initialize xcb-cursor";
+    case XSR_NO_MEMORY:         return "out of memory";
+    }
+    return "unknown status";
+}
+
+void
+XsrInitOptions(XsrOptions *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->xcf_size = 32;
+    opts->screen = -1;
+}
+
+/*
+ * XsrParseOption: Parse the command line option at argv[*i] into opts,
+ *                 leaving *i at its last argument.  Returns 1 if it was
+ *                 one, 0 if it is not a command option, and -1 if its
+ *                 arguments are missing or bad.
+ */
+int
+XsrParseOption(XsrOptions *opts, int argc, char **argv, int *i)
+{
+    char *arg = argv[*i];
+
+    if (!strcmp("-def", arg) || !strcmp("-default", arg)) {
+        opts->restore_defaults = 1;
+        return 1;
+    }
+    if (!strcmp("-name", arg)) {
+        if (++*i>=argc) return -1;
+        opts->name = argv[*i];
+        opts->nonexcl++;
+        return 1;
+    }
+    if (!strcmp("-cursor", arg)) {
+        if (++*i>=argc) return -1;
+        opts->cursor_file = argv[*i];
+        if (++*i>=argc) return -1;
+        opts->cursor_mask = argv[*i];
+        opts->nonexcl++;
+        return 1;
+    }
+    if (!strcmp("-cursor_name", arg)) {
+        if (++*i>=argc) return -1;
+        opts->cursor_name = argv[*i];
+        opts->nonexcl++;
+        return 1;
+    }
+    if (!strcmp("-xcf", arg)) {
+        if (++*i>=argc) return -1;
+        opts->xcf = argv[*i];
+        if (++*i>=argc) return -1;
+        opts->xcf_size = atoi(argv[*i]);
+        if (opts->xcf_size <= 0)
+            opts->xcf_size = 32;
+        opts->nonexcl++;
+        return 1;
+    }
+    if (!strcmp("-fg",arg) || !strcmp("-foreground",arg)) {
+        if (++*i>=argc) return -1;
+        opts->fore_color = argv[*i];
+        return 1;
+    }
+    if (!strcmp("-bg",arg) || !strcmp("-background",arg)) {
+        if (++*i>=argc) return -1;
+        opts->back_color = argv[*i];
+        return 1;
+    }
+    if (!strcmp("-solid", arg)) {
+        if (++*i>=argc) return -1;
+        opts->solid_color = argv[*i];
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-gray", arg) || !strcmp("-grey", arg)) {
+        opts->gray = 1;
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-bitmap", arg)) {
+        if (++*i>=argc) return -1;
+        opts->bitmap_file = argv[*i];
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-image", arg)) {
+        if (++*i>=argc) return -1;
+        opts->image_file = argv[*i];
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-scale", arg)) {
+        opts->placement = XSR_PLACE_SCALE;
+        return 1;
+    }
+    if (!strcmp("-fill", arg)) {
+        opts->placement = XSR_PLACE_FILL;
+        return 1;
+    }
+    if (!strcmp("-fit", arg)) {
+        opts->placement = XSR_PLACE_FIT;
+        return 1;
+    }
+    if (!strcmp("-center", arg)) {
+        opts->placement = XSR_PLACE_CENTER;
+        return 1;
+    }
+    if (!strcmp("-filter", arg)) {
+        if (++*i>=argc) return -1;
+        if (!strcmp(argv[*i], "nearest"))
+            opts->filter = XSR_FILTER_NEAREST;
+        else if (!strcmp(argv[*i], "bilinear"))
+            opts->filter = XSR_FILTER_BILINEAR;
+        else if (!strcmp(argv[*i], "box"))
+            opts->filter = XSR_FILTER_BOX;
+        else
+            return -1;
+        return 1;
+    }
+    if (!strcmp("-pattern", arg)) {
+        PatternSpec ps;
+
+        if (++*i>=argc) return -1;
+        if (!PatternParse(argv[*i], &ps)) return -1;
+        opts->pattern = argv[*i];
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-gradient", arg)) {
+        if (++*i>=argc) return -1;
+        opts->gradient = XSR_LINEAR_GRADIENT;
+        opts->gradient_angle = atoi(argv[*i]);
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-radial", arg)) {
+        opts->gradient = XSR_RADIAL_GRADIENT;
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-dither", arg)) {
+        if (++*i>=argc) return -1;
+        if (!strcmp(argv[*i], "ordered"))
+            opts->dither = XSR_DITHER_ORDERED;
+        else if (!strcmp(argv[*i], "diffusion"))
+            opts->dither = XSR_DITHER_DIFFUSION;
+        else if (!strcmp(argv[*i], "none"))
+            opts->dither = XSR_DITHER_NONE;
+        else
+            return -1;
+        return 1;
+    }
+    if (!strcmp("-nocache", arg)) {
+        opts->no_cache = 1;
+        return 1;
+    }
+    if (!strcmp("-publish", arg)) {
+        opts->publish = 1;
+        return 1;
+    }
+    if (!strcmp("-force", arg)) {
+        opts->force = 1;
+        return 1;
+    }
+    if (!strcmp("-mod", arg)) {
+        if (++*i>=argc) return -1;
+        opts->mod_x = atoi(argv[*i]);
+        if (opts->mod_x <= 0) opts->mod_x = 1;
+        if (++*i>=argc) return -1;
+        opts->mod_y = atoi(argv[*i]);
+        if (opts->mod_y <= 0) opts->mod_y = 1;
+        opts->excl++;
+        return 1;
+    }
+    if (!strcmp("-screen", arg)) {
+        if (++*i>=argc) return -1;
+        opts->screen = atoi(argv[*i]);
+        if (opts->screen < 0) return -1;
+        return 1;
+    }
+    if (!strcmp("-allscreens", arg)) {
+        opts->all_screens = 1;
+        return 1;
+    }
+    if (!strcmp("-rv",arg) || !strcmp("-reverse",arg)) {
+        opts->reverse = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * XsrLoadFiles: Parse the bitmap files a command names ahead of time, so
+ *               that applying it to many connections parses them once.
+ *               On failure the reason is left in message.
+ */
+XsrStatus
+XsrLoadFiles(XsrOptions *opts, char *message, int len)
+{
+    struct {
+        const char *file;
+        XsrBitmapData **parsed;
+    } files[3] = {
+        { opts->bitmap_file, &opts->bitmap_data },
+        { opts->cursor_file, &opts->cursor_data },
+        { opts->cursor_mask, &opts->mask_data },
+    };
+    XsrBitmapData *d;
+    int i, status;
+
+    for (i = 0; i < 3; i++) {
+        if (!files[i].file || *files[i].parsed)
+            continue;
+        if (!(d = calloc(1, sizeof(XsrBitmapData)))) {
+            snprintf(message, len, "out of memory");
+            return XSR_NO_MEMORY;
+        }
+        status = read_bitmap_data_from_file(files[i].file, &d->data, &d->width,
+                                            &d->height, &d->x_hot, &d->y_hot);
+        if (status != BitmapSuccess) {
+            snprintf(message, len, "%s: %s", BitmapError(status), files[i].file);
+            free(d);
+            return status == BitmapNoMemory ? XSR_NO_MEMORY : XSR_BAD_FILE;
+        }
+        *files[i].parsed = d;
+    }
+    return XSR_SUCCESS;
+}
+
+void
+XsrFreeFiles(XsrOptions *opts)
+{
+    XsrBitmapData **parsed[3] = {
+        &opts->bitmap_data, &opts->cursor_data, &opts->mask_data
+    };
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (!*parsed[i])
+            continue;
+        free((*parsed[i])->data);
+        free(*parsed[i]);
+        *parsed[i] = NULL;
+    }
+}
+
+/*
+ * CopyOptions: A copy of a command with its strings, so the caller's may
+ *              change before the command is finished.  One free() frees it.
+ */
+static XsrOptions *
+CopyOptions(const XsrOptions *opts)
+{
+    XsrOptions tmp = *opts, *copy;
+    char **strings[] = {
+        &tmp.fore_color, &tmp.back_color, &tmp.name, &tmp.cursor_file,
+        &tmp.cursor_mask, &tmp.cursor_name, &tmp.solid_color, &tmp.xcf,
+        &tmp.bitmap_file, &tmp.image_file, &tmp.pattern
+    };
+    size_t i, n = sizeof(strings) / sizeof(strings[0]), size = sizeof(XsrOptions);
+    char *p;
+
+    for (i = 0; i < n; i++)
+        if (*strings[i])
+            size += strlen(*strings[i]) + 1;
+    if (!(copy = malloc(size)))
+        return NULL;
+    p = (char *)(copy + 1);
+    for (i = 0; i < n; i++) {
+        if (!*strings[i])
+            continue;
+        strcpy(p, *strings[i]);
+        *strings[i] = p;
+        p += strlen(p) + 1;
+    }
+    *copy = tmp;
+    return copy;
+}
+
+/*
+ * XsrSubmit: Start a command on the screen it names, or on every screen for
+ *            -allscreens.  The queries for all of them go out before any
+ *            answer is awaited, and nothing waits on the server here unless
+ *            the command before still does.  A command that needs no
+ *            answers is carried out at once; the rest when the next one is
+ *            submitted or XsrComplete() is called.  Returns what is already
+ *            known about how it went.
+ */
+XsrStatus
+XsrSubmit(XsrContext *ctx, const XsrOptions *opts)
+{
+    int i, waiting = 0;
+
+    FinishCommand(ctx);
+    if (opts->excl > 1)
+        return Report(ctx, XSR_BAD_COMMAND,
+                      "choose only one of {solid, gray, bitmap, mod, image, pattern, gradient, radial}");
+    if (opts->all_screens) {
+        ctx->first = 0;
+        ctx->last = ctx->n_screens - 1;
+    }
+    else {
+        ctx->first = ctx->last = (opts->screen >= 0) ? opts->screen : ctx->screen_nbr;
+        if (ctx->first >= ctx->n_screens)
+            return Report(ctx, XSR_BAD_SCREEN, "no screen %d on this display",
+                          ctx->first);
+    }
+    if (opts->cursor_name && CursorNameToIndex(opts->cursor_name) == -1)
+        return Report(ctx, XSR_BAD_CURSOR, "Error creating cursor");
+    if (!(ctx->cmd = CopyOptions(opts)))
+        return Report(ctx, XSR_NO_MEMORY, "out of memory");
+
+    for (i = ctx->first; i <= ctx->last; i++) {
+        SelectScreen(ctx, i);
+        ApplyStart(ctx);
+        waiting |= (ctx->cur->fg_slot.pending || ctx->cur->bg_slot.pending ||
+                    ctx->cur->solid_slot.pending || ctx->cur->applied_pending ||
+                    ctx->root_atoms_pending);
+    }
+    if (!waiting)
+        return FinishCommand(ctx);
+    xcb_flush(ctx->dpy);
+    return XSR_SUCCESS;
+}
+
+/*
+ * FinishCommand: Carry out the submitted command, if any, on each of its
+ *                screens.  Returns the first failure.
+ */
+static XsrStatus
+FinishCommand(XsrContext *ctx)
+{
+    XsrStatus s, status = XSR_SUCCESS;
+    int i;
+
+    if (!ctx->cmd)
+        return XSR_SUCCESS;
+    /* a first command could only ask for the atoms; now for the roots' records */
+    CollectRootAtoms(ctx);
+    for (i = ctx->first; i <= ctx->last; i++) {
+        SelectScreen(ctx, i);
+        RequestApplied(ctx);
+    }
+    for (i = ctx->first; i <= ctx->last; i++) {
+        SelectScreen(ctx, i);
+        s = ApplyFinish(ctx);
+        if (s && !status)
+            status = s;
+    }
+    free(ctx->cmd);
+    ctx->cmd = NULL;
+    return status;
+}
+
+/*
+ * XsrComplete: Finish the commands submitted since the last call: flush
+ *              them, do the _XSETROOT_ID, _XROOTPMAP_ID and
+ *              _XSETROOT_XCB_APPLIED bookkeeping and collect their deferred
+ *              errors.  Returns the first failure among them.
+ */
+XsrStatus
+XsrComplete(XsrContext *ctx)
+{
+    XsrStatus status;
+    int i;
+
+    FinishCommand(ctx);
+    xcb_flush(ctx->dpy);
+    FixupState(ctx);
+    PublishRoots(ctx);
+    for (i = 0; i < ctx->n_screens; i++)
+        ctx->screens[i].unsave_past = 0;
+    /* what failed must not be recorded as shown */
+    CheckDeferred(ctx);
+    RecordApplied(ctx);
+    /* a warm context keeps the cursor font for the next command */
+    if (ctx->cursor_fid && !ctx->keep_warm) {
+        StatsRequest(&ctx->stats, XCB_CLOSE_FONT, 8,
+                     xcb_close_font(ctx->dpy, ctx->cursor_fid).sequence);
+        ctx->cursor_fid = XCB_NONE;
+    }
+    /* the bookkeeping must not wait for a next command, which may not come */
+    xcb_flush(ctx->dpy);
+    status = ctx->status;
+    ctx->status = XSR_SUCCESS;
+    return status;
+}
+
+/*
+ * ApplyStart: Send the queries the submitted command needs answered on the
+ *             current screen.
+ */
+static void
+ApplyStart(XsrContext *ctx)
+{
+    XsrOptions *opts = ctx->cmd;
+    ScreenState *cur = ctx->cur;
+    xcb_screen_t *screen = ctx->screen;
+    char *fore_color = opts->fore_color;
+    char *back_color = opts->back_color;
+
+    /* Handle '-reverse' early to do it only once. */
+    if (opts->reverse) {
+        if (fore_color) {
+            char *temp = fore_color;
+            fore_color = back_color;
+            back_color = temp;
+        }
+        ctx->fg_pixel = screen->white_pixel;
+        ctx->bg_pixel = screen->black_pixel;
+    }
+    else
+    {
+        ctx->fg_pixel = screen->black_pixel;
+        ctx->bg_pixel = screen->white_pixel;
+    }
+
+    /*
+     * Send every query the run depends on before waiting for any of them,
+     * so that setup costs one round trip however many options are given.
+     */
+    memset(&cur->fg_slot, 0, sizeof(ColorSlot));
+    memset(&cur->bg_slot, 0, sizeof(ColorSlot));
+    memset(&cur->solid_slot, 0, sizeof(ColorSlot));
+    cur->fg_slot.name = fore_color;
+    cur->fg_slot.pixel = ctx->fg_pixel;
+    cur->bg_slot.name = back_color;
+    cur->bg_slot.pixel = ctx->bg_pixel;
+    cur->fg_slot.want_pixel = cur->bg_slot.want_pixel =
+        (opts->gray || opts->bitmap_file || opts->mod_x);
+    /* what an image placed with -fit or -center leaves bare is -bg */
+    cur->bg_slot.want_pixel |= (opts->image_file && opts->placement != XSR_PLACE_TILE);
+    cur->fg_slot.want_rgb = cur->bg_slot.want_rgb =
+        (opts->cursor_file || opts->cursor_name || opts->pattern || opts->gradient);
+    RequestColor(ctx, &cur->fg_slot);
+    RequestColor(ctx, &cur->bg_slot);
+    if (opts->solid_color) {
+        cur->solid_slot.name = opts->solid_color;
+        cur->solid_slot.pixel = screen->black_pixel;
+        cur->solid_slot.want_pixel = 1;
+        RequestColor(ctx, &cur->solid_slot);
+    }
+    if ((ctx->visual->_class & Dynamic) && !ctx->state_atom && !ctx->state_atom_pending) {
+        ctx->state_atom_c = xcb_intern_atom_unchecked(ctx->dpy, 0, strlen("_XSETROOT_ID"),
+                                                      "_XSETROOT_ID");
+        StatsRequest(&ctx->stats, XCB_INTERN_ATOM, 8 + STATS_PAD(strlen("_XSETROOT_ID")),
+                     ctx->state_atom_c.sequence);
+        ctx->state_atom_pending = 1;
+    }
+    /* and what the root already shows */
+    InternRootAtoms(ctx);
+    RequestApplied(ctx);
+    /* whether images can go through MIT-SHM is asked meanwhile, too */
+    if ((opts->bitmap_file || opts->cursor_file || opts->image_file || opts->pattern ||
+         opts->gradient) && ctx->shm == SHM_UNKNOWN)
+        xcb_prefetch_extension_data(ctx->dpy, &xcb_shm_id);
+    /* and whether the server can draw gradients itself */
+    if (opts->gradient && ctx->render == RENDER_UNKNOWN)
+        xcb_prefetch_extension_data(ctx->dpy, &xcb_render_id);
+}
+
+/*
+ * ApplyFinish: Collect the answers ApplyStart() asked for and make the
+ *              change on the current screen.  Returns the status.
+ */
+static XsrStatus
+ApplyFinish(XsrContext *ctx)
+{
+    XsrOptions *opts = ctx->cmd;
+    ScreenState *cur = ctx->cur;
+    int restore_defaults = opts->restore_defaults;
+    char key[CACHE_KEY_MAX];
+    xcb_cursor_t cursor;
+    uint16_t ww, hh;
+    xcb_pixmap_t bitmap = XCB_NONE, image = XCB_NONE;
+    Placement place;
+    PatternSpec ps;
+    Plan plan;
+    XsrOptions unchanged;
+    uint64_t want[N_APPLIED];
+    int cursor_index = -1, reset_back, reset_cursor, touched, skipped = 0, i;
+    XsrStatus status = XSR_SUCCESS;
+
+    memset(&plan, 0, sizeof(plan));
+    memset(&place, 0, sizeof(place));
+    plan.window = ctx->root;
+
+    /* If there are no arguments then restore defaults. */
+    if (!opts->excl && !opts->nonexcl)
+        restore_defaults = 1;
+    reset_cursor = restore_defaults;
+    reset_back = restore_defaults && !opts->excl;
+    if (opts->cursor_name)
+        cursor_index = CursorNameToIndex(opts->cursor_name);
+
+    /* Leave out every part of the command the root already shows. */
+    CollectApplied(ctx);
+    touched = AppliedHashes(ctx, opts, reset_back, reset_cursor, want);
+    if (!opts->force && cur->applied_known) {
+        unchanged = *opts;
+        if ((touched & 1 << APPLIED_BACK) && want[APPLIED_BACK] &&
+            want[APPLIED_BACK] == cur->applied[APPLIED_BACK]) {
+            unchanged.solid_color = unchanged.bitmap_file = NULL;
+            unchanged.image_file = unchanged.pattern = NULL;
+            unchanged.gray = unchanged.gradient = unchanged.mod_x = 0;
+            unchanged.excl = 0;
+            reset_back = 0;
+            skipped = 1;
+        }
+        if ((touched & 1 << APPLIED_CURSOR) && want[APPLIED_CURSOR] &&
+            want[APPLIED_CURSOR] == cur->applied[APPLIED_CURSOR]) {
+            unchanged.cursor_file = unchanged.cursor_name = unchanged.xcf = NULL;
+            reset_cursor = 0;
+            skipped = 1;
+        }
+        if ((touched & 1 << APPLIED_NAME) && want[APPLIED_NAME] &&
+            want[APPLIED_NAME] == cur->applied[APPLIED_NAME]) {
+            unchanged.name = NULL;
+            skipped = 1;
+        }
+        opts = &unchanged;
+    }
+
+    /* Bitmaps and images need no colors, so read and upload them meanwhile. */
+    if (opts->bitmap_file) {
+        FileKey(ctx, key, sizeof(key), "bitmap", opts->bitmap_file);
+        if (!(bitmap = CachedBitmap(ctx, key, &ww, &hh))) {
+            bitmap = ReadBitmapFile(ctx, opts->bitmap_file, opts->bitmap_data,
+                                    &ww, &hh, (int16_t *)NULL, (int16_t *)NULL);
+            if (!bitmap) {
+                status = XSR_BAD_FILE;
+                goto fail;
+            }
+            CacheBitmap(ctx, key, bitmap, ww, hh);
+        }
+    }
+    if (opts->image_file &&
+        !(image = ReadImageFile(ctx, opts->image_file, &place)) && !place.solid) {
+        status = XSR_BAD_FILE;
+        goto fail;
+    }
+
+    if (skipped && !opts->excl && !opts->cursor_file && !opts->cursor_name) {
+        /* nothing left needs them */
+        DiscardColor(ctx, &cur->fg_slot);
+        DiscardColor(ctx, &cur->bg_slot);
+        DiscardColor(ctx, &cur->solid_slot);
+    }
+    else if (!CollectColor(ctx, &cur->fg_slot) | !CollectColor(ctx, &cur->bg_slot) |
+             (opts->solid_color && !CollectColor(ctx, &cur->solid_slot))) {
+        status = XSR_BAD_COLOR;
+        goto fail;
+    }
+    ctx->fg_pixel = cur->fg_slot.pixel;
+    ctx->bg_pixel = cur->bg_slot.pixel;
+
+    /* Handle a cursor file */
+    if (opts->cursor_file) {
+        cursor = CreateCursorFromFiles(ctx, opts->cursor_file, opts->cursor_mask);
+        if (!cursor) {
+            status = XSR_BAD_CURSOR;
+            goto fail;
+        }
+        PlanCursor(ctx, &plan, cursor, 1);
+    }
+
+    if (opts->cursor_name)
+        PlanCursor(ctx, &plan, CreateCursorFromName(ctx, cursor_index), 1);
+    /* XXX xcb-cursor */
+    if (opts->xcf) {
+        xcb_cursor_context_t *cctx;
+
+        if (xcb_cursor_context_new(ctx->dpy, ctx->screen, &cctx) < 0) {
+            status = Report(ctx, XSR_NO_CURSOR_CONTEXT, "Error initializing xcb-cursor");
+            goto fail;
+        }
+        cursor = xcb_cursor_load_cursor(cctx, opts->xcf);
+        xcb_cursor_context_free(cctx);
+        if (cursor)
+            PlanCursor(ctx, &plan, cursor, 1);
+        else {
+            status = Report(ctx, XSR_BAD_CURSOR, "Error creating cursor");
+            goto fail;
+        }
+    }
+/*
+    if (xcf) {
+        XcursorImages *images = XcursorFilenameLoadImages(xcf, xcf_size);
+        if (!images) {
+            fprintf(stderr, "Invalid cursor file \"%s\"\n", xcf);
+        } else {
+            cursor = XcursorImagesLoadCursor(dpy, images);
+            if (cursor)
+            {
+                xcb_change_window_attributes(dpy, root, XCB_CW_CURSOR, &cursor);
+                xcb_free_cursor(dpy, cursor);
+            }
+        }
+    }
+*/
+    /* Handle -gray and -grey options */
+    if (opts->gray) {
+        if (!(bitmap = CachedBitmap(ctx, "gray", &ww, &hh))) {
+            bitmap = UploadBitmap(ctx, (uint8_t *)gray_bits, gray_width, gray_height);
+            CacheBitmap(ctx, "gray", bitmap, gray_width, gray_height);
+        }
+        SetBackgroundToBitmap(ctx, &plan, bitmap, gray_width, gray_height);
+    }
+
+    /* Handle -solid option; a published background must be a pixmap */
+    if (opts->solid_color && opts->publish)
+        SetBackgroundToPixmap(ctx, &plan, SolidPixmap(ctx, cur->solid_slot.pixel));
+    else if (opts->solid_color)
+        PlanBackPixel(ctx, &plan, cur->solid_slot.pixel);
+
+    /* Handle -bitmap option */
+    if (opts->bitmap_file)
+        SetBackgroundToBitmap(ctx, &plan, bitmap, ww, hh);
+
+    /* Handle -image option, on the background color if it leaves any bare */
+    if (opts->image_file && place.solid && opts->publish)
+        SetBackgroundToPixmap(ctx, &plan, SolidPixmap(ctx, place.pixel));
+    else if (opts->image_file && place.solid)
+        PlanBackPixel(ctx, &plan, place.pixel);
+    else if (opts->image_file) {
+        if (opts->placement != XSR_PLACE_TILE)
+            image = PadImage(ctx, image, &place);
+        SetBackgroundToPixmap(ctx, &plan, image);
+        image = XCB_NONE;
+    }
+
+    /* Handle -pattern option */
+    if (opts->pattern) {
+        if (!PatternParse(opts->pattern, &ps)) {
+            status = Report(ctx, XSR_BAD_COMMAND, "bad pattern \"%s\"", opts->pattern);
+            goto fail;
+        }
+        if ((status = MakePattern(ctx, &ps, &image)))
+            goto fail;
+        SetBackgroundToPixmap(ctx, &plan, image);
+        image = XCB_NONE;
+    }
+
+    /* Handle -gradient and -radial options */
+    if (opts->gradient) {
+        if ((status = MakeGradient(ctx, opts->gradient, opts->gradient_angle, &image)))
+            goto fail;
+        SetBackgroundToPixmap(ctx, &plan, image);
+        image = XCB_NONE;
+    }
+
+    /* Handle set background to a modula pattern */
+    if (opts->mod_x) {
+        bitmap = MakeModulaBitmap(ctx, opts->mod_x, opts->mod_y);
+        SetBackgroundToBitmap(ctx, &plan, bitmap, 16, 16);
+    }
+
+    /* Handle set name */
+    plan.name = opts->name;
+
+    /* Handle restore defaults: reset whatever was not set above. */
+    if (reset_cursor && !(plan.mask & XCB_CW_CURSOR))
+        PlanCursor(ctx, &plan, XCB_NONE, 0);
+    if (reset_back)
+        PlanBackPixmap(ctx, &plan, XCB_NONE, 0);
+
+    CommitPlan(ctx, &plan);
+    for (i = 0; i < N_APPLIED; i++) {
+        if ((touched & 1 << i) && cur->applied[i] != want[i]) {
+            cur->applied[i] = want[i];
+            cur->applied_dirty = 1;
+        }
+    }
+    return XSR_SUCCESS;
+
+fail:
+    /* Drop whatever the failed command still has outstanding. */
+    DiscardColor(ctx, &cur->fg_slot);
+    DiscardColor(ctx, &cur->bg_slot);
+    DiscardColor(ctx, &cur->solid_slot);
+    if (bitmap && !CacheHoldsBitmap(ctx, bitmap))
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(ctx->dpy, bitmap).sequence);
+    if (image)
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(ctx->dpy, image).sequence);
+    if ((plan.mask & XCB_CW_CURSOR) && plan.own_cursor && plan.cursor)
+        StatsRequest(&ctx->stats, XCB_FREE_CURSOR, 8,
+                     xcb_free_cursor(ctx->dpy, plan.cursor).sequence);
+    return status;
+}
+
+/*
+ * SelectScreen: Make screen n the one commands work on.
+ */
+static void
+SelectScreen(XsrContext *ctx, int n)
+{
+    ctx->cur = &ctx->screens[n];
+    ctx->screen = ctx->cur->screen;
+    ctx->root = ctx->screen->root;
+    ctx->visual = ctx->cur->visual;
+}
+
+/*
+ * Free past incarnation if needed, and retain state if needed, on every
+ * screen.  The roots' properties are all asked for before any answer is
+ * awaited.
+ */
+static void
+FixupState(XsrContext *ctx)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_intern_atom_reply_t *ia_r;
+    xcb_get_property_reply_t *gp_r;
+    xcb_atom_t prop;
+    xcb_pixmap_t owner;
+    const xcb_setup_t *setup = xcb_get_setup(dpy);
+    ScreenState *s;
+    uint64_t t;
+    int i, busy = 0;
+
+    for (i = 0; i < ctx->n_screens; i++) {
+        s = &ctx->screens[i];
+        if (!(s->visual->_class & Dynamic))
+            s->unsave_past = 0;
+        busy |= s->unsave_past || s->save_colors;
+    }
+    if (ctx->state_atom_pending) {
+        /* Sent up front with the color queries; pick it up even if unused. */
+        t = StatsNow(&ctx->stats);
+        ia_r = xcb_intern_atom_reply(dpy, ctx->state_atom_c, NULL);
+        StatsWait(&ctx->stats, XCB_INTERN_ATOM, ctx->state_atom_c.sequence, t);
+        ctx->state_atom_pending = 0;
+        if (ia_r)
+            ctx->state_atom = ia_r->atom;
+        free(ia_r);
+    }
+    if (!busy)
+        return;
+    if (!ctx->state_atom) {
+        Report(ctx, XSR_SUCCESS, "error: failed to intern _XSETROOT_ID property atom");
+        return;
+    }
+    prop = ctx->state_atom;
+
+    /*
+     * Once the property names our own pixmap there is no need to look
+     * again: whoever replaced it would have killed us first.
+     */
+    for (i = 0; i < ctx->n_screens; i++) {
+        s = &ctx->screens[i];
+        if (!s->unsave_past || s->state_is_ours)
+            continue;
+        s->state_c = xcb_get_property_unchecked(dpy, 0, s->screen->root, prop,
+                                                XCB_ATOM_ANY, 0, 1L);
+        StatsRequest(&ctx->stats, XCB_GET_PROPERTY, 24, s->state_c.sequence);
+        s->state_pending = 1;
+    }
+    for (i = 0; i < ctx->n_screens; i++) {
+        s = &ctx->screens[i];
+        if (!s->state_pending)
+            continue;
+        s->state_pending = 0;
+        t = StatsNow(&ctx->stats);
+        gp_r = xcb_get_property_reply(dpy, s->state_c, NULL);
+        StatsWait(&ctx->stats, XCB_GET_PROPERTY, s->state_c.sequence, t);
+        if (!gp_r || gp_r->type == XCB_NONE) {
+            /* nobody kept colors here */
+        }
+        else if ((gp_r->type != XCB_ATOM_PIXMAP) || (gp_r->format != 32) ||
+                 (gp_r->length != 1) || (gp_r->bytes_after != 0)) {
+            Report(ctx, XSR_SUCCESS, "warning: _XSETROOT_ID property is garbage");
+        }
+        else {
+            owner = *((xcb_pixmap_t *)xcb_get_property_value(gp_r));
+            /* a warm context finds its own pixmap there on later commands */
+            if ((owner & ~setup->resource_id_mask) != setup->resource_id_base) {
+                StatsRequest(&ctx->stats, XCB_KILL_CLIENT, 8, xcb_kill_client(dpy, owner).sequence);
+                s->killed = owner;
+            }
+            else
+                s->state_is_ours = 1;
+        }
+        free(gp_r);
+    }
+    for (i = 0; i < ctx->n_screens; i++) {
+        s = &ctx->screens[i];
+        if (!s->save_colors || s->state_is_ours)
+            continue;
+        if (!s->save_pixmap) {
+            s->save_pixmap = xcb_generate_id(dpy);
+            StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16,
+                         xcb_create_pixmap(dpy, s->screen->root_depth, s->save_pixmap,
+                                           s->screen->root, 1, 1).sequence);
+        }
+        StatsRequest(&ctx->stats, XCB_CHANGE_PROPERTY, 28,
+                     xcb_change_property(dpy, XCB_PROP_MODE_REPLACE, s->screen->root,
+                                         prop, XCB_ATOM_PIXMAP, 32, 1,
+                                         (void *)&s->save_pixmap).sequence);
+        StatsRequest(&ctx->stats, XCB_SET_CLOSE_DOWN_MODE, 4,
+                     xcb_set_close_down_mode(dpy, XCB_CLOSE_DOWN_RETAIN_PERMANENT).sequence);
+        s->state_is_ours = 1;
+    }
+}
+
+/*
+ * PublishRoots: Name the background of every root changed under -publish
+ *               in _XROOTPMAP_ID and ESETROOT_PMAP_ID, as Esetroot does,
+ *               for compositing managers and transparent terminals to use
+ *               as it is.  The pixmap must outlive us, so the connection's
+ *               resources are retained.  The previous setter's pixmap,
+ *               named by both, is freed by killing the client that kept
+ *               it, or by freeing it if it is ours.  A root changed without
+ *               -publish keeps the properties, unless they name a pixmap
+ *               of ours, which goes with them.
+ */
+static void
+PublishRoots(XsrContext *ctx)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    const xcb_setup_t *setup = xcb_get_setup(dpy);
+    uint32_t client = ~setup->resource_id_mask;
+    xcb_atom_t *atoms = ctx->root_atoms;
+    xcb_get_property_reply_t *gp_r;
+    xcb_pixmap_t old[2];
+    ScreenState *s;
+    uint64_t t;
+    int i, j, retain = 0;
+
+    CollectRootAtoms(ctx);
+
+    /* what an earlier setter left is asked for on every root at once */
+    for (i = 0; i < ctx->n_screens; i++) {
+        s = &ctx->screens[i];
+        if (!s->pmap_changed || (!s->pmap_publish && !s->pmap))
+            continue;
+        if (!atoms[ATOM_XROOTPMAP_ID] || !atoms[ATOM_ESETROOT_PMAP_ID]) {
+            Report(ctx, XSR_SUCCESS, "error: failed to intern _XROOTPMAP_ID property atoms");
+            s->pmap_changed = 0;
+            continue;
+        }
+        if (s->pmap)
+            continue;
+        for (j = 0; j < 2; j++) {
+            s->pmap_c[j] = xcb_get_property_unchecked(dpy, 0, s->screen->root,
+                                                      atoms[j], XCB_ATOM_PIXMAP,
+                                                      0, 1L);
+            StatsRequest(&ctx->stats, XCB_GET_PROPERTY, 24, s->pmap_c[j].sequence);
+        }
+        s->pmap_pending = 1;
+    }
+
+    for (i = 0; i < ctx->n_screens; i++) {
+        s = &ctx->screens[i];
+        if (!s->pmap_changed || (!s->pmap_publish && !s->pmap)) {
+            s->pmap_changed = 0;
+            s->killed = XCB_NONE;
+            continue;
+        }
+        if (s->pmap_pending) {
+            t = StatsNow(&ctx->stats);
+            for (j = 0; j < 2; j++) {
+                gp_r = xcb_get_property_reply(dpy, s->pmap_c[j], NULL);
+                old[j] = XCB_NONE;
+                if (gp_r && gp_r->type == XCB_ATOM_PIXMAP && gp_r->format == 32 &&
+                    gp_r->length == 1)
+                    old[j] = *((xcb_pixmap_t *)xcb_get_property_value(gp_r));
+                free(gp_r);
+            }
+            StatsWait(&ctx->stats, XCB_GET_PROPERTY, s->pmap_c[1].sequence, t);
+            s->pmap_pending = 0;
+            /* only a pixmap both name was retained for them */
+            if (old[0] && old[0] == old[1] && (old[0] & client) != setup->resource_id_base &&
+                (!s->killed || (s->killed & client) != (old[0] & client)))
+                StatsRequest(&ctx->stats, XCB_KILL_CLIENT, 8,
+                             xcb_kill_client(dpy, old[0]).sequence);
+        }
+        else if (s->pmap != s->pmap_new && s->pmap != s->save_pixmap)
+            StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, s->pmap).sequence);
+
+        for (j = 0; j < 2; j++) {
+            if (s->pmap_new)
+                StatsRequest(&ctx->stats, XCB_CHANGE_PROPERTY, 28,
+                             xcb_change_property(dpy, XCB_PROP_MODE_REPLACE, s->screen->root,
+                                                 atoms[j], XCB_ATOM_PIXMAP, 32, 1,
+                                                 &s->pmap_new).sequence);
+            else
+                StatsRequest(&ctx->stats, XCB_DELETE_PROPERTY, 12,
+                             xcb_delete_property(dpy, s->screen->root,
+                                                 atoms[j]).sequence);
+        }
+        retain |= s->pmap_new != XCB_NONE;
+        s->pmap = s->applied_pmap = s->pmap_new;
+        s->applied_dirty = 1;
+        s->pmap_new = XCB_NONE;
+        s->pmap_changed = 0;
+        s->killed = XCB_NONE;
+    }
+    if (retain)
+        StatsRequest(&ctx->stats, XCB_SET_CLOSE_DOWN_MODE, 4,
+                     xcb_set_close_down_mode(dpy, XCB_CLOSE_DOWN_RETAIN_PERMANENT).sequence);
+}
+
+/*
+ * InternRootAtoms: Ask for the atoms of the root properties kept here, if
+ *                  no command has yet.
+ */
+static void
+InternRootAtoms(XsrContext *ctx)
+{
+    int i;
+
+    if (ctx->root_atoms[ATOM_APPLIED] || ctx->root_atoms_pending)
+        return;
+    for (i = 0; i < N_ROOT_ATOMS; i++) {
+        ctx->root_atoms_c[i] = xcb_intern_atom_unchecked(ctx->dpy, 0, strlen(root_atom_names[i]),
+                                                         root_atom_names[i]);
+        StatsRequest(&ctx->stats, XCB_INTERN_ATOM, 8 + STATS_PAD(strlen(root_atom_names[i])),
+                     ctx->root_atoms_c[i].sequence);
+    }
+    ctx->root_atoms_pending = 1;
+}
+
+/*
+ * CollectRootAtoms: Wait for the atoms InternRootAtoms() asked for; any
+ *                   the server didn't give are left None.
+ */
+static void
+CollectRootAtoms(XsrContext *ctx)
+{
+    xcb_intern_atom_reply_t *ia_r;
+    uint64_t t;
+    int i;
+
+    if (!ctx->root_atoms_pending)
+        return;
+    t = StatsNow(&ctx->stats);
+    for (i = 0; i < N_ROOT_ATOMS; i++) {
+        ia_r = xcb_intern_atom_reply(ctx->dpy, ctx->root_atoms_c[i], NULL);
+        ctx->root_atoms[i] = ia_r ? ia_r->atom : XCB_NONE;
+        free(ia_r);
+    }
+    StatsWait(&ctx->stats, XCB_INTERN_ATOM, ctx->root_atoms_c[N_ROOT_ATOMS - 1].sequence, t);
+    ctx->root_atoms_pending = 0;
+}
+
+/*
+ * RequestApplied: Ask for the current root's _XSETROOT_XCB_APPLIED,
+ *                 _XROOTPMAP_ID and WM_NAME, unless known since the last
+ *                 XsrComplete() or the atoms aren't in yet.
+ */
+static void
+RequestApplied(XsrContext *ctx)
+{
+    ScreenState *cur = ctx->cur;
+    xcb_atom_t props[3] = {
+        ctx->root_atoms[ATOM_APPLIED], ctx->root_atoms[ATOM_XROOTPMAP_ID], XCB_ATOM_WM_NAME
+    };
+    uint32_t lengths[3] = { APPLIED_WORDS, 1, APPLIED_NAME_MAX / 4 };
+    int i;
+
+    if (cur->applied_known || cur->applied_pending || !props[0] || !props[1])
+        return;
+    for (i = 0; i < 3; i++) {
+        cur->applied_c[i] = xcb_get_property_unchecked(ctx->dpy, 0, ctx->root, props[i],
+                                                       XCB_ATOM_ANY, 0, lengths[i]);
+        StatsRequest(&ctx->stats, XCB_GET_PROPERTY, 24, cur->applied_c[i].sequence);
+    }
+    cur->applied_pending = 1;
+}
+
+/*
+ * CollectApplied: Wait for what RequestApplied() asked for and take the
+ *                 hashes in.  The background's is dropped if _XROOTPMAP_ID
+ *                 has changed since it was recorded, the name's if WM_NAME
+ *                 is not the name it was made from.
+ */
+static void
+CollectApplied(XsrContext *ctx)
+{
+    ScreenState *cur = ctx->cur;
+    xcb_get_property_reply_t *gp_r[3];
+    xcb_pixmap_t pmap = XCB_NONE;
+    char name[APPLIED_NAME_MAX + 1];
+    const char *name_strings[] = { "name", NULL };
+    uint32_t *words;
+    uint64_t t;
+    int i, len;
+
+    if (!cur->applied_pending)
+        return;
+    cur->applied_pending = 0;
+    t = StatsNow(&ctx->stats);
+    for (i = 0; i < 3; i++)
+        gp_r[i] = xcb_get_property_reply(ctx->dpy, cur->applied_c[i], NULL);
+    StatsWait(&ctx->stats, XCB_GET_PROPERTY, cur->applied_c[2].sequence, t);
+    if (gp_r[0] && gp_r[1] && gp_r[2]) {
+        memset(cur->applied, 0, sizeof(cur->applied));
+        cur->applied_pmap = XCB_NONE;
+        if (gp_r[0]->type == XCB_ATOM_CARDINAL && gp_r[0]->format == 32 &&
+            gp_r[0]->length == APPLIED_WORDS) {
+            words = xcb_get_property_value(gp_r[0]);
+            for (i = 0; i < N_APPLIED; i++)
+                cur->applied[i] = words[2 * i] | (uint64_t)words[2 * i + 1] << 32;
+            cur->applied_pmap = words[2 * N_APPLIED];
+        }
+        if (gp_r[1]->type == XCB_ATOM_PIXMAP && gp_r[1]->format == 32 && gp_r[1]->length == 1)
+            pmap = *((xcb_pixmap_t *)xcb_get_property_value(gp_r[1]));
+        /* another program has set the background since */
+        if (pmap != cur->applied_pmap)
+            cur->applied[APPLIED_BACK] = 0;
+        cur->applied_pmap = pmap;
+        /* or renamed the root, hashed as AppliedHashes() does */
+        if (gp_r[2]->type == XCB_ATOM_STRING && gp_r[2]->format == 8 && !gp_r[2]->bytes_after) {
+            len = xcb_get_property_value_length(gp_r[2]);
+            memcpy(name, xcb_get_property_value(gp_r[2]), len);
+            name[len] = '\0';
+            name_strings[1] = name;
+        }
+        if (HashParts(NULL, name_strings, 2, NULL, 0, NULL, 0) != cur->applied[APPLIED_NAME])
+            cur->applied[APPLIED_NAME] = 0;
+        cur->applied_known = 1;
+    }
+    for (i = 0; i < 3; i++)
+        free(gp_r[i]);
+}
+
+/*
+ * AppliedHashes: Hash what each part of the current root would be made
+ *                from under a command, into want[APPLIED_*].  Returns a
+ *                bit for each part the command sets; one whose files can't
+ *                be read hashes to 0, which matches nothing.
+ */
+static int
+AppliedHashes(XsrContext *ctx, const XsrOptions *opts, int reset_back, int reset_cursor,
+              uint64_t *want)
+{
+    const char *dir = (ctx->disk_cache && !opts->no_cache) ? ctx->cache_dir : NULL;
+    const char *fg = ctx->cur->fg_slot.name, *bg = ctx->cur->bg_slot.name;
+    const char *back_strings[] = { "back", opts->solid_color, opts->pattern, fg, bg };
+    const char *back_files[] = { opts->bitmap_file, opts->image_file };
+    int32_t back_numbers[] = {
+        opts->reverse, opts->gray, opts->placement, opts->filter, opts->gradient,
+        opts->gradient_angle, opts->dither, opts->publish, opts->mod_x, opts->mod_y,
+        ctx->screen->width_in_pixels, ctx->screen->height_in_pixels
+    };
+    const char *cursor_strings[] = { "cursor", opts->cursor_name, opts->xcf, fg, bg };
+    const char *cursor_files[] = { opts->cursor_file, opts->cursor_mask };
+    int32_t cursor_numbers[] = { opts->reverse, opts->xcf_size };
+    const char *name_strings[] = { "name", opts->name };
+    int touched = 0;
+
+    memset(want, 0, N_APPLIED * sizeof(uint64_t));
+    if (opts->excl || reset_back) {
+        want[APPLIED_BACK] = HashParts(dir, back_strings, 5, back_numbers, 12, back_files, 2);
+        touched |= 1 << APPLIED_BACK;
+    }
+    if (opts->cursor_file || opts->cursor_name || opts->xcf || reset_cursor) {
+        want[APPLIED_CURSOR] = HashParts(dir, cursor_strings, 5, cursor_numbers, 2,
+                                         cursor_files, 2);
+        touched |= 1 << APPLIED_CURSOR;
+    }
+    if (opts->name) {
+        want[APPLIED_NAME] = HashParts(dir, name_strings, 2, NULL, 0, NULL, 0);
+        touched |= 1 << APPLIED_NAME;
+    }
+    return touched;
+}
+
+/*
+ * HashParts: Hash strings, a missing one told apart from an empty one,
+ *            numbers and the contents of files, those remembered in dir
+ *            unless it is NULL.  Never 0, unless a file can't be read.
+ */
+static uint64_t
+HashParts(const char *dir, const char *const *strings, int n_strings,
+          const int32_t *numbers, int n_numbers, const char *const *files, int n_files)
+{
+    DiskCacheKey key;
+    uint64_t h = 0;
+    int i;
+
+    for (i = 0; i < n_strings; i++)
+        h = DiskCacheHash(strings[i] ? strings[i] : "", strings[i] ? strlen(strings[i]) + 1 : 0,
+                          h + i);
+    h = DiskCacheHash(numbers, n_numbers * sizeof(int32_t), h);
+    for (i = 0; i < n_files; i++) {
+        DiskCacheKeyInit(&key, "file");
+        if (files[i] && !DiskCacheKeyFile(dir, &key, files[i]))
+            return 0;
+        h = DiskCacheHash(key.data, key.len, h);
+    }
+    return h ? h : 1;
+}
+
+/*
+ * RecordApplied: Write back _XSETROOT_XCB_APPLIED on every root whose
+ *                record changed, and forget them all: the next command
+ *                reads them again, as other programs may have been at the
+ *                roots in between.  Where a cursor failed, so did the
+ *                ChangeWindowAttributes it went with, and the root shows
+ *                neither its background nor its cursor for sure.
+ */
+static void
+RecordApplied(XsrContext *ctx)
+{
+    uint32_t words[APPLIED_WORDS];
+    ScreenState *s;
+    int i, j;
+
+    for (i = 0; i < ctx->n_screens; i++) {
+        s = &ctx->screens[i];
+        if (s->applied_failed) {
+            s->applied[APPLIED_BACK] = s->applied[APPLIED_CURSOR] = 0;
+            s->applied_dirty = 1;
+        }
+        if (s->applied_dirty && ctx->root_atoms[ATOM_APPLIED]) {
+            for (j = 0; j < N_APPLIED; j++) {
+                words[2 * j] = (uint32_t)s->applied[j];
+                words[2 * j + 1] = (uint32_t)(s->applied[j] >> 32);
+            }
+            words[2 * N_APPLIED] = s->applied_pmap;
+            StatsRequest(&ctx->stats, XCB_CHANGE_PROPERTY, 24 + 4 * APPLIED_WORDS,
+                         xcb_change_property(ctx->dpy, XCB_PROP_MODE_REPLACE,
+                                             s->screen->root, ctx->root_atoms[ATOM_APPLIED],
+                                             XCB_ATOM_CARDINAL, 32, APPLIED_WORDS,
+                                             words).sequence);
+        }
+        s->applied_dirty = s->applied_failed = 0;
+        s->applied_known = 0;
+    }
+}
+
+/*
+ * SetBackgroundToBitmap: Set the root window background to a caller supplied
+ *                        bitmap.
+ */
+static void
+SetBackgroundToBitmap(XsrContext *ctx, Plan *plan, xcb_pixmap_t bitmap,
+                      uint16_t width, uint16_t height)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_pixmap_t pix;
+    xcb_gcontext_t gc;
+    uint32_t params[2];
+
+    params[0] = ctx->fg_pixel;
+    params[1] = ctx->bg_pixel;
+    gc = xcb_generate_id(dpy);
+    StatsRequest(&ctx->stats, XCB_CREATE_GC, 24,
+                 xcb_create_gc(dpy, gc, ctx->root, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND,
+                               params).sequence);
+    pix = xcb_generate_id(dpy);
+    StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16,
+                 xcb_create_pixmap(dpy, ctx->screen->root_depth, pix, ctx->root,
+                                   width, height).sequence);
+    StatsRequest(&ctx->stats, XCB_COPY_PLANE, 32,
+                 xcb_copy_plane(dpy, bitmap, pix, gc, 0, 0, 0, 0,
+                                width, height, 1).sequence);
+    StatsRequest(&ctx->stats, XCB_FREE_GC, 8, xcb_free_gc(dpy, gc).sequence);
+    if (!CacheHoldsBitmap(ctx, bitmap))
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, bitmap).sequence);
+    SetBackgroundToPixmap(ctx, plan, pix);
+}
+
+/*
+ * SetBackgroundToPixmap: Set the root window background to a root depth
+ *                        pixmap of ours, which the plan then owns unless
+ *                        it is to be kept: for _XSETROOT_ID, or to be
+ *                        published.
+ */
+static void
+SetBackgroundToPixmap(XsrContext *ctx, Plan *plan, xcb_pixmap_t pix)
+{
+    int keep = ctx->cmd->publish;
+
+    /* over many commands the property gets a pixmap of its own instead */
+    if (ctx->cur->save_colors && !ctx->keep_warm) {
+        ctx->cur->save_pixmap = pix;
+        keep = 1;
+    }
+    PlanBackPixmap(ctx, plan, pix, !keep);
+}
+
+/*
+ * SolidPixmap: Make a 1x1 root depth pixmap of a pixel, for a solid
+ *              background that is to be published.
+ */
+static xcb_pixmap_t
+SolidPixmap(XsrContext *ctx, uint32_t pixel)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_rectangle_t rect = { 0, 0, 1, 1 };
+    xcb_pixmap_t pix;
+    xcb_gcontext_t gc;
+
+    pix = xcb_generate_id(dpy);
+    StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16,
+                 xcb_create_pixmap(dpy, ctx->screen->root_depth, pix, ctx->root,
+                                   1, 1).sequence);
+    gc = xcb_generate_id(dpy);
+    StatsRequest(&ctx->stats, XCB_CREATE_GC, 20,
+                 xcb_create_gc(dpy, gc, pix, XCB_GC_FOREGROUND, &pixel).sequence);
+    StatsRequest(&ctx->stats, XCB_POLY_FILL_RECTANGLE, 20,
+                 xcb_poly_fill_rectangle(dpy, pix, gc, 1, &rect).sequence);
+    StatsRequest(&ctx->stats, XCB_FREE_GC, 8, xcb_free_gc(dpy, gc).sequence);
+    return pix;
+}
+
+/*
+ * PlanCursor: Record the cursor for a window, dropping any cursor the plan
+ *             held before.  Owned cursors are freed after CommitPlan().
+ */
+static void
+PlanCursor(XsrContext *ctx, Plan *plan, xcb_cursor_t cursor, int owned)
+{
+    if ((plan->mask & XCB_CW_CURSOR) && plan->own_cursor)
+        StatsRequest(&ctx->stats, XCB_FREE_CURSOR, 8,
+                     xcb_free_cursor(ctx->dpy, plan->cursor).sequence);
+    plan->mask |= XCB_CW_CURSOR;
+    plan->cursor = cursor;
+    plan->own_cursor = owned;
+}
+
+/*
+ * PlanBackPixmap: Record a background pixmap (or None) for a window.
+ */
+static void
+PlanBackPixmap(XsrContext *ctx, Plan *plan, xcb_pixmap_t pixmap, int owned)
+{
+    if (plan->free_pixmap)
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8,
+                     xcb_free_pixmap(ctx->dpy, plan->free_pixmap).sequence);
+    plan->mask = (plan->mask & ~XCB_CW_BACK_PIXEL) | XCB_CW_BACK_PIXMAP;
+    plan->back_pixmap = pixmap;
+    plan->free_pixmap = owned ? pixmap : XCB_NONE;
+}
+
+/*
+ * PlanBackPixel: Record a solid background pixel for a window.
+ */
+static void
+PlanBackPixel(XsrContext *ctx, Plan *plan, uint32_t pixel)
+{
+    if (plan->free_pixmap)
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8,
+                     xcb_free_pixmap(ctx->dpy, plan->free_pixmap).sequence);
+    plan->mask = (plan->mask & ~XCB_CW_BACK_PIXMAP) | XCB_CW_BACK_PIXEL;
+    plan->back_pixel = pixel;
+    plan->free_pixmap = XCB_NONE;
+}
+
+/*
+ * CommitPlan: Send a plan as one ChangeWindowAttributes, clear the window
+ *             once if its background changed, and drop what it owned.
+ */
+static void
+CommitPlan(XsrContext *ctx, Plan *plan)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    uint32_t values[3];
+    int n = 0;
+
+    /* values go in the order of their bits in the mask */
+    if (plan->mask & XCB_CW_BACK_PIXMAP)
+        values[n++] = plan->back_pixmap;
+    if (plan->mask & XCB_CW_BACK_PIXEL)
+        values[n++] = plan->back_pixel;
+    if (plan->mask & XCB_CW_CURSOR)
+        values[n++] = plan->cursor;
+    if (n)
+        StatsRequest(&ctx->stats, XCB_CHANGE_WINDOW_ATTRIBUTES, 12 + 4 * n,
+                     xcb_change_window_attributes(dpy, plan->window, plan->mask,
+                                                  values).sequence);
+
+    if (plan->name)
+        StatsRequest(&ctx->stats, XCB_CHANGE_PROPERTY, 24 + STATS_PAD(strlen(plan->name)),
+                     xcb_change_property(dpy, XCB_PROP_MODE_REPLACE, plan->window,
+                                         XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8,
+                                         strlen(plan->name), plan->name).sequence);
+
+    if (plan->mask & (XCB_CW_BACK_PIXMAP | XCB_CW_BACK_PIXEL)) {
+        StatsRequest(&ctx->stats, XCB_CLEAR_AREA, 16,
+                     xcb_clear_area(dpy, 0, plan->window, 0, 0, 0, 0).sequence);
+        ctx->cur->unsave_past = 1;
+        /* one published earlier in the batch is no longer anyone's */
+        if (ctx->cur->pmap_new)
+            StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8,
+                         xcb_free_pixmap(dpy, ctx->cur->pmap_new).sequence);
+        ctx->cur->pmap_changed = 1;
+        ctx->cur->pmap_publish = ctx->cmd->publish;
+        ctx->cur->pmap_new = (ctx->cmd->publish && (plan->mask & XCB_CW_BACK_PIXMAP))
+                             ? plan->back_pixmap : XCB_NONE;
+    }
+
+    if ((plan->mask & XCB_CW_CURSOR) && plan->own_cursor && plan->cursor)
+        StatsRequest(&ctx->stats, XCB_FREE_CURSOR, 8, xcb_free_cursor(dpy, plan->cursor).sequence);
+    if (plan->free_pixmap)
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8,
+                     xcb_free_pixmap(dpy, plan->free_pixmap).sequence);
+    plan->mask = 0;
+    plan->own_cursor = 0;
+    plan->free_pixmap = XCB_NONE;
+    plan->name = NULL;
+}
+
+
+/*
+ * CreateCursorFromFiles: make a cursor of the right colors from two bitmap
+ *                        files.  Returns None after reporting why if they
+ *                        are unusable.
+ */
+#define BITMAP_HOT_DEFAULT 8
+
+static xcb_cursor_t
+CreateCursorFromFiles(XsrContext *ctx, char *cursor_file, char *mask_file)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_pixmap_t cursor_bitmap, mask_bitmap;
+    uint16_t width, height, ww, hh;
+    int16_t x_hot, y_hot;
+    xcb_cursor_t cursor;
+    xcb_coloritem_t *fg = &ctx->cur->fg_slot.color, *bg = &ctx->cur->bg_slot.color;
+    xcb_void_cookie_t cookie;
+
+    cursor_bitmap = ReadBitmapFile(ctx, cursor_file, ctx->cmd->cursor_data,
+                                   &width, &height, &x_hot, &y_hot);
+    if (!cursor_bitmap)
+        return XCB_NONE;
+    mask_bitmap = ReadBitmapFile(ctx, mask_file, ctx->cmd->mask_data,
+                                 &ww, &hh, (int16_t *)NULL, (int16_t *)NULL);
+    if (!mask_bitmap) {
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, cursor_bitmap).sequence);
+        return XCB_NONE;
+    }
+
+    if ((x_hot == -1) && (y_hot == -1)) {
+        x_hot = BITMAP_HOT_DEFAULT;
+        y_hot = BITMAP_HOT_DEFAULT;
+    }
+    if (width != ww || height != hh) {
+        Report(ctx, XSR_BAD_CURSOR,
+               "dimensions of cursor bitmap and cursor mask bitmap are different");
+        cursor = XCB_NONE;
+    }
+    else if ((x_hot < 0) || (x_hot >= width) ||
+             (y_hot < 0) || (y_hot >= height)) {
+        Report(ctx, XSR_BAD_CURSOR, "hotspot is outside cursor bounds");
+        cursor = XCB_NONE;
+    }
+    else {
+        /* The server keeps its own reference, so the pixmaps can go at once. */
+        cursor = xcb_generate_id(dpy);
+        cookie = xcb_create_cursor_checked(dpy, cursor, cursor_bitmap, mask_bitmap,
+                                           fg->red, fg->green, fg->blue,
+                                           bg->red, bg->green, bg->blue, x_hot, y_hot);
+        StatsRequest(&ctx->stats, XCB_CREATE_CURSOR, 32, cookie.sequence);
+        DeferCheck(ctx, cookie, XCB_CREATE_CURSOR, XSR_BAD_CURSOR, "Error creating cursor");
+    }
+
+    StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, cursor_bitmap).sequence);
+    StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, mask_bitmap).sequence);
+
+    return cursor;
+}
+
+/*
+ * CreateCursorFromName: make a glyph cursor from the cursor font opened in
+ *                       ApplyStart(); failures are reported by
+ *                       CheckDeferred().
+ */
+static xcb_cursor_t
+CreateCursorFromName(XsrContext *ctx, int index)
+{
+    xcb_coloritem_t *fg = &ctx->cur->fg_slot.color, *bg = &ctx->cur->bg_slot.color;
+    xcb_cursor_t cursor;
+    xcb_void_cookie_t cookie;
+
+    /* nothing waits on the font, so it needn't go out with the queries */
+    if (!ctx->cursor_fid) {
+        ctx->cursor_fid = xcb_generate_id(ctx->dpy);
+        cookie = xcb_open_font_checked(ctx->dpy, ctx->cursor_fid,
+                                       strlen(cursor_font), cursor_font);
+        StatsRequest(&ctx->stats, XCB_OPEN_FONT, 12 + STATS_PAD(strlen(cursor_font)),
+                     cookie.sequence);
+        DeferCheck(ctx, cookie, XCB_OPEN_FONT, XSR_SERVER_ERROR, "can't open cursor font");
+    }
+    cursor = xcb_generate_id(ctx->dpy);
+    cookie = xcb_create_glyph_cursor_checked(ctx->dpy, cursor, ctx->cursor_fid,
+                                             ctx->cursor_fid, index, index+1,
+                                             fg->red, fg->green, fg->blue,
+                                             bg->red, bg->green, bg->blue);
+    StatsRequest(&ctx->stats, XCB_CREATE_GLYPH_CURSOR, 32, cookie.sequence);
+    DeferCheck(ctx, cookie, XCB_CREATE_GLYPH_CURSOR, XSR_BAD_CURSOR, "Error creating cursor");
+    return cursor;
+}
+
+/*
+ * MakeModulaBitmap: Returns a modula bitmap based on an x & y mod.
+ */
+static xcb_pixmap_t
+MakeModulaBitmap(XsrContext *ctx, int mod_x, int mod_y)
+{
+    int i;
+    long pattern_line = 0;
+    uint8_t modula_data[16*16/8];
+    char key[32];
+    xcb_pixmap_t bitmap;
+    uint16_t ww, hh;
+
+    snprintf(key, sizeof(key), "mod:%d,%d", mod_x, mod_y);
+    if ((bitmap = CachedBitmap(ctx, key, &ww, &hh)))
+        return bitmap;
+    for (i=16; i--; ) {
+        pattern_line <<=1;
+        if ((i % mod_x) == 0) pattern_line |= 0x0001;
+    }
+    for (i=0; i<16; i++) {
+        if ((i % mod_y) == 0) {
+            modula_data[i*2] = (char)0xff;
+            modula_data[i*2+1] = (char)0xff;
+        } else {
+            modula_data[i*2] = pattern_line & 0xff;
+            modula_data[i*2+1] = (pattern_line>>8) & 0xff;
+        }
+    }
+
+    bitmap = UploadBitmap(ctx, modula_data, 16, 16);
+    CacheBitmap(ctx, key, bitmap, 16, 16);
+    return bitmap;
+}
+
+/*
+ * UploadBitmap: Make a depth-1 pixmap from XBM ordered bitmap data.
+ */
+static xcb_pixmap_t
+UploadBitmap(XsrContext *ctx, uint8_t *data, uint16_t width, uint16_t height)
+{
+    MemoryBands bands = { data, 0 };
+
+    return PutBitmap(ctx, width, height, NextMemoryBand, &bands);
+}
+
+static const uint8_t *
+NextMemoryBand(void *closure, size_t len)
+{
+    MemoryBands *bands = closure;
+
+    bands->offset += len;
+    return bands->data + bands->offset - len;
+}
+
+/*
+ * ShmAvailable: Find out, the first time an image is big enough to ask,
+ *               whether MIT-SHM can be used.
+ */
+static int
+ShmAvailable(XsrContext *ctx)
+{
+    const xcb_query_extension_reply_t *ext;
+    xcb_shm_query_version_cookie_t version_c;
+    xcb_shm_query_version_reply_t *version;
+    uint64_t start;
+
+    if (ctx->shm != SHM_UNKNOWN)
+        return ctx->shm != SHM_NONE;
+    ctx->shm = SHM_NONE;
+    ext = xcb_get_extension_data(ctx->dpy, &xcb_shm_id);
+    if (!ext || !ext->present)
+        return 0;
+    ctx->shm_opcode = ext->major_opcode;
+    StatsExtension(&ctx->stats, ctx->shm_opcode, "MIT-SHM");
+    version_c = xcb_shm_query_version(ctx->dpy);
+    StatsRequest(&ctx->stats, ctx->shm_opcode, 4, version_c.sequence);
+    start = StatsNow(&ctx->stats);
+    version = xcb_shm_query_version_reply(ctx->dpy, version_c, NULL);
+    StatsWait(&ctx->stats, ctx->shm_opcode, version_c.sequence, start);
+    if (!version)
+        return 0;
+#ifdef HAVE_MEMFD_CREATE
+    if (version->major_version > 1 || version->minor_version >= 2)
+        ctx->shm = SHM_FD;
+    else
+#endif
+        ctx->shm = SHM_SYSV;
+    free(version);
+    return 1;
+}
+
+/*
+ * ShmAttach: Make a segment of size bytes and attach it to the server read
+ *            only.  Returns 0 if there is no segment to use.
+ */
+static int
+ShmAttach(XsrContext *ctx, ShmSegment *shm, size_t size)
+{
+    int fd = -1, id = -1, ok;
+
+    shm->seg = xcb_generate_id(ctx->dpy);
+    shm->size = size;
+    shm->sysv = 1;
+#ifdef HAVE_MEMFD_CREATE
+    if (ctx->shm == SHM_FD && (fd = memfd_create("xsetroot", MFD_CLOEXEC)) >= 0) {
+        if (ftruncate(fd, size) < 0 ||
+            (shm->addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                              fd, 0)) == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        shm->sysv = 0;
+    }
+#endif
+    if (shm->sysv) {
+        if ((id = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600)) < 0)
+            return 0;
+        if ((shm->addr = shmat(id, NULL, 0)) == (void *)-1) {
+            shmctl(id, IPC_RMID, NULL);
+            return 0;
+        }
+    }
+
+    ok = ShmConnect(ctx, shm->seg, shm->sysv ? -1 : fd, id);
+    if (shm->sysv)
+        shmctl(id, IPC_RMID, NULL);
+    if (!ok) {
+        if (shm->sysv)
+            shmdt(shm->addr);
+        else
+            munmap(shm->addr, size);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * ShmConnect: Attach a segment to the server read only, passing fd, which
+ *             xcb closes once it is sent, or else the SysV id.  The server
+ *             is waited on for the first segment of a context, and for
+ *             every SysV one, which can be removed only once attached; if
+ *             it fails, MIT-SHM is not tried again.  Returns 0 if it did.
+ */
+static int
+ShmConnect(XsrContext *ctx, xcb_shm_seg_t seg, int fd, int id)
+{
+    xcb_void_cookie_t cookie;
+    xcb_generic_error_t *error;
+    int check = fd < 0 || !ctx->shm_trusted;
+    uint64_t start;
+
+    if (fd >= 0) {
+        cookie = check ? xcb_shm_attach_fd_checked(ctx->dpy, seg, fd, 1)
+                       : xcb_shm_attach_fd(ctx->dpy, seg, fd, 1);
+        StatsRequest(&ctx->stats, ctx->shm_opcode, 12, cookie.sequence);
+    }
+    else {
+        cookie = xcb_shm_attach_checked(ctx->dpy, seg, id, 1);
+        StatsRequest(&ctx->stats, ctx->shm_opcode, 16, cookie.sequence);
+    }
+    if (!check)
+        return 1;
+
+    start = StatsNow(&ctx->stats);
+    error = xcb_request_check(ctx->dpy, cookie);
+    StatsSync(&ctx->stats, ctx->shm_opcode, cookie.sequence, start);
+    if (error) {
+        free(error);
+        ctx->shm = SHM_NONE;
+        return 0;
+    }
+    ctx->shm_trusted = 1;
+    return 1;
+}
+
+/*
+ * ShmDetach: Let go of a segment.  The server keeps it until it has
+ *            carried out the requests that use it.
+ */
+static void
+ShmDetach(XsrContext *ctx, ShmSegment *shm)
+{
+    StatsRequest(&ctx->stats, ctx->shm_opcode, 8, xcb_shm_detach(ctx->dpy, shm->seg).sequence);
+    if (shm->sysv)
+        shmdt(shm->addr);
+    else
+        munmap(shm->addr, shm->size);
+}
+
+/*
+ * RenderAvailable: Find out, the first time a gradient is asked for,
+ *                  whether the server can draw it, and with which picture
+ *                  format on each screen's root visual.  The version and
+ *                  the formats are asked together in one round trip.
+ */
+static int
+RenderAvailable(XsrContext *ctx)
+{
+    const xcb_query_extension_reply_t *ext;
+    xcb_render_query_version_cookie_t version_c;
+    xcb_render_query_version_reply_t *version;
+    xcb_render_query_pict_formats_cookie_t formats_c;
+    xcb_render_query_pict_formats_reply_t *formats;
+    xcb_render_pictscreen_iterator_t si;
+    xcb_render_pictdepth_iterator_t di;
+    xcb_render_pictvisual_iterator_t vi;
+    uint64_t start;
+    int i;
+
+    if (ctx->render != RENDER_UNKNOWN)
+        return ctx->render != RENDER_NONE;
+    ctx->render = RENDER_NONE;
+    ext = xcb_get_extension_data(ctx->dpy, &xcb_render_id);
+    if (!ext || !ext->present)
+        return 0;
+    ctx->render_opcode = ext->major_opcode;
+    StatsExtension(&ctx->stats, ctx->render_opcode, "RENDER");
+    version_c = xcb_render_query_version(ctx->dpy, XCB_RENDER_MAJOR_VERSION,
+                                         XCB_RENDER_MINOR_VERSION);
+    StatsRequest(&ctx->stats, ctx->render_opcode, 12, version_c.sequence);
+    formats_c = xcb_render_query_pict_formats(ctx->dpy);
+    StatsRequest(&ctx->stats, ctx->render_opcode, 4, formats_c.sequence);
+    start = StatsNow(&ctx->stats);
+    version = xcb_render_query_version_reply(ctx->dpy, version_c, NULL);
+    formats = xcb_render_query_pict_formats_reply(ctx->dpy, formats_c, NULL);
+    StatsWait(&ctx->stats, ctx->render_opcode, formats_c.sequence, start);
+    if (version && formats &&
+        (version->major_version > 0 || version->minor_version >= 10)) {
+        ctx->render = RENDER_GRADIENTS;
+        for (si = xcb_render_query_pict_formats_screens_iterator(formats), i = 0;
+             si.rem && i < ctx->n_screens; xcb_render_pictscreen_next(&si), i++)
+            for (di = xcb_render_pictscreen_depths_iterator(si.data); di.rem;
+                 xcb_render_pictdepth_next(&di))
+                for (vi = xcb_render_pictdepth_visuals_iterator(di.data); vi.rem;
+                     xcb_render_pictvisual_next(&vi))
+                    if (vi.data->visual == ctx->screens[i].screen->root_visual)
+                        ctx->screens[i].root_format = vi.data->format;
+    }
+    free(version);
+    free(formats);
+    return ctx->render != RENDER_NONE;
+}
+
+/*
+ * PutBitmap: Make a depth-1 pixmap from the rows next() hands out,
+ *            converting each band to the server's bitmap format on the
+ *            way.  Returns None if next() runs dry, with the pixmap freed.
+ */
+static xcb_pixmap_t
+PutBitmap(XsrContext *ctx, uint16_t width, uint16_t height, BandProc next, void *closure)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    const xcb_setup_t *setup = xcb_get_setup(dpy);
+    uint32_t pad = setup->bitmap_format_scanline_pad;
+    uint32_t unit = setup->bitmap_format_scanline_unit / 8;
+    int reverse = setup->bitmap_format_bit_order != XCB_IMAGE_ORDER_LSB_FIRST;
+    int swap = unit > 1 && setup->bitmap_format_bit_order != setup->image_byte_order;
+    size_t in_stride = (width + 7) / 8;
+    size_t out_stride = (width + pad - 1) / pad * pad / 8;
+    size_t n, y, r, i, j;
+    const uint8_t *src, *in;
+    uint8_t *band, *out, b;
+    xcb_pixmap_t bitmap;
+    xcb_gcontext_t gc;
+    xcb_void_cookie_t cookie;
+    Upload up;
+
+    if (!StartUpload(ctx, &up, out_stride, height))
+        return XCB_NONE;
+
+    bitmap = xcb_generate_id(dpy);
+    cookie = xcb_create_pixmap(dpy, 1, bitmap, ctx->root, width, height);
+    StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16, cookie.sequence);
+    gc = xcb_generate_id(dpy);
+    cookie = xcb_create_gc(dpy, gc, bitmap, 0, NULL);
+    StatsRequest(&ctx->stats, XCB_CREATE_GC, 16, cookie.sequence);
+
+    for (y = 0; y < height; y += n) {
+        n = (height - y < up.rows) ? height - y : up.rows;
+        if (!(src = next(closure, in_stride * n))) {
+            StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, bitmap).sequence);
+            bitmap = XCB_NONE;
+            break;
+        }
+        band = UploadBand(ctx, &up);
+        for (r = 0; r < n; r++) {
+            in = src + r * in_stride;
+            out = band + r * out_stride;
+            if (!reverse)
+                memcpy(out, in, in_stride);
+            else {
+                for (i = 0; i < in_stride; i++) {
+                    b = in[i];
+                    b = (b & 0xf0) >> 4 | (b & 0x0f) << 4;
+                    b = (b & 0xcc) >> 2 | (b & 0x33) << 2;
+                    out[i] = (b & 0xaa) >> 1 | (b & 0x55) << 1;
+                }
+            }
+            memset(out + in_stride, 0, out_stride - in_stride);
+            if (swap) {
+                for (i = 0; i < out_stride; i += unit)
+                    for (j = 0; j < unit / 2; j++) {
+                        b = out[i + j];
+                        out[i + j] = out[i + unit - 1 - j];
+                        out[i + unit - 1 - j] = b;
+                    }
+            }
+        }
+        SendBand(ctx, &up, bitmap, gc, XCB_IMAGE_FORMAT_XY_PIXMAP, 1, width, y, n);
+    }
+
+    StatsRequest(&ctx->stats, XCB_FREE_GC, 8, xcb_free_gc(dpy, gc).sequence);
+    FinishUpload(ctx, &up);
+    return bitmap;
+}
+
+/*
+ * StartUpload: Get ready to send an image of height scanlines of stride
+ *              bytes a band at a time, through MIT-SHM if it is worth it
+ *              and can be had.  Otherwise BIG-REQUESTS is used, if the
+ *              server has it, only when one request won't do.  Returns 0
+ *              after reporting why if there is no memory for a band.
+ */
+static int
+StartUpload(XsrContext *ctx, Upload *up, size_t stride, uint16_t height)
+{
+    memset(up, 0, sizeof(*up));
+    up->stride = stride;
+    up->height = height;
+    up->store = ctx->store;
+    ctx->store = NULL;
+    if (stride * height >= SHM_MIN_BYTES && ShmAvailable(ctx)) {
+        up->rows = BAND_BYTES / stride;
+        if (up->rows < 1)
+            up->rows = 1;
+        if (up->rows > height)
+            up->rows = height;
+        up->use_shm = ShmAttach(ctx, &up->shm,
+                                (height < 2 * up->rows ? height : 2 * up->rows) * stride);
+        if (up->use_shm)
+            return 1;
+    }
+
+    up->rows = BandRows(ctx, stride, height);
+    if (!(up->buf = calloc(up->rows, stride))) {
+        Report(ctx, XSR_NO_MEMORY, "out of memory uploading image");
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * BandRows: How many scanlines of stride bytes a PutImage may carry.
+ */
+static size_t
+BandRows(XsrContext *ctx, size_t stride, uint16_t height)
+{
+    const xcb_setup_t *setup = xcb_get_setup(ctx->dpy);
+    uint64_t max_bytes = (uint64_t)setup->maximum_request_length * 4;
+    size_t rows;
+
+    if (24 + (uint64_t)stride * height > max_bytes)
+        max_bytes = (uint64_t)xcb_get_maximum_request_length(ctx->dpy) * 4;
+    if (max_bytes > BAND_BYTES)
+        max_bytes = BAND_BYTES;
+    rows = (max_bytes - 28) / stride;
+    if (rows < 1)
+        rows = 1;
+    return rows > height ? height : rows;
+}
+
+/*
+ * UploadBand: Where to put the scanlines of the next band.
+ */
+static uint8_t *
+UploadBand(XsrContext *ctx, Upload *up)
+{
+    int half = up->band & 1;
+    xcb_get_input_focus_reply_t *r;
+    uint64_t start;
+
+    if (!up->use_shm)
+        return up->buf;
+    if (up->fenced[half]) {
+        start = StatsNow(&ctx->stats);
+        r = xcb_get_input_focus_reply(ctx->dpy, up->fence[half], NULL);
+        StatsWait(&ctx->stats, XCB_GET_INPUT_FOCUS, up->fence[half].sequence, start);
+        free(r);
+        up->fenced[half] = 0;
+    }
+    return up->shm.addr + half * up->rows * up->stride;
+}
+
+/*
+ * SendBand: Put the n scanlines of the band just filled at row y of a
+ *           drawable.
+ */
+static void
+SendBand(XsrContext *ctx, Upload *up, xcb_drawable_t drawable, xcb_gcontext_t gc,
+         uint8_t format, uint8_t depth, uint16_t width, uint16_t y, uint16_t n)
+{
+    int half = up->band++ & 1;
+    xcb_void_cookie_t cookie;
+
+    if (!up->use_shm) {
+        cookie = xcb_put_image(ctx->dpy, format, drawable, gc, width, n, 0, y, 0,
+                               depth, up->stride * n, up->buf);
+        StatsRequest(&ctx->stats, XCB_PUT_IMAGE, 24 + up->stride * n, cookie.sequence);
+        /* written while the server works on it */
+        if (up->store)
+            DiskCacheWrite(up->store, up->buf, up->stride * n);
+        return;
+    }
+    cookie = xcb_shm_put_image(ctx->dpy, drawable, gc, width, n, 0, 0, width, n,
+                               0, y, depth, format, 0, up->shm.seg,
+                               half * up->rows * up->stride);
+    StatsRequest(&ctx->stats, ctx->shm_opcode, 40, cookie.sequence);
+    if (up->store)
+        DiskCacheWrite(up->store, up->shm.addr + half * up->rows * up->stride, up->stride * n);
+    /* a half used again must wait for the server to be done with it */
+    if (y + n + up->rows < up->height) {
+        up->fence[half] = xcb_get_input_focus(ctx->dpy);
+        StatsRequest(&ctx->stats, XCB_GET_INPUT_FOCUS, 4, up->fence[half].sequence);
+        up->fenced[half] = 1;
+    }
+}
+
+/*
+ * FinishUpload: Let go of the band buffer or segment.
+ */
+static void
+FinishUpload(XsrContext *ctx, Upload *up)
+{
+    int i;
+
+    for (i = 0; i < 2; i++)
+        if (up->fenced[i])
+            xcb_discard_reply(ctx->dpy, up->fence[i].sequence);
+    if (up->use_shm)
+        ShmDetach(ctx, &up->shm);
+    free(up->buf);
+}
+
+/*
+ * PutCached: Make a pixmap of the pixels of a disk cache entry.  With
+ *            MIT-SHM file descriptors the server maps the file and reads
+ *            them from there; else they go from the mapping a band at a
+ *            time.  Nothing is copied here either way.
+ */
+static xcb_pixmap_t
+PutCached(XsrContext *ctx, const DiskCacheEntry *e)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    const DiskCacheInfo *info = &e->info;
+    xcb_void_cookie_t cookie;
+    xcb_pixmap_t pix;
+    xcb_gcontext_t gc;
+    xcb_shm_seg_t seg;
+    size_t rows, n, y;
+    int fd;
+
+    pix = xcb_generate_id(dpy);
+    cookie = xcb_create_pixmap(dpy, info->depth, pix, ctx->root, info->width, info->height);
+    StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16, cookie.sequence);
+    gc = xcb_generate_id(dpy);
+    cookie = xcb_create_gc(dpy, gc, pix, 0, NULL);
+    StatsRequest(&ctx->stats, XCB_CREATE_GC, 16, cookie.sequence);
+
+    seg = XCB_NONE;
+    if ((size_t)info->stride * info->height >= SHM_MIN_BYTES && ShmAvailable(ctx) &&
+        ctx->shm == SHM_FD && (fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 0)) >= 0) {
+        seg = xcb_generate_id(dpy);
+        if (!ShmConnect(ctx, seg, fd, -1))
+            seg = XCB_NONE;
+    }
+    if (seg) {
+        cookie = xcb_shm_put_image(dpy, pix, gc, info->width, info->height, 0, 0,
+                                   info->width, info->height, 0, 0, info->depth,
+                                   info->format, 0, seg, e->offset);
+        StatsRequest(&ctx->stats, ctx->shm_opcode, 40, cookie.sequence);
+        StatsRequest(&ctx->stats, ctx->shm_opcode, 8, xcb_shm_detach(dpy, seg).sequence);
+    }
+    else {
+        rows = BandRows(ctx, info->stride, info->height);
+        for (y = 0; y < info->height; y += n) {
+            n = (info->height - y < rows) ? info->height - y : rows;
+            cookie = xcb_put_image(dpy, info->format, pix, gc, info->width, n, 0, y, 0,
+                                   info->depth, info->stride * n, e->data + y * info->stride);
+            StatsRequest(&ctx->stats, XCB_PUT_IMAGE, 24 + info->stride * n, cookie.sequence);
+        }
+    }
+    StatsRequest(&ctx->stats, XCB_FREE_GC, 8, xcb_free_gc(dpy, gc).sequence);
+    return pix;
+}
+
+/*
+ * PutPixels: Make a root depth pixmap of the rows make_row() makes, each
+ *            band sent as soon as its rows are packed in pf, dithered as
+ *            the command asks if pf is shallow.  With threads above
+ *            1 the rows of a band are made on that many threads at once,
+ *            in no particular order; otherwise they are made in order.
+ *            start_band(), unless NULL, readies each band first.  Returns
+ *            None if start_band() or make_row() fails, with the pixmap
+ *            freed, or after reporting why if there is no memory.
+ */
+static xcb_pixmap_t
+PutPixels(XsrContext *ctx, const PixelFormat *pf, uint16_t width, uint16_t height,
+          BandStartProc start_band, RowProc make_row, void *closure, int threads)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    int dither = ctx->cmd->dither;
+    Filler fillers[MT_MAX];
+    BandFill fill;
+    Upload up;
+    xcb_pixmap_t pix;
+    xcb_gcontext_t gc;
+    xcb_void_cookie_t cookie;
+    uint8_t *band;
+    uint32_t *row;
+    size_t n, y;
+    int i, started, levels[3];
+
+    memset(&fill, 0, sizeof(fill));
+    fill.make_row = make_row;
+    fill.closure = closure;
+    fill.pf = pf;
+    fill.width = width;
+    fill.stride = PackStride(fill.pf, width);
+    if (!(fillers[0].argb = malloc(width * sizeof(uint32_t)))) {
+        Report(ctx, XSR_NO_MEMORY, "out of memory making image");
+        return XCB_NONE;
+    }
+    if (!StartUpload(ctx, &up, fill.stride, height)) {
+        free(fillers[0].argb);
+        return XCB_NONE;
+    }
+    PackLevels(pf, levels);
+    if (dither != XSR_DITHER_NONE && (levels[0] < 256 || levels[1] < 256 || levels[2] < 256)) {
+        fill.dither = DitherNew(dither == XSR_DITHER_DIFFUSION ? DITHER_DIFFUSION : DITHER_ORDERED,
+                                levels, width);
+        if (dither == XSR_DITHER_DIFFUSION)
+            fill.rows = malloc((size_t)up.rows * width * sizeof(uint32_t));
+        if (!fill.dither || (dither == XSR_DITHER_DIFFUSION && !fill.rows)) {
+            Report(ctx, XSR_NO_MEMORY, "out of memory dithering image");
+            DitherFree(fill.dither);
+            free(fill.rows);
+            free(fillers[0].argb);
+            FinishUpload(ctx, &up);
+            return XCB_NONE;
+        }
+    }
+
+    /* the other threads help as far as they can be had */
+    pthread_mutex_init(&fill.lock, NULL);
+    pthread_cond_init(&fill.start, NULL);
+    pthread_cond_init(&fill.done, NULL);
+    if (threads > MT_MAX)
+        threads = MT_MAX;
+    for (started = 1; started < threads; started++) {
+        fillers[started].fill = &fill;
+        if (!(fillers[started].argb = malloc(width * sizeof(uint32_t))))
+            break;
+        if (pthread_create(&fillers[started].thread, NULL, FillThread, &fillers[started])) {
+            free(fillers[started].argb);
+            break;
+        }
+    }
+
+    pix = xcb_generate_id(dpy);
+    cookie = xcb_create_pixmap(dpy, ctx->screen->root_depth, pix, ctx->root,
+                               width, height);
+    StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16, cookie.sequence);
+    gc = xcb_generate_id(dpy);
+    cookie = xcb_create_gc(dpy, gc, pix, 0, NULL);
+    StatsRequest(&ctx->stats, XCB_CREATE_GC, 16, cookie.sequence);
+
+    for (y = 0; y < height && !fill.failed; y += n) {
+        n = (height - y < up.rows) ? height - y : up.rows;
+        if (start_band && !start_band(closure, y, n)) {
+            fill.failed = 1;
+            break;
+        }
+        band = UploadBand(ctx, &up);
+        pthread_mutex_lock(&fill.lock);
+        fill.band = band;
+        fill.y = y;
+        fill.n = n;
+        fill.next = fill.finished = 0;
+        fill.band_nbr++;
+        pthread_cond_broadcast(&fill.start);
+        pthread_mutex_unlock(&fill.lock);
+
+        FillBand(&fill, fillers[0].argb);
+        pthread_mutex_lock(&fill.lock);
+        while (fill.finished < fill.n)
+            pthread_cond_wait(&fill.done, &fill.lock);
+        pthread_mutex_unlock(&fill.lock);
+        for (i = 0, row = fill.rows; row && !fill.failed && i < (int)n; i++, row += width) {
+            DitherRow(fill.dither, y + i, row);
+            PackRow(fill.pf, row, band + i * fill.stride, width);
+        }
+        if (!fill.failed)
+            SendBand(ctx, &up, pix, gc, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                     ctx->screen->root_depth, width, y, n);
+    }
+
+    pthread_mutex_lock(&fill.lock);
+    fill.quit = 1;
+    pthread_cond_broadcast(&fill.start);
+    pthread_mutex_unlock(&fill.lock);
+    for (i = 1; i < started; i++) {
+        pthread_join(fillers[i].thread, NULL);
+        free(fillers[i].argb);
+    }
+    pthread_cond_destroy(&fill.done);
+    pthread_cond_destroy(&fill.start);
+    pthread_mutex_destroy(&fill.lock);
+    free(fillers[0].argb);
+    DitherFree(fill.dither);
+    free(fill.rows);
+
+    StatsRequest(&ctx->stats, XCB_FREE_GC, 8, xcb_free_gc(dpy, gc).sequence);
+    FinishUpload(ctx, &up);
+    if (fill.failed) {
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, pix).sequence);
+        return XCB_NONE;
+    }
+    return pix;
+}
+
+/*
+ * FillBand: Make, dither and pack rows of the band being filled until
+ *           there are none left to hand out; for error diffusion only make
+ *           them.  After a failure the rest are skipped.
+ */
+static void
+FillBand(BandFill *fill, uint32_t *argb)
+{
+    uint8_t *out;
+    int i, y, ok;
+
+    pthread_mutex_lock(&fill->lock);
+    while (fill->next < fill->n) {
+        i = fill->next++;
+        y = fill->y + i;
+        out = fill->band + i * fill->stride;
+        if (fill->rows)
+            argb = fill->rows + (size_t)i * fill->width;
+        ok = !fill->failed;
+        pthread_mutex_unlock(&fill->lock);
+        if (ok && (ok = fill->make_row(fill->closure, y, argb)) && !fill->rows) {
+            if (fill->dither)
+                DitherRow(fill->dither, y, argb);
+            PackRow(fill->pf, argb, out, fill->width);
+        }
+        pthread_mutex_lock(&fill->lock);
+        if (!ok)
+            fill->failed = 1;
+        if (++fill->finished == fill->n)
+            pthread_cond_signal(&fill->done);
+    }
+    pthread_mutex_unlock(&fill->lock);
+}
+
+static void *
+FillThread(void *arg)
+{
+    Filler *filler = arg;
+    BandFill *fill = filler->fill;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&fill->lock);
+    for (;;) {
+        while (!fill->quit && fill->band_nbr == seen)
+            pthread_cond_wait(&fill->start, &fill->lock);
+        if (fill->quit)
+            break;
+        seen = fill->band_nbr;
+        pthread_mutex_unlock(&fill->lock);
+        FillBand(fill, filler->argb);
+        pthread_mutex_lock(&fill->lock);
+    }
+    pthread_mutex_unlock(&fill->lock);
+    return NULL;
+}
+
+/*
+ * FillThreads: How many threads an image of width x height is worth.
+ */
+static int
+FillThreads(uint16_t width, uint16_t height)
+{
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads > (long)width * height / MT_PIXELS)
+        threads = (long)width * height / MT_PIXELS;
+    return threads < 1 ? 1 : threads;
+}
+
+/*
+ * RequestColor: Resolve a color slot locally if possible, otherwise send
+ *               whatever query the server needs to answer it.
+ *
+ * Names and numeric specs are looked up client side; on a TrueColor root the
+ * pixel is then computed from the visual masks and nothing is sent at all.
+ * The server is asked only for names we do not know, or for pixels on
+ * visuals whose colormap we cannot predict.
+ */
+static void
+RequestColor(XsrContext *ctx, ColorSlot *slot)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_colormap_t cmap = ctx->screen->default_colormap;
+    char *name = slot->name;
+    xcb_coloritem_t *c = &slot->color;
+    int truecolor = (ctx->visual->_class == XCB_VISUAL_CLASS_TRUE_COLOR);
+
+    c->pixel = slot->pixel;
+    c->flags = XCB_COLOR_FLAG_RED | XCB_COLOR_FLAG_GREEN | XCB_COLOR_FLAG_BLUE;
+    if (!slot->want_pixel && !slot->want_rgb)
+        return;
+    if (CachedColor(ctx, slot))
+        return;
+    if (name && *name) {
+        if (ColorNameToRGB(name, &c->red, &c->green, &c->blue)) {
+            if (!slot->want_pixel)
+                return;
+            if (truecolor) {
+                slot->pixel = c->pixel = PackPixel(ctx->visual, c->red, c->green, c->blue);
+                return;
+            }
+            slot->cookie.alloc_rgb = xcb_alloc_color(dpy, cmap, c->red, c->green, c->blue);
+            StatsRequest(&ctx->stats, XCB_ALLOC_COLOR, 16, slot->cookie.alloc_rgb.sequence);
+            slot->pending = COLOR_ALLOC_RGB;
+        }
+        else if (slot->want_pixel) {
+            slot->cookie.alloc = xcb_alloc_named_color(dpy, cmap, strlen(name), name);
+            StatsRequest(&ctx->stats, XCB_ALLOC_NAMED_COLOR, 12 + STATS_PAD(strlen(name)),
+                         slot->cookie.alloc.sequence);
+            slot->pending = COLOR_ALLOC;
+        }
+        else {
+            slot->cookie.lookup = xcb_lookup_color(dpy, cmap, strlen(name), name);
+            StatsRequest(&ctx->stats, XCB_LOOKUP_COLOR, 12 + STATS_PAD(strlen(name)),
+                         slot->cookie.lookup.sequence);
+            slot->pending = COLOR_LOOKUP;
+        }
+    }
+    else if (slot->want_rgb) {
+        if (truecolor)
+            UnpackPixel(ctx->visual, slot->pixel, &c->red, &c->green, &c->blue);
+        else {
+            slot->cookie.query = xcb_query_colors(dpy, cmap, 1, &slot->pixel);
+            StatsRequest(&ctx->stats, XCB_QUERY_COLORS, 12, slot->cookie.query.sequence);
+            slot->pending = COLOR_QUERY;
+        }
+    }
+}
+
+/*
+ * CollectColor: Wait for the reply to a slot's query and fill it in.
+ *               Returns 0 after reporting why if the color is bad.
+ */
+static int
+CollectColor(XsrContext *ctx, ColorSlot *slot)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_alloc_named_color_reply_t *an_r;
+    xcb_alloc_color_reply_t *ac_r;
+    xcb_lookup_color_reply_t *lc_r;
+    xcb_query_colors_reply_t *qc_r;
+    xcb_generic_error_t *e = NULL;
+    xcb_rgb_t *rgb;
+    int pending = slot->pending;
+    uint64_t t = StatsNow(&ctx->stats);
+
+    slot->pending = COLOR_NONE;
+    switch (pending) {
+    case COLOR_ALLOC:
+        an_r = xcb_alloc_named_color_reply(dpy, slot->cookie.alloc, &e);
+        StatsWait(&ctx->stats, XCB_ALLOC_NAMED_COLOR, slot->cookie.alloc.sequence, t);
+        if (!an_r) {
+            if (e && e->error_code == XCB_NAME)
+                Report(ctx, XSR_BAD_COLOR, "unknown color \"%s\"", slot->name);
+            else
+                Report(ctx, XSR_BAD_COLOR, "unable to allocate color for \"%s\"",
+                       slot->name);
+            free(e);
+            return 0;
+        }
+        slot->pixel = an_r->pixel;
+        slot->color.red = an_r->exact_red;
+        slot->color.green = an_r->exact_green;
+        slot->color.blue = an_r->exact_blue;
+        free(an_r);
+        break;
+    case COLOR_ALLOC_RGB:
+        ac_r = xcb_alloc_color_reply(dpy, slot->cookie.alloc_rgb, &e);
+        StatsWait(&ctx->stats, XCB_ALLOC_COLOR, slot->cookie.alloc_rgb.sequence, t);
+        free(e);
+        if (!ac_r) {
+            Report(ctx, XSR_BAD_COLOR, "unable to allocate color for \"%s\"",
+                   slot->name);
+            return 0;
+        }
+        slot->pixel = ac_r->pixel;
+        free(ac_r);
+        break;
+    case COLOR_LOOKUP:
+        lc_r = xcb_lookup_color_reply(dpy, slot->cookie.lookup, &e);
+        StatsWait(&ctx->stats, XCB_LOOKUP_COLOR, slot->cookie.lookup.sequence, t);
+        free(e);
+        if (!lc_r) {
+            Report(ctx, XSR_BAD_COLOR, "unknown color or bad color format: %s",
+                   slot->name);
+            return 0;
+        }
+        slot->color.red = lc_r->exact_red;
+        slot->color.green = lc_r->exact_green;
+        slot->color.blue = lc_r->exact_blue;
+        free(lc_r);
+        CacheColor(ctx, slot, 0);
+        return 1;
+    case COLOR_QUERY:
+        qc_r = xcb_query_colors_reply(dpy, slot->cookie.query, &e);
+        StatsWait(&ctx->stats, XCB_QUERY_COLORS, slot->cookie.query.sequence, t);
+        free(e);
+        if (!qc_r) {
+            Report(ctx, XSR_BAD_COLOR, "bad pixel value: %d", slot->pixel);
+            return 0;
+        }
+        rgb = xcb_query_colors_colors(qc_r);
+        slot->color.red = rgb->red;
+        slot->color.green = rgb->green;
+        slot->color.blue = rgb->blue;
+        free(qc_r);
+        CacheColor(ctx, slot, 0);
+        return 1;
+    default:
+        return 1;
+    }
+
+    /* a freshly allocated pixel must outlive us on a dynamic visual */
+    slot->color.pixel = slot->pixel;
+    if ((slot->pixel != ctx->screen->black_pixel) &&
+        (slot->pixel != ctx->screen->white_pixel) &&
+        (ctx->visual->_class & Dynamic))
+        ctx->cur->save_colors = 1;
+    CacheColor(ctx, slot, 1);
+    return 1;
+}
+
+/*
+ * DiscardColor: Forget the query of a slot nobody will collect.
+ */
+static void
+DiscardColor(XsrContext *ctx, ColorSlot *slot)
+{
+    /* every cookie in the union starts with its sequence number */
+    if (slot->pending != COLOR_NONE)
+        xcb_discard_reply(ctx->dpy, slot->cookie.alloc.sequence);
+    slot->pending = COLOR_NONE;
+}
+
+/*
+ * CachedColor: Fill in a slot from an answer the server gave an earlier
+ *              command.  Only a warm context keeps any.
+ */
+static int
+CachedColor(XsrContext *ctx, ColorSlot *slot)
+{
+    const char *name = slot->name ? slot->name : "";
+    int i;
+
+    for (i = 0; i < MAX_CACHED_COLORS; i++) {
+        if (!ctx->color_cache[i].name || strcmp(ctx->color_cache[i].name, name) ||
+            ctx->color_cache[i].colormap != ctx->screen->default_colormap)
+            continue;
+        if (!*name && ctx->color_cache[i].def_pixel != slot->pixel)
+            continue;
+        if (slot->want_pixel && !ctx->color_cache[i].have_pixel)
+            continue;
+        if (ctx->color_cache[i].have_pixel)
+            slot->pixel = ctx->color_cache[i].pixel;
+        slot->color = ctx->color_cache[i].color;
+        slot->color.pixel = slot->pixel;
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * CacheColor: Remember what the server said about a slot, when kept warm.
+ */
+static void
+CacheColor(XsrContext *ctx, ColorSlot *slot, int have_pixel)
+{
+    int i = ctx->next_cached_color;
+
+    if (!ctx->keep_warm)
+        return;
+    free(ctx->color_cache[i].name);
+    ctx->color_cache[i].name = strdup(slot->name ? slot->name : "");
+    ctx->color_cache[i].colormap = ctx->screen->default_colormap;
+    ctx->color_cache[i].def_pixel = slot->pixel;
+    ctx->color_cache[i].have_pixel = have_pixel;
+    ctx->color_cache[i].pixel = slot->pixel;
+    ctx->color_cache[i].color = slot->color;
+    ctx->next_cached_color = (i + 1) % MAX_CACHED_COLORS;
+}
+
+/*
+ * FileKey: A bitmap cache key for a file, which changes whenever the file
+ *          does.  The key is left empty, so nothing is cached, if the file
+ *          can't be looked at.
+ */
+static void
+FileKey(XsrContext *ctx, char *key, size_t len, const char *prefix, const char *file)
+{
+    struct stat st;
+    int n;
+
+    key[0] = '\0';
+    if (!ctx->keep_warm || stat(file, &st) < 0)
+        return;
+    n = snprintf(key, len, "%s:%llu:%llu:%lld:%ld:%lld:%s", prefix,
+                 (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+                 (long long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec,
+                 (long long)st.st_size, file);
+    if (n < 0 || (size_t)n >= len)
+        key[0] = '\0';
+}
+
+/*
+ * CachedBitmap: Look up a depth-1 bitmap uploaded by an earlier command.
+ */
+static xcb_pixmap_t
+CachedBitmap(XsrContext *ctx, const char *key, uint16_t *width, uint16_t *height)
+{
+    int i;
+
+    if (!*key)
+        return XCB_NONE;
+    for (i = 0; i < MAX_CACHED_BITMAPS; i++) {
+        if (ctx->bitmap_cache[i].key && ctx->bitmap_cache[i].root == ctx->root &&
+            !strcmp(ctx->bitmap_cache[i].key, key)) {
+            ctx->bitmap_cache[i].used = ++ctx->cache_clock;
+            *width = ctx->bitmap_cache[i].width;
+            *height = ctx->bitmap_cache[i].height;
+            return ctx->bitmap_cache[i].bitmap;
+        }
+    }
+    return XCB_NONE;
+}
+
+/*
+ * CacheBitmap: Keep an uploaded bitmap for later commands, when kept warm,
+ *              freeing the least recently used one if full.
+ */
+static void
+CacheBitmap(XsrContext *ctx, const char *key, xcb_pixmap_t bitmap,
+            uint16_t width, uint16_t height)
+{
+    int i, victim = 0;
+
+    if (!ctx->keep_warm || !*key)
+        return;
+    for (i = 0; i < MAX_CACHED_BITMAPS; i++) {
+        if (!ctx->bitmap_cache[i].key) {
+            victim = i;
+            break;
+        }
+        if (ctx->bitmap_cache[i].used < ctx->bitmap_cache[victim].used)
+            victim = i;
+    }
+    if (ctx->bitmap_cache[victim].key) {
+        StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8,
+                     xcb_free_pixmap(ctx->dpy, ctx->bitmap_cache[victim].bitmap).sequence);
+        free(ctx->bitmap_cache[victim].key);
+    }
+    ctx->bitmap_cache[victim].key = strdup(key);
+    if (!ctx->bitmap_cache[victim].key)
+        return;
+    ctx->bitmap_cache[victim].root = ctx->root;
+    ctx->bitmap_cache[victim].bitmap = bitmap;
+    ctx->bitmap_cache[victim].width = width;
+    ctx->bitmap_cache[victim].height = height;
+    ctx->bitmap_cache[victim].used = ++ctx->cache_clock;
+}
+
+/*
+ * CacheHoldsBitmap: Whether a bitmap belongs to the cache, and so must not
+ *                   be freed after use.
+ */
+static int
+CacheHoldsBitmap(XsrContext *ctx, xcb_pixmap_t bitmap)
+{
+    int i;
+
+    for (i = 0; i < MAX_CACHED_BITMAPS; i++)
+        if (ctx->bitmap_cache[i].key && ctx->bitmap_cache[i].bitmap == bitmap)
+            return 1;
+    return 0;
+}
+
+/*
+ * DeferCheck: Remember a checked request so its error, if any, is reported
+ *             by CheckDeferred() instead of costing a round trip now.
+ */
+static void
+DeferCheck(XsrContext *ctx, xcb_void_cookie_t cookie, uint8_t opcode,
+           XsrStatus status, const char *what)
+{
+    int n = ctx->n_deferred;
+
+    if (n == MAX_DEFERRED) {
+        /* Out of room: settle this one right away. */
+        uint64_t t = StatsNow(&ctx->stats);
+        xcb_generic_error_t *e = xcb_request_check(ctx->dpy, cookie);
+        StatsSync(&ctx->stats, opcode, cookie.sequence, t);
+        if (e) {
+            Report(ctx, status, "%s", what);
+            ctx->cur->applied_failed = 1;
+            free(e);
+        }
+        return;
+    }
+    ctx->deferred[n].cookie = cookie;
+    ctx->deferred[n].opcode = opcode;
+    ctx->deferred[n].status = status;
+    ctx->deferred[n].what = what;
+    ctx->deferred[n].screen = ctx->cur;
+    ctx->n_deferred++;
+}
+
+/*
+ * CheckDeferred: Report errors for every deferred request.  Only the first
+ *                check syncs with the server; the rest are already known.
+ */
+static void
+CheckDeferred(XsrContext *ctx)
+{
+    xcb_generic_error_t *e;
+    int i;
+    uint64_t t;
+
+    for (i = 0; i < ctx->n_deferred; i++) {
+        t = StatsNow(&ctx->stats);
+        e = xcb_request_check(ctx->dpy, ctx->deferred[i].cookie);
+        StatsSync(&ctx->stats, ctx->deferred[i].opcode, ctx->deferred[i].cookie.sequence, t);
+        if (!e)
+            continue;
+        Report(ctx, ctx->deferred[i].status, "%s", ctx->deferred[i].what);
+        ctx->deferred[i].screen->applied_failed = 1;
+        free(e);
+        /* a warm context must not go on using a font it never got */
+        if (ctx->deferred[i].opcode == XCB_OPEN_FONT)
+            ctx->cursor_fid = XCB_NONE;
+    }
+    ctx->n_deferred = 0;
+}
+
+static const char *
+BitmapError(int status)
+{
+    switch (status) {
+    case BitmapOpenFailed:  return "can't open file";
+    case BitmapReadFailed:  return "error reading file";
+    case BitmapNoMemory:    return "out of memory reading file";
+    default:                return "bad bitmap format file";
+    }
+}
+
+/*
+ * ReadBitmapFile: Upload a bitmap file, parsing it unless XsrLoadFiles()
+ *                 already has or the disk cache has it converted.
+ *                 Returns None after reporting why if it can't be read.
+ */
+static xcb_pixmap_t
+ReadBitmapFile(XsrContext *ctx, char *filename, const XsrBitmapData *parsed,
+               uint16_t *width, uint16_t *height, int16_t *x_hot, int16_t *y_hot)
+{
+    const xcb_setup_t *setup = xcb_get_setup(ctx->dpy);
+    uint32_t pad = setup->bitmap_format_scanline_pad;
+    FileBands bands;
+    DiskCacheKey key;
+    DiskCacheEntry entry;
+    DiskCacheWriter writer;
+    DiskCacheInfo info;
+    xcb_pixmap_t bitmap;
+    int16_t hot[2];
+    int status, keyed, cached = 0, lock = -1;
+
+    if (parsed) {
+        *width = parsed->width;
+        *height = parsed->height;
+        if (x_hot)
+            *x_hot = parsed->x_hot;
+        if (y_hot)
+            *y_hot = parsed->y_hot;
+        return UploadBitmap(ctx, parsed->data, *width, *height);
+    }
+    keyed = ctx->disk_cache && !ctx->cmd->no_cache && BitmapKey(ctx, filename, &key);
+    if (keyed && DiskCacheFind(ctx->cache_dir, &key, &entry, &lock)) {
+        bitmap = PutCached(ctx, &entry);
+        *width = entry.info.width;
+        *height = entry.info.height;
+        if (x_hot)
+            *x_hot = entry.info.x;
+        if (y_hot)
+            *y_hot = entry.info.y;
+        DiskCacheRelease(&entry);
+        return bitmap;
+    }
+    status = open_bitmap_stream(filename, &bands.stream, width, height, &hot[0], &hot[1]);
+    if (status != BitmapSuccess) {
+        if (keyed)
+            DiskCacheUnlock(ctx->cache_dir, &key, lock);
+        Report(ctx, status == BitmapNoMemory ? XSR_NO_MEMORY : XSR_BAD_FILE,
+               "%s: %s", BitmapError(status), filename);
+        return XCB_NONE;
+    }
+    if (x_hot)
+        *x_hot = hot[0];
+    if (y_hot)
+        *y_hot = hot[1];
+    if (keyed) {
+        memset(&info, 0, sizeof(info));
+        info.width = *width;
+        info.height = *height;
+        info.depth = 1;
+        info.format = XCB_IMAGE_FORMAT_XY_PIXMAP;
+        info.stride = (*width + pad - 1) / pad * pad / 8;
+        info.x = hot[0];
+        info.y = hot[1];
+        if ((cached = DiskCacheCreate(ctx->cache_dir, &key, &info, &writer)))
+            ctx->store = &writer;
+    }
+    /* each band is sent as soon as it is decoded */
+    bands.buf = NULL;
+    bands.status = BitmapSuccess;
+    bitmap = PutBitmap(ctx, *width, *height, NextFileBand, &bands);
+    ctx->store = NULL;
+    status = close_bitmap_stream(bands.stream, bitmap != XCB_NONE);
+    free(bands.buf);
+    if (bands.status != BitmapSuccess)
+        status = bands.status;
+    if (cached && bitmap && status == BitmapSuccess)
+        DiskCacheCommit(ctx->cache_dir, &writer);
+    else if (cached)
+        DiskCacheAbort(&writer);
+    if (keyed)
+        DiskCacheUnlock(ctx->cache_dir, &key, lock);
+    if (status != BitmapSuccess) {
+        if (bitmap)
+            StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8,
+                         xcb_free_pixmap(ctx->dpy, bitmap).sequence);
+        Report(ctx, status == BitmapNoMemory ? XSR_NO_MEMORY : XSR_BAD_FILE,
+               "%s: %s", BitmapError(status), filename);
+        return XCB_NONE;
+    }
+    return bitmap;
+}
+
+/*
+ * BitmapKey: The disk cache key of a bitmap file as this server takes it.
+ *            Returns 0 if the file can't be read.
+ */
+static int
+BitmapKey(XsrContext *ctx, const char *filename, DiskCacheKey *key)
+{
+    const xcb_setup_t *setup = xcb_get_setup(ctx->dpy);
+    uint8_t format[4] = {
+        setup->bitmap_format_scanline_pad, setup->bitmap_format_scanline_unit,
+        setup->bitmap_format_bit_order, setup->image_byte_order
+    };
+
+    DiskCacheKeyInit(key, "bitmap");
+    if (!DiskCacheKeyFile(ctx->cache_dir, key, filename))
+        return 0;
+    DiskCacheKeyAdd(key, format, sizeof(format));
+    return !key->overflow;
+}
+
+/*
+ * NextFileBand: Decode the next band of a bitmap file.  PutBitmap() asks
+ *               for its largest band first.
+ */
+static const uint8_t *
+NextFileBand(void *closure, size_t len)
+{
+    FileBands *bands = closure;
+
+    if (!bands->buf && !(bands->buf = malloc(len ? len : 1))) {
+        bands->status = BitmapNoMemory;
+        return NULL;
+    }
+    bands->status = read_bitmap_stream(bands->stream, bands->buf, len);
+    return bands->status == BitmapSuccess ? bands->buf : NULL;
+}
+
+/*
+ * RootPixelFormat: How pixels of a screen's root visual are packed, if it
+ *                  is TrueColor with a layout Pack.c knows.  NULL if not.
+ */
+static PixelFormat *
+RootPixelFormat(xcb_connection_t *c, xcb_screen_t *screen, xcb_visualtype_t *visual)
+{
+    const xcb_setup_t *setup = xcb_get_setup(c);
+    xcb_format_iterator_t it;
+    PixelFormat *pf;
+
+    if (!visual || visual->_class != XCB_VISUAL_CLASS_TRUE_COLOR)
+        return NULL;
+    for (it = xcb_setup_pixmap_formats_iterator(setup); it.rem; xcb_format_next(&it))
+        if (it.data->depth == screen->root_depth)
+            break;
+    if (!it.rem || !(pf = malloc(sizeof(PixelFormat))))
+        return NULL;
+    if (!PackInit(pf, it.data->bits_per_pixel, it.data->scanline_pad,
+                  setup->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST,
+                  visual->red_mask, visual->green_mask, visual->blue_mask)) {
+        free(pf);
+        return NULL;
+    }
+    return pf;
+}
+
+/*
+ * ImageFormat: The format full color images are packed in on the current
+ *              screen: the root visual's own if it is TrueColor, else a
+ *              color cube in the default colormap, allocated the first
+ *              time it is needed.  Returns the status, after reporting why
+ *              what can't be done if there is neither.
+ */
+static XsrStatus
+ImageFormat(XsrContext *ctx, const char *what, const PixelFormat **pf)
+{
+    ScreenState *cur = ctx->cur;
+
+    if (cur->pixels) {
+        *pf = cur->pixels;
+        return XSR_SUCCESS;
+    }
+    if (ctx->visual->_class == XCB_VISUAL_CLASS_TRUE_COLOR ||
+        ctx->visual->_class == XCB_VISUAL_CLASS_DIRECT_COLOR)
+        return Report(ctx, XSR_BAD_COMMAND, "%s can't be drawn on this root visual", what);
+    if (!cur->palette && !(cur->palette = AllocPalette(ctx)))
+        return Report(ctx, XSR_BAD_COLOR, "%s: no colors left to dither to", what);
+    *pf = cur->palette;
+    return XSR_SUCCESS;
+}
+
+/*
+ * AllocPalette: Allocate the biggest color cube, up to MAX_CUBE levels of
+ *               each channel, that the default colormap has room for.  All
+ *               colors of a size are asked for at once, so each size tried
+ *               costs one round trip.  The colors are kept like those of
+ *               -fg and -bg.  NULL if not even 2 levels can be had.
+ */
+#define MAX_CUBE    6
+
+static PixelFormat *
+AllocPalette(XsrContext *ctx)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_screen_t *screen = ctx->screen;
+    const xcb_setup_t *setup = xcb_get_setup(dpy);
+    xcb_alloc_color_cookie_t cookies[MAX_CUBE * MAX_CUBE * MAX_CUBE];
+    uint32_t colors[MAX_CUBE * MAX_CUBE * MAX_CUBE];
+    xcb_alloc_color_reply_t *r;
+    xcb_generic_error_t *e;
+    xcb_format_iterator_t it;
+    PixelFormat *pf;
+    uint64_t t;
+    int cube, n, i, got, max;
+
+    for (it = xcb_setup_pixmap_formats_iterator(setup); it.rem; xcb_format_next(&it))
+        if (it.data->depth == screen->root_depth)
+            break;
+    /* the packers do whole bytes */
+    if (!it.rem || it.data->bits_per_pixel % 8 || !(pf = malloc(sizeof(PixelFormat))))
+        return NULL;
+    for (cube = MAX_CUBE; cube >= 2; cube--) {
+        n = cube * cube * cube;
+        if (n > ctx->visual->colormap_entries)
+            continue;
+        max = cube - 1;
+        for (i = 0; i < n; i++) {
+            cookies[i] = xcb_alloc_color(dpy, screen->default_colormap,
+                                         i / (cube * cube) * 65535 / max,
+                                         i / cube % cube * 65535 / max,
+                                         i % cube * 65535 / max);
+            StatsRequest(&ctx->stats, XCB_ALLOC_COLOR, 16, cookies[i].sequence);
+        }
+        t = StatsNow(&ctx->stats);
+        for (i = got = 0; i < n; i++) {
+            e = NULL;
+            if ((r = xcb_alloc_color_reply(dpy, cookies[i], &e)))
+                colors[got++] = r->pixel;
+            free(r);
+            free(e);
+        }
+        StatsWait(&ctx->stats, XCB_ALLOC_COLOR, cookies[n - 1].sequence, t);
+        if (got == n)
+            break;
+        /* give back what we got and try a smaller cube */
+        if (got)
+            StatsRequest(&ctx->stats, XCB_FREE_COLORS, 12 + 4 * got,
+                         xcb_free_colors(dpy, screen->default_colormap, 0, got,
+                                         colors).sequence);
+    }
+    if (cube < 2 || !PackInitPalette(pf, it.data->bits_per_pixel, it.data->scanline_pad,
+                                     setup->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST,
+                                     cube, colors)) {
+        free(pf);
+        return NULL;
+    }
+    if (ctx->visual->_class & Dynamic)
+        ctx->cur->save_colors = 1;
+    return pf;
+}
+
+static const char *
+ImageError(int status)
+{
+    switch (status) {
+    case ImageOpenFailed:   return "can't open file";
+    case ImageReadFailed:   return "error reading file";
+    case ImageNoMemory:     return "out of memory reading file";
+    default:                return "bad image file";
+    }
+}
+
+/*
+ * ReadImageFile: Make a root depth pixmap of a PPM, PAM or farbfeld file
+ *                placed as the command asks, sending each band as soon as
+ *                its rows are made, or of the pixels the disk cache kept
+ *                from the last time.  The pixmap is of the part of the
+ *                image on the root, at place.  Returns None after
+ *                reporting why if it can't be.
+ */
+static xcb_pixmap_t
+ReadImageFile(XsrContext *ctx, char *filename, Placement *place)
+{
+    static const int filters[] = { SCALE_AUTO, SCALE_NEAREST, SCALE_BILINEAR, SCALE_BOX };
+    const PixelFormat *pf;
+    ImageRows rows;
+    DiskCacheKey key;
+    DiskCacheEntry entry;
+    DiskCacheWriter writer;
+    DiskCacheInfo info;
+    xcb_pixmap_t pix = XCB_NONE;
+    uint8_t packed[4];
+    uint16_t src_w, src_h;
+    int i, whole, keyed, cached = 0, lock = -1, levels[3];
+
+    if (ImageFormat(ctx, "-image", &pf))
+        return XCB_NONE;
+    keyed = ctx->disk_cache && !ctx->cmd->no_cache && ImageKey(ctx, filename, pf, &key);
+    if (keyed && DiskCacheFind(ctx->cache_dir, &key, &entry, &lock)) {
+        memset(place, 0, sizeof(*place));
+        if (ctx->cmd->placement == XSR_PLACE_TILE && entry.info.width == 1 &&
+            entry.info.height == 1) {
+            place->solid = 1;
+            place->pixel = PixelValue(pf, entry.data);
+        }
+        else
+            pix = PutCached(ctx, &entry);
+        place->x = entry.info.x;
+        place->y = entry.info.y;
+        place->width = entry.info.width;
+        place->height = entry.info.height;
+        DiskCacheRelease(&entry);
+        return pix;
+    }
+    memset(&rows, 0, sizeof(rows));
+    rows.status = open_image_stream(filename, &rows.stream, &src_w, &src_h);
+    if (rows.status != ImageSuccess) {
+        if (keyed)
+            DiskCacheUnlock(ctx->cache_dir, &key, lock);
+        Report(ctx, rows.status == ImageNoMemory ? XSR_NO_MEMORY : XSR_BAD_FILE,
+               "%s: %s", ImageError(rows.status), filename);
+        return XCB_NONE;
+    }
+    PlaceImage(ctx, src_w, src_h, place);
+    rows.width = src_w;
+    whole = place->scaled_w == src_w && place->scaled_h == src_h &&
+            place->width == src_w && place->height == src_h;
+    /* a tile that is dithered isn't one any more */
+    PackLevels(pf, levels);
+    if (whole && ctx->cmd->placement == XSR_PLACE_TILE &&
+        (ctx->cmd->dither == XSR_DITHER_NONE ||
+         (levels[0] == 256 && levels[1] == 256 && levels[2] == 256)) &&
+        !FindTile(ctx, &rows, filename, pf, src_h, place))
+        goto done;
+    if (keyed) {
+        memset(&info, 0, sizeof(info));
+        info.width = place->width;
+        info.height = place->height;
+        info.depth = ctx->screen->root_depth;
+        info.format = XCB_IMAGE_FORMAT_Z_PIXMAP;
+        info.stride = PackStride(pf, place->width);
+        info.x = place->x;
+        info.y = place->y;
+        if ((cached = DiskCacheCreate(ctx->cache_dir, &key, &info, &writer)))
+            ctx->store = &writer;
+    }
+    if (place->solid) {
+        PackRow(pf, PeriodFinderRow(rows.tile, 0), packed, 1);
+        if (cached)
+            DiskCacheWrite(&writer, packed, info.stride);
+    }
+    else if (whole)
+        /* a file is read front to back, so on one thread */
+        pix = PutPixels(ctx, pf, place->width, place->height, NULL, NextImageRow, &rows, 1);
+    else if (!(rows.scaler = ScalerNew(filters[ctx->cmd->filter], src_w, src_h,
+                                       place->scaled_w, place->scaled_h,
+                                       place->src_x, place->src_y,
+                                       place->width, place->height)))
+        Report(ctx, XSR_BAD_FILE, "can't scale %s to %dx%d", filename,
+               place->scaled_w, place->scaled_h);
+    else
+        pix = PutPixels(ctx, pf, place->width, place->height, StartImageBand,
+                        NextScaledRow, &rows, FillThreads(place->width, place->height));
+    ctx->store = NULL;
+    if (cached && (pix || place->solid) && rows.status == ImageSuccess)
+        DiskCacheCommit(ctx->cache_dir, &writer);
+    else if (cached)
+        DiskCacheAbort(&writer);
+done:
+    if (keyed)
+        DiskCacheUnlock(ctx->cache_dir, &key, lock);
+    if (rows.stream)
+        close_image_stream(rows.stream);
+    PeriodFinderFree(rows.tile);
+    ScalerFree(rows.scaler);
+    for (i = 0; i < rows.size; i++)
+        free(rows.window[i]);
+    free(rows.window);
+    if (rows.status != ImageSuccess)
+        Report(ctx, rows.status == ImageNoMemory ? XSR_NO_MEMORY : XSR_BAD_FILE,
+               "%s: %s", ImageError(rows.status), filename);
+    return pix;
+}
+
+/*
+ * ImageKey: The disk cache key of an image file as the command places it
+ *           on the current screen, packed in pf.  Returns 0 if the file
+ *           can't be read.
+ */
+static int
+ImageKey(XsrContext *ctx, const char *filename, const PixelFormat *pf, DiskCacheKey *key)
+{
+    uint32_t how[] = {
+        ctx->screen->width_in_pixels, ctx->screen->height_in_pixels, ctx->cmd->placement,
+        ctx->cmd->filter, ctx->cmd->dither, ctx->screen->root_depth, pf->bpp, pf->pad,
+        pf->msb_first, pf->red_mask, pf->green_mask, pf->blue_mask, pf->cube
+    };
+
+    DiskCacheKeyInit(key, "image");
+    if (!DiskCacheKeyFile(ctx->cache_dir, key, filename))
+        return 0;
+    DiskCacheKeyAdd(key, how, sizeof(how));
+    DiskCacheKeyAdd(key, pf->colors, pf->cube * pf->cube * pf->cube * sizeof(uint32_t));
+    return !key->overflow;
+}
+
+/*
+ * FindTile: Read an image tiled at its own size until it is known whether
+ *           it repeats a smaller tile, and if it does make place that tile,
+ *           or solid if it is a single pixel.  The rows read are held for
+ *           NextImageRow() to give out again; if some had to be let go the
+ *           file is opened anew.  Returns 0 if it can't be read.
+ */
+static int
+FindTile(XsrContext *ctx, ImageRows *rows, const char *filename, const PixelFormat *pf,
+         uint16_t height, Placement *place)
+{
+    PeriodFinder *f;
+    uint32_t *argb = NULL;
+    uint8_t packed[4];
+    uint16_t w, h;
+    int y, more = 1;
+
+    /* without the memory it is just sent whole */
+    if (!(f = PeriodFinderNew(rows->width, height, sizeof(uint32_t), TILE_MAX_HELD)) ||
+        !(argb = malloc(rows->width * sizeof(uint32_t)))) {
+        PeriodFinderFree(f);
+        return 1;
+    }
+    for (y = 0; y < height && more; y++) {
+        if ((rows->status = read_image_row(rows->stream, argb)) != ImageSuccess)
+            break;
+        more = PeriodFinderAdd(f, argb);
+    }
+    free(argb);
+    if (rows->status != ImageSuccess) {
+        PeriodFinderFree(f);
+        return 0;
+    }
+    if (more) {
+        place->width = rows->width = f->period_x;
+        place->height = f->period_y;
+        if (f->period_x == 1 && f->period_y == 1) {
+            place->solid = 1;
+            PackRow(pf, PeriodFinderRow(f, 0), packed, 1);
+            place->pixel = PixelValue(pf, packed);
+        }
+    }
+    else if (f->held < y) {
+        PeriodFinderFree(f);
+        f = NULL;
+        close_image_stream(rows->stream);
+        rows->stream = NULL;
+        rows->status = open_image_stream(filename, &rows->stream, &w, &h);
+        if (rows->status != ImageSuccess) {
+            rows->stream = NULL;
+            return 0;
+        }
+        if (w != rows->width || h != height) {
+            rows->status = ImageFileInvalid;    /* it changed under us */
+            return 0;
+        }
+    }
+    rows->tile = f;
+    return 1;
+}
+
+/*
+ * PixelValue: The pixel a ZPixmap scanline of pf starts with.
+ */
+static uint32_t
+PixelValue(const PixelFormat *pf, const uint8_t *p)
+{
+    uint32_t pixel = 0;
+    int i, n = pf->bpp / 8;
+
+    for (i = 0; i < n; i++)
+        pixel |= (uint32_t)p[pf->msb_first ? n - 1 - i : i] << 8 * i;
+    return pixel;
+}
+
+/*
+ * PlaceImage: Work out the size an image of src_w x src_h is scaled to
+ *             and which part of it goes where on the root.
+ */
+static void
+PlaceImage(XsrContext *ctx, int src_w, int src_h, Placement *place)
+{
+    int root_w = ctx->screen->width_in_pixels, root_h = ctx->screen->height_in_pixels;
+    int placement = ctx->cmd->placement;
+    /* whether the root is wider for its height than the image */
+    int wider = (int64_t)root_w * src_h >= (int64_t)root_h * src_w;
+
+    place->scaled_w = src_w;
+    place->scaled_h = src_h;
+    if (placement == XSR_PLACE_SCALE) {
+        place->scaled_w = root_w;
+        place->scaled_h = root_h;
+    }
+    else if (placement == XSR_PLACE_FILL || placement == XSR_PLACE_FIT) {
+        /* scaled to the root along one side, the other in proportion */
+        if (wider == (placement == XSR_PLACE_FILL)) {
+            place->scaled_w = root_w;
+            place->scaled_h = ((int64_t)src_h * root_w + src_w / 2) / src_w;
+        }
+        else {
+            place->scaled_h = root_h;
+            place->scaled_w = ((int64_t)src_w * root_h + src_h / 2) / src_h;
+        }
+        if (placement == XSR_PLACE_FILL) {
+            place->scaled_w = place->scaled_w < root_w ? root_w : place->scaled_w;
+            place->scaled_h = place->scaled_h < root_h ? root_h : place->scaled_h;
+        }
+        else {
+            place->scaled_w = place->scaled_w > root_w ? root_w : place->scaled_w;
+            place->scaled_h = place->scaled_h > root_h ? root_h : place->scaled_h;
+            place->scaled_w += !place->scaled_w;
+            place->scaled_h += !place->scaled_h;
+        }
+    }
+
+    /* tiles are whole; anything else is centered, cropped to the root */
+    place->src_x = place->src_y = place->x = place->y = 0;
+    place->width = place->scaled_w;
+    place->height = place->scaled_h;
+    if (placement == XSR_PLACE_TILE)
+        return;
+    if (place->width > root_w) {
+        place->src_x = (place->width - root_w) / 2;
+        place->width = root_w;
+    }
+    else
+        place->x = (root_w - place->width) / 2;
+    if (place->height > root_h) {
+        place->src_y = (place->height - root_h) / 2;
+        place->height = root_h;
+    }
+    else
+        place->y = (root_h - place->height) / 2;
+}
+
+/*
+ * PadImage: Put an image that leaves part of the root bare on a root size
+ *           pixmap filled with the background color, on the server.
+ *           Returns the pixmap, image itself if it covers the root.
+ */
+static xcb_pixmap_t
+PadImage(XsrContext *ctx, xcb_pixmap_t image, const Placement *place)
+{
+    xcb_connection_t *dpy = ctx->dpy;
+    xcb_rectangle_t rect = { 0, 0, ctx->screen->width_in_pixels, ctx->screen->height_in_pixels };
+    xcb_pixmap_t pix;
+    xcb_gcontext_t gc;
+
+    if (place->width == rect.width && place->height == rect.height)
+        return image;
+    gc = xcb_generate_id(dpy);
+    pix = xcb_generate_id(dpy);
+    StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16,
+                 xcb_create_pixmap(dpy, ctx->screen->root_depth, pix, ctx->root,
+                                   rect.width, rect.height).sequence);
+    StatsRequest(&ctx->stats, XCB_CREATE_GC, 20,
+                 xcb_create_gc(dpy, gc, pix, XCB_GC_FOREGROUND, &ctx->bg_pixel).sequence);
+    StatsRequest(&ctx->stats, XCB_POLY_FILL_RECTANGLE, 20,
+                 xcb_poly_fill_rectangle(dpy, pix, gc, 1, &rect).sequence);
+    StatsRequest(&ctx->stats, XCB_COPY_AREA, 28,
+                 xcb_copy_area(dpy, image, pix, gc, 0, 0, place->x, place->y,
+                               place->width, place->height).sequence);
+    StatsRequest(&ctx->stats, XCB_FREE_GC, 8, xcb_free_gc(dpy, gc).sequence);
+    StatsRequest(&ctx->stats, XCB_FREE_PIXMAP, 8, xcb_free_pixmap(dpy, image).sequence);
+    return pix;
+}
+
+static int
+NextImageRow(void *closure, int y, uint32_t *argb)
+{
+    ImageRows *rows = closure;
+
+    if (rows->tile && y < rows->tile->held) {
+        memcpy(argb, PeriodFinderRow(rows->tile, y), rows->width * sizeof(uint32_t));
+        return 1;
+    }
+    rows->status = read_image_row(rows->stream, argb);
+    return rows->status == ImageSuccess;
+}
+
+/*
+ * StartImageBand: Read the source rows rows y to y + n - 1 of a scaled
+ *                 image need into the window, skipping any no row needs.
+ */
+static int
+StartImageBand(void *closure, int y, int n)
+{
+    ImageRows *rows = closure;
+    uint32_t **window;
+    int first, count, drop, size;
+
+    ScalerSourceRows(rows->scaler, y, n, &first, &count);
+    drop = first - rows->first < rows->count ? first - rows->first : rows->count;
+    if (drop > 0) {
+        /* their buffers go to the end, to be read into again */
+        memcpy(rows->window + rows->size, rows->window, drop * sizeof(uint32_t *));
+        memmove(rows->window, rows->window + drop, (rows->size - drop) * sizeof(uint32_t *));
+        memcpy(rows->window + rows->size - drop, rows->window + rows->size,
+               drop * sizeof(uint32_t *));
+    }
+    rows->count -= drop;
+    rows->first = first;
+    if (count > rows->size) {
+        size = count;
+        if (!(window = realloc(rows->window, 2 * size * sizeof(uint32_t *)))) {
+            rows->status = ImageNoMemory;
+            return 0;
+        }
+        rows->window = window;
+        for (; rows->size < size; rows->size++)
+            if (!(window[rows->size] = malloc(rows->width * sizeof(uint32_t)))) {
+                rows->status = ImageNoMemory;
+                return 0;
+            }
+    }
+    /* rows before the window are read into its first free buffer and lost */
+    for (; rows->next < first + count; rows->next++) {
+        rows->status = read_image_row(rows->stream, rows->window[rows->count]);
+        if (rows->status != ImageSuccess)
+            return 0;
+        if (rows->next >= first)
+            rows->count++;
+    }
+    return 1;
+}
+
+static int
+NextScaledRow(void *closure, int y, uint32_t *argb)
+{
+    ImageRows *rows = closure;
+
+    ScalerRow(rows->scaler, y, (const uint32_t *const *)rows->window, rows->first, argb);
+    return 1;
+}
+
+/*
+ * MakePattern: Make a root size pixmap of a -pattern running from the
+ *              foreground color to the background one, on as many
+ *              threads as its size is worth.  Returns the status, after
+ *              reporting why if it fails.
+ */
+static XsrStatus
+MakePattern(XsrContext *ctx, const PatternSpec *ps, xcb_pixmap_t *pix)
+{
+    xcb_screen_t *screen = ctx->screen;
+    xcb_coloritem_t *fg = &ctx->cur->fg_slot.color, *bg = &ctx->cur->bg_slot.color;
+    uint16_t width = screen->width_in_pixels, height = screen->height_in_pixels;
+    const PixelFormat *pf;
+    XsrStatus status;
+    Pattern *p;
+
+    if ((status = ImageFormat(ctx, "-pattern", &pf)))
+        return status;
+    p = PatternNew(ps, (fg->red >> 8) << 16 | (fg->green >> 8) << 8 | fg->blue >> 8,
+                   (bg->red >> 8) << 16 | (bg->green >> 8) << 8 | bg->blue >> 8,
+                   width, height);
+    if (!p)
+        return Report(ctx, XSR_NO_MEMORY, "out of memory making pattern");
+
+    /* pattern rows can't fail, so PutPixels() reported why if it did */
+    *pix = PutPixels(ctx, pf, width, height, NULL, NextPatternRow, p, FillThreads(width, height));
+    PatternFree(p);
+    return *pix ? XSR_SUCCESS : ctx->reported;
+}
+
+static int
+NextPatternRow(void *closure, int y, uint32_t *argb)
+{
+    PatternRow(closure, y, argb);
+    return 1;
+}
+
+/* RENDER's 16.16 fixed point */
+#define RenderFixed(v)  ((xcb_render_fixed_t)lround((v) * 65536))
+
+/*
+ * MakeGradient: Make a root size pixmap of a -gradient at angle degrees,
+ *               or a -radial one, from the foreground color to the
+ *               background one.  With RENDER the server draws it and
+ *               nothing is uploaded; else it is the -pattern of the same
+ *               name, made here.  Returns the status, after reporting why
+ *               if it fails.
+ */
+static XsrStatus
+MakeGradient(XsrContext *ctx, int gradient, int angle, xcb_pixmap_t *pix)
+{
+    xcb_screen_t *screen = ctx->screen;
+    xcb_coloritem_t *fg = &ctx->cur->fg_slot.color, *bg = &ctx->cur->bg_slot.color;
+    uint16_t width = screen->width_in_pixels, height = screen->height_in_pixels;
+    xcb_render_fixed_t stops[2] = { 0, RenderFixed(1) };
+    xcb_render_color_t colors[2] = {
+        { fg->red, fg->green, fg->blue, 0xffff },
+        { bg->red, bg->green, bg->blue, 0xffff }
+    };
+    uint32_t repeat = XCB_RENDER_REPEAT_PAD;
+    xcb_render_picture_t src, dst;
+    xcb_render_pointfix_t p1, p2;
+    xcb_void_cookie_t void_c;
+    const PixelFormat *pf;
+    XsrStatus status;
+    PatternSpec ps;
+    double a, c, s, t, tmin, tmax;
+    int i;
+
+    if (!RenderAvailable(ctx) || !ctx->cur->root_format) {
+        if ((status = ImageFormat(ctx, gradient == XSR_RADIAL_GRADIENT ? "-radial" : "-gradient",
+                                  &pf)))
+            return status;
+        ps.kind = gradient == XSR_RADIAL_GRADIENT ? PATTERN_RADIAL : PATTERN_LINEAR;
+        ps.size = 0;
+        ps.angle = angle;
+        return MakePattern(ctx, &ps, pix);
+    }
+
+    *pix = xcb_generate_id(ctx->dpy);
+    StatsRequest(&ctx->stats, XCB_CREATE_PIXMAP, 16,
+                 xcb_create_pixmap(ctx->dpy, screen->root_depth, *pix, ctx->root,
+                                   width, height).sequence);
+    dst = xcb_generate_id(ctx->dpy);
+    StatsRequest(&ctx->stats, ctx->render_opcode, 20,
+                 xcb_render_create_picture(ctx->dpy, dst, *pix, ctx->cur->root_format,
+                                           0, NULL).sequence);
+    src = xcb_generate_id(ctx->dpy);
+    if (gradient == XSR_RADIAL_GRADIENT) {
+        /* from the center out to the corners, as Pattern.c has it */
+        p1.x = p2.x = RenderFixed(width / 2.0);
+        p1.y = p2.y = RenderFixed(height / 2.0);
+        void_c = xcb_render_create_radial_gradient(ctx->dpy, src, p1, p2, 0,
+                                                   RenderFixed(hypot(width / 2.0, height / 2.0)),
+                                                   2, stops, colors);
+        StatsRequest(&ctx->stats, ctx->render_opcode, 36 + 2 * 12, void_c.sequence);
+    } else {
+        /* the ends are where the corner pixels project, as in Pattern.c */
+        a = (angle % 360) * M_PI / 180;
+        c = cos(a);
+        s = sin(a);
+        tmin = tmax = 0.5 * c + 0.5 * s;
+        for (i = 0; i < 4; i++) {
+            t = ((i & 1) ? width - 0.5 : 0.5) * c + ((i & 2) ? height - 0.5 : 0.5) * s;
+            tmin = t < tmin ? t : tmin;
+            tmax = t > tmax ? t : tmax;
+        }
+        if (tmax - tmin < 1)
+            tmax = tmin + 1;
+        p1.x = RenderFixed(tmin * c);
+        p1.y = RenderFixed(tmin * s);
+        p2.x = RenderFixed(tmax * c);
+        p2.y = RenderFixed(tmax * s);
+        void_c = xcb_render_create_linear_gradient(ctx->dpy, src, p1, p2, 2, stops, colors);
+        StatsRequest(&ctx->stats, ctx->render_opcode, 28 + 2 * 12, void_c.sequence);
+    }
+    /* rounding must not leave pixels past either end transparent */
+    StatsRequest(&ctx->stats, ctx->render_opcode, 16,
+                 xcb_render_change_picture(ctx->dpy, src, XCB_RENDER_CP_REPEAT,
+                                           &repeat).sequence);
+    StatsRequest(&ctx->stats, ctx->render_opcode, 36,
+                 xcb_render_composite(ctx->dpy, XCB_RENDER_PICT_OP_SRC, src, XCB_NONE, dst,
+                                      0, 0, 0, 0, 0, 0, width, height).sequence);
+    StatsRequest(&ctx->stats, ctx->render_opcode, 8,
+                 xcb_render_free_picture(ctx->dpy, src).sequence);
+    StatsRequest(&ctx->stats, ctx->render_opcode, 8,
+                 xcb_render_free_picture(ctx->dpy, dst).sequence);
+    return XSR_SUCCESS;
+}
+/* vim: set ts=4 sw=4 et cindent: */
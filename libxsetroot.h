@@ -0,0 +1,150 @@
+/* libxsetroot.h
+ *
+ * Setting root window backgrounds, cursors and names on a connection the
+ * caller already has.  Everything lives in an XsrContext, one per
+ * connection, so a program may use any number of them; nothing here exits
+ * or writes to the terminal.
+ *
+ * A command is described by XsrOptions, filled in directly or option by
+ * option from command line words with XsrParseOption().  XsrSubmit() sends
+ * the requests for it without waiting on the server, and XsrComplete()
+ * collects the replies and reports how it went.  Commands submitted before
+ * one XsrComplete() are pipelined: only a command whose colors the server
+ * must look up waits, and only when the next one is submitted.
+ */
+
+#ifndef _LIBXSETROOT_H_
+#define _LIBXSETROOT_H_
+
+#include <stdint.h>
+#include <xcb/xcb.h>
+
+/* Status codes; anything but XSR_SUCCESS means the command failed. */
+typedef enum {
+    XSR_SUCCESS = 0,
+    XSR_BAD_COMMAND,            /* options that don't go together */
+    XSR_BAD_SCREEN,             /* no such screen on the display */
+    XSR_BAD_COLOR,              /* unknown color, or none left to allocate */
+    XSR_BAD_FILE,               /* a bitmap or image file can't be read or parsed */
+    XSR_BAD_CURSOR,             /* a cursor can't be made */
+    XSR_SERVER_ERROR,           /* the server refused a request */
+    XSR_NO_CURSOR_CONTEXT,      /* xcb-cursor can't be initialized */
+    XSR_NO_MEMORY
+} XsrStatus;
+
+/* A parsed bitmap file, as XsrLoadFiles() leaves it. */
+typedef struct {
+    uint8_t *data;
+    uint16_t width, height;
+    int16_t x_hot, y_hot;
+} XsrBitmapData;
+
+/* Everything one command asks for; zero it, then set what is wanted. */
+typedef struct {
+    char *fore_color;
+    char *back_color;
+    int reverse;
+    int restore_defaults;
+    int excl;                   /* number of background options given */
+    int nonexcl;                /* number of other changes given */
+    char *name;
+    char *cursor_file;
+    char *cursor_mask;
+    char *cursor_name;
+    char *solid_color;
+    char *xcf;
+    int xcf_size;
+    int gray;
+    char *bitmap_file;
+    char *image_file;           /* PPM, PAM or farbfeld */
+    int placement;              /* XSR_PLACE_*, how the image covers the root */
+    int filter;                 /* XSR_FILTER_*, how it is scaled */
+    char *pattern;              /* -pattern spec */
+    int gradient;               /* XSR_LINEAR_GRADIENT or XSR_RADIAL_GRADIENT */
+    int gradient_angle;         /* -gradient angle in degrees */
+    int dither;                 /* XSR_DITHER_*, for images on shallow roots */
+    int no_cache;               /* don't use the disk cache, if the context has one */
+    int publish;                /* name the background in _XROOTPMAP_ID */
+    int force;                  /* apply what the root already shows, too */
+    int mod_x;
+    int mod_y;
+    int screen;                 /* -screen, or -1 for the display's own */
+    int all_screens;
+    /* set by XsrLoadFiles(), else the files are read when applied */
+    XsrBitmapData *bitmap_data;
+    XsrBitmapData *cursor_data;
+    XsrBitmapData *mask_data;
+} XsrOptions;
+
+/* XsrOptions gradient, for -gradient and -radial */
+#define XSR_LINEAR_GRADIENT     1
+#define XSR_RADIAL_GRADIENT     2
+
+/*
+ * XsrOptions placement of an image: tiled at its own size, scaled to the
+ * root's size, scaled to cover the root or to fit in it keeping its
+ * shape, or centered at its own size
+ */
+#define XSR_PLACE_TILE          0
+#define XSR_PLACE_SCALE         1
+#define XSR_PLACE_FILL          2
+#define XSR_PLACE_FIT           3
+#define XSR_PLACE_CENTER        4
+
+/* XsrOptions filter; auto is box where the image shrinks, else bilinear */
+#define XSR_FILTER_AUTO         0
+#define XSR_FILTER_NEAREST      1
+#define XSR_FILTER_BILINEAR     2
+#define XSR_FILTER_BOX          3
+
+/* XsrOptions dither */
+#define XSR_DITHER_ORDERED      0
+#define XSR_DITHER_DIFFUSION    1
+#define XSR_DITHER_NONE         2
+
+typedef struct _XsrContext XsrContext;
+
+/*
+ * Called with every message, where status is XSR_SUCCESS for warnings that
+ * don't fail the command.  Without one only the last message is kept.
+ */
+typedef void (*XsrErrorProc)(void *closure, XsrStatus status, const char *message);
+
+/* XsrOpen() flags */
+#define XSR_KEEP_WARM   (1 << 0)    /* keep fonts, colors and bitmaps */
+#define XSR_NO_SHM      (1 << 1)    /* send images over the connection only */
+#define XSR_DISK_CACHE  (1 << 2)    /* keep decoded files in the user's cache */
+
+/*
+ * What a context counted of one type of request, while XsrSetStats() had
+ * it counting.  A wait is a round trip only if its request was sent after
+ * the previous round trip began.
+ */
+typedef struct {
+    const char *name;           /* of the request, or of its extension */
+    unsigned long requests;
+    unsigned long long bytes;   /* on the wire */
+    unsigned long waits;        /* for replies and error checks */
+    unsigned long round_trips;
+    uint64_t blocked_ns;        /* spent waiting */
+} XsrRequestStats;
+
+extern XsrContext *XsrOpen(xcb_connection_t *c, int screen, int flags);
+extern void XsrClose(XsrContext *ctx);
+extern void XsrSetErrorHandler(XsrContext *ctx, XsrErrorProc proc, void *closure);
+extern const char *XsrErrorMessage(XsrContext *ctx);
+extern void XsrSetStats(XsrContext *ctx, int enable);
+extern int XsrGetStats(XsrContext *ctx, int opcode, XsrRequestStats *stats);
+
+extern void XsrInitOptions(XsrOptions *opts);
+extern int XsrParseOption(XsrOptions *opts, int argc, char **argv, int *i);
+extern XsrStatus XsrLoadFiles(XsrOptions *opts, char *message, int len);
+extern void XsrFreeFiles(XsrOptions *opts);
+
+extern XsrStatus XsrSubmit(XsrContext *ctx, const XsrOptions *opts);
+extern XsrStatus XsrComplete(XsrContext *ctx);
+
+extern const char *XsrStatusString(XsrStatus status);
+
+#endif /* _LIBXSETROOT_H_ */
+/* vim: set ts=4 sw=4 et cindent: */
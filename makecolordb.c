@@ -0,0 +1,146 @@
+/* makecolordb.c
+ *
+ * Build-time generator for colordb.h: reads an rgb.txt style color list on
+ * stdin and writes a hash-and-displace perfect hash table of the lowercased
+ * names on stdout.  Lookups in ColorDB.c then cost one hash to pick the
+ * bucket's seed, one more to pick the slot, and a single strcmp.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <err.h>
+#include "CharSet.h"
+#include "ColorDB.h"
+
+#define MAXNAME     64
+
+typedef struct {
+    char name[MAXNAME];
+    int red, green, blue;
+    uint32_t bucket;
+} Entry;
+
+static Entry *entries;
+static int n_entries;
+
+static int
+cmpname(const void *a, const void *b)
+{
+    return strcmp(((const Entry *)a)->name, ((const Entry *)b)->name);
+}
+
+static void
+read_colors(FILE *in)
+{
+    char line[256], *name, *end;
+    int alloc = 0, r, g, b, n;
+
+    while (fgets(line, sizeof(line), in)) {
+        if (line[0] == '!' || sscanf(line, "%d %d %d %n", &r, &g, &b, &n) != 3)
+            continue;
+        name = line + n;
+        for (end = name + strlen(name); end > name && (end[-1] == '\n' ||
+             end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'); end--) ;
+        *end = '\0';
+        if (!*name || strlen(name) >= MAXNAME)
+            continue;
+        if (n_entries == alloc) {
+            alloc = alloc ? alloc * 2 : 512;
+            if (!(entries = realloc(entries, alloc * sizeof(Entry))))
+                err(EXIT_FAILURE, NULL);
+        }
+        CopyISOLatin1Lowered(entries[n_entries].name, name);
+        entries[n_entries].red = r;
+        entries[n_entries].green = g;
+        entries[n_entries].blue = b;
+        n_entries++;
+    }
+
+    /* "DarkSlateGray" and "darkslategray" are the same color to us */
+    qsort(entries, n_entries, sizeof(Entry), cmpname);
+    for (r = g = 0; r < n_entries; r++)
+        if (!g || strcmp(entries[g-1].name, entries[r].name))
+            entries[g++] = entries[r];
+    n_entries = g;
+}
+
+int
+main(void)
+{
+    uint32_t size, nbuckets, b, d, i, j, k, slot;
+    int *order, *count, *slots, *taken, *members;
+    uint16_t *disp;
+
+    read_colors(stdin);
+    if (!n_entries)
+        errx(EXIT_FAILURE, "no colors on input");
+
+    for (size = 1; size < (uint32_t)n_entries + n_entries / 4; size <<= 1) ;
+    nbuckets = (n_entries + 3) / 4;
+
+    count = calloc(nbuckets, sizeof(int));
+    order = calloc(nbuckets, sizeof(int));
+    disp = calloc(nbuckets, sizeof(uint16_t));
+    slots = malloc(size * sizeof(int));
+    taken = calloc(size, sizeof(int));
+    members = malloc(n_entries * sizeof(int));
+    if (!count || !order || !disp || !slots || !taken || !members)
+        err(EXIT_FAILURE, NULL);
+    for (i = 0; i < size; i++)
+        slots[i] = -1;
+    for (i = 0; i < (uint32_t)n_entries; i++) {
+        entries[i].bucket = ColorHash(entries[i].name, 0) % nbuckets;
+        count[entries[i].bucket]++;
+    }
+
+    /* place the most crowded buckets first, while the table is empty */
+    for (i = 0; i < nbuckets; i++)
+        order[i] = i;
+    for (i = 1; i < nbuckets; i++)
+        for (j = i; j > 0 && count[order[j-1]] < count[order[j]]; j--) {
+            k = order[j]; order[j] = order[j-1]; order[j-1] = k;
+        }
+
+    for (i = 0; i < nbuckets && count[order[i]]; i++) {
+        b = order[i];
+        for (j = k = 0; j < (uint32_t)n_entries; j++)
+            if (entries[j].bucket == b)
+                members[k++] = j;
+        for (d = 1; d < 65536; d++) {
+            for (j = 0; j < k; j++) {
+                slot = ColorHash(entries[members[j]].name, d) & (size - 1);
+                if (slots[slot] != -1 || taken[slot] == (int)d)
+                    break;
+                taken[slot] = d;
+            }
+            if (j == k)
+                break;
+        }
+        if (d == 65536)
+            errx(EXIT_FAILURE, "no displacement found for bucket %u", b);
+        disp[b] = d;
+        for (j = 0; j < k; j++)
+            slots[ColorHash(entries[members[j]].name, d) & (size - 1)] = members[j];
+    }
+
+    printf("/* colordb.h -- generated by makecolordb, do not edit */\n\n");
+    printf("#define COLORDB_SIZE %u\n", size);
+    printf("#define COLORDB_BUCKETS %u\n\n", nbuckets);
+    printf("static const uint16_t colordb_disp[COLORDB_BUCKETS] = {");
+    for (i = 0; i < nbuckets; i++)
+        printf("%s%u,", (i % 12) ? " " : "\n    ", disp[i]);
+    printf("\n};\n\n");
+    printf("static const struct {\n    const char *name;\n"
+           "    uint8_t red, green, blue;\n} colordb[COLORDB_SIZE] = {\n");
+    for (i = 0; i < size; i++)
+        if (slots[i] == -1)
+            printf("    { NULL, 0, 0, 0 },\n");
+        else
+            printf("    { \"%s\", %d, %d, %d },\n", entries[slots[i]].name,
+                   entries[slots[i]].red, entries[slots[i]].green,
+                   entries[slots[i]].blue);
+    printf("};\n");
+    return 0;
+}
+/* vim: set ts=4 sw=4 et cindent: */
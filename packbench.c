@@ -0,0 +1,136 @@
+/* packbench.c
+ *
+ * Microbenchmark for the pixel packers in Pack.c: every packer this CPU can
+ * run packs rows of a 4K wide image in its layout, and so does the generic
+ * packer.  Throughput of both, the speedup and whether the output matched
+ * byte for byte (on an odd width too, for the tails) are reported as
+ * key=value lines.
+ *
+ *   packbench [-width <pixels>]
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <err.h>
+#include "Pack.h"
+
+#define MIN_SECONDS     0.2
+#define ROWS            64
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Megapixels per second packing rows of argb, ROWS of them in turn. */
+static double
+run_packer(const PixelFormat *pf, const uint32_t *argb, uint8_t *out, int width)
+{
+    size_t stride = PackStride(pf, width);
+    double t0 = now(), elapsed;
+    long n = 0;
+
+    do {
+        PackRow(pf, argb + (size_t)(n % ROWS) * width, out + (n % ROWS) * stride, width);
+        n++;
+    } while (n % ROWS || (elapsed = now() - t0) < MIN_SECONDS);
+    return (double)n * width / elapsed / 1e6;
+}
+
+static int
+same_output(const PixelFormat *a, const PixelFormat *b, const uint32_t *argb,
+            uint8_t *out_a, uint8_t *out_b, int width)
+{
+    size_t stride = PackStride(a, width);
+    int y;
+
+    for (y = 0; y < ROWS; y++) {
+        PackRow(a, argb + (size_t)y * width, out_a, width);
+        PackRow(b, argb + (size_t)y * width, out_b, width);
+        if (memcmp(out_a, out_b, stride))
+            return 0;
+    }
+    return 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const PackKernel *k, *generic = NULL;
+    PixelFormat *pf, *ref;
+    uint32_t *argb, seed = 12345, r, g, b;
+    uint8_t *out, *out_ref;
+    double rate, generic_rate;
+    int width = 3840, bpp, msb, i, match;
+    size_t n;
+
+    if (argc == 3 && !strcmp(argv[1], "-width"))
+        width = atoi(argv[2]);
+    else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-width <pixels>]\n", argv[0]);
+        return 1;
+    }
+    if (width < 1)
+        errx(1, "bad width");
+    for (i = 0; i < n_pack_kernels; i++)
+        if (!strcmp(pack_kernels[i].name, "generic"))
+            generic = &pack_kernels[i];
+    if (!generic)
+        errx(1, "no generic packer");
+
+    n = (size_t)(width + 1) * ROWS;
+    pf = malloc(sizeof(PixelFormat));
+    ref = malloc(sizeof(PixelFormat));
+    argb = malloc(n * sizeof(uint32_t));
+    out = malloc(n * 4 + 64);
+    out_ref = malloc(n * 4 + 64);
+    if (!pf || !ref || !argb || !out || !out_ref)
+        err(1, "malloc");
+    for (i = 0; (size_t)i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        argb[i] = seed ^ (seed >> 16);
+    }
+
+    for (i = 0; i < n_pack_kernels; i++) {
+        k = &pack_kernels[i];
+        if (k == generic || !PackKernelUsable(k))
+            continue;
+        bpp = k->bpp ? k->bpp : 32;
+        msb = k->msb_first > 0;
+        if (k->red_mask || k->green_mask || k->blue_mask)
+            r = k->red_mask, g = k->green_mask, b = k->blue_mask;
+        else if (bpp == 8)              /* the table packers: layouts */
+            r = 0xe0, g = 0x1c, b = 0x03;   /* with no packer of their own */
+        else if (bpp == 16)
+            r = 0x1f, g = 0x7e0, b = 0xf800;
+        else if (bpp == 24)
+            r = 0xff, g = 0xff00, b = 0xff0000;
+        else
+            r = 0x3ff00000, g = 0xffc00, b = 0x3ff;
+        PackInit(pf, bpp, 32, msb, r, g, b);
+        PackInit(ref, bpp, 32, msb, r, g, b);
+        pf->pack = k->pack;
+        ref->pack = generic->pack;
+
+        match = same_output(pf, ref, argb, out, out_ref, width) &&
+                same_output(pf, ref, argb, out, out_ref, width > 4 ? (width - 4) | 1 : width);
+        rate = run_packer(pf, argb, out, width);
+        generic_rate = run_packer(ref, argb, out_ref, width);
+        printf("bench=pack kernel=%s bpp=%d order=%s width=%d mpix_per_s=%.1f "
+               "generic_mpix_per_s=%.1f speedup=%.2f match=%s\n",
+               k->name, bpp, msb ? "msb" : "lsb", width, rate, generic_rate,
+               rate / generic_rate, match ? "yes" : "no");
+        fflush(stdout);
+    }
+    return 0;
+}
+/* vim: set ts=4 sw=4 et cindent: */
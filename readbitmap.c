@@ -1,203 +1,833 @@
-/* bitmap_to_pixmap.c */
+/* readbitmap.c
+ *
+ * XBM reader.  The file is mapped instead of read, the header is scanned
+ * once, and the data is decoded straight into the bitmap: runs of evenly
+ * spaced "0x.." values a vector at a time, anything else by a scalar loop
+ * that takes values exactly as strtoul(s, &tail, 0) did, digits in the
+ * array's name included.  Files of several megabytes are cut into runs of
+ * whole lines and decoded by a thread per run, or, through the stream
+ * functions, a band at a time with the text behind it given back.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdint.h>
-//#include <limits.h>
+#include <limits.h>
 #include <errno.h>
-#include <err.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_TARGET 1
+#endif
 #include "readbitmap.h"
 
-#define MAXREAD     4096
+#define MAXREAD     65536
 #define XBM_X10     1
 #define XBM_X11     2
 
-static void *xalloc(size_t sz)
+#define MT_PIECE    (2 << 20)   /* least text worth a thread of its own */
+#define MT_MAX      16
+
+#define PATTERN_MAX 288         /* lcm(stride, 32) for strides 5 to 9 */
+#define RUN_MAX     (4 * PATTERN_MAX)
+
+/* value of a hex digit, or 0xff */
+static const uint8_t hexval[256] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+       0,    1,    2,    3,    4,    5,    6,    7,    8,    9, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,   10,   11,   12,   13,   14,   15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff,   10,   11,   12,   13,   14,   15, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+};
+
+static int
+isspace_c(unsigned char c)
 {
-    void *value = calloc(1, sz ? sz : 1);
-    if (!value)
-        err(EXIT_FAILURE, NULL);
-    return value;
+    return c == ' ' || (c >= '\t' && c <= '\r');
 }
 
-static void *xrealloc(void *ptr, size_t sz)
+/*
+ * A run of values laid out alike: "0x" and 'digits' hex digits followed by
+ * the same separator, 'stride' bytes apart.  expect[] holds the literal
+ * bytes of 'len' bytes of such a run and digit[] marks where the hex digits
+ * go; len is a whole number of values and of 32-byte vectors.
+ */
+typedef struct {
+    int stride;
+    int digits;
+    int len;
+    unsigned char x;
+    unsigned char sep[4];
+    int seplen;
+    unsigned char expect[PATTERN_MAX];
+    unsigned char digit[PATTERN_MAX];
+} Pattern;
+
+/*
+ * Validate up to avail bytes against a pattern and turn each into its
+ * nibble value.  Returns the length of the prefix that matches.
+ */
+typedef size_t (*ScanProc)(const unsigned char *p, size_t avail,
+                           const Pattern *pat, uint8_t *nib);
+
+/*
+ * The part of the data one thread decodes, or a stream's position: p is
+ * where decode_piece() resumes, carry the high byte of an X10 value that
+ * didn't fit in out.
+ */
+typedef struct {
+    const unsigned char *p, *end;
+    uint8_t *out;
+    size_t cap, n;
+    int x10;
+    int carry;                  /* -1 if none */
+    int stopped;                /* nothing after this counts */
+    ScanProc scan;
+    Pattern pat;
+} Piece;
+
+/* A file mapped and its header parsed, by open_bitmap(). */
+struct _BitmapStream {
+    unsigned char *buf;
+    size_t size;
+    int mapped;
+    size_t dropped;             /* pages of buf already given back */
+    const unsigned char *data, *end;    /* the data, from the bits line on */
+    int width, height, xhot, yhot;
+    int x10;
+    long length;                /* bytes the file's data must hold */
+    long done;                  /* bytes handed out so far */
+    Piece piece;
+};
+
+#if !defined(__SSE2__)
+static size_t
+scan_scalar(const unsigned char *p, size_t avail, const Pattern *pat, uint8_t *nib)
 {
-    void *value;
-    if (!ptr)
-        value = calloc(1, sz ? sz : 1);
-    else
-        value = realloc(ptr, sz ? sz : 1);
-    if (!value)
-        err(EXIT_FAILURE, NULL);
-    return value;
+    size_t i;
+    int k;
+
+    for (i = 0; i < avail; i++) {
+        k = i % pat->len;
+        if (pat->digit[k]) {
+            if ((nib[i] = hexval[p[i]]) > 15)
+                return i;
+        }
+        else if (p[i] != pat->expect[k])
+            return i;
+    }
+    return i;
 }
+#endif
 
-static char *eatwhite(char *s)
+#if defined(__SSE2__)
+static inline __m128i
+nibbles_sse2(__m128i v, __m128i *hex)
 {
-    if (!s || !*s)
-        return NULL;
-    while (*s && ((*s == ' ') || (*s == '\t'))) ++s;
-    return s;
+    const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i num, alpha;
+
+    num = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                        _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    alpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                          _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    *hex = _mm_or_si128(num, alpha);
+    return _mm_add_epi8(_mm_and_si128(v, _mm_set1_epi8(0x0f)),
+                        _mm_and_si128(alpha, _mm_set1_epi8(9)));
 }
 
-int read_bitmap_data_from_file(const char *fname,
-                               uint8_t **data_ret,
-                               uint16_t *width_ret, uint16_t *height_ret,
-                               int16_t *xhot_ret, int16_t *yhot_ret)
+static size_t
+scan_sse2(const unsigned char *p, size_t avail, const Pattern *pat, uint8_t *nib)
 {
-    int fd, rd, cnt, i, j, value;
-    char **lines, *line, *rbuf, *fbuf = NULL;
-    char name[80], type[80];
-    char *t, *p[20];
-    int width, height, xhot, yhot, format;
-    int length, padding = 0, bytesperline, bytes = 0;
-    long nexti;
-    char *tailp;
-    uint8_t *data = NULL;
+    __m128i v, hex, ok, digit;
+    size_t i;
+    int k, mask;
 
-    if (!fname || ((fd = open(fname, O_RDONLY)) == -1))
-        return BitmapOpenFailed;
+    for (i = 0; i + 16 <= avail; i += 16) {
+        k = i % pat->len;
+        v = _mm_loadu_si128((const __m128i *)(p + i));
+        digit = _mm_loadu_si128((const __m128i *)(pat->digit + k));
+        _mm_storeu_si128((__m128i *)(nib + i), nibbles_sse2(v, &hex));
+        ok = _mm_or_si128(_mm_and_si128(digit, hex),
+                          _mm_andnot_si128(digit,
+                              _mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i *)
+                                                                (pat->expect + k)))));
+        if ((mask = _mm_movemask_epi8(ok)) != 0xffff)
+            return i + __builtin_ctz(~mask);
+    }
+    return i;
+}
+#endif
 
-    /* prep read vars and allocate read buffer */
-    rd = cnt = 0;
-    rbuf = xalloc(MAXREAD);
+#if defined(HAVE_AVX2_TARGET)
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(const unsigned char *p, size_t avail, const Pattern *pat, uint8_t *nib)
+{
+    __m256i v, lower, num, alpha, ok, digit;
+    size_t i;
+    int k;
+    unsigned int mask;
 
-    /* read in file */
-    while ((rd = read(fd, rbuf, MAXREAD)))
-    {
-        if (rd == -1)
-        {
-            if (errno == EAGAIN || errno == EINTR)
-                /* this should probably pause first */
-                continue;
-            close(fd);
-            free(rbuf);
-            free(fbuf);
-            return BitmapReadFailed;
+    for (i = 0; i + 32 <= avail; i += 32) {
+        k = i % pat->len;
+        v = _mm256_loadu_si256((const __m256i *)(p + i));
+        lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        num = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                               _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+        alpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                 _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+        _mm256_storeu_si256((__m256i *)(nib + i),
+                            _mm256_add_epi8(_mm256_and_si256(v, _mm256_set1_epi8(0x0f)),
+                                            _mm256_and_si256(alpha, _mm256_set1_epi8(9))));
+        digit = _mm256_loadu_si256((const __m256i *)(pat->digit + k));
+        ok = _mm256_or_si256(_mm256_and_si256(digit, _mm256_or_si256(num, alpha)),
+                             _mm256_andnot_si256(digit,
+                                 _mm256_cmpeq_epi8(v, _mm256_loadu_si256((const __m256i *)
+                                                                         (pat->expect + k)))));
+        if ((mask = (unsigned int)_mm256_movemask_epi8(ok)) != 0xffffffffu)
+            return i + __builtin_ctz(~mask);
+    }
+    return i;
+}
+#endif
+
+static ScanProc
+pick_scan(void)
+{
+#if defined(HAVE_AVX2_TARGET)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return scan_avx2;
+#endif
+#if defined(__SSE2__)
+    return scan_sse2;
+#else
+    return scan_scalar;
+#endif
+}
+
+/*
+ * Parse the value at s as strtoul(s, &tail, 0) would once white space is
+ * skipped.  Returns its length, 0 if there is no number at s, or -1 if it
+ * overflows.
+ */
+static long
+scan_value(const unsigned char *s, const unsigned char *end, unsigned long *value)
+{
+    const unsigned char *p = s;
+    unsigned long v = 0, base = 10, d;
+    int neg = 0, overflow = 0;
+
+    if (p < end && (*p == '+' || *p == '-'))
+        neg = (*p++ == '-');
+    if (p >= end || *p < '0' || *p > '9')
+        return 0;
+    if (*p == '0') {
+        base = 8;
+        if (end - p > 2 && (p[1] | 0x20) == 'x' && hexval[p[2]] < 16) {
+            base = 16;
+            p += 2;
         }
-        fbuf = (char *)xrealloc(fbuf, cnt + rd + 1);
-        memcpy(fbuf+cnt, rbuf, rd);
-        cnt += rd;
     }
+    for (; p < end && (d = hexval[*p]) < base; p++) {
+        if (v > (ULONG_MAX - d) / base)
+            overflow = 1;
+        v = v * base + d;
+    }
+    if (overflow)
+        return -1;
+    *value = neg ? -v : v;
+    return p - s;
+}
 
-    free(rbuf);
-    close(fd);
+static void
+put_value(Piece *pc, unsigned long v)
+{
+    pc->out[pc->n++] = v;
+    /*
+     * X10 files hold shorts, low byte first.  Their lines are padded to
+     * whole shorts, so every value fills two bytes.
+     */
+    if (pc->x10) {
+        if (pc->n < pc->cap)
+            pc->out[pc->n++] = v >> 8;
+        else
+            pc->carry = (v >> 8) & 0xff;
+    }
+}
 
-    /* make a list of lines */
-    lines = (char **)xalloc(sizeof(char *) * 20);
-    lines[0] = strtok(fbuf, "\n");
-    for (cnt = 0; lines[cnt]; cnt++, lines[cnt] = strtok(NULL, "\n"))
-        if (cnt && !(cnt % 20))
-            lines = (char **)xrealloc(lines, sizeof(char *) * (cnt + 20));
-    lines = (char **)xrealloc(lines, sizeof(char *) * cnt);
+/*
+ * Fill in pat for a run starting with the value at p, if the value and the
+ * next one are laid out alike.  Keeps pat if it already describes them.
+ */
+static int
+start_pattern(Pattern *pat, const unsigned char *p, const unsigned char *end)
+{
+    const unsigned char *q;
+    int digits, seplen, stride, len, i, k;
 
-    width = height = format = 0;
-    xhot = yhot = -1;
+    if (end - p < 24 || p[0] != '0' || (p[1] | 0x20) != 'x')
+        return 0;
+    for (q = p + 2; hexval[*q] < 16 && q - p < 7; q++)
+        ;
+    digits = q - p - 2;
+    if (digits != 2 && digits != 4)
+        return 0;
+    for (seplen = 0; seplen < 3 && (q[seplen] == ',' || q[seplen] == ' ' ||
+                                    q[seplen] == '\t'); seplen++)
+        ;
+    if (!seplen || q[seplen] != '0' || q[seplen + 1] != p[1])
+        return 0;
+    stride = 2 + digits + seplen;
+    if (pat->stride == stride && pat->digits == digits && pat->x == p[1] &&
+        !memcmp(pat->sep, q, seplen))
+        return 1;
 
-    /* parse bitmap header */
-    for (i = 0; i < cnt; i++)
-    {
-        if (!(line = eatwhite(lines[i])))
+    for (len = stride; len % 32; len += stride)
+        ;
+    pat->stride = stride;
+    pat->digits = digits;
+    pat->len = len;
+    pat->x = p[1];
+    pat->seplen = seplen;
+    memcpy(pat->sep, q, seplen);
+    for (i = 0; i < len; i++) {
+        k = i % stride;
+        pat->digit[i] = (k >= 2 && k < 2 + digits) ? 0xff : 0;
+        pat->expect[i] = k == 0 ? '0' : k == 1 ? p[1] :
+                         k < 2 + digits ? 0 : q[k - 2 - digits];
+    }
+    return 1;
+}
+
+/*
+ * Decode the run of values matching pat at p.  Returns where the scalar
+ * loop takes over: just past the last value decoded here.
+ */
+static const unsigned char *
+decode_run(Piece *pc, const Pattern *pat, const unsigned char *p,
+           const unsigned char *end, uint8_t *nib)
+{
+    size_t avail, f, n, k, left, chunk = RUN_MAX - RUN_MAX % pat->len;
+    int width = 2 + pat->digits;
+    const uint8_t *d;
+
+    for (;;) {
+        avail = end - p < (long)chunk ? (size_t)(end - p) : chunk;
+        f = pc->scan(p, avail, pat, nib);
+        n = (f == chunk) ? chunk / pat->stride :
+            (f > (size_t)width) ? (f - width - 1) / pat->stride + 1 : 0;
+        left = (pc->cap - pc->n + pc->x10) / (pc->x10 ? 2 : 1);
+        if (n > left)
+            n = left;
+        for (k = 0; k < n; k++) {
+            d = nib + k * pat->stride + 2;
+            if (pat->digits == 2)
+                put_value(pc, d[0] << 4 | d[1]);
+            else
+                put_value(pc, (unsigned long)(d[0] << 12 | d[1] << 8 | d[2] << 4 | d[3]));
+        }
+        if (n == chunk / pat->stride) {
+            p += chunk;
+            if (pc->n < pc->cap)
+                continue;
+            return p;
+        }
+        return n ? p + (n - 1) * pat->stride + width : p;
+    }
+}
+
+/*
+ * Decode values of a piece of the data section into pc->out until it is
+ * full or the piece ends.
+ */
+static void
+decode_piece(Piece *pc)
+{
+    const unsigned char *p = pc->p, *end = pc->end;
+    unsigned long v;
+    uint8_t nib[RUN_MAX];
+    long len;
+    int try_run = 1;
+
+    if (pc->carry >= 0 && pc->n < pc->cap) {
+        pc->out[pc->n++] = pc->carry;
+        pc->carry = -1;
+    }
+    while (p < end && pc->n < pc->cap) {
+        if (*p == '\n') {
+            try_run = 1;
+            p++;
             continue;
-        if (sscanf(line, "#define %s %d", name, &value) == 2)
-        {
-            p[0] = strtok(name, "_");
-            for (j = 0; j < 20 && p[j]; j++, p[j] = strtok(NULL, "_")) ;
-            if (j)
-            {
-                if (!strcmp(p[j-1], "width"))
-                    width = value;
-                else if (!strcmp(p[j-1], "height"))
-                    height = value;
-                else if ((j >= 2) && !strcmp(p[j-1], "hot"))
-                {
-                    if (!strcmp(p[j-2], "x"))
-                        xhot = value;
-                    else if (!strcmp(p[j-2], "y"))
-                        yhot = value;
-                }
-            }
+        }
+        if (!*p) {
+            /* the text ends at a NUL */
+            pc->stopped = 1;
+            break;
+        }
+        if (try_run && *p == '0' && start_pattern(&pc->pat, p, end)) {
+            /* once per line: a run ends where the line does */
+            p = decode_run(pc, &pc->pat, p, end, nib);
+            try_run = 0;
             continue;
         }
-        if ((sscanf(line, "static unsigned %s %s = {", type, name) == 2)
-            || (sscanf(line, "static %s %s = {", type, name) == 2))
-        {
-            if (!strcmp(type, "short"))
-                format = XBM_X10;
-            else if (!strcmp(type, "char"))
-                format = XBM_X11;
-
-            if (!(t = strrchr(name, '_')))
-                t = name;
-            else
-                ++t;
-            if (strcmp(t, "bits[]"))
+        if ((len = scan_value(p, end, &v)) < 0) {
+            pc->stopped = 1;
+            break;
+        }
+        if (len == 0) {
+            p++;
+            continue;
+        }
+        put_value(pc, v);
+        p += len;
+    }
+    pc->p = p;
+}
+
+static void *
+decode_thread(void *arg)
+{
+    decode_piece(arg);
+    return NULL;
+}
+
+/*
+ * Decode the data section, from p on, into data[length].  Returns the
+ * number of bytes decoded, or -1 if out of memory.
+ */
+static long
+decode_data(const unsigned char *p, const unsigned char *end, int x10,
+            uint8_t *data, size_t length)
+{
+    Piece pieces[MT_MAX];
+    pthread_t threads[MT_MAX];
+    int started[MT_MAX];
+    ScanProc scan = pick_scan();
+    size_t size = end - p, total, n;
+    const unsigned char *cut;
+    long ncpu;
+    int i, count;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    count = size / MT_PIECE;
+    if (count > ncpu)
+        count = ncpu;
+    if (count > MT_MAX)
+        count = MT_MAX;
+    if (count < 1)
+        count = 1;
+
+    /* cut at line ends, which no value crosses */
+    memset(pieces, 0, sizeof(pieces));
+    for (i = 0; i < count; i++) {
+        pieces[i].p = i ? pieces[i - 1].end : p;
+        cut = (i == count - 1) ? end : p + size / count * (i + 1);
+        if (cut < pieces[i].p)
+            cut = pieces[i].p;
+        while (cut < end && cut[-1] != '\n')
+            cut++;
+        pieces[i].end = cut;
+        pieces[i].x10 = x10;
+        pieces[i].carry = -1;
+        pieces[i].scan = scan;
+        n = (cut - pieces[i].p) * (x10 ? 2 : 1);
+        pieces[i].cap = (i == 0 || n > length) ? length : n;
+        pieces[i].out = i ? malloc(pieces[i].cap ? pieces[i].cap : 1) : data;
+        if (!pieces[i].out) {
+            while (--i > 0)
+                free(pieces[i].out);
+            return -1;
+        }
+    }
+    for (i = 1; i < count; i++)
+        started[i] = pthread_create(&threads[i], NULL, decode_thread, &pieces[i]) == 0;
+    decode_piece(&pieces[0]);
+    for (i = 1; i < count; i++) {
+        if (started[i])
+            pthread_join(threads[i], NULL);
+        else
+            decode_piece(&pieces[i]);
+    }
+
+    total = pieces[0].n;
+    for (i = 1; i < count; i++) {
+        if (!pieces[i - 1].stopped && total < length) {
+            n = pieces[i].n < length - total ? pieces[i].n : length - total;
+            memcpy(data + total, pieces[i].out, n);
+            total += n;
+        }
+        else
+            pieces[i].stopped = 1;
+        free(pieces[i].out);
+    }
+    return total;
+}
+
+/*
+ * Map a file, or read it if it can't be mapped.  *mapped says which, for
+ * release_file().
+ */
+static int
+load_file(int fd, unsigned char **buf, size_t *size, int *mapped)
+{
+    struct stat st;
+    unsigned char *grown;
+    size_t cap = 0;
+    ssize_t rd;
+    void *m;
+
+    *buf = NULL;
+    *size = 0;
+    *mapped = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m != MAP_FAILED) {
+            *buf = m;
+            *size = st.st_size;
+            *mapped = 1;
+            return BitmapSuccess;
+        }
+    }
+    for (;;) {
+        if (*size == cap) {
+            cap = cap ? cap * 2 : MAXREAD;
+            if (!(grown = realloc(*buf, cap))) {
+                free(*buf);
+                return BitmapNoMemory;
+            }
+            *buf = grown;
+        }
+        rd = read(fd, *buf + *size, cap - *size);
+        if (rd == 0)
+            return BitmapSuccess;
+        if (rd < 0) {
+            if (errno == EAGAIN || errno == EINTR)
                 continue;
+            free(*buf);
+            return BitmapReadFailed;
+        }
+        *size += rd;
+    }
+}
+
+static void
+release_file(unsigned char *buf, size_t size, int mapped)
+{
+    if (mapped)
+        munmap(buf, size);
+    else
+        free(buf);
+}
+
+/* Skip sscanf() white space. */
+static const unsigned char *
+skip_space(const unsigned char *s, const unsigned char *e)
+{
+    while (s < e && isspace_c(*s))
+        s++;
+    return s;
+}
+
+/* A sscanf() %s: the token at s, after white space.  Returns its end. */
+static const unsigned char *
+get_token(const unsigned char *s, const unsigned char *e, const unsigned char **tok)
+{
+    s = skip_space(s, e);
+    *tok = s;
+    while (s < e && !isspace_c(*s))
+        s++;
+    return s;
+}
+
+static int
+match_word(const unsigned char **s, const unsigned char *e, const char *word)
+{
+    size_t n = strlen(word);
+
+    if ((size_t)(e - *s) < n || memcmp(*s, word, n))
+        return 0;
+    *s += n;
+    return 1;
+}
+
+/*
+ * "#define <name> <number>": fills in what a name ending in _width,
+ * _height, _x_hot or _y_hot defines.
+ */
+static int
+parse_define(const unsigned char *s, const unsigned char *e,
+             int *width, int *height, int *xhot, int *yhot)
+{
+    const unsigned char *name, *name_end, *last, *prev;
+    unsigned long v = 0;
+    long value;
+    int neg = 0, any = 0, overflow = 0;
+
+    if (!match_word(&s, e, "#define"))
+        return 0;
+    name_end = get_token(s, e, &name);
+    if (name_end == name)
+        return 0;
+    s = skip_space(name_end, e);
+    if (s < e && (*s == '+' || *s == '-'))
+        neg = (*s++ == '-');
+    for (; s < e && *s >= '0' && *s <= '9'; s++, any = 1) {
+        if (v > (ULONG_MAX - (*s - '0')) / 10)
+            overflow = 1;
+        v = v * 10 + (*s - '0');
+    }
+    if (!any)
+        return 0;
+    /* what %d makes of it: strtol(), then a cast */
+    if (!neg)
+        value = (overflow || v > LONG_MAX) ? LONG_MAX : (long)v;
+    else
+        value = (overflow || v > (unsigned long)LONG_MAX + 1) ? LONG_MIN : (long)-v;
+
+    /* the last two parts of the name, between underscores */
+    while (name_end > name && name_end[-1] == '_')
+        name_end--;
+    for (last = name_end; last > name && last[-1] != '_'; last--)
+        ;
+    for (prev = last; prev > name && prev[-1] == '_'; prev--)
+        ;
+    if (last == name_end)
+        return 1;
+    if (name_end - last == 5 && !memcmp(last, "width", 5))
+        *width = (int)value;
+    else if (name_end - last == 6 && !memcmp(last, "height", 6))
+        *height = (int)value;
+    else if (name_end - last == 3 && !memcmp(last, "hot", 3) && prev > name &&
+             (prev - 1 == name || prev[-2] == '_')) {
+        if (prev[-1] == 'x')
+            *xhot = (int)value;
+        else if (prev[-1] == 'y')
+            *yhot = (int)value;
+    }
+    return 1;
+}
+
+/*
+ * "static [unsigned] <type> <name> = {": notes the format the type gives,
+ * and returns 1 if the name is that of the bits array.
+ */
+static int
+parse_static(const unsigned char *s, const unsigned char *e, int *format)
+{
+    const unsigned char *type, *type_end, *name, *name_end, *t, *p;
+
+    if (!match_word(&s, e, "static"))
+        return 0;
+    p = skip_space(s, e);
+    if (!match_word(&p, e, "unsigned") ||
+        (type_end = get_token(p, e, &type)) == type ||
+        (name_end = get_token(type_end, e, &name)) == name) {
+        type_end = get_token(s, e, &type);
+        name_end = get_token(type_end, e, &name);
+        if (type_end == type || name_end == name)
+            return 0;
+    }
+    if (type_end - type == 5 && !memcmp(type, "short", 5))
+        *format = XBM_X10;
+    else if (type_end - type == 4 && !memcmp(type, "char", 4))
+        *format = XBM_X11;
+    for (t = name_end; t > name && t[-1] != '_'; t--)
+        ;
+    return name_end - t == 6 && !memcmp(t, "bits[]", 6);
+}
+
+/*
+ * Map a file and parse its header, leaving s->data at the line that
+ * declares the bits.
+ */
+static int
+open_bitmap(const char *fname, BitmapStream *s)
+{
+    const unsigned char *line, *eol, *nul;
+    int fd, status, format = 0, padding = 0, found = 0;
+
+    memset(s, 0, sizeof(*s));
+    if (!fname || ((fd = open(fname, O_RDONLY)) == -1))
+        return BitmapOpenFailed;
+    status = load_file(fd, &s->buf, &s->size, &s->mapped);
+    close(fd);
+    if (status != BitmapSuccess)
+        return status;
+    s->end = s->buf + s->size;
 
+    s->xhot = s->yhot = -1;
+
+    /* parse bitmap header, a line at a time up to the bits array */
+    for (line = s->buf; line < s->end; line = eol + 1) {
+        if (!(eol = memchr(line, '\n', s->end - line)))
+            eol = s->end;
+        /* the text ends at a NUL, if there is one */
+        if ((nul = memchr(line, '\0', eol - line)))
+            s->end = eol = nul;
+        while (line < eol && (*line == ' ' || *line == '\t'))
+            line++;
+        if (parse_define(line, eol, &s->width, &s->height, &s->xhot, &s->yhot))
+            ;
+        else if (parse_static(line, eol, &format)) {
+            found = 1;
             break;
         }
     }
 
-    if (!width || !height || !format)
+    if (!s->width || !s->height || !format || s->width < 0 || s->height < 0 ||
+        s->width > UINT16_MAX || s->height > UINT16_MAX)
     {
-        free(fbuf);
-        free(lines);
+        release_file(s->buf, s->size, s->mapped);
         return BitmapFileInvalid;
     }
 
-    if ((format & XBM_X10) && (width % 16) && ((width % 16) < 9))
+    if ((format & XBM_X10) && (s->width % 16) && ((s->width % 16) < 9))
         padding++;
-    bytesperline = (width + 7) / 8 + padding;
-    length = bytesperline * height;
-    data = xalloc(length);
+    s->length = (long)((s->width + 7) / 8 + padding) * s->height;
+    s->x10 = format == XBM_X10;
+    /* without a bits line there is no data at all */
+    s->data = found ? line : s->end;
 
-    /* parse bitmap data */
-    for (; i < cnt; i++)
-    {
-        if (!(line = eatwhite(lines[i])))
-            continue;
+    s->piece.p = s->data;
+    s->piece.end = s->end;
+    s->piece.x10 = s->x10;
+    s->piece.carry = -1;
+    s->piece.scan = pick_scan();
+    return BitmapSuccess;
+}
 
-        while(*line)
-        {
-            errno = 0;
-            nexti = strtoul(line, &tailp, 0);
-            if (!tailp || errno)
-                break;
-            if (tailp == line)
-            {
-                ++line;
-                continue;
-            }
-            line = tailp;
-            data[bytes++] = nexti;
-            if ((format == XBM_X10) && (!padding || ((bytes + 2) % bytesperline)))
-                data[bytes++] = nexti >> 8;
-            if (*line == ',')
-                ++line;
-        }
-        if (*line)
-            break;
+int read_bitmap_data_from_file(const char *fname,
+                               uint8_t **data_ret,
+                               uint16_t *width_ret, uint16_t *height_ret,
+                               int16_t *xhot_ret, int16_t *yhot_ret)
+{
+    BitmapStream s;
+    long bytes;
+    uint8_t *data;
+    int status;
+
+    if ((status = open_bitmap(fname, &s)) != BitmapSuccess)
+        return status;
+    if (!(data = malloc(s.length))) {
+        release_file(s.buf, s.size, s.mapped);
+        return BitmapNoMemory;
     }
 
-    free(fbuf);
-    free(lines);
+    /* parse bitmap data, from the line that declares it */
+    bytes = decode_data(s.data, s.end, s.x10, data, s.length);
+
+    release_file(s.buf, s.size, s.mapped);
 
-    if (bytes < length)
+    if (bytes < 0)
+    {
+        free(data);
+        return BitmapNoMemory;
+    }
+    if (bytes < s.length)
     {
         free(data);
         return BitmapFileInvalid;
     }
 
     *data_ret = data;
-    *width_ret = width;
-    *height_ret = height;
+    *width_ret = s.width;
+    *height_ret = s.height;
+    if (xhot_ret)
+        *xhot_ret = s.xhot;
+    if (yhot_ret)
+        *yhot_ret = s.yhot;
+
+    return BitmapSuccess;
+}
+
+int open_bitmap_stream(const char *fname, BitmapStream **stream,
+                       uint16_t *width_ret, uint16_t *height_ret,
+                       int16_t *xhot_ret, int16_t *yhot_ret)
+{
+    BitmapStream *s;
+    int status;
+
+    if (!(s = malloc(sizeof(BitmapStream))))
+        return BitmapNoMemory;
+    if ((status = open_bitmap(fname, s)) != BitmapSuccess) {
+        free(s);
+        return status;
+    }
+    if (s->mapped)
+        madvise(s->buf, s->size, MADV_SEQUENTIAL);
+
+    *stream = s;
+    *width_ret = s->width;
+    *height_ret = s->height;
     if (xhot_ret)
-        *xhot_ret = xhot;
+        *xhot_ret = s->xhot;
     if (yhot_ret)
-        *yhot_ret = yhot;
+        *yhot_ret = s->yhot;
+    return BitmapSuccess;
+}
 
+int read_bitmap_stream(BitmapStream *s, uint8_t *buf, size_t len)
+{
+    Piece *pc = &s->piece;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t done;
+
+    if (len > (size_t)(s->length - s->done))
+        return BitmapFileInvalid;
+    pc->out = buf;
+    pc->cap = len;
+    pc->n = 0;
+    if (!pc->stopped)
+        decode_piece(pc);
+    s->done += pc->n;
+    if (pc->n < len)
+        return BitmapFileInvalid;
+
+    /* the text decoded so far is not looked at again */
+    done = (pc->p - s->buf) / page * page;
+    if (s->mapped && done > s->dropped) {
+        madvise(s->buf + s->dropped, done - s->dropped, MADV_DONTNEED);
+        s->dropped = done;
+    }
     return BitmapSuccess;
 }
+
+int close_bitmap_stream(BitmapStream *s, int check)
+{
+    uint8_t rest[4096];
+    size_t len;
+    int status = BitmapSuccess;
+
+    /* the file must hold all of its data, padding included */
+    while (check && status == BitmapSuccess && s->done < s->length) {
+        len = s->length - s->done;
+        status = read_bitmap_stream(s, rest, len < sizeof(rest) ? len : sizeof(rest));
+    }
+    release_file(s->buf, s->size, s->mapped);
+    free(s);
+    return status;
+}
 /* vim:set ts=4 sw=4 et cindent:*/
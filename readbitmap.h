@@ -7,12 +7,26 @@
 #define BitmapOpenFailed    1
 #define BitmapReadFailed    2
 #define BitmapFileInvalid   3
+#define BitmapNoMemory      4
 
 extern int read_bitmap_data_from_file(const char *fname,
                                uint8_t **data,
                                uint16_t *width, uint16_t *height,
                                int16_t *xhot, int16_t *yhot);
 
+/*
+ * The same, a piece at a time: read_bitmap_stream() decodes the next len
+ * bytes of data, and close_bitmap_stream() checks, if asked to, that the
+ * rest of the data is there too.
+ */
+typedef struct _BitmapStream BitmapStream;
+
+extern int open_bitmap_stream(const char *fname, BitmapStream **stream,
+                              uint16_t *width, uint16_t *height,
+                              int16_t *xhot, int16_t *yhot);
+extern int read_bitmap_stream(BitmapStream *stream, uint8_t *buf, size_t len);
+extern int close_bitmap_stream(BitmapStream *stream, int check);
+
 #endif/*!_readbitmap_h*/
 
 /* vim: set ts=4 sw=4 et cindent: */
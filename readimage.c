@@ -0,0 +1,325 @@
+/* readimage.c
+ *
+ * PPM, PAM and farbfeld reader.  Only the header and one row are ever held:
+ * the file goes through a small buffer and each row is turned into 8-bit
+ * ARGB when it is asked for, so an image of any size streams straight
+ * through to the server.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include "readimage.h"
+
+#define MAXREAD     65536
+#define MAXNUMBER   1000000     /* header numbers saturate here */
+
+struct _ImageStream {
+    int fd;
+    int failed;                 /* a read() went wrong */
+    unsigned char buf[MAXREAD];
+    size_t pos, len;
+    unsigned long width, height;
+    unsigned long rows_left;
+    int channels;               /* gray, gray and alpha, RGB or RGBA */
+    int bytes;                  /* per sample as read, 1 or 2 big endian */
+    int ascii;                  /* P3: samples are decimal numbers */
+    unsigned long maxval;
+    uint8_t *scale;             /* sample to 8 bits, unless maxval is 255 */
+    unsigned char *raw;         /* one row of samples */
+};
+
+static int
+isspace_c(int c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static int
+next_byte(ImageStream *s)
+{
+    ssize_t rd;
+
+    if (s->pos == s->len) {
+        do
+            rd = read(s->fd, s->buf, sizeof(s->buf));
+        while (rd < 0 && (errno == EINTR || errno == EAGAIN));
+        if (rd <= 0) {
+            s->failed |= rd < 0;
+            return EOF;
+        }
+        s->pos = 0;
+        s->len = rd;
+    }
+    return s->buf[s->pos++];
+}
+
+/*
+ * Read len bytes, what is buffered first and the rest straight into out.
+ */
+static int
+read_bytes(ImageStream *s, unsigned char *out, size_t len)
+{
+    size_t n = s->len - s->pos;
+    ssize_t rd;
+
+    if (n > len)
+        n = len;
+    memcpy(out, s->buf + s->pos, n);
+    s->pos += n;
+    for (out += n, len -= n; len; out += rd, len -= rd) {
+        rd = read(s->fd, out, len);
+        if (rd < 0 && (errno == EINTR || errno == EAGAIN)) {
+            rd = 0;
+            continue;
+        }
+        if (rd < 0)
+            return ImageReadFailed;
+        if (rd == 0)
+            return ImageFileInvalid;
+    }
+    return ImageSuccess;
+}
+
+/*
+ * A decimal number of a PNM header or P3 raster, after white space and
+ * comments.  The byte that ends it is taken too, as the format wants.
+ */
+static int
+read_number(ImageStream *s, unsigned long *value)
+{
+    int c;
+
+    for (;;) {
+        c = next_byte(s);
+        if (c == '#') {
+            while (c != EOF && c != '\n')
+                c = next_byte(s);
+            continue;
+        }
+        if (c == EOF || !isspace_c(c))
+            break;
+    }
+    if (c < '0' || c > '9')
+        return 0;
+    for (*value = 0; c >= '0' && c <= '9'; c = next_byte(s))
+        *value = *value < MAXNUMBER ? *value * 10 + (c - '0') : MAXNUMBER;
+    return c == EOF || isspace_c(c);
+}
+
+/*
+ * One line of a PAM header, without its newline.  Returns 0 at the end of
+ * the file.
+ */
+static int
+read_line(ImageStream *s, char *line, size_t size)
+{
+    size_t n = 0;
+    int c;
+
+    while ((c = next_byte(s)) != EOF && c != '\n')
+        if (n + 1 < size)
+            line[n++] = c;
+    line[n] = '\0';
+    return c != EOF || n;
+}
+
+static int
+parse_pnm(ImageStream *s, int type)
+{
+    if (!read_number(s, &s->width) || !read_number(s, &s->height) ||
+        !read_number(s, &s->maxval))
+        return ImageFileInvalid;
+    s->channels = 3;
+    s->ascii = type == '3';
+    return ImageSuccess;
+}
+
+static int
+parse_pam(ImageStream *s)
+{
+    char line[256], *p, *key, *value, *end;
+    unsigned long depth = 0, n;
+
+    if (next_byte(s) != '\n')
+        return ImageFileInvalid;
+    for (;;) {
+        if (!read_line(s, line, sizeof(line)))
+            return ImageFileInvalid;
+        for (p = line; isspace_c(*p); p++)
+            ;
+        if (!*p || *p == '#')
+            continue;
+        for (key = p; *p && !isspace_c(*p); p++)
+            ;
+        if (*p)
+            *p++ = '\0';
+        if (!strcmp(key, "ENDHDR"))
+            break;
+        while (isspace_c(*p))
+            p++;
+        value = p;
+        n = strtoul(value, &end, 10);
+        if (end == value || n > MAXNUMBER)
+            n = end == value ? 0 : MAXNUMBER;
+        if (!strcmp(key, "WIDTH"))
+            s->width = n;
+        else if (!strcmp(key, "HEIGHT"))
+            s->height = n;
+        else if (!strcmp(key, "DEPTH"))
+            depth = n;
+        else if (!strcmp(key, "MAXVAL"))
+            s->maxval = n;
+        /* TUPLTYPE says no more than DEPTH does here */
+    }
+    if (depth < 1 || depth > 4)
+        return ImageFileInvalid;
+    s->channels = depth;
+    return ImageSuccess;
+}
+
+static int
+parse_farbfeld(ImageStream *s)
+{
+    unsigned char h[14];
+    int status;
+
+    if ((status = read_bytes(s, h, sizeof(h))) != ImageSuccess)
+        return status == ImageReadFailed ? status : ImageFileInvalid;
+    if (memcmp(h, "rbfeld", 6))
+        return ImageFileInvalid;
+    s->width = (unsigned long)h[6] << 24 | h[7] << 16 | h[8] << 8 | h[9];
+    s->height = (unsigned long)h[10] << 24 | h[11] << 16 | h[12] << 8 | h[13];
+    s->channels = 4;
+    s->maxval = 65535;
+    return ImageSuccess;
+}
+
+int open_image_stream(const char *fname, ImageStream **stream,
+                      uint16_t *width_ret, uint16_t *height_ret)
+{
+    ImageStream *s;
+    int c, status;
+    unsigned long v;
+
+    if (!(s = calloc(1, sizeof(ImageStream))))
+        return ImageNoMemory;
+    if (!fname || (s->fd = open(fname, O_RDONLY)) == -1) {
+        free(s);
+        return ImageOpenFailed;
+    }
+
+    c = next_byte(s);
+    if (c == 'P') {
+        c = next_byte(s);
+        if (c == '3' || c == '6')
+            status = parse_pnm(s, c);
+        else if (c == '7')
+            status = parse_pam(s);
+        else
+            status = ImageFileInvalid;
+    }
+    else if (c == 'f' && next_byte(s) == 'a')
+        status = parse_farbfeld(s);
+    else
+        status = ImageFileInvalid;
+    if (s->failed)
+        status = ImageReadFailed;
+    if (status == ImageSuccess &&
+        (!s->width || !s->height || s->width > UINT16_MAX || s->height > UINT16_MAX ||
+         !s->maxval || s->maxval > 65535))
+        status = ImageFileInvalid;
+    if (status != ImageSuccess) {
+        close_image_stream(s);
+        return status;
+    }
+
+    s->bytes = (s->ascii || s->maxval > 255) ? 2 : 1;
+    s->rows_left = s->height;
+    if (!(s->raw = malloc(s->width * s->channels * s->bytes))) {
+        close_image_stream(s);
+        return ImageNoMemory;
+    }
+    if (s->maxval != 255) {
+        if (!(s->scale = malloc(s->maxval + 1))) {
+            close_image_stream(s);
+            return ImageNoMemory;
+        }
+        for (v = 0; v <= s->maxval; v++)
+            s->scale[v] = (v * 255 + s->maxval / 2) / s->maxval;
+    }
+
+    *stream = s;
+    *width_ret = s->width;
+    *height_ret = s->height;
+    return ImageSuccess;
+}
+
+int read_image_row(ImageStream *s, uint32_t *row)
+{
+    const unsigned char *in = s->raw;
+    unsigned long n = s->width * s->channels, x, v;
+    uint32_t a, r, g, b;
+    uint8_t c[4];
+    int i, status;
+
+    if (!s->rows_left)
+        return ImageFileInvalid;
+    s->rows_left--;
+
+    if (s->ascii) {
+        /* kept as 16-bit samples like a binary row */
+        for (x = 0; x < n; x++) {
+            if (!read_number(s, &v))
+                return s->failed ? ImageReadFailed : ImageFileInvalid;
+            s->raw[2 * x] = v >> 8;
+            s->raw[2 * x + 1] = v;
+        }
+    }
+    else if ((status = read_bytes(s, s->raw, n * s->bytes)) != ImageSuccess)
+        return status;
+
+    /* the usual P6 */
+    if (s->channels == 3 && s->bytes == 1 && !s->scale) {
+        for (x = 0; x < s->width; x++, in += 3)
+            row[x] = 0xff000000 | (uint32_t)in[0] << 16 | in[1] << 8 | in[2];
+        return ImageSuccess;
+    }
+
+    for (x = 0; x < s->width; x++) {
+        for (i = 0; i < s->channels; i++) {
+            if (s->bytes == 2) {
+                v = in[0] << 8 | in[1];
+                in += 2;
+            }
+            else
+                v = *in++;
+            if (v > s->maxval)
+                v = s->maxval;
+            c[i] = s->scale ? s->scale[v] : v;
+        }
+        switch (s->channels) {
+        case 1:     r = g = b = c[0]; a = 0xff;     break;
+        case 2:     r = g = b = c[0]; a = c[1];     break;
+        case 3:     r = c[0]; g = c[1]; b = c[2]; a = 0xff; break;
+        default:    r = c[0]; g = c[1]; b = c[2]; a = c[3]; break;
+        }
+        row[x] = a << 24 | r << 16 | g << 8 | b;
+    }
+    return ImageSuccess;
+}
+
+void close_image_stream(ImageStream *s)
+{
+    close(s->fd);
+    free(s->raw);
+    free(s->scale);
+    free(s);
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,28 @@
+/* readimage.h */
+
+#ifndef _readimage_h
+#define _readimage_h
+
+#include <stdint.h>
+
+#define ImageSuccess        0
+#define ImageOpenFailed     1
+#define ImageReadFailed     2
+#define ImageFileInvalid    3
+#define ImageNoMemory       4
+
+/*
+ * Full color images, PPM (P3 and P6), PAM and farbfeld, read a row at a
+ * time.  read_image_row() gives the next row as one 0xAARRGGBB word per
+ * pixel, 8 bits to a channel; images without alpha are opaque.
+ */
+typedef struct _ImageStream ImageStream;
+
+extern int open_image_stream(const char *fname, ImageStream **stream,
+                             uint16_t *width, uint16_t *height);
+extern int read_image_row(ImageStream *stream, uint32_t *row);
+extern void close_image_stream(ImageStream *stream);
+
+#endif/*!_readimage_h*/
+
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,416 @@
+/* replay.c
+ *
+ * xsetroot_replay: push a request stream captured with "xsetroot_xcb -record"
+ * at a server as fast as it will take it, and report latency and throughput.
+ *
+ * Each iteration opens a fresh connection, sends the recorded requests with
+ * resource IDs, root windows and colormaps rewritten for that connection,
+ * waits wherever the recording saw a reply arrive, and finishes with a
+ * GetInputFocus round trip so the server has done all the work by the time
+ * the clock stops.  Atoms and extension opcodes are replayed as recorded, so
+ * the target should be a server of the same build, e.g. a fresh Xvfb.
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <xcb/xcb.h>
+#include "Trace.h"
+
+#define MAX_ROOTS   16
+
+typedef struct {
+    uint32_t base, mask;
+    int n_roots;
+    uint32_t root[MAX_ROOTS], colormap[MAX_ROOTS];
+} IdSpace;
+
+typedef struct {
+    size_t offset;          /* into the request stream */
+    uint32_t sequence;      /* reply that must have arrived first */
+} WaitPoint;
+
+static const char *program_name;
+static uint8_t *stream;     /* all recorded requests, back to back */
+static size_t stream_len;
+static size_t *req_offset;  /* start of each request in the stream */
+static int n_requests;
+static WaitPoint *waits;
+static int n_waits;
+static IdSpace old_ids, new_ids;
+
+static uint8_t inbuf[65536];
+static size_t in_have;
+static uint16_t last_seen;
+static unsigned long n_errors;
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: %s [-display <display>] [-n <iterations>] <trace>\n",
+            program_name);
+    exit(1);
+}
+
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+read_ids(IdSpace *ids, const xcb_setup_t *setup)
+{
+    xcb_screen_iterator_t it;
+
+    ids->base = setup->resource_id_base;
+    ids->mask = setup->resource_id_mask;
+    ids->n_roots = 0;
+    for (it = xcb_setup_roots_iterator(setup); it.rem && ids->n_roots < MAX_ROOTS;
+         xcb_screen_next(&it)) {
+        ids->root[ids->n_roots] = it.data->root;
+        ids->colormap[ids->n_roots] = it.data->default_colormap;
+        ids->n_roots++;
+    }
+}
+
+static void
+load_trace(const char *fname)
+{
+    FILE *f = fopen(fname, "rb");
+    char magic[4], order[4];
+    uint32_t version, setup_len;
+    xcb_setup_t *setup;
+    TraceRecord rec;
+    size_t alloc = 0, off;
+    int wait_alloc = 0;
+
+    if (!f)
+        err(1, "%s", fname);
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, TRACE_MAGIC, 4) ||
+        fread(order, 1, 4, f) != 4 || fread(&version, 4, 1, f) != 1 ||
+        fread(&setup_len, 4, 1, f) != 1)
+        errx(1, "%s: not a trace file", fname);
+    if (order[0] != TRACE_BYTE_ORDER || version != TRACE_VERSION)
+        errx(1, "%s: recorded with another byte order or version", fname);
+    if (!(setup = malloc(setup_len)) || fread(setup, 1, setup_len, f) != setup_len)
+        errx(1, "%s: truncated setup", fname);
+    read_ids(&old_ids, setup);
+    free(setup);
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.type == TRACE_REQUESTS) {
+            if (stream_len + rec.value > alloc) {
+                alloc = (stream_len + rec.value) * 2;
+                if (!(stream = realloc(stream, alloc)))
+                    err(1, NULL);
+            }
+            if (fread(stream + stream_len, 1, rec.value, f) != rec.value)
+                break;
+            stream_len += rec.value;
+        }
+        else if (rec.type == TRACE_REPLY) {
+            /* errors need not recur on replay, so only replies are waited on */
+            if (n_waits == wait_alloc) {
+                wait_alloc = wait_alloc ? wait_alloc * 2 : 64;
+                if (!(waits = realloc(waits, wait_alloc * sizeof(WaitPoint))))
+                    err(1, NULL);
+            }
+            waits[n_waits].offset = stream_len;
+            waits[n_waits].sequence = rec.value;
+            n_waits++;
+        }
+    }
+    fclose(f);
+
+    /* frame the stream into requests, honoring BIG-REQUESTS lengths */
+    for (off = 0, alloc = 0; off + 4 <= stream_len; ) {
+        uint32_t len = *(uint16_t *)(stream + off + 2);
+
+        if (!len && off + 8 <= stream_len)
+            len = *(uint32_t *)(stream + off + 4);
+        if (!len || off + len * 4 > stream_len)
+            break;
+        if ((size_t)n_requests == alloc) {
+            alloc = alloc ? alloc * 2 : 256;
+            if (!(req_offset = realloc(req_offset, alloc * sizeof(size_t))))
+                err(1, NULL);
+        }
+        req_offset[n_requests++] = off;
+        off += len * 4;
+    }
+    stream_len = off;
+}
+
+static uint32_t
+remap(uint32_t id)
+{
+    int i;
+
+    if ((id & ~old_ids.mask) == old_ids.base)
+        return new_ids.base | (id & old_ids.mask);
+    for (i = 0; i < old_ids.n_roots && i < new_ids.n_roots; i++) {
+        if (id == old_ids.root[i])
+            return new_ids.root[i];
+        if (id == old_ids.colormap[i])
+            return new_ids.colormap[i];
+    }
+    return id;
+}
+
+static void
+remap_at(uint8_t *req, size_t len, size_t off)
+{
+    uint32_t v;
+
+    if (off + 4 > len)
+        return;
+    memcpy(&v, req + off, 4);
+    v = remap(v);
+    memcpy(req + off, &v, 4);
+}
+
+/* Rewrite the values of a value-mask list whose bits in 'ids' are XIDs. */
+static void
+remap_values(uint8_t *req, size_t len, size_t mask_off, uint32_t ids)
+{
+    uint32_t mask;
+    size_t off = mask_off + 4;
+    int bit;
+
+    if (mask_off + 4 > len)
+        return;
+    memcpy(&mask, req + mask_off, 4);
+    for (bit = 0; bit < 32; bit++)
+        if (mask & (1u << bit)) {
+            if (ids & (1u << bit))
+                remap_at(req, len, off);
+            off += 4;
+        }
+}
+
+static void
+remap_request(uint8_t *req, size_t len)
+{
+    uint32_t type, n, i;
+
+    switch (req[0]) {
+    case XCB_CHANGE_WINDOW_ATTRIBUTES:
+        remap_at(req, len, 4);
+        remap_values(req, len, 8, XCB_CW_BACK_PIXMAP | XCB_CW_BORDER_PIXMAP |
+                                  XCB_CW_COLORMAP | XCB_CW_CURSOR);
+        break;
+    case XCB_CREATE_GC:
+        remap_at(req, len, 4);
+        remap_at(req, len, 8);
+        remap_values(req, len, 12, XCB_GC_TILE | XCB_GC_STIPPLE |
+                                   XCB_GC_FONT | XCB_GC_CLIP_MASK);
+        break;
+    case XCB_CHANGE_GC:
+        remap_at(req, len, 4);
+        remap_values(req, len, 8, XCB_GC_TILE | XCB_GC_STIPPLE |
+                                  XCB_GC_FONT | XCB_GC_CLIP_MASK);
+        break;
+    case XCB_CHANGE_PROPERTY:
+        remap_at(req, len, 4);
+        memcpy(&type, req + 12, 4);
+        memcpy(&n, req + 20, 4);
+        if (req[16] == 32 && (type == XCB_ATOM_PIXMAP || type == XCB_ATOM_WINDOW))
+            for (i = 0; i < n; i++)
+                remap_at(req, len, 24 + 4 * i);
+        break;
+    case XCB_CREATE_PIXMAP:
+    case XCB_COPY_AREA:
+    case XCB_COPY_PLANE:
+    case XCB_CREATE_CURSOR:
+    case XCB_CREATE_GLYPH_CURSOR:
+        remap_at(req, len, 4);
+        remap_at(req, len, 8);
+        remap_at(req, len, 12);
+        break;
+    case XCB_POLY_FILL_RECTANGLE:
+    case XCB_PUT_IMAGE:
+        remap_at(req, len, 4);
+        remap_at(req, len, 8);
+        break;
+    case XCB_GET_PROPERTY:
+    case XCB_DELETE_PROPERTY:
+    case XCB_OPEN_FONT:
+    case XCB_CLOSE_FONT:
+    case XCB_FREE_PIXMAP:
+    case XCB_FREE_GC:
+    case XCB_CLEAR_AREA:
+    case XCB_ALLOC_COLOR:
+    case XCB_ALLOC_NAMED_COLOR:
+    case XCB_QUERY_COLORS:
+    case XCB_LOOKUP_COLOR:
+    case XCB_FREE_CURSOR:
+    case XCB_KILL_CLIENT:
+        remap_at(req, len, 4);
+        break;
+    default:
+        /* extension layouts are unknown: rewrite anything that is an XID */
+        if (req[0] >= 128)
+            for (i = 4; i + 4 <= len && i < 32; i += 4)
+                remap_at(req, len, i);
+        break;
+    }
+}
+
+static void
+write_all(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len) {
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            err(1, "write");
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+/* Read server packets until one at or past 'sequence' has been seen. */
+static void
+wait_for(int fd, uint16_t sequence)
+{
+    size_t need;
+    ssize_t n;
+
+    while ((int16_t)(last_seen - sequence) < 0) {
+        n = read(fd, inbuf + in_have, sizeof(inbuf) - in_have);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            errx(1, "server closed the connection");
+        }
+        in_have += n;
+        while (in_have >= 32) {
+            need = 32;
+            if ((inbuf[0] & 0x7f) == 1 || (inbuf[0] & 0x7f) == XCB_GE_GENERIC)
+                need += *(uint32_t *)(inbuf + 4) * 4;
+            if (need > sizeof(inbuf))
+                errx(1, "reply too large");
+            if (in_have < need)
+                break;
+            if (inbuf[0] == 0)
+                n_errors++;
+            if ((inbuf[0] & 0x7f) != XCB_KEYMAP_NOTIFY)
+                last_seen = *(uint16_t *)(inbuf + 2);
+            memmove(inbuf, inbuf + need, in_have - need);
+            in_have -= need;
+        }
+    }
+}
+
+static double
+replay_once(const char *display_name, uint8_t *work)
+{
+    xcb_connection_t *c;
+    uint8_t sync[4] = { XCB_GET_INPUT_FOCUS, 0, 1, 0 };
+    size_t sent = 0;
+    double t0, t1;
+    int fd, r, w;
+
+    c = xcb_connect(display_name, NULL);
+    if (xcb_connection_has_error(c))
+        errx(2, "unable to open display '%s'", display_name ? display_name : "");
+    read_ids(&new_ids, xcb_get_setup(c));
+    /* from here on the socket is ours; xcb leaves it non-blocking */
+    fd = xcb_get_file_descriptor(c);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    memcpy(work, stream, stream_len);
+    for (r = 0; r < n_requests; r++) {
+        size_t end = r + 1 < n_requests ? req_offset[r + 1] : stream_len;
+        remap_request(work + req_offset[r], end - req_offset[r]);
+    }
+    in_have = 0;
+    last_seen = 0;
+
+    t0 = now_us();
+    for (w = 0; w < n_waits; w++) {
+        write_all(fd, work + sent, waits[w].offset - sent);
+        sent = waits[w].offset;
+        wait_for(fd, waits[w].sequence);
+    }
+    write_all(fd, work + sent, stream_len - sent);
+    write_all(fd, sync, sizeof(sync));
+    wait_for(fd, n_requests + 1);
+    t1 = now_us();
+
+    xcb_disconnect(c);
+    return t1 - t0;
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *display_name = NULL, *trace_file = NULL;
+    int iterations = 100, i;
+    double *lat, total = 0;
+    uint8_t *work;
+
+    program_name = argv[0];
+    for (i = 1; i < argc; i++) {
+        if (!strcmp("-display", argv[i]) || !strcmp("-d", argv[i])) {
+            if (++i >= argc) usage();
+            display_name = argv[i];
+        }
+        else if (!strcmp("-n", argv[i])) {
+            if (++i >= argc) usage();
+            if ((iterations = atoi(argv[i])) <= 0)
+                iterations = 1;
+        }
+        else if (!trace_file && argv[i][0] != '-')
+            trace_file = argv[i];
+        else
+            usage();
+    }
+    if (!trace_file)
+        usage();
+
+    load_trace(trace_file);
+    if (!(work = malloc(stream_len ? stream_len : 1)) ||
+        !(lat = malloc(iterations * sizeof(double))))
+        err(1, NULL);
+    for (i = 0; i < iterations; i++) {
+        lat[i] = replay_once(display_name, work);
+        total += lat[i];
+    }
+    qsort(lat, iterations, sizeof(double), cmpdouble);
+
+    printf("trace=%s iterations=%d requests=%d bytes=%zu waits=%d errors=%lu\n",
+           trace_file, iterations, n_requests, stream_len, n_waits, n_errors);
+    printf("latency_us min=%.1f median=%.1f p99=%.1f max=%.1f\n",
+           lat[0], lat[iterations / 2], lat[((iterations - 1) * 99) / 100],
+           lat[iterations - 1]);
+    printf("throughput requests_per_sec=%.0f mbytes_per_sec=%.2f\n",
+           (double)n_requests * iterations / (total / 1e6),
+           (double)stream_len * iterations / total);
+    free(work);
+    free(lat);
+    return 0;
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -0,0 +1,174 @@
+/* xbmbench.c
+ *
+ * Microbenchmark for read_bitmap_data_from_file(): writes synthetic X10 and
+ * X11 bitmaps of increasing size, parses each repeatedly in a child process
+ * and reports throughput, allocations per parse and the child's peak RSS as
+ * key=value lines.
+ *
+ *   xbmbench [-max <size>]                 run the benchmark
+ *   xbmbench -write <x10|x11> <w> <h> <file>   just write a bitmap
+ *
+ * readbitmap.c is compiled into this program with malloc, calloc and
+ * realloc redirected to the counting wrappers below (see Makefile.am).
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "readbitmap.h"
+
+/* <stdlib.h> declared the wrappers under the redirected names */
+#undef malloc
+#undef calloc
+#undef realloc
+extern void *malloc(size_t);
+extern void *calloc(size_t, size_t);
+extern void *realloc(void *, size_t);
+
+#define MIN_SECONDS     0.5
+#define MAX_ITERATIONS  1000
+
+static unsigned long n_allocs;
+
+void *
+bench_malloc(size_t sz)
+{
+    n_allocs++;
+    return malloc(sz);
+}
+
+void *
+bench_calloc(size_t n, size_t sz)
+{
+    n_allocs++;
+    return calloc(n, sz);
+}
+
+void *
+bench_realloc(void *ptr, size_t sz)
+{
+    n_allocs++;
+    return realloc(ptr, sz);
+}
+
+static double
+now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Write a pseudo-random bitmap in the format bitmap(1) produces: X11 files
+ * hold 12 bytes per line, X10 files 8 shorts.
+ */
+static void
+write_xbm(const char *fname, int x10, int width, int height)
+{
+    FILE *f = fopen(fname, "w");
+    long i, n;
+    uint32_t seed = 12345;
+
+    if (!f)
+        err(1, "%s", fname);
+    if (x10)
+        n = (long)((width + 15) / 16) * height;
+    else
+        n = (long)((width + 7) / 8) * height;
+    fprintf(f, "#define bench_width %d\n#define bench_height %d\n", width, height);
+    fprintf(f, "#define bench_x_hot %d\n#define bench_y_hot %d\n", width / 2, height / 2);
+    fprintf(f, "static %s bench_bits[] = {", x10 ? "unsigned short" : "unsigned char");
+    for (i = 0; i < n; i++) {
+        seed = seed * 1103515245 + 12345;
+        if (i % (x10 ? 8 : 12) == 0)
+            fputs("\n  ", f);
+        if (x10)
+            fprintf(f, " 0x%04x%s", (seed >> 8) & 0xffff, i + 1 < n ? "," : "");
+        else
+            fprintf(f, " 0x%02x%s", (seed >> 16) & 0xff, i + 1 < n ? "," : "");
+    }
+    fputs("};\n", f);
+    if (fclose(f))
+        err(1, "%s", fname);
+}
+
+static void
+run_case(const char *fname, const char *format, int size)
+{
+    struct stat st;
+    struct rusage ru;
+    uint8_t *data;
+    uint16_t w, h;
+    double t0, elapsed = 0;
+    int i;
+
+    if (stat(fname, &st))
+        err(1, "%s", fname);
+    n_allocs = 0;
+    for (i = 0; i < MAX_ITERATIONS && (i < 1 || elapsed < MIN_SECONDS); i++) {
+        t0 = now();
+        if (read_bitmap_data_from_file(fname, &data, &w, &h, NULL, NULL) != BitmapSuccess)
+            errx(1, "%s: parse failed", fname);
+        elapsed += now() - t0;
+        free(data);
+    }
+    getrusage(RUSAGE_SELF, &ru);
+    printf("bench=xbm_parse format=%s size=%dx%d file_bytes=%lld iterations=%d "
+           "mb_per_s=%.2f us_per_parse=%.1f allocs=%lu peak_rss_kb=%ld\n",
+           format, size, size, (long long)st.st_size, i,
+           st.st_size * (double)i / elapsed / 1e6, elapsed / i * 1e6,
+           n_allocs / i, ru.ru_maxrss);
+    fflush(stdout);
+}
+
+int
+main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/xbmbenchXXXXXX", fname[64];
+    int max = 16384, size, x10;
+    pid_t pid;
+
+    if (argc == 6 && !strcmp(argv[1], "-write")) {
+        write_xbm(argv[5], !strcmp(argv[2], "x10"), atoi(argv[3]), atoi(argv[4]));
+        return 0;
+    }
+    if (argc == 3 && !strcmp(argv[1], "-max"))
+        max = atoi(argv[2]);
+    else if (argc != 1) {
+        fprintf(stderr, "usage: %s [-max <size>]\n"
+                "       %s -write <x10|x11> <width> <height> <file>\n",
+                argv[0], argv[0]);
+        return 1;
+    }
+    if (!mkdtemp(dir))
+        err(1, "mkdtemp");
+
+    for (size = 16; size <= max; size *= 4) {
+        for (x10 = 0; x10 < 2; x10++) {
+            snprintf(fname, sizeof(fname), "%s/%d.%s", dir, size, x10 ? "x10" : "x11");
+            write_xbm(fname, x10, size, size);
+            /* a child per case, so that peak RSS belongs to this case alone */
+            fflush(stdout);
+            if ((pid = fork()) == 0) {
+                run_case(fname, x10 ? "x10" : "x11", size);
+                _exit(0);
+            }
+            waitpid(pid, NULL, 0);
+            unlink(fname);
+        }
+    }
+    rmdir(dir);
+    return 0;
+}
+/* vim: set ts=4 sw=4 et cindent: */
@@ -26,7 +26,8 @@ in this Software without prior written authorization from The Open Group.
 /*
  * xsetroot.c     MIT Project Athena, X Window System root window 
  *        parameter setting utility.  This program will set 
- *        various parameters of the X root window.
+ *        various parameters of the X root window.  The work is done by
+ *        libxsetroot; this is its command line.
  *
  *  Author:    Mark Lillibridge, MIT Project Athena
  *        11-Jun-87
@@ -37,46 +38,65 @@ in this Software without prior written authorization from The Open Group.
 #endif
 
 #include <xcb/xcb.h>
-#include <xcb/xcb_aux.h>
-#include <xcb/xcb_image.h>
-#include <xcb/xcb_cursor.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <X11/bitmaps/gray>
-#include "CurUtil.h"
-#include "readbitmap.h"
-
-#define Dynamic 1
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include "Daemon.h"
+#include "Fanout.h"
+#include "Record.h"
+#include "libxsetroot.h"
 
 static char *program_name;
 static xcb_connection_t *dpy;
-static xcb_screen_t *screen;
-static xcb_window_t root;
-static int screen_nbr;
-static char *fore_color = NULL;
-static char *back_color = NULL;
-static uint32_t fg_pixel;
-static uint32_t bg_pixel;
-static int reverse = 0;
-static int save_colors = 0;
-static int unsave_past = 0;
-static xcb_pixmap_t save_pixmap = (xcb_pixmap_t)XCB_NONE;
-static const char *cursor_font = "cursor";
+static XsrContext *ctx;
+
+/*
+ * Everything one command line asks for: the command itself for
+ * libxsetroot, and how to run it.  ParseOptions() fills it in.
+ */
+typedef struct {
+    XsrOptions cmd;
+    char *display_name;
+    char *record_file;
+    int stats;
+    int daemon;
+    int client;
+    char *batch_file;
+    char *displays;             /* -displays list, glob or file */
+    int jobs;                   /* -displays workers at a time */
+    int version;
+} Options;
+
+static Options *fanout_opts;    /* what each -displays worker applies */
 
 static void usage(void);
+static void PrintUsage(void);
+static int ParseOptions(Options *opts, int argc, char **argv);
+static int OpenDisplay(const char *display_name, const char *record_file, int flags);
+static int Run(Options *opts);
+static int ExitStatus(XsrStatus status);
+static void PrintError(void *closure, XsrStatus status, const char *message);
+static void PrintStats(void);
+static int RunBatch(const char *file);
+static int SplitWords(char *line, char **words, int max);
+static int DaemonCommand(int argc, char **argv);
+static int DisplayWorker(const char *display_name);
+static int DrainEvents(void);
 static const char *GetDisplayName(const char *display_name);
-static void FixupState(void);
-static void SetBackgroundToBitmap(xcb_pixmap_t bitmap, uint16_t width, uint16_t height);
-static xcb_cursor_t CreateCursorFromFiles(char *cursor_file, char *mask_file);
-static xcb_cursor_t CreateCursorFromName(char *name);
-static xcb_pixmap_t MakeModulaBitmap(int mod_x, int mod_y);
-static xcb_coloritem_t NameToColor(char *name, uint32_t pixel);
-static uint32_t NameToPixel(char *name, uint32_t pixel);
-static xcb_pixmap_t ReadBitmapFile(char *filename, uint16_t *width, uint16_t *height, int16_t *x_hot, int16_t *y_hot);
 
 static void
 usage(void)
+{
+    PrintUsage();
+    exit(1);
+    /*NOTREACHED*/
+}
+
+static void
+PrintUsage(void)
 {
     fprintf(stderr, "usage: %s [options]\n%s\n", program_name,
             "  where options are:\n"
@@ -92,606 +112,489 @@ usage(void)
             "  -solid <color>\n"
             "  -gray   or   -grey\n"
             "  -bitmap <filename>\n"
+            "  -image <filename>\n"
+            "  -scale   or   -fill   or   -fit   or   -center\n"
+            "  -filter nearest|bilinear|box\n"
+            "  -pattern <kind>[,<size>][,<angle>]\n"
+            "  -gradient <angle>\n"
+            "  -radial\n"
+            "  -dither ordered|diffusion|none\n"
+            "  -nocache\n"
+            "  -publish\n"
+            "  -force\n"
             "  -mod <x> <y>\n"
+            "  -screen <n>\n"
+            "  -allscreens\n"
+            "  -stats\n"
+            "  -record <trace file>\n"
+            "  -daemon\n"
+            "  -client [options]\n"
+            "  -batch <file>   or   -batch -\n"
+            "  -displays <list, glob or file>\n"
+            "  -jobs <n>\n"
             "  -help\n"
             "  -version\n"
             );
-    exit(1);
-    /*NOTREACHED*/
 }
 
 
 int
 main(int argc, char *argv[]) 
 {
-    int excl = 0;
-    int nonexcl = 0;
-    int restore_defaults = 0;
-    char *display_name = NULL;
-    char *name = NULL;
-    char *cursor_file = NULL;
-    char *cursor_mask = NULL;
-    char *cursor_name = NULL;
-    char *solid_color = NULL;
-    char *xcf = NULL;
-    int xcf_size = 32;
-    xcb_cursor_t cursor;
-    int gray = 0;
-    char *bitmap_file = NULL;
-    int mod_x = 0;
-    int mod_y = 0;
-    register int i;
-    uint16_t ww, hh;
-    xcb_pixmap_t bitmap;
-    uint32_t params[2];
+    Options opts;
+    char **forward, **displays;
+    char message[1024];
+    int i, n, ops, status;
 
     program_name=argv[0];
 
-    for (i = 1; i < argc; i++) {
-        if (!strcmp ("-display", argv[i]) || !strcmp ("-d", argv[i])) {
-            if (++i>=argc) usage ();
-            display_name = argv[i];
-            continue;
+    if (ParseOptions(&opts, argc, argv) < 0)
+        usage();
+    if (opts.version) {
+        printf("%s\n", PACKAGE_STRING);
+        exit(0);
+    }
+    ops = (opts.cmd.excl || opts.cmd.nonexcl || opts.cmd.restore_defaults ||
+           opts.cmd.fore_color || opts.cmd.back_color || opts.cmd.reverse);
+    if ((opts.client && (opts.daemon || opts.record_file || opts.batch_file)) ||
+        (opts.daemon && (ops || opts.stats || opts.batch_file)) ||
+        (opts.batch_file && ops) ||
+        (opts.displays && (opts.display_name || opts.record_file || opts.stats ||
+                           opts.daemon || opts.client || opts.batch_file)))
+        usage();
+
+    /* Hand the command line to a running daemon; -display picks which. */
+    if (opts.client) {
+        forward = malloc(argc * sizeof(char *));
+        if (!forward) {
+            fprintf(stderr, "%s: out of memory\n", program_name);
+            exit(2);
         }
-        if (!strcmp("-help", argv[i])) {
-            usage();
+        for (i = 1, n = 0; i < argc; i++)
+            if (strcmp(argv[i], "-client"))
+                forward[n++] = argv[i];
+        exit(DaemonForward(program_name, opts.display_name, n, forward));
+    }
+
+    /*
+     * Fan out over many displays.  The bitmap files are read here, once,
+     * and the forked workers only talk to their servers.
+     */
+    if (opts.displays) {
+        if ((n = FanoutDisplays(opts.displays, &displays)) <= 0) {
+            fprintf(stderr, "%s: no displays in '%s'\n", program_name, opts.displays);
+            exit(2);
         }
-        if (!strcmp("-version", argv[i])) {
-            printf("%s\n", PACKAGE_STRING);
-            exit(0);
+        if ((status = XsrLoadFiles(&opts.cmd, message, sizeof(message)))) {
+            fprintf(stderr, "%s: %s\n", program_name, message);
+            exit(ExitStatus(status));
         }
-        if (!strcmp("-def", argv[i]) || !strcmp("-default", argv[i])) {
-            restore_defaults = 1;
-            continue;
+        fanout_opts = &opts;
+        exit(FanoutRun(program_name, displays, n, opts.jobs, DisplayWorker));
+    }
+
+    /* a daemon or batch keeps what one command set up for the next */
+    if ((status = OpenDisplay(opts.display_name, opts.record_file,
+                              XSR_DISK_CACHE | ((opts.daemon || opts.batch_file) ? XSR_KEEP_WARM : 0))))
+        exit(status);
+    XsrSetStats(ctx, opts.stats);
+
+    if (opts.daemon)
+        status = DaemonServe(program_name, opts.display_name,
+                             xcb_get_file_descriptor(dpy), DaemonCommand, DrainEvents);
+    else if (opts.batch_file)
+        status = RunBatch(opts.batch_file);
+    else
+        status = Run(&opts);
+    if (opts.stats)
+        PrintStats();
+    XsrClose(ctx);
+    xcb_disconnect(dpy);
+    RecordFinish();
+    exit (status);
+}
+
+/*
+ * OpenDisplay: Connect, through the -record proxy if asked to, and make
+ *              the context for the connection.  Returns 0, or the exit
+ *              status after saying what went wrong.
+ */
+static int
+OpenDisplay(const char *display_name, const char *record_file, int flags)
+{
+    int screen_nbr;
+
+    if (record_file) {
+        /* the recording proxy forwards bytes, not shared memory */
+        flags |= XSR_NO_SHM;
+        dpy = RecordConnect(display_name, &screen_nbr, record_file);
+        if (!dpy) {
+            fprintf(stderr, "%s: unable to record to '%s'\n", program_name,
+                    record_file);
+            return 2;
         }
-        if (!strcmp("-name", argv[i])) {
-            if (++i>=argc) usage();
-            name = argv[i];
-            nonexcl++;
+    }
+    else
+        dpy = xcb_connect(display_name, &screen_nbr);
+    if (xcb_connection_has_error(dpy)) {
+        fprintf(stderr, "%s:  unable to open display '%s'\n",
+                program_name, GetDisplayName(display_name));
+        return 2;
+    }
+    if (!(ctx = XsrOpen(dpy, screen_nbr, flags))) {
+        fprintf(stderr, "%s: out of memory\n", program_name);
+        return 2;
+    }
+    XsrSetErrorHandler(ctx, PrintError, NULL);
+    return 0;
+}
+
+/*
+ * ParseOptions: Fill in opts from a command line.  Returns -1 if the
+ *               command line is bad and usage should be shown.
+ */
+static int
+ParseOptions(Options *opts, int argc, char **argv)
+{
+    int i, n;
+
+    memset(opts, 0, sizeof(*opts));
+    XsrInitOptions(&opts->cmd);
+    opts->jobs = 32;
+    for (i = 1; i < argc; i++) {
+        if ((n = XsrParseOption(&opts->cmd, argc, argv, &i)) < 0)
+            return -1;
+        if (n)
             continue;
-        }
-        if (!strcmp("-cursor", argv[i])) {
-            if (++i>=argc) usage();
-            cursor_file = argv[i];
-            if (++i>=argc) usage();
-            cursor_mask = argv[i];
-            nonexcl++;
+        if (!strcmp ("-display", argv[i]) || !strcmp ("-d", argv[i])) {
+            if (++i>=argc) return -1;
+            opts->display_name = argv[i];
             continue;
         }
-        if (!strcmp("-cursor_name", argv[i])) {
-            if (++i>=argc) usage();
-            cursor_name = argv[i];
-            nonexcl++;
-            continue;
+        if (!strcmp("-help", argv[i])) {
+            return -1;
         }
-        if (!strcmp("-xcf", argv[i])) {
-            if (++i>=argc) usage();
-            xcf = argv[i];
-            if (++i>=argc) usage();
-            xcf_size = atoi(argv[i]);
-            if (xcf_size <= 0)
-                xcf_size = 32;
-            nonexcl++;
-            continue;
+        if (!strcmp("-version", argv[i])) {
+            opts->version = 1;
+            return 0;
         }
-
-        if (!strcmp("-fg",argv[i]) || !strcmp("-foreground",argv[i])) {
-            if (++i>=argc) usage();
-            fore_color = argv[i];
+        if (!strcmp("-stats", argv[i])) {
+            opts->stats = 1;
             continue;
         }
-        if (!strcmp("-bg",argv[i]) || !strcmp("-background",argv[i])) {
-            if (++i>=argc) usage();
-            back_color = argv[i];
+        if (!strcmp("-record", argv[i])) {
+            if (++i>=argc) return -1;
+            opts->record_file = argv[i];
             continue;
         }
-        if (!strcmp("-solid", argv[i])) {
-            if (++i>=argc) usage();
-            solid_color = argv[i];
-            excl++;
+        if (!strcmp("-daemon", argv[i])) {
+            opts->daemon = 1;
             continue;
         }
-        if (!strcmp("-gray", argv[i]) || !strcmp("-grey", argv[i])) {
-            gray = 1;
-            excl++;
+        if (!strcmp("-client", argv[i])) {
+            opts->client = 1;
             continue;
         }
-        if (!strcmp("-bitmap", argv[i])) {
-            if (++i>=argc) usage();
-            bitmap_file = argv[i];
-            excl++;
+        if (!strcmp("-batch", argv[i])) {
+            if (++i>=argc) return -1;
+            opts->batch_file = argv[i];
             continue;
         }
-        if (!strcmp("-mod", argv[i])) {
-            if (++i>=argc) usage();
-            mod_x = atoi(argv[i]);
-            if (mod_x <= 0) mod_x = 1;
-            if (++i>=argc) usage();
-            mod_y = atoi(argv[i]);
-            if (mod_y <= 0) mod_y = 1;
-            excl++;
+        if (!strcmp("-displays", argv[i])) {
+            if (++i>=argc) return -1;
+            opts->displays = argv[i];
             continue;
         }
-        if (!strcmp("-rv",argv[i]) || !strcmp("-reverse",argv[i])) {
-            reverse = 1;
+        if (!strcmp("-jobs", argv[i])) {
+            if (++i>=argc) return -1;
+            opts->jobs = atoi(argv[i]);
+            if (opts->jobs <= 0) return -1;
             continue;
         }
-        usage();
+        return -1;
     } 
 
     /* Check for multiple use of exclusive options */
-    if (excl > 1) {
-    fprintf(stderr, "%s: choose only one of {solid, gray, bitmap, mod}\n",
-        program_name);
-        usage();
-    }
-
-    dpy = xcb_connect(display_name, &screen_nbr);
-    if (xcb_connection_has_error(dpy)) {
-        fprintf(stderr, "%s:  unable to open display '%s'\n",
-                program_name, GetDisplayName(display_name));
-        exit(2);
-    }
-    screen = xcb_aux_get_screen(dpy, screen_nbr);
-    root = screen->root;
-  
-    /* If there are no arguments then restore defaults. */
-    if (!excl && !nonexcl)
-        restore_defaults = 1;
-
-    /* Handle '-reverse' early to do it only once. */
-    if (reverse) {
-        if (fore_color) {
-            char *temp = fore_color;
-            fore_color = back_color;
-            back_color = temp;
-        }
-        fg_pixel = screen->white_pixel;
-        bg_pixel = screen->black_pixel;
-    }
-    else
-    {
-        fg_pixel = screen->black_pixel;
-        bg_pixel = screen->white_pixel;
-    }
-  
-    /* Handle a cursor file */
-    if (cursor_file) {
-        cursor = CreateCursorFromFiles(cursor_file, cursor_mask);
-        if (cursor) {
-            xcb_change_window_attributes(dpy, root, XCB_CW_CURSOR, &cursor);
-            xcb_free_cursor(dpy, cursor);
-        }
-        else {
-            fprintf(stderr, "%s: Error creating cursor\n", program_name);
-            exit(1);
-        }
-    }
-  
-    if (cursor_name) {
-        cursor = CreateCursorFromName(cursor_name);
-        if (cursor)
-        {
-            xcb_change_window_attributes(dpy, root, XCB_CW_CURSOR, &cursor);
-            xcb_free_cursor(dpy, cursor);
-        }
-        else {
-            fprintf(stderr, "%s: Error creating cursor\n", program_name);
-            exit(1);
-        }
-    }
-    /* XXX xcb-cursor */
-    if (xcf) {
-        xcb_cursor_context_t *ctx;
-
-        if (xcb_cursor_context_new(dpy, screen, &ctx) < 0) {
-            fprintf(stderr, "%s: Error initializing xcb-cursor\n",
-                    program_name);
-            exit(2);
-        }
-        cursor = xcb_cursor_load_cursor(ctx, xcf);
-        if (cursor) {
-            xcb_change_window_attributes(dpy, root, XCB_CW_CURSOR, &cursor);
-            xcb_free_cursor(dpy, cursor);
-        }
-        else {
-            fprintf(stderr, "%s: Error creating cursor\n", program_name);
-            exit(1);
-        }
-    }
-/*    
-    if (xcf) {
-        XcursorImages *images = XcursorFilenameLoadImages(xcf, xcf_size);
-        if (!images) {
-            fprintf(stderr, "Invalid cursor file \"%s\"\n", xcf);
-        } else {
-            cursor = XcursorImagesLoadCursor(dpy, images);
-            if (cursor)
-            {
-                xcb_change_window_attributes(dpy, root, XCB_CW_CURSOR, &cursor);
-                xcb_free_cursor(dpy, cursor);
-            }
-        }
-    }
-*/
-    /* Handle -gray and -grey options */
-    if (gray) {
-        bitmap = xcb_create_pixmap_from_bitmap_data(dpy, root, (uint8_t *)gray_bits,
-                        gray_width, gray_height, screen->root_depth,
-                        NameToPixel(fore_color, fg_pixel),
-                        NameToPixel(back_color, bg_pixel), NULL);
-        SetBackgroundToBitmap(bitmap, gray_width, gray_height);
-    }
-  
-    /* Handle -solid option */
-    if (solid_color) {
-        params[0] = NameToPixel(solid_color, screen->black_pixel);
-        xcb_change_window_attributes(dpy, root, XCB_CW_BACK_PIXEL, params);
-        xcb_clear_area(dpy, 0, root, 0, 0, 0, 0);
-        unsave_past = 1;
-    }
-  
-    /* Handle -bitmap option */
-    if (bitmap_file) {
-        bitmap = ReadBitmapFile(bitmap_file, &ww, &hh, (int16_t *)NULL, (int16_t *)NULL);
-        SetBackgroundToBitmap(bitmap, ww, hh);
-    }
-  
-    /* Handle set background to a modula pattern */
-    if (mod_x) {
-        bitmap = MakeModulaBitmap(mod_x, mod_y);
-        SetBackgroundToBitmap(bitmap, 16, 16);
-    }
-  
-    /* Handle set name */
-    if (name)
-        xcb_change_property(dpy, XCB_PROP_MODE_REPLACE, root, XCB_ATOM_WM_NAME,
-                            XCB_ATOM_STRING, 8, strlen(name), name);
-  
-    /* Handle restore defaults */
-    if (restore_defaults) {
-        if (!cursor_file) {
-            cursor = 0;
-            xcb_change_window_attributes(dpy, root, XCB_CW_CURSOR, &cursor);
-        }
-        if (!excl) {
-            params[0] = XCB_NONE;
-            xcb_change_window_attributes(dpy, root, XCB_CW_BACK_PIXMAP, params);
-            xcb_clear_area(dpy, 0, root, 0, 0, 0, 0);
-            unsave_past = 1;
-        }
+    if (opts->cmd.excl > 1) {
+        fprintf(stderr, "%s: choose only one of {solid, gray, bitmap, mod, image, pattern, gradient, radial}\n",
+                program_name);
+        return -1;
     }
-
-    xcb_flush(dpy); 
-    FixupState();
-    xcb_disconnect(dpy);
-    exit (0);
+    return 0;
 }
 
-/* Return a safe string representing for the Display. */
-const char *
-GetDisplayName(const char *display_name)
+/*
+ * Run: Carry out one command and wait for the outcome.  Returns the exit
+ *      status.
+ */
+static int
+Run(Options *opts)
 {
-    const char *name = display_name;
-
-    if (!name) {
-        name = getenv("DISPLAY");
-        if (!name)
-            name = "";
-    }
-    return name;
+    XsrSubmit(ctx, &opts->cmd);
+    return ExitStatus(XsrComplete(ctx));
 }
 
-/* Free past incarnation if needed, and retain state if needed. */
-static void
-FixupState(void)
+/*
+ * ExitStatus: The exit status for a libxsetroot status, as xsetroot has
+ *             always had it: 2 if it couldn't get going at all.
+ */
+static int
+ExitStatus(XsrStatus status)
 {
-    xcb_intern_atom_cookie_t ia_c;
-    xcb_intern_atom_reply_t *ia_r;
-    xcb_get_property_cookie_t gp_c;
-    xcb_get_property_reply_t *gp_r;
-    xcb_atom_t prop;
-    unsigned char *data;
-
-    if (!(xcb_aux_get_visualtype(dpy, screen_nbr, screen->root_visual)->_class & Dynamic))
-        unsave_past = 0;
-    if (!unsave_past && !save_colors)
-        return;
-    ia_c = xcb_intern_atom_unchecked(dpy, 0, strlen("_XSETROOT_ID"), "_XSETROOT_ID");
-    ia_r = xcb_intern_atom_reply(dpy, ia_c, NULL);
-    if (ia_r) {
-        prop = ia_r->atom;
-        free(ia_r);
-    }
-    else {
-        fprintf(stderr, "%s: error: failed to intern _XSETROOT_ID property atom\n",
-                program_name);
-        return;
-    }
-
-    if (unsave_past) {
-        gp_c = xcb_get_property_unchecked(dpy, 0, root, prop, XCB_ATOM_ANY, 0, 1L);
-        gp_r = xcb_get_property_reply(dpy, gp_c, NULL);
-        if (!gp_r || (gp_r->type != XCB_ATOM_PIXMAP) || (gp_r->format != 32) ||
-            (gp_r->length != 1) || (gp_r->bytes_after != 0)) {
-            free(gp_r);
-            fprintf(stderr, "%s: warning: _XSETROOT_ID property is garbage\n", program_name);
-        }
-        else {
-            data = xcb_get_property_value(gp_r);
-            xcb_kill_client(dpy, *((xcb_pixmap_t *)data));
-            free(gp_r);
-        }
-    }
-    if (save_colors) {
-        if (!save_pixmap) {
-            save_pixmap = xcb_generate_id(dpy);
-            xcb_create_pixmap(dpy, screen->root_depth, save_pixmap, root, 1, 1);
-        }
-        xcb_change_property(dpy, XCB_PROP_MODE_REPLACE, root, prop, XCB_ATOM_PIXMAP,
-                            32, 1, (void *)&save_pixmap);
-        xcb_set_close_down_mode(dpy, XCB_CLOSE_DOWN_RETAIN_PERMANENT);
+    switch (status) {
+    case XSR_SUCCESS:
+        return 0;
+    case XSR_NO_CURSOR_CONTEXT:
+    case XSR_NO_MEMORY:
+        return 2;
+    default:
+        return 1;
     }
 }
 
 /*
- * SetBackgroundToBitmap: Set the root window background to a caller supplied 
- *                        bitmap.
+ * PrintError: The libxsetroot error handler: messages go to stderr.
  */
 static void
-SetBackgroundToBitmap(xcb_pixmap_t bitmap, uint16_t width, uint16_t height)
+PrintError(void *closure, XsrStatus status, const char *message)
 {
-    xcb_pixmap_t pix;
-    xcb_gcontext_t gc;
-    uint32_t params[2];
-
-    params[0] = NameToPixel(fore_color, fg_pixel);
-    params[1] = NameToPixel(back_color, bg_pixel);
-    gc = xcb_generate_id(dpy);
-    xcb_create_gc(dpy, gc, root, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND, params);
-    pix = xcb_generate_id(dpy);
-    xcb_create_pixmap(dpy, screen->root_depth, pix, root, width, height);
-    xcb_copy_plane(dpy, bitmap, pix, gc, 0, 0, 0, 0, width, height, 1);
-    xcb_change_window_attributes(dpy, root, XCB_CW_BACK_PIXMAP, &pix);
-    xcb_free_gc(dpy, gc);
-    xcb_free_pixmap(dpy, bitmap);
-    if (save_colors)
-        save_pixmap = pix;
-    else
-        xcb_free_pixmap(dpy, pix);
-    xcb_clear_area(dpy, 0, root, 0, 0, 0, 0);
-    unsave_past = 1;
+    fprintf(stderr, "%s: %s\n", program_name, message);
 }
 
-
 /*
- * CreateCursorFromFiles: make a cursor of the right colors from two bitmap
- *                        files.
+ * PrintStats: The -stats report: one key=value line per opcode used, then
+ *             the totals.
  */
-#define BITMAP_HOT_DEFAULT 8
-
-static xcb_cursor_t
-CreateCursorFromFiles(char *cursor_file, char *mask_file)
+static void
+PrintStats(void)
 {
-    xcb_pixmap_t cursor_bitmap, mask_bitmap;
-    uint16_t width, height, ww, hh;
-    int16_t x_hot, y_hot;
-    xcb_cursor_t cursor;
-    xcb_coloritem_t fg, bg;
+    XsrRequestStats st;
+    unsigned long requests = 0, waits = 0, round_trips = 0;
+    unsigned long long bytes = 0;
+    uint64_t blocked_ns = 0;
+    int i;
 
-    fg = NameToColor(fore_color, fg_pixel);
-    bg = NameToColor(back_color, bg_pixel);
+    for (i = 0; i < 256; i++) {
+        if (!XsrGetStats(ctx, i, &st))
+            continue;
+        printf("opcode=%d request=%s requests=%lu bytes=%llu waits=%lu "
+               "round_trips=%lu blocked_us=%llu\n",
+               i, st.name, st.requests, st.bytes, st.waits, st.round_trips,
+               (unsigned long long)(st.blocked_ns / 1000));
+        requests += st.requests;
+        bytes += st.bytes;
+        waits += st.waits;
+        round_trips += st.round_trips;
+        blocked_ns += st.blocked_ns;
+    }
+    printf("total requests=%lu bytes=%llu waits=%lu round_trips=%lu blocked_us=%llu\n",
+           requests, bytes, waits, round_trips,
+           (unsigned long long)(blocked_ns / 1000));
+    fflush(stdout);
+}
 
-    cursor_bitmap = ReadBitmapFile(cursor_file, &width, &height, &x_hot, &y_hot);
-    mask_bitmap = ReadBitmapFile(mask_file, &ww, &hh, (int16_t *)NULL, (int16_t *)NULL);
+/*
+ * RunBatch: Apply the commands in a batch file, or standard input for "-",
+ *           over the one connection.  Requests of successive commands are
+ *           pipelined; only "sync" and "sleep" lines and the end of the file
+ *           flush them and collect errors.  Returns the exit status.
+ */
+#define MAX_BATCH_WORDS 64
 
-    if (width != ww || height != hh) {
-        fprintf(stderr, 
-                "%s: dimensions of cursor bitmap and cursor mask bitmap are different\n",
-                program_name);
-       exit(1);
-       /*NOTREACHED*/
+static int
+RunBatch(const char *file)
+{
+    FILE *f;
+    char *line = NULL, *end;
+    size_t size = 0;
+    char *words[MAX_BATCH_WORDS + 2];
+    Options opts;
+    double seconds;
+    struct timespec ts;
+    int n, lineno = 0, s, status = 0;
+
+    if (!strcmp(file, "-"))
+        f = stdin;
+    else if (!(f = fopen(file, "r"))) {
+        fprintf(stderr, "%s: can't open batch file: %s\n", program_name, file);
+        return 1;
     }
 
-    if ((x_hot == -1) && (y_hot == -1)) {
-        x_hot = BITMAP_HOT_DEFAULT;
-        y_hot = BITMAP_HOT_DEFAULT;
+    while (getline(&line, &size, f) != -1) {
+        lineno++;
+        words[0] = program_name;
+        s = 0;
+        if ((n = SplitWords(line, words + 1, MAX_BATCH_WORDS)) == 0)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "%s: %s:%d: unbalanced quotes or too many words\n",
+                    program_name, file, lineno);
+            s = 1;
+        }
+        else if (!strcmp(words[1], "sync") && n == 1)
+            s = ExitStatus(XsrComplete(ctx));
+        else if (!strcmp(words[1], "sleep") && n == 2) {
+            /* show everything so far before pausing */
+            s = ExitStatus(XsrComplete(ctx));
+            seconds = strtod(words[2], &end);
+            if (*end || seconds < 0) {
+                fprintf(stderr, "%s: %s:%d: bad sleep time\n", program_name,
+                        file, lineno);
+                s = 1;
+            }
+            else {
+                ts.tv_sec = (time_t)seconds;
+                ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+                while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+                    ;
+            }
+        }
+        else if (ParseOptions(&opts, n + 1, words) < 0 || opts.version ||
+                 opts.display_name || opts.record_file || opts.daemon ||
+                 opts.client || opts.batch_file || opts.stats || opts.displays) {
+            fprintf(stderr, "%s: %s:%d: bad command\n", program_name, file, lineno);
+            s = 1;
+        }
+        else {
+            /* failures come out of the next XsrComplete() */
+            XsrSubmit(ctx, &opts.cmd);
+        }
+        if (s && !status)
+            status = s;
     }
-    if ((x_hot < 0) || (x_hot >= width) ||
-        (y_hot < 0) || (y_hot >= height)) {
-        fprintf(stderr, "%s: hotspot is outside cursor bounds\n", program_name);
-        exit(1);
-        /*NOTREACHED*/
+    if (ferror(f)) {
+        fprintf(stderr, "%s: error reading batch file: %s\n", program_name, file);
+        status = 1;
     }
-
-    cursor = xcb_generate_id(dpy);
-    xcb_create_cursor(dpy, cursor, cursor_bitmap, mask_bitmap,
-                               fg.red, fg.green, fg.blue,
-                               bg.red, bg.green, bg.blue, x_hot, y_hot);
-    xcb_clear_area(dpy, 0, root, 0, 0, 0, 0);
-    xcb_aux_sync(dpy);
-    xcb_free_pixmap(dpy, cursor_bitmap);
-    xcb_free_pixmap(dpy, mask_bitmap);
-
-    return cursor;
+    s = ExitStatus(XsrComplete(ctx));
+    if (s && !status)
+        status = s;
+    free(line);
+    if (f != stdin)
+        fclose(f);
+    return status;
 }
 
-static xcb_cursor_t
-CreateCursorFromName(char *name)
+/*
+ * SplitWords: Split a batch line into words in place, honouring single and
+ *             double quotes and backslashes.  A '#' starting a word begins a
+ *             comment.  Returns the number of words, or -1 if the quotes
+ *             don't balance or there are more than max words.
+ */
+static int
+SplitWords(char *line, char **words, int max)
 {
-    xcb_void_cookie_t cookie;
-    xcb_coloritem_t fg, bg;
-    xcb_font_t fid;
-    xcb_cursor_t cursor;
-    int i;
-
-    fg = NameToColor(fore_color, fg_pixel);
-    bg = NameToColor(back_color, bg_pixel);
-    i = CursorNameToIndex (name);
-    if (i == -1)
-        return (xcb_cursor_t) 0;
-    fid = xcb_generate_id(dpy);
-    cookie = xcb_open_font_checked(dpy, fid, strlen(cursor_font), cursor_font);
-    if (xcb_request_check(dpy, cookie))
-        return (xcb_cursor_t) 0;
-    cursor = xcb_generate_id(dpy);
-    xcb_create_glyph_cursor(dpy, cursor, fid, fid, i, i+1,
-                            fg.red, fg.green, fg.blue,
-                            bg.red, bg.green, bg.blue);
-    return cursor;
+    char *in = line, *out;
+    char quote;
+    int n = 0;
+
+    for (;;) {
+        while (isspace((unsigned char)*in))
+            in++;
+        if (!*in || *in == '#')
+            break;
+        if (n == max)
+            return -1;
+        words[n++] = out = in;
+        quote = 0;
+        while (*in && (quote || !isspace((unsigned char)*in))) {
+            if (quote && *in == quote) {
+                quote = 0;
+                in++;
+            }
+            else if (!quote && (*in == '\'' || *in == '"'))
+                quote = *in++;
+            else if (*in == '\\' && quote != '\'' && in[1]) {
+                in++;
+                *out++ = *in++;
+            }
+            else
+                *out++ = *in++;
+        }
+        if (quote)
+            return -1;
+        if (*in)
+            in++;
+        *out = '\0';
+    }
+    words[n] = NULL;
+    return n;
 }
 
 /*
- * MakeModulaBitmap: Returns a modula bitmap based on an x & y mod.
+ * DaemonCommand: Run one command line forwarded by "-client".
  */
-static xcb_pixmap_t 
-MakeModulaBitmap(int mod_x, int mod_y)
+static int
+DaemonCommand(int argc, char **argv)
 {
-    int i;
-    long pattern_line = 0;
-    uint8_t modula_data[16*16/8];
+    Options opts;
+    int status;
 
-    for (i=16; i--; ) {
-        pattern_line <<=1;
-        if ((i % mod_x) == 0) pattern_line |= 0x0001;
+    if (ParseOptions(&opts, argc, argv) < 0) {
+        PrintUsage();
+        return 1;
     }
-    for (i=0; i<16; i++) {
-        if ((i % mod_y) == 0) {
-            modula_data[i*2] = (char)0xff;
-            modula_data[i*2+1] = (char)0xff;
-        } else {
-            modula_data[i*2] = pattern_line & 0xff;
-            modula_data[i*2+1] = (pattern_line>>8) & 0xff;
-        }
+    if (opts.version) {
+        printf("%s\n", PACKAGE_STRING);
+        return 0;
     }
-
-    return xcb_create_pixmap_from_bitmap_data(dpy, root, modula_data, 16, 16,
-                                              screen->root_depth,
-                                              NameToPixel(fore_color, fg_pixel),
-                                              NameToPixel(back_color, bg_pixel), NULL);
+    if (opts.record_file || opts.daemon || opts.batch_file || opts.displays) {
+        fprintf(stderr, "%s: -record, -daemon, -batch and -displays can't be sent to a daemon\n",
+                program_name);
+        return 1;
+    }
+    XsrSetStats(ctx, opts.stats);
+    status = Run(&opts);
+    DrainEvents();
+    if (opts.stats)
+        PrintStats();
+    XsrSetStats(ctx, 0);
+    return status;
 }
 
-
 /*
- * NameToColor: Convert the name of a color to its xcb_coloritem_t value.
+ * DisplayWorker: Carry out the command line on one display of -displays.
+ *                Runs in a worker process of its own.
  */
-static xcb_coloritem_t 
-NameToColor(char *name, uint32_t pixel)
+static int
+DisplayWorker(const char *display_name)
 {
-    xcb_query_colors_cookie_t qc_c;
-    xcb_query_colors_reply_t *qc_r;
-    xcb_lookup_color_cookie_t lc_c;
-    xcb_lookup_color_reply_t *lc_r;
-    xcb_coloritem_t c;
-    xcb_rgb_t *rgb;
-    
-    if (!name || !*name) {
-        c.pixel = pixel;
-        qc_c = xcb_query_colors_unchecked(dpy, screen->default_colormap, 1, &pixel);
-        qc_r = xcb_query_colors_reply(dpy, qc_c, NULL);
-        if (qc_r) {
-            rgb = xcb_query_colors_colors(qc_r);
-            c.red = rgb->red;
-            c.green = rgb->green;
-            c.blue = rgb->blue;
-            c.flags = XCB_COLOR_FLAG_RED | XCB_COLOR_FLAG_GREEN | XCB_COLOR_FLAG_BLUE;
-            free(qc_r);
-        }
-        else {
-            fprintf(stderr, "%s: bad pixel value: %d\n", program_name, pixel);
-            exit(1);
-        }
-    }
-    else {
-        lc_c = xcb_lookup_color_unchecked(dpy, screen->default_colormap, strlen(name), name);
-        lc_r = xcb_lookup_color_reply(dpy, lc_c, NULL);
-        if (lc_r) {
-            c.red = lc_r->exact_red;
-            c.green = lc_r->exact_green;
-            c.blue = lc_r->exact_blue;
-            c.flags = XCB_COLOR_FLAG_RED | XCB_COLOR_FLAG_GREEN | XCB_COLOR_FLAG_BLUE;
-            free(lc_r);
-        }
-        else {
-            fprintf(stderr, "%s: unknown color or bad color format: %s\n", program_name, name);
-            exit(1);
-        }
-        /*NOTREACHED*/
-    }
-    return(c);
+    int status;
+
+    if ((status = OpenDisplay(display_name, NULL, XSR_DISK_CACHE)))
+        return status;
+    status = Run(fanout_opts);
+    XsrClose(ctx);
+    xcb_disconnect(dpy);
+    return status;
 }
 
-static uint32_t 
-NameToPixel(char *name, uint32_t pixel)
+/*
+ * DrainEvents: Drop what the server sent between commands.  Errors from
+ *              unchecked requests arrive as events and nobody wants them.
+ *              Returns nonzero once the connection is gone.
+ */
+static int
+DrainEvents(void)
 {
-    xcb_lookup_color_cookie_t lc_c;
-    xcb_lookup_color_reply_t *lc_r;
-    xcb_alloc_color_cookie_t ac_c;
-    xcb_alloc_color_reply_t *ac_r;
-    xcb_coloritem_t ecolor;
-
-    if (!name || !*name)
-        return pixel;
-    lc_c = xcb_lookup_color_unchecked(dpy, screen->default_colormap, strlen(name), name);
-    lc_r = xcb_lookup_color_reply(dpy, lc_c, NULL);
-    if (lc_r) {
-        ecolor.red = lc_r->exact_red;
-        ecolor.green = lc_r->exact_green;
-        ecolor.blue = lc_r->exact_blue;
-        ecolor.flags = XCB_COLOR_FLAG_RED | XCB_COLOR_FLAG_GREEN | XCB_COLOR_FLAG_BLUE;
-        free(lc_r);
-    }
-    else {
-        fprintf(stderr, "%s: unknown color \"%s\"\n", program_name, name);
-        exit(1);
-        /*NOTREACHED*/
-    }
+    xcb_generic_event_t *ev;
 
-    ac_c = xcb_alloc_color_unchecked(dpy, screen->default_colormap,
-                                     ecolor.red, ecolor.green, ecolor.blue);
-    ac_r = xcb_alloc_color_reply(dpy, ac_c, NULL);
-    if (ac_r) {
-        ecolor.pixel = ac_r->pixel;
-        ecolor.red = ac_r->red;
-        ecolor.green = ac_r->green;
-        ecolor.blue = ac_r->blue;
-    }
-    else {
-        fprintf(stderr, "%s:  unable to allocate color for \"%s\"\n",
-                program_name, name);
-        exit(1);
-        /*NOTREACHED*/
-    }
-
-    if ((ecolor.pixel != screen->black_pixel) &&
-        (ecolor.pixel != screen->white_pixel) &&
-        (xcb_aux_get_visualtype(dpy, screen_nbr, screen->root_visual)->_class & Dynamic))
-        save_colors = 1;
-
-    return ecolor.pixel;
+    while ((ev = xcb_poll_for_event(dpy)))
+        free(ev);
+    return xcb_connection_has_error(dpy);
 }
 
-static xcb_pixmap_t 
-ReadBitmapFile(char *filename, uint16_t *width, uint16_t *height, 
-               int16_t *x_hot, int16_t *y_hot)
+/* Return a safe string representing for the Display. */
+const char *
+GetDisplayName(const char *display_name)
 {
-    uint8_t *data;
-    int status;
+    const char *name = display_name;
 
-    status = read_bitmap_data_from_file(filename, &data, width, height, x_hot, y_hot);
-    if (status == BitmapSuccess)
-        /* Is this a memory leak? Does data need to be free'd before return? */
-        /* I don't think this is a leak... so long as the pixmap is free'd before exit. */
-        return xcb_create_pixmap_from_bitmap_data(dpy, root, data, *width, *height, 1,
-                                                  NameToPixel(fore_color, fg_pixel),
-                                                  NameToPixel(back_color, bg_pixel), NULL);
-    else if (status == BitmapOpenFailed)
-        fprintf(stderr, "%s: can't open file: %s\n", program_name, filename);
-    else if (status == BitmapReadFailed)
-        fprintf(stderr, "%s: error reading file: %s\n", program_name, filename);
-    else if (status == BitmapFileInvalid)
-        fprintf(stderr, "%s: bad bitmap format file: %s\n", program_name, filename);
-    exit(1);
-    /*NOTREACHED*/
+    if (!name) {
+        name = getenv("DISPLAY");
+        if (!name)
+            name = "";
+    }
+    return name;
 }
 /* vim: set ts=4 sw=4 et cindent: */